@@ -0,0 +1,237 @@
+/*
+ * Frame conversion throughput, single-threaded and on the stripe pool, at the
+ * frame size, scaled from 1920x1080 to 640x360 and to the other output formats,
+ * and of MJPEG and Bayer frames decoded or developed at 1920x1080 and scaled
+ * down.
+ *
+ * Usage: convert_benchmark [threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <QBuffer>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QSize>
+
+#include <libcamera/formats.h>
+
+#include "format_converter.h"
+#include "qlibcameraframe.h"
+#include "stripe_pool.h"
+
+namespace {
+
+constexpr int Iterations = 100;
+
+/* A frame of random pixels, owning its planes */
+class BenchmarkFrameData : public LibCameraFrameData
+{
+public:
+    BenchmarkFrameData(const std::vector<qsizetype> &sizes)
+    {
+        for (qsizetype size : sizes) {
+            buffers_.emplace_back(size);
+            for (uchar &byte : buffers_.back())
+                byte = rand();
+
+            planes[planeCount].data = buffers_.back().data();
+            planes[planeCount].size = size;
+            planeCount++;
+        }
+    }
+
+    /* A single plane holding \a data */
+    BenchmarkFrameData(const QByteArray &data)
+    {
+        buffers_.emplace_back(data.begin(), data.end());
+        planes[0].data = buffers_.back().data();
+        planes[0].size = data.size();
+        planeCount = 1;
+    }
+
+private:
+    std::vector<std::vector<uchar>> buffers_;
+};
+
+struct Format {
+    const char *name;
+    libcamera::PixelFormat format;
+};
+
+struct Filter {
+    const char *name;
+    qlibcamera::ScaleFilter filter;
+};
+
+struct OutputFormat {
+    const char *name;
+    QImage::Format format;
+};
+
+LibCameraFrame createFrame(const libcamera::PixelFormat &format, const QSize &size,
+                           unsigned int *stride)
+{
+    const qsizetype pixels = size.width() * size.height();
+
+    if (format == libcamera::formats::SRGGB10_CSI2P) {
+        *stride = size.width() * 5 / 4;
+        return LibCameraFrame(new BenchmarkFrameData({ pixels * 5 / 4 }));
+    }
+
+    if (format == libcamera::formats::YUYV) {
+        *stride = size.width() * 2;
+        return LibCameraFrame(new BenchmarkFrameData({ pixels * 2 }));
+    }
+
+    *stride = size.width();
+    if (format == libcamera::formats::NV12)
+        return LibCameraFrame(new BenchmarkFrameData({ pixels, pixels / 2 }));
+
+    return LibCameraFrame(new BenchmarkFrameData({ pixels, pixels / 4, pixels / 4 }));
+}
+
+/* A JPEG of a noisy gradient, about as hard to decode as a camera frame */
+LibCameraFrame createJpegFrame(const QSize &size)
+{
+    QImage image(size, QImage::Format_RGB32);
+    for (int y = 0; y < size.height(); y++) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < size.width(); x++)
+            line[x] = qRgb(x * 255 / size.width() + rand() % 16, y * 255 / size.height(),
+                           128 + rand() % 16);
+    }
+
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "JPEG", 90);
+
+    return LibCameraFrame(new BenchmarkFrameData(data));
+}
+
+/* Milliseconds per frame */
+double measure(qlibcamera::FormatConverter &converter, const LibCameraFrame &frame, QImage *image)
+{
+    /* Warm the caches and the pool threads up. */
+    converter.convert(frame, image);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < Iterations; i++)
+        converter.convert(frame, image);
+
+    return timer.nsecsElapsed() / 1000000.0 / Iterations;
+}
+
+/* Prints the time per frame with one thread and with \a threads */
+void report(const char *format, const char *size, qlibcamera::FormatConverter &converter,
+            const LibCameraFrame &frame, unsigned int threads)
+{
+    qlibcamera::StripePool *pool = qlibcamera::StripePool::global();
+    QImage image(converter.outputSize(), converter.outputFormat());
+
+    pool->setThreadCount(1);
+    const double single = measure(converter, frame, &image);
+    pool->setThreadCount(threads);
+    const double parallel = measure(converter, frame, &image);
+
+    printf("%-8s %-20s %7.2f ms %7.2f ms %7.2fx\n", format, size, single, parallel,
+           single / parallel);
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[])
+{
+    const Format formats[] = {
+        { "YUV420", libcamera::formats::YUV420 },
+        { "NV12", libcamera::formats::NV12 },
+        { "YUYV", libcamera::formats::YUYV },
+    };
+    const QSize sizes[] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    const Filter filters[] = {
+        { "nearest", qlibcamera::ScaleFilter::Nearest },
+        { "bilinear", qlibcamera::ScaleFilter::Bilinear },
+        { "box", qlibcamera::ScaleFilter::Box },
+    };
+    const OutputFormat outputFormats[] = {
+        { "RGB888", QImage::Format_RGB888 },
+        { "RGB16", QImage::Format_RGB16 },
+        { "Grayscale8", QImage::Format_Grayscale8 },
+    };
+
+    qlibcamera::StripePool *pool = qlibcamera::StripePool::global();
+    if (argc > 1)
+        pool->setThreadCount(atoi(argv[1]));
+    const unsigned int threads = pool->threadCount();
+
+    printf("%-8s %-20s %10s %10s %8s\n", "format", "size", "1 thread",
+           QByteArray::number(threads).append(" threads").constData(), "speedup");
+
+    for (const Format &format : formats) {
+        for (const QSize &size : sizes) {
+            unsigned int stride;
+            LibCameraFrame frame = createFrame(format.format, size, &stride);
+
+            qlibcamera::FormatConverter converter;
+            converter.configure(format.format, size, stride);
+
+            const QByteArray name = QByteArray::number(size.width()) + 'x' +
+                                    QByteArray::number(size.height());
+            report(format.name, name.constData(), converter, frame, threads);
+        }
+
+        const QSize size(1920, 1080);
+        unsigned int stride;
+        LibCameraFrame frame = createFrame(format.format, size, &stride);
+
+        for (const Filter &filter : filters) {
+            qlibcamera::FormatConverter converter;
+            converter.configure(format.format, size, stride);
+            converter.setOutput(QSize(640, 360), QRect(), filter.filter);
+
+            const QByteArray name = QByteArray("640x360 ") + filter.name;
+            report(format.name, name.constData(), converter, frame, threads);
+        }
+
+        for (const OutputFormat &outputFormat : outputFormats) {
+            qlibcamera::FormatConverter converter;
+            converter.setOutputFormat(outputFormat.format);
+            converter.configure(format.format, size, stride);
+
+            const QByteArray name = QByteArray("1920x1080 ") + outputFormat.name;
+            report(format.name, name.constData(), converter, frame, threads);
+        }
+    }
+
+    const QSize size(1920, 1080);
+    const LibCameraFrame jpeg = createJpegFrame(size);
+
+    for (const QSize &output : { size, QSize(960, 540), QSize(640, 360), QSize(240, 135) }) {
+        qlibcamera::FormatConverter converter;
+        converter.configure(libcamera::formats::MJPEG, size, 0);
+        converter.setOutput(output);
+
+        const QByteArray name = QByteArray::number(output.width()) + 'x' +
+                                QByteArray::number(output.height());
+        report("MJPEG", name.constData(), converter, jpeg, threads);
+    }
+
+    unsigned int stride;
+    const LibCameraFrame raw = createFrame(libcamera::formats::SRGGB10_CSI2P, size, &stride);
+
+    for (const QSize &output : { size, QSize(960, 540), QSize(640, 360) }) {
+        qlibcamera::FormatConverter converter;
+        converter.configure(libcamera::formats::SRGGB10_CSI2P, size, stride);
+        converter.setOutput(output);
+
+        const QByteArray name = QByteArray::number(output.width()) + 'x' +
+                                QByteArray::number(output.height());
+        report("RAW10P", name.constData(), converter, raw, threads);
+    }
+
+    return 0;
+}
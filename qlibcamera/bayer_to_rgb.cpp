@@ -0,0 +1,195 @@
+#include "bayer_to_rgb.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+using namespace qlibcamera;
+
+namespace {
+
+/* Samples of \a Bits bits, the table index keeping the MaxLevelBits most significant */
+template<RawPacking P, unsigned int Bits>
+void levelRow(const uint8_t *src, uint8_t *dst, unsigned int width,
+              const uint8_t *even, const uint8_t *odd)
+{
+    constexpr unsigned int shift = Bits > MaxLevelBits ? Bits - MaxLevelBits : 0;
+    constexpr unsigned int mask = (1 << (Bits - shift)) - 1;
+    unsigned int x = 0;
+
+    if constexpr (P == RawPacking::Bytes) {
+        for (; x < width; x += 2) {
+            dst[x] = even[src[x]];
+            dst[x + 1] = odd[src[x + 1]];
+        }
+    } else if constexpr (P == RawPacking::Words) {
+        for (; x < width; x += 2, src += 4) {
+            dst[x] = even[((src[0] | src[1] << 8) >> shift) & mask];
+            dst[x + 1] = odd[((src[2] | src[3] << 8) >> shift) & mask];
+        }
+    } else if constexpr (P == RawPacking::Csi2Packed10) {
+        for (; x + 4 <= width; x += 4, src += 5) {
+            const unsigned int lsbs = src[4];
+            dst[x + 0] = even[(src[0] << 2) | ((lsbs >> 0) & 3)];
+            dst[x + 1] = odd[(src[1] << 2) | ((lsbs >> 2) & 3)];
+            dst[x + 2] = even[(src[2] << 2) | ((lsbs >> 4) & 3)];
+            dst[x + 3] = odd[(src[3] << 2) | ((lsbs >> 6) & 3)];
+        }
+
+        /* A last pair, in a group of 4 */
+        if (x < width) {
+            dst[x + 0] = even[(src[0] << 2) | (src[4] & 3)];
+            dst[x + 1] = odd[(src[1] << 2) | ((src[4] >> 2) & 3)];
+        }
+    } else {
+        for (; x < width; x += 2, src += 3) {
+            const unsigned int lsbs = src[2];
+            dst[x] = even[(src[0] << 4) | (lsbs & 0xf)];
+            dst[x + 1] = odd[(src[1] << 4) | (lsbs >> 4)];
+        }
+    }
+}
+
+/*
+ * Bilinear demosaicing: green is the average of the 4 neighbours of red and
+ * blue samples, red and blue the average of the 2 or 4 nearest samples of
+ * their colour. \a Red rows hold red and green samples, the others blue and
+ * green.
+ */
+template<bool Red, bool GreenFirst>
+void bilinearRow(const uint8_t *const rows[3], uint8_t *dst, unsigned int width)
+{
+    for (unsigned int x = 0; x < width; x++) {
+        const uint8_t *above = rows[0] + x;
+        const uint8_t *row = rows[1] + x;
+        const uint8_t *below = rows[2] + x;
+
+        /* c is the colour of the row, d the other of red and blue. */
+        unsigned int c, g, d;
+
+        if (((x & 1) == 0) == GreenFirst) {
+            g = row[0];
+            c = (row[-1] + row[1] + 1) >> 1;
+            d = (above[0] + below[0] + 1) >> 1;
+        } else {
+            c = row[0];
+            g = (above[0] + below[0] + row[-1] + row[1] + 2) >> 2;
+            d = (above[-1] + above[1] + below[-1] + below[1] + 2) >> 2;
+        }
+
+        dst[4 * x + 0] = Red ? d : c;
+        dst[4 * x + 1] = g;
+        dst[4 * x + 2] = Red ? c : d;
+        dst[4 * x + 3] = 0xff;
+    }
+}
+
+/* A pixel per 2x2 block, red at position \a R and blue across */
+template<unsigned int R>
+void binnedRow(const uint8_t *const rows[3], uint8_t *dst, unsigned int width)
+{
+    constexpr unsigned int B = 3 - R;
+    constexpr unsigned int G1 = R == 0 || R == 3 ? 1 : 0;
+    constexpr unsigned int G2 = 3 - G1;
+
+    for (unsigned int x = 0; x < width; x++) {
+        const uint8_t block[4] = {
+            rows[0][2 * x], rows[0][2 * x + 1],
+            rows[1][2 * x], rows[1][2 * x + 1],
+        };
+
+        dst[4 * x + 0] = block[B];
+        dst[4 * x + 1] = (block[G1] + block[G2] + 1) >> 1;
+        dst[4 * x + 2] = block[R];
+        dst[4 * x + 3] = 0xff;
+    }
+}
+
+const BayerKernels scalarKernels = {
+    "scalar",
+    {
+        { bilinearRow<false, false>, bilinearRow<false, true> },
+        { bilinearRow<true, false>, bilinearRow<true, true> },
+    },
+    { binnedRow<0>, binnedRow<1>, binnedRow<2>, binnedRow<3> },
+};
+
+/* sRGB encoding of linear values in [0, SrgbSteps] */
+constexpr unsigned int SrgbSteps = 4095;
+
+const std::array<uint8_t, SrgbSteps + 1> &srgbTable()
+{
+    static const std::array<uint8_t, SrgbSteps + 1> table = []() {
+        std::array<uint8_t, SrgbSteps + 1> values;
+
+        for (unsigned int i = 0; i <= SrgbSteps; i++) {
+            const double linear = double(i) / SrgbSteps;
+            const double encoded = linear <= 0.0031308 ? 12.92 * linear
+                                 : 1.055 * std::pow(linear, 1 / 2.4) - 0.055;
+            values[i] = std::lround(encoded * 255);
+        }
+
+        return values;
+    }();
+
+    return table;
+}
+
+} /* namespace */
+
+RawLevelFunction qlibcamera::rawLevelRow(RawPacking packing, unsigned int bits)
+{
+    switch (packing) {
+    case RawPacking::Bytes:
+        return bits == 8 ? levelRow<RawPacking::Bytes, 8> : nullptr;
+    case RawPacking::Words:
+        switch (bits) {
+        case 10:
+            return levelRow<RawPacking::Words, 10>;
+        case 12:
+            return levelRow<RawPacking::Words, 12>;
+        case 16:
+            return levelRow<RawPacking::Words, 16>;
+        default:
+            return nullptr;
+        }
+    case RawPacking::Csi2Packed10:
+        return bits == 10 ? levelRow<RawPacking::Csi2Packed10, 10> : nullptr;
+    case RawPacking::Csi2Packed12:
+        return bits == 12 ? levelRow<RawPacking::Csi2Packed12, 12> : nullptr;
+    }
+
+    return nullptr;
+}
+
+void qlibcamera::rawLevels(uint8_t *tables, unsigned int bits, const uint8_t order[4],
+                           const int32_t blackLevels[4], const float gains[4])
+{
+    const unsigned int size = 1 << std::min(bits, MaxLevelBits);
+    const uint8_t *encode = srgbTable().data();
+
+    for (unsigned int position = 0; position < 4; position++) {
+        const unsigned int channel = order[position];
+        const double black = std::clamp(blackLevels[channel], 0, 65535) / 65536.0;
+        const double scale = gains[channel] / (1 - black);
+        uint8_t *table = tables + position * size;
+
+        for (unsigned int i = 0; i < size; i++) {
+            const double linear = (double(i) / size - black) * scale;
+            table[i] = encode[std::clamp<long>(std::lround(linear * SrgbSteps), 0, SrgbSteps)];
+        }
+    }
+}
+
+const BayerKernels &BayerKernels::scalar()
+{
+    return scalarKernels;
+}
+
+/* The widest kernels the build has */
+const BayerKernels &BayerKernels::best()
+{
+    static const BayerKernels *kernels = bayerNeon() ? bayerNeon() : &scalarKernels;
+
+    return *kernels;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace qlibcamera {
+
+    /* Storage of the samples of a raw row */
+    enum class RawPacking {
+        Bytes,              /* 8-bit samples */
+        Words,              /* Little-endian 16-bit words, the samples in the low bits */
+        Csi2Packed10,       /* 4 samples in 5 bytes, the 2 LSBs of each in the last one */
+        Csi2Packed12,       /* 2 samples in 3 bytes, the 4 LSBs of each in the last one */
+    };
+
+    /* Raw samples index the level tables with at most that many bits. */
+    constexpr unsigned int MaxLevelBits = 12;
+
+    /*
+     * Maps \a width samples of a raw row to bytes through the level tables of
+     * the even and odd columns. \a width is even, and a multiple of 4 for
+     * 10-bit CSI-2 packed rows but for the last group.
+     */
+    using RawLevelFunction = void (*)(const uint8_t *src, uint8_t *dst, unsigned int width,
+                                      const uint8_t *even, const uint8_t *odd);
+
+    /* Of \a bits samples stored as \a packing, null if unsupported */
+    RawLevelFunction rawLevelRow(RawPacking packing, unsigned int bits);
+
+    /*
+     * Fills the level tables of the four positions of the 2x2 pattern,
+     * (1 << min(\a bits, MaxLevelBits)) bytes each: the black level of each
+     * position is subtracted, the remaining range to white scaled by its
+     * gain, clipped and sRGB encoded. \a order holds the channel at each
+     * position, R, Gr, Gb or B, and indexes \a blackLevels, in 16-bit scale,
+     * and \a gains.
+     */
+    void rawLevels(uint8_t *tables, unsigned int bits, const uint8_t order[4],
+                   const int32_t blackLevels[4], const float gains[4]);
+
+    /*
+     * Develops \a width BGRX pixels of a Bayer row from levelled rows, each
+     * pointing at an even column.
+     *
+     * Bilinear kernels interpolate pixels of rows[1] from rows[0] and
+     * rows[2] above and below it, and read a pixel left and right of the
+     * row, mirrored past the frame edges.
+     *
+     * Binning kernels make a pixel of each 2x2 block of rows[0] and rows[1],
+     * at half the resolution: red and blue as sampled, green as the average
+     * of both greens. rows[2] is unused.
+     */
+    using BayerRowFunction = void (*)(const uint8_t *const rows[3], uint8_t *dst,
+                                      unsigned int width);
+
+    /**
+     * \brief Bayer demosaicing row kernels of an instruction set
+     *
+     * Bilinear kernels are indexed by the colour of the row, red for rows of
+     * red and green samples, and whether green comes first. Binning kernels
+     * by the position of red in the 2x2 block, blue being across. All kernels
+     * produce the output of the scalar reference bit for bit.
+     */
+    struct BayerKernels {
+        const char *name;
+        BayerRowFunction bilinear[2][2];    /* [red row][green first] */
+        BayerRowFunction binned[4];         /* [red position] */
+
+        static const BayerKernels &scalar();
+        static const BayerKernels &best();
+    };
+
+    /* Kernels of an instruction set, null if the build lacks it */
+    const BayerKernels *bayerNeon();
+
+}
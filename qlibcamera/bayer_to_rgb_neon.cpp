@@ -0,0 +1,126 @@
+#include "bayer_to_rgb.h"
+
+/* As the YUV kernels, built when the compiler targets NEON. */
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+using namespace qlibcamera;
+
+namespace {
+
+/* (a + b + c + d + 2) >> 2, widened so nothing rounds early */
+inline uint8x16_t average4(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d)
+{
+    const uint16x8_t low = vaddq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)),
+                                     vaddl_u8(vget_low_u8(c), vget_low_u8(d)));
+    const uint16x8_t high = vaddq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)),
+                                      vaddl_u8(vget_high_u8(c), vget_high_u8(d)));
+
+    return vcombine_u8(vrshrn_n_u16(low, 2), vrshrn_n_u16(high, 2));
+}
+
+/*
+ * 16 pixels at a time, both interpolations computed for every pixel and
+ * selected by the colour of its sample.
+ */
+template<bool Red, bool GreenFirst>
+void bilinearRowNeon(const uint8_t *const rows[3], uint8_t *dst, unsigned int width)
+{
+    static constexpr uint8_t evenLanes[16] = {
+        0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0,
+    };
+    const uint8x16_t even = vld1q_u8(evenLanes);
+    const uint8x16_t green = GreenFirst ? even : vmvnq_u8(even);
+    const uint8x16_t alpha = vdupq_n_u8(0xff);
+
+    const uint8_t *above = rows[0];
+    const uint8_t *row = rows[1];
+    const uint8_t *below = rows[2];
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        const uint8x16_t centre = vld1q_u8(row + x);
+        const uint8x16_t left = vld1q_u8(row + x - 1);
+        const uint8x16_t right = vld1q_u8(row + x + 1);
+        const uint8x16_t up = vld1q_u8(above + x);
+        const uint8x16_t down = vld1q_u8(below + x);
+
+        /* Green samples, and red or blue samples */
+        const uint8x16_t horizontal = vrhaddq_u8(left, right);
+        const uint8x16_t vertical = vrhaddq_u8(up, down);
+        const uint8x16_t cross = average4(up, down, left, right);
+        const uint8x16_t diagonal = average4(vld1q_u8(above + x - 1), vld1q_u8(above + x + 1),
+                                             vld1q_u8(below + x - 1), vld1q_u8(below + x + 1));
+
+        const uint8x16_t c = vbslq_u8(green, horizontal, centre);
+        const uint8x16_t d = vbslq_u8(green, vertical, diagonal);
+
+        uint8x16x4_t pixels;
+        pixels.val[0] = Red ? d : c;
+        pixels.val[1] = vbslq_u8(green, centre, cross);
+        pixels.val[2] = Red ? c : d;
+        pixels.val[3] = alpha;
+        vst4q_u8(dst + 4 * x, pixels);
+    }
+
+    if (x < width) {
+        const uint8_t *tail[3] = { above + x, row + x, below + x };
+        BayerKernels::scalar().bilinear[Red][GreenFirst](tail, dst + 4 * x, width - x);
+    }
+}
+
+template<unsigned int R>
+void binnedRowNeon(const uint8_t *const rows[3], uint8_t *dst, unsigned int width)
+{
+    constexpr unsigned int B = 3 - R;
+    constexpr unsigned int G1 = R == 0 || R == 3 ? 1 : 0;
+    constexpr unsigned int G2 = 3 - G1;
+
+    const uint8x16_t alpha = vdupq_n_u8(0xff);
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        /* Even and odd columns of both rows, in 2x2 block order */
+        const uint8x16x2_t top = vld2q_u8(rows[0] + 2 * x);
+        const uint8x16x2_t bottom = vld2q_u8(rows[1] + 2 * x);
+        const uint8x16_t block[4] = { top.val[0], top.val[1], bottom.val[0], bottom.val[1] };
+
+        uint8x16x4_t pixels;
+        pixels.val[0] = block[B];
+        pixels.val[1] = vrhaddq_u8(block[G1], block[G2]);
+        pixels.val[2] = block[R];
+        pixels.val[3] = alpha;
+        vst4q_u8(dst + 4 * x, pixels);
+    }
+
+    if (x < width) {
+        const uint8_t *tail[3] = { rows[0] + 2 * x, rows[1] + 2 * x };
+        BayerKernels::scalar().binned[R](tail, dst + 4 * x, width - x);
+    }
+}
+
+const BayerKernels neonKernels = {
+    "neon",
+    {
+        { bilinearRowNeon<false, false>, bilinearRowNeon<false, true> },
+        { bilinearRowNeon<true, false>, bilinearRowNeon<true, true> },
+    },
+    { binnedRowNeon<0>, binnedRowNeon<1>, binnedRowNeon<2>, binnedRowNeon<3> },
+};
+
+} /* namespace */
+
+const BayerKernels *qlibcamera::bayerNeon()
+{
+    return &neonKernels;
+}
+
+#else /* __ARM_NEON */
+
+const qlibcamera::BayerKernels *qlibcamera::bayerNeon()
+{
+    return nullptr;
+}
+
+#endif /* __ARM_NEON */
@@ -0,0 +1,556 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Raspberry Pi Ltd
+ *
+ * DNG writer
+ *
+ * The TIFF container is written by hand instead of through libtiff. The
+ * header and the IFD are assembled in memory, and the image data is written
+ * straight from the mapped frame buffer, one syscall per batch of rows.
+ */
+
+#include "dng_writer.h"
+
+#include <algorithm>
+#include <array>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+using namespace libcamera;
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The DNG writer only supports little endian hosts"
+#endif
+
+namespace {
+
+enum CFAPatternColour : uint8_t {
+	CFAPatternRed = 0,
+	CFAPatternGreen = 1,
+	CFAPatternBlue = 2,
+};
+
+enum class Packing {
+	None,
+	CSI2P,
+};
+
+struct FormatInfo {
+	uint8_t bitsPerSample;
+	Packing packing;
+	/* Index of the R, Gr, Gb, B channel at each position of the 2x2 pattern */
+	uint8_t order[4];
+};
+
+constexpr uint8_t orderRGGB[4] = { 0, 1, 2, 3 };
+constexpr uint8_t orderGRBG[4] = { 1, 0, 3, 2 };
+constexpr uint8_t orderGBRG[4] = { 2, 3, 0, 1 };
+constexpr uint8_t orderBGGR[4] = { 3, 2, 1, 0 };
+
+#define FORMAT_INFO(bits, packing, order) \
+	{ bits, packing, { order[0], order[1], order[2], order[3] } }
+
+const std::map<PixelFormat, FormatInfo> formatInfo = {
+	{ formats::SBGGR8, FORMAT_INFO(8, Packing::None, orderBGGR) },
+	{ formats::SGBRG8, FORMAT_INFO(8, Packing::None, orderGBRG) },
+	{ formats::SGRBG8, FORMAT_INFO(8, Packing::None, orderGRBG) },
+	{ formats::SRGGB8, FORMAT_INFO(8, Packing::None, orderRGGB) },
+	{ formats::SBGGR10, FORMAT_INFO(10, Packing::None, orderBGGR) },
+	{ formats::SGBRG10, FORMAT_INFO(10, Packing::None, orderGBRG) },
+	{ formats::SGRBG10, FORMAT_INFO(10, Packing::None, orderGRBG) },
+	{ formats::SRGGB10, FORMAT_INFO(10, Packing::None, orderRGGB) },
+	{ formats::SBGGR10_CSI2P, FORMAT_INFO(10, Packing::CSI2P, orderBGGR) },
+	{ formats::SGBRG10_CSI2P, FORMAT_INFO(10, Packing::CSI2P, orderGBRG) },
+	{ formats::SGRBG10_CSI2P, FORMAT_INFO(10, Packing::CSI2P, orderGRBG) },
+	{ formats::SRGGB10_CSI2P, FORMAT_INFO(10, Packing::CSI2P, orderRGGB) },
+	{ formats::SBGGR12, FORMAT_INFO(12, Packing::None, orderBGGR) },
+	{ formats::SGBRG12, FORMAT_INFO(12, Packing::None, orderGBRG) },
+	{ formats::SGRBG12, FORMAT_INFO(12, Packing::None, orderGRBG) },
+	{ formats::SRGGB12, FORMAT_INFO(12, Packing::None, orderRGGB) },
+	{ formats::SBGGR12_CSI2P, FORMAT_INFO(12, Packing::CSI2P, orderBGGR) },
+	{ formats::SGBRG12_CSI2P, FORMAT_INFO(12, Packing::CSI2P, orderGBRG) },
+	{ formats::SGRBG12_CSI2P, FORMAT_INFO(12, Packing::CSI2P, orderGRBG) },
+	{ formats::SRGGB12_CSI2P, FORMAT_INFO(12, Packing::CSI2P, orderRGGB) },
+	{ formats::SBGGR16, FORMAT_INFO(16, Packing::None, orderBGGR) },
+	{ formats::SGBRG16, FORMAT_INFO(16, Packing::None, orderGBRG) },
+	{ formats::SGRBG16, FORMAT_INFO(16, Packing::None, orderGRBG) },
+	{ formats::SRGGB16, FORMAT_INFO(16, Packing::None, orderRGGB) },
+};
+
+#undef FORMAT_INFO
+
+/* TIFF field types */
+enum TiffType : uint16_t {
+	TiffByte = 1,
+	TiffAscii = 2,
+	TiffShort = 3,
+	TiffLong = 4,
+	TiffRational = 5,
+	TiffSRational = 10,
+};
+
+/* TIFF and DNG tags */
+enum TiffTag : uint16_t {
+	TagNewSubfileType = 254,
+	TagImageWidth = 256,
+	TagImageLength = 257,
+	TagBitsPerSample = 258,
+	TagCompression = 259,
+	TagPhotometricInterpretation = 262,
+	TagMake = 271,
+	TagModel = 272,
+	TagStripOffsets = 273,
+	TagOrientation = 274,
+	TagSamplesPerPixel = 277,
+	TagRowsPerStrip = 278,
+	TagStripByteCounts = 279,
+	TagPlanarConfiguration = 284,
+	TagSoftware = 305,
+	TagCFARepeatPatternDim = 33421,
+	TagCFAPattern = 33422,
+	TagDNGVersion = 50706,
+	TagDNGBackwardVersion = 50707,
+	TagUniqueCameraModel = 50708,
+	TagCFAPlaneColor = 50710,
+	TagCFALayout = 50711,
+	TagBlackLevelRepeatDim = 50713,
+	TagBlackLevel = 50714,
+	TagWhiteLevel = 50717,
+	TagColorMatrix1 = 50721,
+	TagAsShotNeutral = 50728,
+	TagCalibrationIlluminant1 = 50778,
+};
+
+constexpr uint16_t PhotometricCFA = 32803;
+constexpr uint16_t IlluminantD65 = 21;
+
+/*
+ * A single IFD, serialized in memory. Values that don't fit in the 4 bytes
+ * of an entry are stored in a data area following the IFD.
+ */
+class TiffDirectory
+{
+public:
+	void add(TiffTag tag, TiffType type, uint32_t count, const void *data)
+	{
+		const uint8_t *bytes = static_cast<const uint8_t *>(data);
+		entries_.push_back({ tag, type, count,
+				     std::vector<uint8_t>(bytes, bytes + count * typeSize(type)) });
+	}
+
+	void addShort(TiffTag tag, uint16_t value)
+	{
+		add(tag, TiffShort, 1, &value);
+	}
+
+	void addLong(TiffTag tag, uint32_t value)
+	{
+		add(tag, TiffLong, 1, &value);
+	}
+
+	void addAscii(TiffTag tag, const std::string &value)
+	{
+		add(tag, TiffAscii, value.size() + 1, value.c_str());
+	}
+
+	void addRationals(TiffTag tag, TiffType type, const std::vector<double> &values)
+	{
+		std::vector<int32_t> data;
+		for (double value : values) {
+			data.push_back(static_cast<int32_t>(value * 10000 + (value < 0 ? -0.5 : 0.5)));
+			data.push_back(10000);
+		}
+		add(tag, type, values.size(), data.data());
+	}
+
+	/*
+	 * Serialize the header and the IFD. The image data follows at the
+	 * returned offset, which is stored in the StripOffsets entry.
+	 */
+	uint32_t serialize(std::vector<uint8_t> &out, uint32_t imageSize)
+	{
+		addLong(TagStripOffsets, 0);
+		addLong(TagStripByteCounts, imageSize);
+
+		std::sort(entries_.begin(), entries_.end(),
+			  [](const Entry &a, const Entry &b) { return a.tag < b.tag; });
+
+		const uint32_t ifdOffset = 8;
+		const uint32_t ifdSize = 2 + entries_.size() * 12 + 4;
+
+		uint32_t dataSize = 0;
+		for (const Entry &entry : entries_) {
+			if (entry.data.size() > 4)
+				dataSize += (entry.data.size() + 1) & ~1u;
+		}
+
+		/* Keep the image data 16 bytes aligned. */
+		const uint32_t imageOffset = (ifdOffset + ifdSize + dataSize + 15) & ~15u;
+
+		for (Entry &entry : entries_) {
+			if (entry.tag == TagStripOffsets)
+				memcpy(entry.data.data(), &imageOffset, 4);
+		}
+
+		out.assign(imageOffset, 0);
+		uint8_t *header = out.data();
+		memcpy(header, "II", 2);
+		put16(header + 2, 42);
+		put32(header + 4, ifdOffset);
+
+		uint8_t *ifd = header + ifdOffset;
+		uint32_t dataOffset = ifdOffset + ifdSize;
+		put16(ifd, entries_.size());
+		ifd += 2;
+
+		for (const Entry &entry : entries_) {
+			put16(ifd, entry.tag);
+			put16(ifd + 2, entry.type);
+			put32(ifd + 4, entry.count);
+
+			if (entry.data.size() <= 4) {
+				memcpy(ifd + 8, entry.data.data(), entry.data.size());
+			} else {
+				put32(ifd + 8, dataOffset);
+				memcpy(header + dataOffset, entry.data.data(), entry.data.size());
+				dataOffset += (entry.data.size() + 1) & ~1u;
+			}
+
+			ifd += 12;
+		}
+
+		/* No next IFD. */
+		put32(ifd, 0);
+
+		return imageOffset;
+	}
+
+private:
+	struct Entry {
+		uint16_t tag;
+		uint16_t type;
+		uint32_t count;
+		std::vector<uint8_t> data;
+	};
+
+	static unsigned int typeSize(TiffType type)
+	{
+		switch (type) {
+		case TiffShort:
+			return 2;
+		case TiffLong:
+			return 4;
+		case TiffRational:
+		case TiffSRational:
+			return 8;
+		default:
+			return 1;
+		}
+	}
+
+	static void put16(uint8_t *dst, uint16_t value)
+	{
+		memcpy(dst, &value, 2);
+	}
+
+	static void put32(uint8_t *dst, uint32_t value)
+	{
+		memcpy(dst, &value, 4);
+	}
+
+	std::vector<Entry> entries_;
+};
+
+int writeAll(int fd, const void *data, size_t size)
+{
+	const uint8_t *ptr = static_cast<const uint8_t *>(data);
+
+	while (size) {
+		ssize_t ret = ::write(fd, ptr, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		ptr += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Write rows from a strided buffer without copying them. Rows are gathered
+ * in batches, and partial writes fall back to writeAll().
+ */
+int writeRows(int fd, const uint8_t *data, unsigned int rows,
+	      unsigned int rowLength, unsigned int stride)
+{
+	if (stride == rowLength)
+		return writeAll(fd, data, static_cast<size_t>(rowLength) * rows);
+
+	constexpr unsigned int BatchRows = 64;
+	struct iovec iov[BatchRows];
+
+	for (unsigned int y = 0; y < rows;) {
+		unsigned int count = std::min(BatchRows, rows - y);
+		for (unsigned int i = 0; i < count; i++) {
+			iov[i].iov_base = const_cast<uint8_t *>(data + static_cast<size_t>(y + i) * stride);
+			iov[i].iov_len = rowLength;
+		}
+
+		ssize_t ret = ::writev(fd, iov, count);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		/* Finish a short write row by row. */
+		size_t written = ret;
+		for (unsigned int i = 0; i < count; i++, y++) {
+			if (written >= rowLength) {
+				written -= rowLength;
+				continue;
+			}
+
+			int err = writeAll(fd, data + static_cast<size_t>(y) * stride + written,
+					   rowLength - written);
+			if (err)
+				return err;
+			written = 0;
+		}
+	}
+
+	return 0;
+}
+
+void unpackRow10CSI2P(const uint8_t *src, uint16_t *dst, unsigned int width)
+{
+	unsigned int x = 0;
+
+	for (; x + 4 <= width; x += 4, src += 5) {
+		const uint8_t lsbs = src[4];
+		dst[x + 0] = (src[0] << 2) | ((lsbs >> 0) & 3);
+		dst[x + 1] = (src[1] << 2) | ((lsbs >> 2) & 3);
+		dst[x + 2] = (src[2] << 2) | ((lsbs >> 4) & 3);
+		dst[x + 3] = (src[3] << 2) | ((lsbs >> 6) & 3);
+	}
+
+	for (unsigned int i = 0; x < width; x++, i++)
+		dst[x] = (src[i] << 2) | ((src[4] >> (i * 2)) & 3);
+}
+
+void unpackRow12CSI2P(const uint8_t *src, uint16_t *dst, unsigned int width)
+{
+	unsigned int x = 0;
+
+	for (; x + 2 <= width; x += 2, src += 3) {
+		dst[x + 0] = (src[0] << 4) | (src[2] & 0x0f);
+		dst[x + 1] = (src[1] << 4) | (src[2] >> 4);
+	}
+
+	if (x < width)
+		dst[x] = (src[0] << 4) | (src[2] & 0x0f);
+}
+
+/* Small row-major 3x3 matrix helpers for the colour matrix */
+using Matrix3 = std::array<double, 9>;
+
+Matrix3 multiply(const Matrix3 &a, const Matrix3 &b)
+{
+	Matrix3 m{};
+	for (unsigned int i = 0; i < 3; i++)
+		for (unsigned int j = 0; j < 3; j++)
+			for (unsigned int k = 0; k < 3; k++)
+				m[i * 3 + j] += a[i * 3 + k] * b[k * 3 + j];
+	return m;
+}
+
+bool invert(const Matrix3 &m, Matrix3 &inverse)
+{
+	const double det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+			   m[1] * (m[3] * m[8] - m[5] * m[6]) +
+			   m[2] * (m[3] * m[7] - m[4] * m[6]);
+	if (det == 0.0)
+		return false;
+
+	inverse = {
+		(m[4] * m[8] - m[5] * m[7]) / det,
+		(m[2] * m[7] - m[1] * m[8]) / det,
+		(m[1] * m[5] - m[2] * m[4]) / det,
+		(m[5] * m[6] - m[3] * m[8]) / det,
+		(m[0] * m[8] - m[2] * m[6]) / det,
+		(m[2] * m[3] - m[0] * m[5]) / det,
+		(m[3] * m[7] - m[4] * m[6]) / det,
+		(m[1] * m[6] - m[0] * m[7]) / det,
+		(m[0] * m[4] - m[1] * m[3]) / det,
+	};
+	return true;
+}
+
+} /* namespace */
+
+int DNGWriter::write(const char *filename, const std::string &model,
+		     const StreamConfiguration &config,
+		     const ControlList &metadata,
+		     const Span<const uint8_t> &data)
+{
+	const auto it = formatInfo.find(config.pixelFormat);
+	if (it == formatInfo.cend()) {
+		std::cerr << "Unsupported pixel format " << config.pixelFormat
+			  << std::endl;
+		return -EINVAL;
+	}
+
+	const FormatInfo &info = it->second;
+	const unsigned int width = config.size.width;
+	const unsigned int height = config.size.height;
+
+	/* Samples wider than 8 bits are stored unpacked, in 16 bits. */
+	const unsigned int bytesPerSample = info.bitsPerSample > 8 ? 2 : 1;
+	const unsigned int rowLength = width * bytesPerSample;
+	const uint32_t imageSize = rowLength * height;
+
+	unsigned int srcRowLength = rowLength;
+	if (info.packing == Packing::CSI2P)
+		srcRowLength = (width * info.bitsPerSample + 7) / 8;
+
+	if (static_cast<size_t>(config.stride) * (height - 1) + srcRowLength > data.size()) {
+		std::cerr << "Frame buffer too small for " << config.toString()
+			  << std::endl;
+		return -EINVAL;
+	}
+
+	TiffDirectory ifd;
+
+	ifd.addLong(TagNewSubfileType, 0);
+	ifd.addLong(TagImageWidth, width);
+	ifd.addLong(TagImageLength, height);
+	ifd.addShort(TagBitsPerSample, bytesPerSample * 8);
+	ifd.addShort(TagCompression, 1);
+	ifd.addShort(TagPhotometricInterpretation, PhotometricCFA);
+	ifd.addAscii(TagMake, "libcamera");
+	ifd.addAscii(TagModel, model);
+	ifd.addAscii(TagUniqueCameraModel, model);
+	ifd.addShort(TagOrientation, 1);
+	ifd.addShort(TagSamplesPerPixel, 1);
+	ifd.addLong(TagRowsPerStrip, height);
+	ifd.addShort(TagPlanarConfiguration, 1);
+	ifd.addAscii(TagSoftware, "qlibcamera");
+
+	const uint8_t dngVersion[] = { 1, 2, 0, 0 };
+	const uint8_t dngBackwardVersion[] = { 1, 1, 0, 0 };
+	ifd.add(TagDNGVersion, TiffByte, 4, dngVersion);
+	ifd.add(TagDNGBackwardVersion, TiffByte, 4, dngBackwardVersion);
+
+	/* CFA layout, the channel order is R, Gr, Gb, B. */
+	const uint16_t patternDim[] = { 2, 2 };
+	const uint8_t planeColour[] = { CFAPatternRed, CFAPatternGreen, CFAPatternBlue };
+	const uint8_t channelColour[] = { CFAPatternRed, CFAPatternGreen, CFAPatternGreen, CFAPatternBlue };
+	uint8_t pattern[4];
+	for (unsigned int i = 0; i < 4; i++)
+		pattern[i] = channelColour[info.order[i]];
+
+	ifd.add(TagCFARepeatPatternDim, TiffShort, 2, patternDim);
+	ifd.add(TagCFAPattern, TiffByte, 4, pattern);
+	ifd.add(TagCFAPlaneColor, TiffByte, 3, planeColour);
+	ifd.addShort(TagCFALayout, 1);
+
+	/* Black levels are reported on a 16-bit scale. */
+	uint32_t blackLevel[4] = {};
+	const auto blackLevels = metadata.get(controls::SensorBlackLevels);
+	if (blackLevels) {
+		for (unsigned int i = 0; i < 4; i++)
+			blackLevel[i] = (*blackLevels)[info.order[i]] >> (16 - info.bitsPerSample);
+	}
+
+	ifd.add(TagBlackLevelRepeatDim, TiffShort, 2, patternDim);
+	ifd.add(TagBlackLevel, TiffLong, 4, blackLevel);
+	ifd.addLong(TagWhiteLevel, (1u << info.bitsPerSample) - 1);
+
+	/*
+	 * The colour matrix maps XYZ to the camera's native colour space. Build
+	 * it from the white balance gains and the colour correction matrix
+	 * reported by the pipeline handler, which map camera RGB to sRGB.
+	 */
+	double rGain = 1.0;
+	double bGain = 1.0;
+	const auto colourGains = metadata.get(controls::ColourGains);
+	if (colourGains && (*colourGains)[0] > 0 && (*colourGains)[1] > 0) {
+		rGain = (*colourGains)[0];
+		bGain = (*colourGains)[1];
+	}
+
+	Matrix3 ccm = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+	const auto colourCorrection = metadata.get(controls::ColourCorrectionMatrix);
+	if (colourCorrection)
+		std::copy(colourCorrection->begin(), colourCorrection->end(), ccm.begin());
+
+	const Matrix3 wbGains = { rGain, 0, 0, 0, 1, 0, 0, 0, bGain };
+	const Matrix3 rgb2xyz = {
+		0.4124564, 0.3575761, 0.1804375,
+		0.2126729, 0.7151522, 0.0721750,
+		0.0193339, 0.1191920, 0.9503041,
+	};
+
+	Matrix3 colourMatrix;
+	if (!invert(multiply(rgb2xyz, multiply(ccm, wbGains)), colourMatrix))
+		invert(rgb2xyz, colourMatrix);
+
+	ifd.addRationals(TagColorMatrix1, TiffSRational,
+			 std::vector<double>(colourMatrix.begin(), colourMatrix.end()));
+	ifd.addRationals(TagAsShotNeutral, TiffRational, { 1.0 / rGain, 1.0, 1.0 / bGain });
+	ifd.addShort(TagCalibrationIlluminant1, IlluminantD65);
+
+	std::vector<uint8_t> header;
+	ifd.serialize(header, imageSize);
+
+	int fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		std::cerr << "Failed to open dng file " << filename << ": "
+			  << strerror(errno) << std::endl;
+		return -errno;
+	}
+
+	int ret = writeAll(fd, header.data(), header.size());
+	if (ret)
+		goto done;
+
+	if (info.packing == Packing::None) {
+		ret = writeRows(fd, data.data(), height, rowLength, config.stride);
+	} else {
+		/* Packed rows are expanded one at a time. */
+		std::vector<uint16_t> line(width);
+		const uint8_t *row = data.data();
+
+		for (unsigned int y = 0; y < height && !ret; y++, row += config.stride) {
+			if (info.bitsPerSample == 10)
+				unpackRow10CSI2P(row, line.data(), width);
+			else
+				unpackRow12CSI2P(row, line.data(), width);
+
+			ret = writeAll(fd, line.data(), rowLength);
+		}
+	}
+
+done:
+	if (ret)
+		std::cerr << "Failed to write dng file " << filename << ": "
+			  << strerror(-ret) << std::endl;
+
+	if (::close(fd) < 0 && !ret)
+		ret = -errno;
+
+	return ret;
+}
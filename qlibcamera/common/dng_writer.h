@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2020, Raspberry Pi Ltd
+ *
+ * DNG writer
+ */
+
+#pragma once
+
+#include <string>
+
+#include <libcamera/base/span.h>
+
+#include <libcamera/controls.h>
+#include <libcamera/stream.h>
+
+class DNGWriter
+{
+public:
+	static int write(const char *filename, const std::string &model,
+			 const libcamera::StreamConfiguration &config,
+			 const libcamera::ControlList &metadata,
+			 const libcamera::Span<const uint8_t> &data);
+};
@@ -7,353 +7,945 @@
 
 #include "format_converter.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <errno.h>
-#include <utility>
+#include <string.h>
 
 #include <QImage>
 
 #include <libcamera/formats.h>
 
-#define RGBSHIFT		8
-#ifndef MAX
-#define MAX(a,b)		((a)>(b)?(a):(b))
-#endif
-#ifndef MIN
-#define MIN(a,b)		((a)<(b)?(a):(b))
-#endif
-#ifndef CLAMP
-#define CLAMP(a,low,high)	MAX((low),MIN((high),(a)))
-#endif
-#ifndef CLIP
-#define CLIP(x)			CLAMP(x,0,255)
-#endif
+#include "stripe_pool.h"
 
 using namespace qlibcamera;
 
+namespace {
+
+using RgbRowTable = std::array<YuvRowFunction, static_cast<size_t>(RgbFormat::Count)>;
+
+/*
+ * RGB rows, with the component offsets of the format as constants. The
+ * coefficients are unused, the signature is shared with the YUV kernels.
+ */
+template<unsigned int Bpp, unsigned int R, unsigned int G, unsigned int B, RgbFormat F>
+void rgbRow(const uint8_t *const src[3], uint8_t *dst, unsigned int width,
+	    [[maybe_unused]] const YuvCoefficients &k)
+{
+	const uint8_t *line = src[0];
+
+	for (unsigned int x = 0; x < width; x++)
+		storeRgb<F>(dst, x, line[Bpp * x + R], line[Bpp * x + G], line[Bpp * x + B]);
+}
+
+template<unsigned int Bpp, unsigned int R, unsigned int G, unsigned int B>
+constexpr RgbRowTable rgbRows = {
+	rgbRow<Bpp, R, G, B, RgbFormat::RGB32>,
+	rgbRow<Bpp, R, G, B, RgbFormat::RGB888>,
+	rgbRow<Bpp, R, G, B, RgbFormat::RGB16>,
+	rgbRow<Bpp, R, G, B, RgbFormat::Grayscale8>,
+};
+
+/* Sampled RGB components, in B, G, R planes */
+template<RgbFormat F>
+void rgbSampleRow(const uint8_t *const src[3], uint8_t *dst, unsigned int width,
+		  [[maybe_unused]] const YuvCoefficients &k)
+{
+	for (unsigned int x = 0; x < width; x++)
+		storeRgb<F>(dst, x, src[2][x], src[1][x], src[0][x]);
+}
+
+constexpr RgbRowTable rgbSampleRows = {
+	rgbSampleRow<RgbFormat::RGB32>,
+	rgbSampleRow<RgbFormat::RGB888>,
+	rgbSampleRow<RgbFormat::RGB16>,
+	rgbSampleRow<RgbFormat::Grayscale8>,
+};
+
+std::optional<RgbFormat> rgbFormat(QImage::Format format)
+{
+	switch (format) {
+	case QImage::Format_RGB32:
+		return RgbFormat::RGB32;
+	case QImage::Format_RGB888:
+		return RgbFormat::RGB888;
+	case QImage::Format_RGB16:
+		return RgbFormat::RGB16;
+	case QImage::Format_Grayscale8:
+		return RgbFormat::Grayscale8;
+	default:
+		return std::nullopt;
+	}
+}
+
+const YuvCoefficients &coefficients(const std::optional<libcamera::ColorSpace> &colorSpace)
+{
+	if (!colorSpace)
+		return YuvCoefficients::get(YuvCoefficients::Rec601, false);
+
+	const bool fullRange = colorSpace->range == libcamera::ColorSpace::Range::Full;
+
+	switch (colorSpace->ycbcrEncoding) {
+	case libcamera::ColorSpace::YcbcrEncoding::Rec709:
+		return YuvCoefficients::get(YuvCoefficients::Rec709, fullRange);
+	case libcamera::ColorSpace::YcbcrEncoding::Rec2020:
+		return YuvCoefficients::get(YuvCoefficients::Rec2020, fullRange);
+	default:
+		return YuvCoefficients::get(YuvCoefficients::Rec601, fullRange);
+	}
+}
+
+/*
+ * Mapping of output pixel \a o of \a out to the \a in source pixels, centres
+ * aligned.
+ */
+unsigned int nearestPixel(unsigned int o, unsigned int out, unsigned int in)
+{
+	return (uint64_t(2 * o + 1) * in) / (2 * out);
+}
+
+/* The source pixel before the centre of \a o, and the weight of the next one in 1/256 */
+unsigned int bilinearPixel(unsigned int o, unsigned int out, unsigned int in,
+			   unsigned int *weight)
+{
+	const int64_t position = int64_t(2 * o + 1) * in * 256 / (2 * out) - 128;
+
+	if (position <= 0 || in == 1) {
+		*weight = 0;
+		return 0;
+	}
+
+	unsigned int pixel = position >> 8;
+	*weight = position & 0xff;
+
+	/* Past the last centre, weigh the last pixel fully. */
+	if (pixel >= in - 1) {
+		pixel = in - 2;
+		*weight = 256;
+	}
+
+	return pixel;
+}
+
+/* The source pixels [*end - n, *end) \a o covers, at least one */
+unsigned int boxPixels(unsigned int o, unsigned int out, unsigned int in, unsigned int *end)
+{
+	const unsigned int start = uint64_t(o) * in / out;
+	*end = std::max<unsigned int>(uint64_t(o + 1) * in / out, start + 1);
+	return start;
+}
+
+/* Blend the pixels of \a span around each output column. */
+template<unsigned int Bpp>
+void resampleRow(const uint8_t *span, uint8_t *out, unsigned int width,
+		 const unsigned int *columns, const unsigned int *weights)
+{
+	for (unsigned int x = 0; x < width; x++) {
+		const uint8_t *p = span + Bpp * columns[x];
+		const unsigned int w = weights[x];
+
+		for (unsigned int c = 0; c < Bpp; c++)
+			out[Bpp * x + c] = (p[c] * (256 - w) + p[c + Bpp] * w + 128) >> 8;
+	}
+}
+
+/* Bayer formats, with the R, Gr, Gb or B channel at each position of the 2x2 pattern */
+struct BayerFormat {
+	libcamera::PixelFormat format;
+	unsigned int bits;
+	RawPacking packing;
+	uint8_t order[4];
+};
+
+#define BAYER_FORMATS(bits, suffix, packing)						\
+	{ libcamera::formats::SRGGB##bits##suffix, bits, packing, { 0, 1, 2, 3 } },	\
+	{ libcamera::formats::SGRBG##bits##suffix, bits, packing, { 1, 0, 3, 2 } },	\
+	{ libcamera::formats::SGBRG##bits##suffix, bits, packing, { 2, 3, 0, 1 } },	\
+	{ libcamera::formats::SBGGR##bits##suffix, bits, packing, { 3, 2, 1, 0 } }
+
+const BayerFormat bayerFormats[] = {
+	BAYER_FORMATS(8, , RawPacking::Bytes),
+	BAYER_FORMATS(10, , RawPacking::Words),
+	BAYER_FORMATS(12, , RawPacking::Words),
+	BAYER_FORMATS(16, , RawPacking::Words),
+	BAYER_FORMATS(10, _CSI2P, RawPacking::Csi2Packed10),
+	BAYER_FORMATS(12, _CSI2P, RawPacking::Csi2Packed12),
+};
+
+#undef BAYER_FORMATS
+
+/* Room for the pixels mirrored past the ends of levelled rows, keeping them aligned */
+constexpr unsigned int RawPadding = 16;
+
+/* Identifies converted Bayer frames in the rows threads keep, 0 for none */
+std::atomic<uint64_t> bayerFrames;
+
+/* A levelled Bayer row, of a frame */
+struct LevelledRow {
+	uint64_t frame = 0;
+	unsigned int y;
+	std::vector<uint8_t> data;
+};
+
+/* Per-thread buffers of the scaling stages, reused across frames */
+struct Scratch {
+	std::vector<uint8_t> span;              /* A converted row of the crop rectangle */
+	std::vector<uint8_t> blended;           /* A row to pack to the output format */
+	std::vector<uint8_t> resampled[2];      /* Horizontally scaled rows */
+	std::vector<uint8_t> gathered[3];       /* Sampled or averaged components */
+	std::vector<uint32_t> sums[3];          /* Column sums of the planes */
+	std::vector<uint8_t> developed;         /* A developed Bayer row */
+	LevelledRow levelled[3];                /* Bayer rows, row y in slot y % 3 */
+};
+
+thread_local Scratch scratch;
+
+} /* namespace */
+
+template<unsigned int Bpp, unsigned int R, unsigned int G, unsigned int B>
+void FormatConverter::setRgb()
+{
+	rgbRows_ = rgbRows<Bpp, R, G, B>.data();
+	yuv_ = false;
+
+	planes_[0] = { 0, stride_, 1, 2 * Bpp };
+	planeCount_ = 1;
+
+	components_[0] = { 0, 1, Bpp, B };
+	components_[1] = { 0, 1, Bpp, G };
+	components_[2] = { 0, 1, Bpp, R };
+}
+
+/* YVU planar formats \a swap the chroma planes. */
+template<YuvLayout L>
+void FormatConverter::setYuv(unsigned int horzSubSample, unsigned int vertSubSample, bool swap)
+{
+	layout_ = L;
+	yuv_ = true;
+
+	if constexpr (isYuvPacked(L)) {
+		using P = YuvPacking<L>;
+
+		planes_[0] = { 0, stride_, 1, 4 };
+		planeCount_ = 1;
+
+		components_[0] = { 0, 1, 2, P::y };
+		components_[1] = { 0, 2, 4, P::u };
+		components_[2] = { 0, 2, 4, P::v };
+	} else if constexpr (L == YuvLayout::Planar || L == YuvLayout::Planar444) {
+		const unsigned int stride = stride_ / horzSubSample;
+		const unsigned int pairBytes = 2 / horzSubSample;
+
+		planes_[0] = { 0, stride_, 1, 2 };
+		planes_[1] = { swap ? 2u : 1u, stride, vertSubSample, pairBytes };
+		planes_[2] = { swap ? 1u : 2u, stride, vertSubSample, pairBytes };
+		planeCount_ = 3;
+
+		components_[0] = { 0, 1, 1, 0 };
+		components_[1] = { 1, horzSubSample, 1, 0 };
+		components_[2] = { 2, horzSubSample, 1, 0 };
+	} else {
+		/* Semi-planar chroma interleaves U and V. */
+		constexpr unsigned int uPos = L == YuvLayout::SemiPlanarUV ||
+					      L == YuvLayout::SemiPlanar444UV ? 0 : 1;
+
+		planes_[0] = { 0, stride_, 1, 2 };
+		planes_[1] = { 1, stride_ * 2 / horzSubSample, vertSubSample, 4 / horzSubSample };
+		planeCount_ = 2;
+
+		components_[0] = { 0, 1, 1, 0 };
+		components_[1] = { 1, horzSubSample, 2, uPos };
+		components_[2] = { 1, horzSubSample, 2, 1 - uPos };
+	}
+}
+
+/*
+ * Bayer frames are developed as they are read, to BGRX rows converted as
+ * RGB32. Returns -EINVAL if \a format is not a Bayer format.
+ */
+int FormatConverter::setBayer(const libcamera::PixelFormat &format)
+{
+	const BayerFormat *info = std::find_if(std::begin(bayerFormats), std::end(bayerFormats),
+					       [&](const BayerFormat &f) { return f.format == format; });
+	if (info == std::end(bayerFormats))
+		return -EINVAL;
+
+	setRgb<4, 2, 1, 0>();
+	bayer_ = true;
+
+	level_ = rawLevelRow(info->packing, info->bits);
+	rawBits_ = info->bits;
+	std::copy(info->order, info->order + 4, cfaOrder_);
+	redPosition_ = std::find(info->order, info->order + 4, 0) - info->order;
+	levels_.clear();
+
+	return 0;
+}
+
 int FormatConverter::configure(const libcamera::PixelFormat &format,
-			       const QSize &size, unsigned int stride)
+			       const QSize &size, unsigned int stride,
+			       const std::optional<libcamera::ColorSpace> &colorSpace)
+{
+	stride_ = stride;
+	mjpeg_ = format == libcamera::formats::MJPEG;
+
+	/*
+	 * MJPEG frames are converted as decoded, laid out as the JPEGs are
+	 * sampled. Until the first one tells, take them as 4:2:2 like most UVC
+	 * cameras send them.
+	 */
+	decodedFormat_ = libcamera::PixelFormat();
+	int ret = setLayout(mjpeg_ ? libcamera::formats::YUV422 : format);
+	if (ret)
+		return ret;
+
+	format_ = format;
+	width_ = size.width();
+	height_ = size.height();
+
+	/* JFIF specifies BT.601 full range. */
+	coefficients_ = mjpeg_ ? &YuvCoefficients::get(YuvCoefficients::Rec601, true)
+			       : &coefficients(colorSpace);
+
+	updateKernels();
+	updateOutput();
+
+	return 0;
+}
+
+/* Set the planes, components and row kernels of frames of \a format */
+int FormatConverter::setLayout(const libcamera::PixelFormat &format)
 {
+	bayer_ = false;
+
 	switch (format) {
 	case libcamera::formats::NV12:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = false;
+		setYuv<YuvLayout::SemiPlanarUV>(2, 2);
 		break;
 	case libcamera::formats::NV21:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = true;
+		setYuv<YuvLayout::SemiPlanarVU>(2, 2);
 		break;
 	case libcamera::formats::NV16:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 1;
-		nvSwap_ = false;
+		setYuv<YuvLayout::SemiPlanarUV>(2, 1);
 		break;
 	case libcamera::formats::NV61:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 1;
-		nvSwap_ = true;
+		setYuv<YuvLayout::SemiPlanarVU>(2, 1);
 		break;
 	case libcamera::formats::NV24:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 1;
-		vertSubSample_ = 1;
-		nvSwap_ = false;
+		setYuv<YuvLayout::SemiPlanar444UV>(1, 1);
 		break;
 	case libcamera::formats::NV42:
-		formatFamily_ = YUVSemiPlanar;
-		horzSubSample_ = 1;
-		vertSubSample_ = 1;
-		nvSwap_ = true;
+		setYuv<YuvLayout::SemiPlanar444VU>(1, 1);
 		break;
 
 	case libcamera::formats::R8:
-		formatFamily_ = RGB;
-		r_pos_ = 0;
-		g_pos_ = 0;
-		b_pos_ = 0;
-		bpp_ = 1;
+		setRgb<1, 0, 0, 0>();
 		break;
 	case libcamera::formats::RGB888:
-		formatFamily_ = RGB;
-		r_pos_ = 2;
-		g_pos_ = 1;
-		b_pos_ = 0;
-		bpp_ = 3;
+		setRgb<3, 2, 1, 0>();
 		break;
 	case libcamera::formats::BGR888:
-		formatFamily_ = RGB;
-		r_pos_ = 0;
-		g_pos_ = 1;
-		b_pos_ = 2;
-		bpp_ = 3;
+		setRgb<3, 0, 1, 2>();
 		break;
 	case libcamera::formats::ARGB8888:
 	case libcamera::formats::XRGB8888:
-		formatFamily_ = RGB;
-		r_pos_ = 2;
-		g_pos_ = 1;
-		b_pos_ = 0;
-		bpp_ = 4;
+		setRgb<4, 2, 1, 0>();
 		break;
 	case libcamera::formats::RGBA8888:
 	case libcamera::formats::RGBX8888:
-		formatFamily_ = RGB;
-		r_pos_ = 3;
-		g_pos_ = 2;
-		b_pos_ = 1;
-		bpp_ = 4;
+		setRgb<4, 3, 2, 1>();
 		break;
 	case libcamera::formats::ABGR8888:
 	case libcamera::formats::XBGR8888:
-		formatFamily_ = RGB;
-		r_pos_ = 0;
-		g_pos_ = 1;
-		b_pos_ = 2;
-		bpp_ = 4;
+		setRgb<4, 0, 1, 2>();
 		break;
 	case libcamera::formats::BGRA8888:
 	case libcamera::formats::BGRX8888:
-		formatFamily_ = RGB;
-		r_pos_ = 1;
-		g_pos_ = 2;
-		b_pos_ = 3;
-		bpp_ = 4;
+		setRgb<4, 1, 2, 3>();
 		break;
 
 	case libcamera::formats::VYUY:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 1;
-		cb_pos_ = 2;
+		setYuv<YuvLayout::VYUY>(2, 1);
 		break;
 	case libcamera::formats::YVYU:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 0;
-		cb_pos_ = 3;
+		setYuv<YuvLayout::YVYU>(2, 1);
 		break;
 	case libcamera::formats::UYVY:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 1;
-		cb_pos_ = 0;
+		setYuv<YuvLayout::UYVY>(2, 1);
 		break;
 	case libcamera::formats::YUYV:
-		formatFamily_ = YUVPacked;
-		y_pos_ = 0;
-		cb_pos_ = 1;
+		setYuv<YuvLayout::YUYV>(2, 1);
 		break;
 
 	case libcamera::formats::YUV420:
-		formatFamily_ = YUVPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = false;
+		setYuv<YuvLayout::Planar>(2, 2);
 		break;
 	case libcamera::formats::YVU420:
-		formatFamily_ = YUVPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 2;
-		nvSwap_ = true;
+		setYuv<YuvLayout::Planar>(2, 2, true);
 		break;
 	case libcamera::formats::YUV422:
-		formatFamily_ = YUVPlanar;
-		horzSubSample_ = 2;
-		vertSubSample_ = 1;
-		nvSwap_ = false;
+		setYuv<YuvLayout::Planar>(2, 1);
 		break;
-
-	case libcamera::formats::MJPEG:
-		formatFamily_ = MJPEG;
+	case libcamera::formats::YUV444:
+		setYuv<YuvLayout::Planar444>(1, 1);
 		break;
 
 	default:
-		return -EINVAL;
+		return setBayer(format);
 	};
 
-	format_ = format;
-	width_ = size.width();
-	height_ = size.height();
-	stride_ = stride;
+	return 0;
+}
+
+/*
+ * Convert to QImage::Format_RGB32, Format_RGB888, Format_RGB16 or
+ * Format_Grayscale8. May be called before configure().
+ */
+int FormatConverter::setOutputFormat(QImage::Format format)
+{
+	const std::optional<RgbFormat> rgb = rgbFormat(format);
+	if (!rgb)
+		return -EINVAL;
+
+	outputFormat_ = format;
+	rgbFormat_ = *rgb;
+
+	if (width_)
+		updateKernels();
 
 	return 0;
 }
 
-void FormatConverter::convert(const QList<QByteArray>& dataList, QImage *dst)
+FormatConverter::RowKernels FormatConverter::kernels(RgbFormat format) const
 {
-	switch (formatFamily_) {
-    case MJPEG:
-        dst->loadFromData(dataList.at(0), "JPEG");
-		break;
-	case RGB:
-        convertRGB(dataList, dst->bits());
-		break;
-	case YUVPacked:
-        convertYUVPacked(dataList, dst->bits());
+	const size_t index = static_cast<size_t>(format);
+
+	if (!yuv_)
+		return { rgbRows_[index], rgbSampleRows[index] };
+
+	const YuvToRgbKernels &kernels = YuvToRgbKernels::best();
+	return { kernels.row(layout_, format), kernels.row(YuvLayout::Planar444, format) };
+}
+
+void FormatConverter::updateKernels()
+{
+	/* 5:6:5 pixels can't be blended bytewise. */
+	blendFormat_ = rgbFormat_ == RgbFormat::RGB16 ? RgbFormat::RGB32 : rgbFormat_;
+
+	output_ = kernels(rgbFormat_);
+	blend_ = kernels(blendFormat_);
+	pack_ = rgbRows<4, 2, 1, 0>[static_cast<size_t>(rgbFormat_)];
+	lumaOnly_ = yuv_ && rgbFormat_ == RgbFormat::Grayscale8;
+}
+
+/*
+ * Convert the \a crop rectangle of frames, the whole frame if empty, to
+ * images of \a size, the size of the rectangle if empty. May be called
+ * before configure(), the output is then resolved against the frame size.
+ */
+void FormatConverter::setOutput(const QSize &size, const QRect &crop, ScaleFilter filter)
+{
+	requestedSize_ = size;
+	requestedCrop_ = crop;
+	filter_ = filter;
+
+	if (width_)
+		updateOutput();
+}
+
+void FormatConverter::updateOutput()
+{
+	QRect frame(0, 0, width_, height_);
+
+	crop_ = requestedCrop_.isEmpty() ? frame : requestedCrop_.intersected(frame);
+	if (crop_.isEmpty())
+		crop_ = frame;
+
+	/*
+	 * MJPEG frames are decoded as small as DCT scaling goes, and Bayer
+	 * frames binned to half size, with the crop rectangle still at least
+	 * as large as the output, the filter scales the rest of the way. The
+	 * rectangle is scaled along.
+	 */
+	binned_ = false;
+
+	if (mjpeg_ || bayer_) {
+		const QSize size = requestedSize_.isEmpty() ? crop_.size() : requestedSize_;
+		const unsigned int maxScale = mjpeg_ ? MjpegDecoder::MaxScale : 1;
+		unsigned int scale = 0;
+
+		while (scale < maxScale &&
+		       crop_.width() >= size.width() << (scale + 1) &&
+		       crop_.height() >= size.height() << (scale + 1))
+			scale++;
+
+		/* Decoding rounds the size up, binning drops an odd last row or column. */
+		const unsigned int round = mjpeg_ ? (1 << scale) - 1 : 0;
+		frame = QRect(0, 0, (width_ + round) >> scale, (height_ + round) >> scale);
+		crop_ = QRect(QPoint(crop_.left() >> scale, crop_.top() >> scale),
+			      QPoint(crop_.right() >> scale, crop_.bottom() >> scale))
+				.intersected(frame);
+		if (crop_.isEmpty())
+			crop_ = frame;
+
+		if (mjpeg_) {
+			decoder_.setScale(scale);
+			decodedSize_ = frame.size();
+		} else {
+			binned_ = scale;
+		}
+	}
+
+	/* Kernels convert pixel pairs from an even column. */
+	const unsigned int left = crop_.left() & ~1;
+	const unsigned int right = std::min<unsigned int>(crop_.right() + 2, frame.width()) & ~1;
+	crop_.setLeft(left);
+	crop_.setWidth(std::max(right - left, 2u));
+
+	outputSize_ = requestedSize_.isEmpty() ? crop_.size() : requestedSize_;
+	scaled_ = outputSize_ != crop_.size();
+
+	const unsigned int width = outputSize_.width();
+	const unsigned int cropWidth = crop_.width();
+	std::vector<unsigned int> samples;
+
+	columns_.clear();
+	columnWeights_.clear();
+	columnEnds_.clear();
+
+	if (!scaled_) {
+		setSamples({});
+		rows_ = &FormatConverter::convertRows;
+		return;
+	}
+
+	switch (filter_) {
+	case ScaleFilter::Nearest:
+		for (unsigned int x = 0; x < width; x++)
+			samples.push_back(crop_.left() + nearestPixel(x, width, cropWidth));
+		setSamples(samples);
+		rows_ = &FormatConverter::nearestRows;
 		break;
-	case YUVSemiPlanar:
-        convertYUVSemiPlanar(dataList, dst->bits());
+
+	case ScaleFilter::Bilinear:
+		columns_.resize(width);
+		columnWeights_.resize(width);
+		for (unsigned int x = 0; x < width; x++)
+			columns_[x] = bilinearPixel(x, width, cropWidth, &columnWeights_[x]);
+
+		/*
+		 * Shrinking four times or more, converting only the pairs the
+		 * columns blend beats converting whole rows with vector kernels.
+		 */
+		if (8 * width <= cropWidth) {
+			for (unsigned int x = 0; x < width; x++) {
+				samples.push_back(crop_.left() + columns_[x]);
+				samples.push_back(crop_.left() + columns_[x] + 1);
+				columns_[x] = 2 * x;
+			}
+		}
+		setSamples(samples);
+		rows_ = &FormatConverter::bilinearRows;
 		break;
-	case YUVPlanar:
-        convertYUVPlanar(dataList, dst->bits());
+
+	case ScaleFilter::Box:
+		columns_.resize(width);
+		columnEnds_.resize(width);
+		for (unsigned int x = 0; x < width; x++)
+			columns_[x] = boxPixels(x, width, cropWidth, &columnEnds_[x]);
+
+		/* Offsets of all columns in the column sums, from the crop rectangle. */
+		for (unsigned int x = 0; x < cropWidth; x++)
+			samples.push_back(x);
+		setSamples(samples);
+		rows_ = &FormatConverter::boxRows;
 		break;
-	};
+	}
 }
 
-static void yuv_to_rgb(int y, int u, int v, int *r, int *g, int *b)
+/*
+ * Convert the frame \a columns only. Chroma of subsampled formats is taken
+ * from the pair of each column, and converted per pixel.
+ */
+void FormatConverter::setSamples(const std::vector<unsigned int> &columns)
 {
-	int c = y - 16;
-	int d = u - 128;
-	int e = v - 128;
-	*r = CLIP(( 298 * c           + 409 * e + 128) >> RGBSHIFT);
-	*g = CLIP(( 298 * c - 100 * d - 208 * e + 128) >> RGBSHIFT);
-	*b = CLIP(( 298 * c + 516 * d           + 128) >> RGBSHIFT);
+	for (unsigned int c = 0; c < 3; c++) {
+		const Component &component = components_[c];
+
+		samples_[c].resize(columns.size());
+		for (size_t i = 0; i < columns.size(); i++)
+			samples_[c][i] = columns[i] / component.horzSubSample * component.step +
+					 component.offset;
+	}
 }
 
-void FormatConverter::convertRGB(const QList<QByteArray> &dataList, unsigned char *dst)
+/*
+ * Level tables of the black levels and white balance gains of \a metadata,
+ * black at 0 and gains of 1 when not reported, as the DNG writer takes them.
+ * The tables are only rebuilt when these change.
+ */
+void FormatConverter::updateLevels(const FrameMetadata &metadata)
 {
-    const unsigned char *src = (const unsigned char *) dataList.at(0).constData();
-	unsigned int x, y;
-	int r, g, b;
-
-	for (y = 0; y < height_; y++) {
-		for (x = 0; x < width_; x++) {
-			r = src[bpp_ * x + r_pos_];
-			g = src[bpp_ * x + g_pos_];
-			b = src[bpp_ * x + b_pos_];
-
-			dst[4 * x + 0] = b;
-			dst[4 * x + 1] = g;
-			dst[4 * x + 2] = r;
-			dst[4 * x + 3] = 0xff;
-		}
+	int32_t blackLevels[4] = {};
+	float gains[4] = { 1, 1, 1, 1 };
+
+	if (metadata.has(FrameMetadata::SensorBlackLevels))
+		std::copy(metadata.blackLevels, metadata.blackLevels + 4, blackLevels);
+	if (metadata.has(FrameMetadata::ColourGains) &&
+	    metadata.colourGains[0] > 0 && metadata.colourGains[1] > 0) {
+		gains[0] = metadata.colourGains[0];
+		gains[3] = metadata.colourGains[1];
+	}
+
+	if (!levels_.empty() && std::equal(blackLevels, blackLevels + 4, blackLevels_) &&
+	    std::equal(gains, gains + 4, gains_))
+		return;
+
+	levels_.resize(4 << std::min(rawBits_, MaxLevelBits));
+	rawLevels(levels_.data(), rawBits_, cfaOrder_, blackLevels, gains);
+	std::copy(blackLevels, blackLevels + 4, blackLevels_);
+	std::copy(gains, gains + 4, gains_);
+}
+
+/*
+ * Convert \a frame to \a dst, an image of the output size and format.
+ * Returns -EINVAL if an MJPEG frame can't be decoded, or doesn't decode to
+ * the configured size, \a dst is then left as is.
+ */
+int FormatConverter::convert(const LibCameraFrame &frame, QImage *dst)
+{
+	if (bayer_) {
+		updateLevels(frame.metadata());
+		frameId_ = ++bayerFrames;
+	}
 
-		src += stride_;
-		dst += width_ * 4;
+	if (!mjpeg_) {
+		convertFrame(frame, dst);
+		return 0;
 	}
+
+	const LibCameraFrame decoded = decoder_.decode(frame);
+	if (decoded.isNull() || decoder_.size() != decodedSize_)
+		return -EINVAL;
+
+	/* Decoding at another scale may change the chroma sampling. */
+	if (decoder_.format() != decodedFormat_ || decoder_.stride() != stride_) {
+		decodedFormat_ = decoder_.format();
+		stride_ = decoder_.stride();
+		setLayout(decodedFormat_);
+		updateKernels();
+		updateOutput();
+	}
+
+	convertFrame(decoded, dst);
+
+	return 0;
 }
 
-void FormatConverter::convertYUVPacked(const QList<QByteArray> &dataList, unsigned char *dst)
+void FormatConverter::convertFrame(const LibCameraFrame &frame, QImage *dst)
 {
-    const unsigned char *src = (const unsigned char *) dataList.at(0).constData();
-	unsigned int src_x, src_y, dst_x, dst_y;
-	unsigned int src_stride;
-	unsigned int dst_stride;
-	unsigned int cr_pos;
-	int r, g, b, y, cr, cb;
-
-	cr_pos = (cb_pos_ + 2) % 4;
-	src_stride = stride_;
-	dst_stride = width_ * 4;
-
-	for (src_y = 0, dst_y = 0; dst_y < height_; src_y++, dst_y++) {
-		for (src_x = 0, dst_x = 0; dst_x < width_; ) {
-			cb = src[src_y * src_stride + src_x * 4 + cb_pos_];
-			cr = src[src_y * src_stride + src_x * 4 + cr_pos];
-
-			y = src[src_y * src_stride + src_x * 4 + y_pos_];
-			yuv_to_rgb(y, cb, cr, &r, &g, &b);
-			dst[dst_y * dst_stride + 4 * dst_x + 0] = b;
-			dst[dst_y * dst_stride + 4 * dst_x + 1] = g;
-			dst[dst_y * dst_stride + 4 * dst_x + 2] = r;
-			dst[dst_y * dst_stride + 4 * dst_x + 3] = 0xff;
-			dst_x++;
-
-			y = src[src_y * src_stride + src_x * 4 + y_pos_ + 2];
-			yuv_to_rgb(y, cb, cr, &r, &g, &b);
-			dst[dst_y * dst_stride + 4 * dst_x + 0] = b;
-			dst[dst_y * dst_stride + 4 * dst_x + 1] = g;
-			dst[dst_y * dst_stride + 4 * dst_x + 2] = r;
-			dst[dst_y * dst_stride + 4 * dst_x + 3] = 0xff;
-			dst_x++;
-
-			src_x++;
-		}
+	/* Box filtering reads the whole crop rectangle, other paths a row per output row. */
+	const unsigned int width = outputSize_.width();
+	const unsigned int height = outputSize_.height();
+	const unsigned int pixels = scaled_ && filter_ == ScaleFilter::Box
+				  ? crop_.width() * crop_.height() : width * height;
+
+	StripePool *pool = StripePool::global();
+	const unsigned int stripes = std::clamp(pixels / MinStripePixels,
+						1u, pool->threadCount());
+	const unsigned int rows = ((height + stripes - 1) / stripes + 1) & ~1u;
+	const unsigned int dstStride = dst->bytesPerLine();
+	unsigned char *bits = dst->bits();
+
+	pool->run(stripes, [&](unsigned int stripe) {
+		const unsigned int top = stripe * rows;
+		const unsigned int bottom = std::min(top + rows, height);
+		if (top < bottom)
+			(this->*rows_)(frame, bits + top * dstStride, dstStride, top, bottom);
+	});
+}
+
+/* The lines of frame row \a y, from column \a x on, which is even */
+void FormatConverter::lines(const LibCameraFrame &frame, unsigned int y, unsigned int x,
+			    const unsigned char *lines[3]) const
+{
+	if (bayer_) {
+		lines[0] = developedRow(frame, y) + 4 * x;
+		return;
+	}
+
+	for (unsigned int i = 0; i < planeCount_; i++) {
+		const Plane &plane = planes_[i];
+		lines[i] = frame.constData(plane.index) + (y / plane.vertSubSample) * plane.stride +
+			   x / 2 * plane.pairBytes;
+	}
+}
+
+/*
+ * Row \a y of a Bayer frame developed to BGRX, over the columns of the crop
+ * rectangle only, at their offset in the row.
+ */
+const uint8_t *FormatConverter::developedRow(const LibCameraFrame &frame, unsigned int y) const
+{
+	const BayerKernels &kernels = BayerKernels::best();
+	const unsigned int left = crop_.left();
+
+	scratch.developed.resize(4 * (left + crop_.width()));
+	uint8_t *dst = scratch.developed.data() + 4 * left;
+
+	if (binned_) {
+		const uint8_t *rows[3] = {
+			levelledRow(frame, 2 * y) + 2 * left,
+			levelledRow(frame, 2 * y + 1) + 2 * left,
+		};
+
+		kernels.binned[redPosition_](rows, dst, crop_.width());
+	} else {
+		/* Rows past the top and bottom are mirrored, keeping the pattern. */
+		const unsigned int above = y ? y - 1 : y + 1;
+		const unsigned int below = y + 1 < height_ ? y + 1 : y - 1;
+		const uint8_t *rows[3] = {
+			levelledRow(frame, above) + left,
+			levelledRow(frame, y) + left,
+			levelledRow(frame, below) + left,
+		};
+		const uint8_t *order = &cfaOrder_[2 * (y & 1)];
+		const bool red = order[0] == 0 || order[1] == 0;
+		const bool greenFirst = order[0] == 1 || order[0] == 2;
+
+		kernels.bilinear[red][greenFirst](rows, dst, crop_.width());
 	}
+
+	return scratch.developed.data();
 }
 
-void FormatConverter::convertYUVPlanar(const QList<QByteArray> &dataList, unsigned char *dst)
+/*
+ * Raw row \a y of a Bayer frame mapped through the level tables, with the
+ * pixels past each end mirrored. Consecutive developed rows share rows, so
+ * each thread keeps the last three of the frame.
+ */
+const uint8_t *FormatConverter::levelledRow(const LibCameraFrame &frame, unsigned int y) const
 {
-	unsigned int c_stride = stride_ / horzSubSample_;
-	unsigned int c_inc = horzSubSample_ == 1 ? 1 : 0;
-    const unsigned char *src_y = (const unsigned char *) dataList.at(0).constData();
-    const unsigned char *src_cb = (const unsigned char *) dataList.at(1).constData();
-    const unsigned char *src_cr = (const unsigned char *) dataList.at(2).constData();
-	int r, g, b;
-
-	if (nvSwap_)
-		std::swap(src_cb, src_cr);
-
-	for (unsigned int y = 0; y < height_; y++) {
-		const unsigned char *line_y = src_y + y * stride_;
-		const unsigned char *line_cb = src_cb + (y / vertSubSample_) *
-					       c_stride;
-		const unsigned char *line_cr = src_cr + (y / vertSubSample_) *
-					       c_stride;
-
-		for (unsigned int x = 0; x < width_; x += 2) {
-			yuv_to_rgb(*line_y, *line_cb, *line_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			line_y++;
-			line_cb += c_inc;
-			line_cr += c_inc;
-			dst += 4;
-
-			yuv_to_rgb(*line_y, *line_cb, *line_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			line_y++;
-			line_cb += 1;
-			line_cr += 1;
-			dst += 4;
+	LevelledRow &row = scratch.levelled[y % 3];
+	const unsigned int width = width_ & ~1u;
+
+	if (row.frame != frameId_ || row.y != y) {
+		const unsigned int size = 1 << std::min(rawBits_, MaxLevelBits);
+		const uint8_t *tables = &levels_[2 * (y & 1) * size];
+
+		row.data.resize(width + 2 * RawPadding);
+		uint8_t *line = row.data.data() + RawPadding;
+
+		level_(frame.constData(0) + y * stride_, line, width, tables, tables + size);
+		line[-1] = line[1];
+		line[width] = line[width - 2];
+
+		row.frame = frameId_;
+		row.y = y;
+	}
+
+	return row.data.data() + RawPadding;
+}
+
+/*
+ * Convert the pixels of frame row \a y the output samples to \a dst with
+ * \a kernels: those of the sample tables, or the row of the crop rectangle.
+ */
+void FormatConverter::sampleRow(const LibCameraFrame &frame, unsigned int y, unsigned char *dst,
+				const RowKernels &kernels)
+{
+	const unsigned int count = samples_[0].size();
+	const unsigned char *src[3] = {};
+
+	if (!count) {
+		lines(frame, y, crop_.left(), src);
+		kernels.row(src, dst, crop_.width(), *coefficients_);
+		return;
+	}
+
+	lines(frame, y, 0, src);
+
+	const uint8_t *planes[3] = {};
+
+	for (unsigned int c = 0; c < (lumaOnly_ ? 1 : 3); c++) {
+		const unsigned char *line = src[components_[c].line];
+		const unsigned int *offsets = samples_[c].data();
+
+		scratch.gathered[c].resize(count);
+		uint8_t *gathered = scratch.gathered[c].data();
+		for (unsigned int x = 0; x < count; x++)
+			gathered[x] = line[offsets[x]];
+		planes[c] = gathered;
+	}
+
+	kernels.samples(planes, dst, count, *coefficients_);
+}
+
+/* Convert output rows [top, bottom) of \a frame to \a dst, the first of them */
+void FormatConverter::convertRows(const LibCameraFrame &frame, unsigned char *dst,
+				  unsigned int dstStride, unsigned int top, unsigned int bottom)
+{
+	for (unsigned int y = top; y < bottom; y++) {
+		sampleRow(frame, crop_.top() + y, dst, output_);
+		dst += dstStride;
+	}
+}
+
+/* Convert only the pixels of the output, sampled straight from the frame. */
+void FormatConverter::nearestRows(const LibCameraFrame &frame, unsigned char *dst,
+				  unsigned int dstStride, unsigned int top, unsigned int bottom)
+{
+	for (unsigned int y = top; y < bottom; y++) {
+		const unsigned int row = nearestPixel(y, outputSize_.height(), crop_.height());
+
+		sampleRow(frame, crop_.top() + row, dst, output_);
+		dst += dstStride;
+	}
+}
+
+/*
+ * Convert the two source rows around each output row, scale them
+ * horizontally and blend them. Scaled rows are kept while consecutive output
+ * rows share them.
+ */
+void FormatConverter::bilinearRows(const LibCameraFrame &frame, unsigned char *dst,
+				   unsigned int dstStride, unsigned int top, unsigned int bottom)
+{
+	const unsigned int width = outputSize_.width();
+	const unsigned int cropHeight = crop_.height();
+	const unsigned int bpp = bytesPerPixel(blendFormat_);
+	const unsigned int rowBytes = width * bpp;
+	const bool packed = blendFormat_ != rgbFormat_;
+	int cached[2] = { -1, -1 };
+
+	scratch.span.resize(std::max<size_t>(crop_.width(), samples_[0].size()) * bpp);
+	for (std::vector<uint8_t> &resampled : scratch.resampled)
+		resampled.resize(rowBytes);
+	if (packed)
+		scratch.blended.resize(rowBytes);
+
+	/* Source row \a y scaled horizontally, not evicting row \a keep */
+	auto resampledRow = [&](unsigned int y, unsigned int keep) -> const uint8_t * {
+		for (unsigned int i = 0; i < 2; i++) {
+			if (cached[i] == static_cast<int>(y))
+				return scratch.resampled[i].data();
+		}
+
+		const unsigned int slot = cached[0] == static_cast<int>(keep) ? 1 : 0;
+		const uint8_t *span = scratch.span.data();
+		uint8_t *out = scratch.resampled[slot].data();
+
+		sampleRow(frame, crop_.top() + y, scratch.span.data(), blend_);
+
+		switch (bpp) {
+		case 4:
+			resampleRow<4>(span, out, width, columns_.data(), columnWeights_.data());
+			break;
+		case 3:
+			resampleRow<3>(span, out, width, columns_.data(), columnWeights_.data());
+			break;
+		default:
+			resampleRow<1>(span, out, width, columns_.data(), columnWeights_.data());
+			break;
+		}
+
+		cached[slot] = y;
+		return out;
+	};
+
+	for (unsigned int y = top; y < bottom; y++) {
+		unsigned int weight;
+		const unsigned int row = bilinearPixel(y, outputSize_.height(), cropHeight, &weight);
+		const unsigned int next = std::min(row + 1, cropHeight - 1);
+		const uint8_t *blended = resampledRow(row, next);
+
+		if (weight) {
+			const uint8_t *a = blended;
+			const uint8_t *b = resampledRow(next, row);
+			uint8_t *out = packed ? scratch.blended.data() : dst;
+
+			for (unsigned int i = 0; i < rowBytes; i++)
+				out[i] = (a[i] * (256 - weight) + b[i] * weight + 128) >> 8;
+			blended = out;
+		}
+
+		if (packed) {
+			const uint8_t *src[3] = { blended };
+			pack_(src, dst, width, *coefficients_);
+		} else if (blended != dst) {
+			memcpy(dst, blended, rowBytes);
 		}
+
+		dst += dstStride;
 	}
 }
 
-void FormatConverter::convertYUVSemiPlanar(const QList<QByteArray> &dataList, unsigned char *dst)
+/*
+ * Average the source pixels each output pixel covers. The frame components
+ * are summed as they are stored, rows first, and only the averages are
+ * converted: the conversion being affine, it matches averaging the converted
+ * pixels but for clipping.
+ */
+void FormatConverter::boxRows(const LibCameraFrame &frame, unsigned char *dst,
+			      unsigned int dstStride, unsigned int top, unsigned int bottom)
 {
-	unsigned int c_stride = stride_ * (2 / horzSubSample_);
-	unsigned int c_inc = horzSubSample_ == 1 ? 2 : 0;
-	unsigned int cb_pos = nvSwap_ ? 1 : 0;
-	unsigned int cr_pos = nvSwap_ ? 0 : 1;
-    const unsigned char *src = (const unsigned char *) dataList.at(0).constData();
-    const unsigned char *src_c = (const unsigned char *) dataList.at(1).constData();
-	int r, g, b;
-
-	for (unsigned int y = 0; y < height_; y++) {
-		const unsigned char *src_y = src + y * stride_;
-		const unsigned char *src_cb = src_c + (y / vertSubSample_) *
-					      c_stride + cb_pos;
-		const unsigned char *src_cr = src_c + (y / vertSubSample_) *
-					      c_stride + cr_pos;
-
-		for (unsigned int x = 0; x < width_; x += 2) {
-			yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			src_y++;
-			src_cb += c_inc;
-			src_cr += c_inc;
-			dst += 4;
-
-			yuv_to_rgb(*src_y, *src_cb, *src_cr, &r, &g, &b);
-			dst[0] = b;
-			dst[1] = g;
-			dst[2] = r;
-			dst[3] = 0xff;
-			src_y++;
-			src_cb += 2;
-			src_cr += 2;
-			dst += 4;
+	const unsigned int width = outputSize_.width();
+	const unsigned int pairs = crop_.width() / 2;
+	const unsigned int *columns = columns_.data();
+	const unsigned int *columnEnds = columnEnds_.data();
+
+	/* Luma is always in the first plane. */
+	const unsigned int planeCount = lumaOnly_ ? 1 : planeCount_;
+	const unsigned int componentCount = lumaOnly_ ? 1 : 3;
+	const uint8_t *averages[3] = {};
+
+	for (unsigned int i = 0; i < planeCount; i++)
+		scratch.sums[i].resize(pairs * planes_[i].pairBytes);
+	for (unsigned int c = 0; c < componentCount; c++) {
+		scratch.gathered[c].resize(width);
+		averages[c] = scratch.gathered[c].data();
+	}
+
+	for (unsigned int y = top; y < bottom; y++) {
+		unsigned int end;
+		const unsigned int start = boxPixels(y, outputSize_.height(), crop_.height(), &end);
+
+		for (unsigned int i = 0; i < planeCount; i++)
+			std::fill(scratch.sums[i].begin(), scratch.sums[i].end(), 0);
+
+		for (unsigned int row = start; row < end; row++) {
+			const unsigned char *src[3] = {};
+
+			lines(frame, crop_.top() + row, crop_.left(), src);
+
+			for (unsigned int i = 0; i < planeCount; i++) {
+				const unsigned char *line = src[i];
+				uint32_t *sums = scratch.sums[i].data();
+				const size_t count = scratch.sums[i].size();
+
+				for (size_t j = 0; j < count; j++)
+					sums[j] += line[j];
+			}
 		}
+
+		for (unsigned int c = 0; c < componentCount; c++) {
+			const uint32_t *sums = scratch.sums[components_[c].line].data();
+			const unsigned int *offsets = samples_[c].data();
+			uint8_t *average = scratch.gathered[c].data();
+
+			for (unsigned int x = 0; x < width; x++) {
+				const uint32_t count = (end - start) * (columnEnds[x] - columns[x]);
+				uint32_t sum = 0;
+
+				for (unsigned int i = columns[x]; i < columnEnds[x]; i++)
+					sum += sums[offsets[i]];
+				average[x] = (sum + count / 2) / count;
+			}
+		}
+
+		output_.samples(averages, dst, width, *coefficients_);
+
+		dst += dstStride;
 	}
 }
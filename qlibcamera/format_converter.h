@@ -7,59 +7,217 @@
 
 #pragma once
 
+#include <optional>
 #include <stddef.h>
+#include <vector>
 
+#include <QImage>
+#include <QRect>
 #include <QSize>
 
+#include <libcamera/color_space.h>
 #include <libcamera/pixel_format.h>
+#include "bayer_to_rgb.h"
 #include "common/image.h"
-
-class QImage;
+#include "mjpeg_decoder.h"
+#include "qlibcameraframe.h"
+#include "yuv_to_rgb.h"
 
 namespace qlibcamera {
 
+    /* How the converter resamples the crop rectangle to the output size */
+    enum class ScaleFilter {
+        Nearest,        /* Only the sampled pixels are read and converted */
+        Bilinear,       /* Up to two source rows per output row */
+        Box,            /* The average of the area of each output pixel */
+    };
+
+    /**
+     * \brief Converts frames to RGB or grey QImages
+     *
+     * configure() resolves the format and colour space to a row kernel
+     * specialised for the layout, the widest the CPU runs, and to the
+     * coefficients of the colour space, so converting a row involves no
+     * per-pixel decision. Frames without a colour space are taken as BT.601
+     * limited range.
+     *
+     * setOutputFormat() selects the image format, RGB32 by default. Every
+     * format has its own kernels, packing pixels as they are converted: RGB16
+     * halves the bytes written, and Grayscale8 only reads luma.
+     *
+     * setOutput() crops and scales frames as they are converted, so the cost
+     * follows the output rather than the frame: rows and pixels the filter
+     * doesn't sample are never read. The crop rectangle is aligned to even
+     * columns for chroma shared by pixel pairs. By default frames are
+     * converted whole at their size.
+     *
+     * MJPEG frames are decoded to planar YUV by a MjpegDecoder and converted
+     * like YUV frames. When the output is at most half the crop rectangle,
+     * they are decoded at 1/2, 1/4 or 1/8 scale, and scaled from there.
+     *
+     * Bayer frames, 8 to 16-bit and CSI-2 packed, are developed to RGB rows
+     * as they are read: level tables subtract the black level and apply the
+     * white balance gains of the frame metadata, then rows are demosaiced
+     * bilinearly. When the output is at most half the crop rectangle, each
+     * 2x2 block is binned to a pixel instead, and scaled from there.
+     *
+     * Frames are converted in horizontal stripes run in parallel on the
+     * global StripePool. Stripes start on even rows, so chroma rows shared
+     * by two luma rows are never split, and are at least MinStripePixels
+     * large: small frames use fewer stripes, down to one.
+     */
     class FormatConverter
     {
     public:
+        static constexpr unsigned int MinStripePixels = 64 * 1024;
+
         int configure(const libcamera::PixelFormat &format, const QSize &size,
-                  unsigned int stride);
+                  unsigned int stride,
+                  const std::optional<libcamera::ColorSpace> &colorSpace = std::nullopt);
+        void setOutput(const QSize &size, const QRect &crop = QRect(),
+                       ScaleFilter filter = ScaleFilter::Bilinear);
 
-        void convert(const QList<QByteArray> &dataList, QImage *dst);
+        int setOutputFormat(QImage::Format format);
+
+        const QSize &outputSize() const { return outputSize_; }
+        QImage::Format outputFormat() const { return outputFormat_; }
+
+        int convert(const LibCameraFrame &frame, QImage *dst);
 
     private:
-        enum FormatFamily {
-            MJPEG,
-            RGB,
-            YUVPacked,
-            YUVPlanar,
-            YUVSemiPlanar,
+        /*
+         * A plane the row kernel reads, a row of it per vertSubSample frame
+         * rows and pairBytes per pair of pixels.
+         */
+        struct Plane {
+            unsigned int index;
+            unsigned int stride;
+            unsigned int vertSubSample;
+            unsigned int pairBytes;
+        };
+
+        /* Y, U or V (B, G or R) of pixel x, at (x / horzSubSample) * step + offset in a line */
+        struct Component {
+            unsigned int line;
+            unsigned int horzSubSample;
+            unsigned int step;
+            unsigned int offset;
         };
 
-        void convertRGB(const QList<QByteArray> &dataList, unsigned char *dst);
-        void convertYUVPacked(const QList<QByteArray> &dataList, unsigned char *dst);
-        void convertYUVPlanar(const QList<QByteArray> &dataList, unsigned char *dst);
-        void convertYUVSemiPlanar(const QList<QByteArray> &dataList, unsigned char *dst);
+        /*
+         * Kernels writing a format: of the frame layout, and of the sampled
+         * or averaged components, one plane each in component order.
+         */
+        struct RowKernels {
+            YuvRowFunction row;
+            YuvRowFunction samples;
+        };
+
+        int setLayout(const libcamera::PixelFormat &format);
+        template<unsigned int Bpp, unsigned int R, unsigned int G, unsigned int B>
+        void setRgb();
+        template<YuvLayout L>
+        void setYuv(unsigned int horzSubSample, unsigned int vertSubSample, bool swap = false);
+        int setBayer(const libcamera::PixelFormat &format);
+        RowKernels kernels(RgbFormat format) const;
+        void updateKernels();
+        void updateOutput();
+        void setSamples(const std::vector<unsigned int> &columns);
+        void updateLevels(const FrameMetadata &metadata);
+
+        void convertFrame(const LibCameraFrame &frame, QImage *dst);
+        void lines(const LibCameraFrame &frame, unsigned int y, unsigned int x,
+                   const unsigned char *lines[3]) const;
+        const uint8_t *developedRow(const LibCameraFrame &frame, unsigned int y) const;
+        const uint8_t *levelledRow(const LibCameraFrame &frame, unsigned int y) const;
+        void sampleRow(const LibCameraFrame &frame, unsigned int y, unsigned char *dst,
+                       const RowKernels &kernels);
+        void convertRows(const LibCameraFrame &frame, unsigned char *dst, unsigned int dstStride,
+                         unsigned int top, unsigned int bottom);
+        void nearestRows(const LibCameraFrame &frame, unsigned char *dst, unsigned int dstStride,
+                         unsigned int top, unsigned int bottom);
+        void bilinearRows(const LibCameraFrame &frame, unsigned char *dst, unsigned int dstStride,
+                          unsigned int top, unsigned int bottom);
+        void boxRows(const LibCameraFrame &frame, unsigned char *dst, unsigned int dstStride,
+                     unsigned int top, unsigned int bottom);
 
         libcamera::PixelFormat format_;
-        unsigned int width_;
+        unsigned int width_ = 0;
         unsigned int height_;
         unsigned int stride_;
 
-        enum FormatFamily formatFamily_;
+        bool mjpeg_;
+        bool yuv_;
+
+        /* MJPEG decoding, and the layout and size of the decoded frames */
+        MjpegDecoder decoder_;
+        libcamera::PixelFormat decodedFormat_;
+        QSize decodedSize_;
+
+        /*
+         * Bayer frames are developed to BGRX rows, converted as RGB32: the
+         * pattern, the level tables of its positions and the black levels
+         * and gains they apply, and whether 2x2 blocks are binned. Converted
+         * frames get a new \a frameId_, keying the rows threads keep.
+         */
+        bool bayer_;
+        bool binned_;
+        RawLevelFunction level_;
+        unsigned int rawBits_;
+        uint8_t cfaOrder_[4];       /* R, Gr, Gb or B at each position of the 2x2 pattern */
+        unsigned int redPosition_;
+        std::vector<uint8_t> levels_;
+        int32_t blackLevels_[4];
+        float gains_[4];
+        uint64_t frameId_;
+
+        YuvLayout layout_;
+        const YuvRowFunction *rgbRows_;     /* Of RGB frames, per output format */
+        const YuvCoefficients *coefficients_;
+        Plane planes_[3];
+        unsigned int planeCount_;
+        Component components_[3];
+
+        /*
+         * Kernels of the output format, and of the format bilinear scaling
+         * blends in, RGB32 for RGB16 output, packed by \a pack_.
+         */
+        QImage::Format outputFormat_ = QImage::Format_RGB32;
+        RgbFormat rgbFormat_ = RgbFormat::RGB32;
+        RgbFormat blendFormat_;
+        RowKernels output_;
+        RowKernels blend_;
+        YuvRowFunction pack_;
+        bool lumaOnly_;             /* Grey output of YUV frames */
+
+        /* Output as requested, and resolved against the frame size */
+        QSize requestedSize_;
+        QRect requestedCrop_;
+        ScaleFilter filter_ = ScaleFilter::Bilinear;
+        QRect crop_;
+        QSize outputSize_;
+        bool scaled_;
 
-        /* NV parameters */
-        unsigned int horzSubSample_;
-        unsigned int vertSubSample_;
-        bool nvSwap_;
+        using Rows = void (FormatConverter::*)(const LibCameraFrame &frame, unsigned char *dst,
+                                               unsigned int dstStride, unsigned int top,
+                                               unsigned int bottom);
+        Rows rows_;
 
-        /* RGB parameters */
-        unsigned int bpp_;
-        unsigned int r_pos_;
-        unsigned int g_pos_;
-        unsigned int b_pos_;
+        /*
+         * Pixels converted from each sampled row, if not the whole crop
+         * rectangle row: the byte offset of each component in its line. Box
+         * filtering keeps the offsets of all crop columns, from the crop
+         * rectangle, in the column sums.
+         */
+        std::vector<unsigned int> samples_[3];
 
-        /* YUV parameters */
-        unsigned int y_pos_;
-        unsigned int cb_pos_;
+        /*
+         * Per output column, in the converted row: the first pixel and the
+         * weight of the next one in 1/256 for bilinear, the first and last +
+         * 1 pixels for box. Rows are mapped as they come.
+         */
+        std::vector<unsigned int> columns_;
+        std::vector<unsigned int> columnWeights_;
+        std::vector<unsigned int> columnEnds_;
     };
 }
@@ -0,0 +1,54 @@
+#include "frame_info.h"
+
+#include <libcamera/control_ids.h>
+
+using namespace qlibcamera;
+
+FrameMetadata FrameMetadata::decode(const libcamera::ControlList &controls)
+{
+    FrameMetadata metadata = {};
+
+    if (const auto value = controls.get(libcamera::controls::ExposureTime)) {
+        metadata.exposureTime = *value;
+        metadata.fields |= ExposureTime;
+    }
+
+    if (const auto value = controls.get(libcamera::controls::AnalogueGain)) {
+        metadata.analogueGain = *value;
+        metadata.fields |= AnalogueGain;
+    }
+
+    if (const auto value = controls.get(libcamera::controls::DigitalGain)) {
+        metadata.digitalGain = *value;
+        metadata.fields |= DigitalGain;
+    }
+
+    if (const auto value = controls.get(libcamera::controls::ColourGains)) {
+        metadata.colourGains[0] = (*value)[0];
+        metadata.colourGains[1] = (*value)[1];
+        metadata.fields |= ColourGains;
+    }
+
+    if (const auto value = controls.get(libcamera::controls::Lux)) {
+        metadata.lux = *value;
+        metadata.fields |= Lux;
+    }
+
+    if (const auto value = controls.get(libcamera::controls::ColourTemperature)) {
+        metadata.colourTemperature = *value;
+        metadata.fields |= ColourTemperature;
+    }
+
+    if (const auto value = controls.get(libcamera::controls::FrameDuration)) {
+        metadata.frameDuration = *value;
+        metadata.fields |= FrameDuration;
+    }
+
+    if (const auto value = controls.get(libcamera::controls::SensorBlackLevels)) {
+        for (unsigned int i = 0; i < 4; i++)
+            metadata.blackLevels[i] = (*value)[i];
+        metadata.fields |= SensorBlackLevels;
+    }
+
+    return metadata;
+}
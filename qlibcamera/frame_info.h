@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <libcamera/controls.h>
+
+#include "latency_histogram.h"
+
+namespace qlibcamera {
+
+    /**
+     * \brief Frame metadata decoded from a request's ControlList
+     *
+     * Plain data, so it can be copied along with images once the request it
+     * came from has been reused. Fields not reported by the pipeline handler
+     * are left out of \a fields and zero.
+     */
+    struct FrameMetadata {
+        enum Field : uint32_t {
+            ExposureTime = 1 << 0,
+            AnalogueGain = 1 << 1,
+            DigitalGain = 1 << 2,
+            ColourGains = 1 << 3,
+            Lux = 1 << 4,
+            ColourTemperature = 1 << 5,
+            FrameDuration = 1 << 6,
+            SensorBlackLevels = 1 << 7,
+        };
+
+        static FrameMetadata decode(const libcamera::ControlList &controls);
+
+        bool has(Field field) const { return fields & field; }
+
+        uint32_t fields;
+        int32_t exposureTime;       /* us */
+        float analogueGain;
+        float digitalGain;
+        float colourGains[2];       /* Red, blue */
+        float lux;
+        int32_t colourTemperature;  /* K */
+        int64_t frameDuration;      /* us */
+        int32_t blackLevels[4];     /* R, Gr, Gb, B, in 16-bit scale */
+    };
+
+    /**
+     * \brief Descriptor of a frame, for the stages that outlive the frame
+     */
+    struct FrameInfo {
+        uint32_t sequence;
+        FrameTimestamps timestamps;
+        FrameMetadata metadata;
+    };
+
+}
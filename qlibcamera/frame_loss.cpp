@@ -0,0 +1,59 @@
+#include "frame_loss.h"
+
+using namespace qlibcamera;
+
+const char *FrameLoss::stageName(LossStage stage)
+{
+    switch (stage) {
+    case LossStage::Sensor:
+        return "sensor";
+    case LossStage::Starvation:
+        return "starvation";
+    case LossStage::Mailbox:
+        return "mailbox";
+    case LossStage::Encoder:
+        return "encoder";
+    default:
+        return "unknown";
+    }
+}
+
+uint64_t FrameLoss::total() const
+{
+    uint64_t total = 0;
+    for (uint64_t count : counts)
+        total += count;
+    return total;
+}
+
+FrameLoss FrameLoss::operator-(const FrameLoss &other) const
+{
+    FrameLoss loss;
+    for (int i = 0; i < static_cast<int>(LossStage::Count); i++)
+        loss.counts[i] = counts[i] - other.counts[i];
+    return loss;
+}
+
+SequenceTracker::SequenceTracker()
+{
+    reset();
+}
+
+/* Frames missing between the previous frame and the one numbered \a sequence */
+uint32_t SequenceTracker::track(uint32_t sequence)
+{
+    /* Unsigned arithmetic handles the wrap-around of the counter. */
+    const uint32_t step = sequence - last_;
+    const bool forward = valid_ && step != 0 && step < (1u << 31);
+
+    valid_ = true;
+    last_ = sequence;
+
+    return forward ? step - 1 : 0;
+}
+
+void SequenceTracker::reset()
+{
+    valid_ = false;
+    last_ = 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace qlibcamera {
+
+    /*
+     * Stages a frame can be lost at, in pipeline order: not delivered by the
+     * sensor, not captured because no request was queued, overwritten in a
+     * consumer mailbox, or not recorded.
+     */
+    enum class LossStage {
+        Sensor,
+        Starvation,
+        Mailbox,
+        Encoder,
+        Count,
+    };
+
+    /**
+     * \brief Frames lost at each stage
+     */
+    struct FrameLoss {
+        static const char *stageName(LossStage stage);
+
+        uint64_t &operator[](LossStage stage) { return counts[static_cast<int>(stage)]; }
+        uint64_t operator[](LossStage stage) const { return counts[static_cast<int>(stage)]; }
+
+        uint64_t total() const;
+        FrameLoss operator-(const FrameLoss &other) const;
+
+        uint64_t counts[static_cast<int>(LossStage::Count)] = {};
+    };
+
+    /**
+     * \brief Detects gaps in the sequence numbers of a stream
+     *
+     * Sequence numbers increase by one per frame produced by the sensor, so a
+     * gap is the number of frames lost before reaching us. A sequence number
+     * going backwards means the stream restarted and is not counted.
+     */
+    class SequenceTracker
+    {
+    public:
+        SequenceTracker();
+
+        uint32_t track(uint32_t sequence);
+        void reset();
+
+    private:
+        bool valid_;
+        uint32_t last_;
+    };
+}
@@ -0,0 +1,162 @@
+#include "frame_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <QMutexLocker>
+
+using namespace qlibcamera;
+
+/*
+ * The global pool is shared by all stages. It is never destroyed, images
+ * may still reference its buffers during static destruction.
+ */
+FramePool *FramePool::global()
+{
+    static FramePool *pool = new FramePool();
+    return pool;
+}
+
+FramePool::FramePool()
+    : hits_(0), misses_(0), allocated_(0), highWater_(0)
+{
+}
+
+FramePool::~FramePool()
+{
+    trim();
+}
+
+/*
+ * Return a buffer of at least \a size bytes, aligned to Alignment. The size
+ * is rounded up to a whole number of cache lines, which is also the key of
+ * the size class.
+ */
+void *FramePool::allocate(size_t size)
+{
+    size = (size + Alignment - 1) & ~(Alignment - 1);
+
+    {
+        QMutexLocker locker(&mutex_);
+        auto it = free_.find(size);
+        if (it != free_.end() && it->second) {
+            Header *header = it->second;
+            it->second = header->next;
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return header + 1;
+        }
+    }
+
+    Header *header = static_cast<Header *>(aligned_alloc(Alignment, sizeof(Header) + size));
+    if (!header)
+        return nullptr;
+
+    header->next = nullptr;
+    header->pool = this;
+    header->size = size;
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    size_t allocated = allocated_.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t highWater = highWater_.load(std::memory_order_relaxed);
+    while (allocated > highWater &&
+           !highWater_.compare_exchange_weak(highWater, allocated, std::memory_order_relaxed))
+        ;
+
+    return header + 1;
+}
+
+void FramePool::release(void *data)
+{
+    if (!data)
+        return;
+
+    Header *header = static_cast<Header *>(data) - 1;
+    header->pool->recycle(header);
+}
+
+void FramePool::recycle(Header *header)
+{
+    QMutexLocker locker(&mutex_);
+    Header *&head = free_[header->size];
+    header->next = head;
+    head = header;
+}
+
+void FramePool::imageCleanup(void *data)
+{
+    release(data);
+}
+
+/*
+ * Create an image backed by a pooled buffer, with the default stride of the
+ * format. The buffer is returned to the pool with the last copy of the image.
+ */
+QImage FramePool::image(const QSize &size, QImage::Format format)
+{
+    const int depth = QImage::toPixelFormat(format).bitsPerPixel();
+    const qsizetype bytesPerLine = ((static_cast<qsizetype>(size.width()) * depth + 31) / 32) * 4;
+
+    uchar *data = static_cast<uchar *>(allocate(bytesPerLine * size.height()));
+    if (!data)
+        return QImage();
+
+    return QImage(data, size.width(), size.height(), bytesPerLine, format,
+                  &FramePool::imageCleanup, data);
+}
+
+/* Deep copy of an image into a pooled buffer */
+QImage FramePool::copy(const QImage &image)
+{
+    if (image.isNull())
+        return QImage();
+
+    QImage result = this->image(image.size(), image.format());
+    if (result.isNull())
+        return image.copy();
+
+    const qsizetype length = qMin(image.bytesPerLine(), result.bytesPerLine());
+    for (int y = 0; y < image.height(); y++)
+        memcpy(result.scanLine(y), image.constScanLine(y), length);
+
+    return result;
+}
+
+/*
+ * Free the cached buffers, e.g. after a format change made their size class
+ * useless. Buffers still in use are returned to the pool as usual.
+ */
+void FramePool::trim()
+{
+    QMutexLocker locker(&mutex_);
+
+    for (auto &[size, head] : free_) {
+        while (head) {
+            Header *next = head->next;
+            allocated_.fetch_sub(size, std::memory_order_relaxed);
+            free(head);
+            head = next;
+        }
+    }
+}
+
+uint64_t FramePool::hits() const
+{
+    return hits_.load(std::memory_order_relaxed);
+}
+
+uint64_t FramePool::misses() const
+{
+    return misses_.load(std::memory_order_relaxed);
+}
+
+/* Bytes owned by the pool, in use or cached */
+size_t FramePool::allocated() const
+{
+    return allocated_.load(std::memory_order_relaxed);
+}
+
+size_t FramePool::highWater() const
+{
+    return highWater_.load(std::memory_order_relaxed);
+}
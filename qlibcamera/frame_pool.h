@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <QImage>
+#include <QMutex>
+#include <QSize>
+
+namespace qlibcamera {
+
+    /**
+     * \brief Recycling allocator for frame-sized buffers
+     *
+     * Buffers are cache-line aligned and grouped in size classes, one per
+     * distinct byte size, which is set by the format, size and stride of the
+     * frames stored in them. Released buffers go back to the free list of
+     * their class instead of the heap, so once every class has been populated
+     * the capture path runs without heap allocations.
+     *
+     * Buffers may be released from any thread. Images returned by image()
+     * give their buffer back when the last QImage sharing it is destroyed.
+     */
+    class FramePool
+    {
+    public:
+        static constexpr size_t Alignment = 64;
+
+        static FramePool *global();
+
+        FramePool();
+        ~FramePool();
+
+        void *allocate(size_t size);
+        static void release(void *data);
+
+        QImage image(const QSize &size, QImage::Format format);
+        QImage copy(const QImage &image);
+
+        void trim();
+
+        uint64_t hits() const;
+        uint64_t misses() const;
+        size_t allocated() const;
+        size_t highWater() const;
+
+    private:
+        struct alignas(Alignment) Header {
+            Header *next;
+            FramePool *pool;
+            size_t size;
+        };
+
+        static void imageCleanup(void *data);
+
+        void recycle(Header *header);
+
+        QMutex mutex_; /* Protects free_ */
+        std::map<size_t, Header *> free_;
+
+        std::atomic<uint64_t> hits_;
+        std::atomic<uint64_t> misses_;
+        std::atomic<size_t> allocated_;
+        std::atomic<size_t> highWater_;
+    };
+
+}
@@ -0,0 +1,166 @@
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <time.h>
+
+using namespace qlibcamera;
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+/*
+ * Values below 2^SubBucketBits get a bucket each, larger values keep their
+ * SubBucketBits most significant bits.
+ */
+int LatencyHistogram::bucketIndex(uint64_t value)
+{
+    if (value < (1u << SubBucketBits))
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SubBucketBits + 1;
+    return (shift << (SubBucketBits - 1)) + (value >> shift);
+}
+
+/* Middle of the range of values covered by a bucket */
+uint64_t LatencyHistogram::bucketValue(int index)
+{
+    if (index < (1 << SubBucketBits))
+        return index;
+
+    int shift = index / HalfSubBuckets - 1;
+    uint64_t low = static_cast<uint64_t>(index - shift * HalfSubBuckets) << shift;
+    return low + ((uint64_t(1) << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    buckets_[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max &&
+           !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        ;
+}
+
+void LatencyHistogram::reset()
+{
+    for (std::atomic<uint64_t> &bucket : buckets_)
+        bucket.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+    return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const
+{
+    uint64_t total = count();
+    if (!total)
+        return 0;
+
+    uint64_t target = static_cast<uint64_t>(total * percent / 100.0 + 0.5);
+    if (target < 1)
+        target = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < BucketCount; i++) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return std::min(bucketValue(i), max());
+    }
+
+    return max();
+}
+
+uint64_t LatencyStats::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *LatencyStats::stageName(LatencyStage stage)
+{
+    switch (stage) {
+    case LatencyStage::RequestComplete:
+        return "requestComplete";
+    case LatencyStage::ProcessCapture:
+        return "processCapture";
+    case LatencyStage::Converted:
+        return "converted";
+    case LatencyStage::Processed:
+        return "processed";
+    case LatencyStage::Encoded:
+        return "encoded";
+    case LatencyStage::Painted:
+        return "painted";
+    default:
+        return "unknown";
+    }
+}
+
+/*
+ * Record the latency of a stage in microseconds. Frames without a sensor
+ * timestamp, or with one from a different time base, are ignored.
+ */
+void LatencyStats::record(LatencyStage stage, uint64_t sensorTimestamp, uint64_t timestamp)
+{
+    if (!sensorTimestamp || timestamp < sensorTimestamp)
+        return;
+
+    histograms_[static_cast<int>(stage)].record((timestamp - sensorTimestamp) / 1000);
+}
+
+void LatencyStats::record(LatencyStage stage, uint64_t sensorTimestamp)
+{
+    record(stage, sensorTimestamp, now());
+}
+
+void LatencyStats::reset()
+{
+    for (LatencyHistogram &histogram : histograms_)
+        histogram.reset();
+}
+
+const LatencyHistogram &LatencyStats::histogram(LatencyStage stage) const
+{
+    return histograms_[static_cast<int>(stage)];
+}
+
+std::string LatencyStats::dump() const
+{
+    std::ostringstream out;
+
+    out << std::left << std::setw(16) << "stage (us)"
+        << std::right << std::setw(10) << "count"
+        << std::setw(10) << "p50"
+        << std::setw(10) << "p95"
+        << std::setw(10) << "p99"
+        << std::setw(10) << "max" << "\n";
+
+    for (int i = 0; i < static_cast<int>(LatencyStage::Count); i++) {
+        const LatencyHistogram &h = histograms_[i];
+        out << std::left << std::setw(16) << stageName(static_cast<LatencyStage>(i))
+            << std::right << std::setw(10) << h.count()
+            << std::setw(10) << h.percentile(50)
+            << std::setw(10) << h.percentile(95)
+            << std::setw(10) << h.percentile(99)
+            << std::setw(10) << h.max() << "\n";
+    }
+
+    return out.str();
+}
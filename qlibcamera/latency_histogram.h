@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace qlibcamera {
+
+    /**
+     * \brief Lock-free log-linear latency histogram
+     *
+     * Values are bucketed HDR-style with 5 significant bits, which bounds the
+     * relative error of reported percentiles to about 3% over the whole 64-bit
+     * range. record() may be called concurrently from any thread.
+     */
+    class LatencyHistogram
+    {
+    public:
+        static constexpr int SubBucketBits = 5;
+        static constexpr int HalfSubBuckets = 1 << (SubBucketBits - 1);
+        static constexpr int BucketCount = (64 - SubBucketBits + 2) * HalfSubBuckets;
+
+        LatencyHistogram();
+
+        void record(uint64_t value);
+        void reset();
+
+        uint64_t count() const;
+        uint64_t max() const;
+        uint64_t percentile(double percent) const;
+
+    private:
+        static int bucketIndex(uint64_t value);
+        static uint64_t bucketValue(int index);
+
+        std::atomic<uint64_t> buckets_[BucketCount];
+        std::atomic<uint64_t> count_;
+        std::atomic<uint64_t> max_;
+    };
+
+    /*
+     * Stages a frame goes through, in pipeline order. Each one is measured
+     * from the start of the sensor exposure.
+     */
+    enum class LatencyStage {
+        RequestComplete,
+        ProcessCapture,
+        Converted,
+        Processed,
+        Encoded,
+        Painted,
+        Count,
+    };
+
+    /* Timestamps in nanoseconds on the CLOCK_BOOTTIME time base */
+    struct FrameTimestamps {
+        uint64_t sensor;
+        uint64_t requestComplete;
+        uint64_t processCapture;
+    };
+
+    class LatencyStats
+    {
+    public:
+        static uint64_t now();
+        static const char *stageName(LatencyStage stage);
+
+        void record(LatencyStage stage, uint64_t sensorTimestamp, uint64_t timestamp);
+        void record(LatencyStage stage, uint64_t sensorTimestamp);
+        void reset();
+
+        const LatencyHistogram &histogram(LatencyStage stage) const;
+
+        std::string dump() const;
+
+    private:
+        LatencyHistogram histograms_[static_cast<int>(LatencyStage::Count)];
+    };
+}
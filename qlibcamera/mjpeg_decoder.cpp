@@ -0,0 +1,230 @@
+#include "mjpeg_decoder.h"
+
+#include <algorithm>
+#include <setjmp.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+#include <libcamera/formats.h>
+
+#include "frame_pool.h"
+
+using namespace qlibcamera;
+
+namespace {
+
+/* Decoded planes, stored in buffers of the frame pool */
+class DecodedFrameData : public LibCameraFrameData
+{
+public:
+    ~DecodedFrameData()
+    {
+        for (int i = 0; i < planeCount; i++)
+            FramePool::release(const_cast<uchar *>(planes[i].data));
+    }
+};
+
+/* libjpeg errors jump back to the decoding call instead of exiting. */
+struct ErrorManager : jpeg_error_mgr {
+    jmp_buf jump;
+};
+
+void errorExit(j_common_ptr cinfo)
+{
+    longjmp(static_cast<ErrorManager *>(cinfo->err)->jump, 1);
+}
+
+/* Corrupt data warnings are common with UVC cameras, and not actionable. */
+void outputMessage([[maybe_unused]] j_common_ptr cinfo)
+{
+}
+
+#if JPEG_LIB_VERSION >= 70
+int dctScaledSize(const jpeg_component_info *component) { return component->DCT_h_scaled_size; }
+int minDctScaledSize(const jpeg_decompress_struct *cinfo) { return cinfo->min_DCT_h_scaled_size; }
+#else
+int dctScaledSize(const jpeg_component_info *component) { return component->DCT_scaled_size; }
+int minDctScaledSize(const jpeg_decompress_struct *cinfo) { return cinfo->min_DCT_scaled_size; }
+#endif
+
+/*
+ * The planar format of the decoded components, valid if luma is decoded at
+ * the output size and both chroma components at its size or half its width,
+ * or half its width and height. libjpeg may decode chroma at a larger scale
+ * than luma rather than upsample it, the sampling factors alone don't tell.
+ */
+libcamera::PixelFormat rawFormat(const jpeg_decompress_struct *cinfo)
+{
+    if (cinfo->jpeg_color_space != JCS_YCbCr || cinfo->num_components != 3)
+        return {};
+
+    const int size = minDctScaledSize(cinfo);
+    const jpeg_component_info *luma = &cinfo->comp_info[0];
+    const jpeg_component_info *cb = &cinfo->comp_info[1];
+    const jpeg_component_info *cr = &cinfo->comp_info[2];
+
+    const int width = luma->h_samp_factor * dctScaledSize(luma);
+    const int height = luma->v_samp_factor * dctScaledSize(luma);
+    if (width != cinfo->max_h_samp_factor * size || height != cinfo->max_v_samp_factor * size)
+        return {};
+
+    const int chromaWidth = cb->h_samp_factor * dctScaledSize(cb);
+    const int chromaHeight = cb->v_samp_factor * dctScaledSize(cb);
+    if (chromaWidth != cr->h_samp_factor * dctScaledSize(cr) ||
+        chromaHeight != cr->v_samp_factor * dctScaledSize(cr))
+        return {};
+
+    if (chromaWidth == width && chromaHeight == height)
+        return libcamera::formats::YUV444;
+    if (2 * chromaWidth == width && chromaHeight == height)
+        return libcamera::formats::YUV422;
+    if (2 * chromaWidth == width && 2 * chromaHeight == height)
+        return libcamera::formats::YUV420;
+
+    return {};
+}
+
+} /* namespace */
+
+struct MjpegDecoder::Context {
+    jpeg_decompress_struct cinfo;
+    ErrorManager error;
+};
+
+MjpegDecoder::MjpegDecoder()
+    : context_(std::make_unique<Context>())
+{
+    jpeg_decompress_struct *cinfo = &context_->cinfo;
+
+    cinfo->err = jpeg_std_error(&context_->error);
+    context_->error.error_exit = errorExit;
+    context_->error.output_message = outputMessage;
+    jpeg_create_decompress(cinfo);
+}
+
+MjpegDecoder::~MjpegDecoder()
+{
+    jpeg_destroy_decompress(&context_->cinfo);
+}
+
+/* Decode at 1 / 2^\a scale of the frame size, \a scale up to MaxScale */
+void MjpegDecoder::setScale(unsigned int scale)
+{
+    scale_ = std::min(scale, MaxScale);
+}
+
+/*
+ * Returns the decoded frame, with the sequence and timestamps of \a frame,
+ * or a null frame if the JPEG can't be decoded. format(), size() and
+ * stride() give its layout.
+ */
+LibCameraFrame MjpegDecoder::decode(const LibCameraFrame &frame)
+{
+    DecodedFrameData *data = new DecodedFrameData();
+
+    if (!decompress(frame, data)) {
+        delete data;
+        return LibCameraFrame();
+    }
+
+    data->sequence = frame.sequence();
+    data->timestamp = frame.timestamp();
+    data->timestamps = frame.timestamps();
+
+    return LibCameraFrame(data);
+}
+
+/*
+ * Decode \a frame to planes allocated in \a data. libjpeg errors jump back to
+ * the setjmp() call, so nothing here may need destroying.
+ */
+bool MjpegDecoder::decompress(const LibCameraFrame &frame, LibCameraFrameData *data)
+{
+    jpeg_decompress_struct *cinfo = &context_->cinfo;
+
+    if (setjmp(context_->error.jump)) {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    jpeg_mem_src(cinfo, frame.constData(0), frame.size(0));
+    jpeg_read_header(cinfo, TRUE);
+
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 1 << scale_;
+    jpeg_calc_output_dimensions(cinfo);
+
+    const libcamera::PixelFormat format = rawFormat(cinfo);
+    cinfo->raw_data_out = format.isValid();
+    cinfo->out_color_space = format.isValid() ? JCS_YCbCr : JCS_EXT_BGRX;
+    jpeg_start_decompress(cinfo);
+
+    unsigned int stride;
+
+    if (!format.isValid()) {
+        stride = cinfo->output_width * 4;
+        uint8_t *plane = static_cast<uint8_t *>(FramePool::global()->allocate(stride * cinfo->output_height));
+
+        data->planes[0] = { plane, qsizetype(stride) * cinfo->output_height };
+        data->planeCount = 1;
+
+        while (cinfo->output_scanline < cinfo->output_height) {
+            JSAMPROW row = plane + cinfo->output_scanline * stride;
+            jpeg_read_scanlines(cinfo, &row, 1);
+        }
+    } else {
+        /*
+         * Rows are written whole blocks at a time, past the output width
+         * and height. Chroma strides divide the luma stride by the
+         * subsampling, as the converter expects.
+         */
+        const jpeg_component_info *luma = &cinfo->comp_info[0];
+        const jpeg_component_info *chroma = &cinfo->comp_info[1];
+        const unsigned int lumaWidth = luma->h_samp_factor * dctScaledSize(luma);
+        const unsigned int horzSubSample = lumaWidth / (chroma->h_samp_factor * dctScaledSize(chroma));
+        const unsigned int width = std::max(luma->width_in_blocks * dctScaledSize(luma),
+                                            chroma->width_in_blocks * dctScaledSize(chroma) * horzSubSample);
+        const unsigned int iMcuRows = cinfo->max_v_samp_factor * minDctScaledSize(cinfo);
+
+        stride = (width + FramePool::Alignment - 1) & ~(FramePool::Alignment - 1);
+
+        JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+        JSAMPARRAY image[3] = { rows[0], rows[1], rows[2] };
+        unsigned int strides[3];
+        unsigned int componentRows[3];
+
+        for (int c = 0; c < 3; c++) {
+            const jpeg_component_info *component = &cinfo->comp_info[c];
+
+            strides[c] = c ? stride / horzSubSample : stride;
+            componentRows[c] = component->v_samp_factor * dctScaledSize(component);
+
+            const qsizetype size = qsizetype(strides[c]) * componentRows[c] * cinfo->total_iMCU_rows;
+            data->planes[c] = { static_cast<uchar *>(FramePool::global()->allocate(size)), size };
+            data->planeCount++;
+        }
+
+        while (cinfo->output_scanline < cinfo->output_height) {
+            const unsigned int iMcu = cinfo->output_scanline / iMcuRows;
+
+            for (int c = 0; c < 3; c++) {
+                uint8_t *plane = const_cast<uchar *>(data->planes[c].data) +
+                                 iMcu * componentRows[c] * strides[c];
+
+                for (unsigned int row = 0; row < componentRows[c]; row++)
+                    rows[c][row] = plane + row * strides[c];
+            }
+
+            jpeg_read_raw_data(cinfo, image, iMcuRows);
+        }
+    }
+
+    jpeg_finish_decompress(cinfo);
+
+    format_ = format.isValid() ? format : libcamera::formats::XRGB8888;
+    size_ = QSize(cinfo->output_width, cinfo->output_height);
+    stride_ = stride;
+
+    return true;
+}
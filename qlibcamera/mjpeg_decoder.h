@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+
+#include <QSize>
+
+#include <libcamera/pixel_format.h>
+
+#include "qlibcameraframe.h"
+
+namespace qlibcamera {
+
+    /**
+     * \brief Decodes MJPEG frames to planar YUV
+     *
+     * The libjpeg-turbo decompressor is created once and reused for every
+     * frame. Frames are decoded without colour conversion nor chroma
+     * upsampling, to YUV420, YUV422 or YUV444 planes as the JPEG is sampled,
+     * in frame pool buffers. Greyscale JPEGs, and JPEGs sampled otherwise, are
+     * converted to XRGB8888 by libjpeg.
+     *
+     * setScale() decodes at 1/2, 1/4 or 1/8 of the size by scaling in the DCT:
+     * only the low frequencies of each block are transformed, so decoding
+     * gets cheaper along with the frame.
+     */
+    class MjpegDecoder
+    {
+    public:
+        static constexpr unsigned int MaxScale = 3;
+
+        MjpegDecoder();
+        ~MjpegDecoder();
+
+        void setScale(unsigned int scale);
+        unsigned int scale() const { return scale_; }
+
+        LibCameraFrame decode(const LibCameraFrame &frame);
+
+        /* Layout of the last decoded frame */
+        const libcamera::PixelFormat &format() const { return format_; }
+        const QSize &size() const { return size_; }
+        unsigned int stride() const { return stride_; }
+
+    private:
+        struct Context;
+
+        bool decompress(const LibCameraFrame &frame, LibCameraFrameData *data);
+
+        std::unique_ptr<Context> context_;
+        unsigned int scale_ = 0;
+
+        libcamera::PixelFormat format_;
+        QSize size_;
+        unsigned int stride_ = 0;
+    };
+}
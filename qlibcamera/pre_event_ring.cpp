@@ -0,0 +1,159 @@
+#include "pre_event_ring.h"
+
+#include <errno.h>
+#include <new>
+#include <string.h>
+
+using namespace qlibcamera;
+
+PreEventRing::PreEventRing()
+    : capacity_(0), duration_(0), head_(0), count_(0), write_(0), bytes_(0), overflows_(0)
+{
+}
+
+/*
+ * Allocate \a capacity bytes for at most \a maxEntries entries spanning at
+ * most \a duration ns, 0 for no time limit.
+ */
+int PreEventRing::allocate(size_t capacity, size_t maxEntries, uint64_t duration)
+{
+    free();
+
+    if (!capacity || !maxEntries)
+        return -EINVAL;
+
+    buffer_.reset(new (std::nothrow) uint8_t[capacity]);
+    if (!buffer_)
+        return -ENOMEM;
+
+    /* Fault the pages in now rather than on the capture path. */
+    memset(buffer_.get(), 0, capacity);
+
+    entries_.resize(maxEntries);
+    capacity_ = capacity;
+    duration_ = duration;
+    overflows_ = 0;
+
+    return 0;
+}
+
+void PreEventRing::free()
+{
+    buffer_.reset();
+    entries_.clear();
+    entries_.shrink_to_fit();
+    capacity_ = 0;
+    clear();
+}
+
+bool PreEventRing::isAllocated() const
+{
+    return buffer_ != nullptr;
+}
+
+/*
+ * Make room for an entry of \a size bytes and return where to copy it, or
+ * nullptr if it is larger than the whole ring.
+ */
+uint8_t *PreEventRing::push(size_t size, uint64_t timestamp, bool key)
+{
+    if (!buffer_)
+        return nullptr;
+
+    if (size > capacity_) {
+        overflows_++;
+        return nullptr;
+    }
+
+    while (count_ && duration_ && timestamp - entries_[head_].timestamp > duration_)
+        pop();
+
+    if (count_ == entries_.size())
+        pop();
+
+    /* Entries are contiguous, wrap around if it doesn't fit at the end. */
+    size_t offset = write_;
+    if (offset + size > capacity_) {
+        while (count_ && entries_[head_].offset >= write_)
+            pop();
+        offset = 0;
+    }
+
+    while (count_ && entries_[head_].offset >= offset && entries_[head_].offset < offset + size)
+        pop();
+
+    Entry &entry = entries_[(head_ + count_) % entries_.size()];
+    entry = { offset, size, timestamp, key };
+    count_++;
+
+    write_ = offset + size;
+    bytes_ += size;
+
+    return buffer_.get() + offset;
+}
+
+void PreEventRing::clear()
+{
+    head_ = 0;
+    count_ = 0;
+    write_ = 0;
+    bytes_ = 0;
+}
+
+size_t PreEventRing::count() const
+{
+    return count_;
+}
+
+/* The entry \a index positions after the oldest one */
+const PreEventRing::Entry &PreEventRing::at(size_t index) const
+{
+    return entries_[(head_ + index) % entries_.size()];
+}
+
+const uint8_t *PreEventRing::data(const Entry &entry) const
+{
+    return buffer_.get() + entry.offset;
+}
+
+/* Index of the oldest key entry, count() if there is none */
+size_t PreEventRing::firstKey() const
+{
+    size_t index = 0;
+    while (index < count_ && !at(index).key)
+        index++;
+
+    return index;
+}
+
+size_t PreEventRing::capacity() const
+{
+    return capacity_;
+}
+
+size_t PreEventRing::bytes() const
+{
+    return bytes_;
+}
+
+/* Time between the oldest and the newest entry, in ns */
+uint64_t PreEventRing::span() const
+{
+    return count_ ? at(count_ - 1).timestamp - at(0).timestamp : 0;
+}
+
+/* Entries that didn't fit in the ring at all */
+uint64_t PreEventRing::overflows() const
+{
+    return overflows_;
+}
+
+void PreEventRing::pop()
+{
+    bytes_ -= entries_[head_].size;
+    head_ = (head_ + 1) % entries_.size();
+    count_--;
+
+    if (!count_)
+        clear();
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace qlibcamera {
+
+    /**
+     * \brief Fixed-memory ring of the most recent frames or packets
+     *
+     * Entries are variable-sized byte blocks stored back to back in a single
+     * buffer, oldest first. Adding an entry evicts the oldest ones until it
+     * fits, until the ring spans at most the configured duration and holds
+     * at most the configured number of entries. All memory is allocated and
+     * touched by allocate(), the steady state only copies.
+     *
+     * Entries marked as key entries are those a stream can be decoded from,
+     * firstKey() is where to start writing the ring out.
+     */
+    class PreEventRing
+    {
+    public:
+        struct Entry {
+            size_t offset;
+            size_t size;
+            uint64_t timestamp; /* ns */
+            bool key;
+        };
+
+        PreEventRing();
+
+        int allocate(size_t capacity, size_t maxEntries, uint64_t duration);
+        void free();
+        bool isAllocated() const;
+
+        uint8_t *push(size_t size, uint64_t timestamp, bool key);
+        void clear();
+
+        size_t count() const;
+        const Entry &at(size_t index) const;
+        const uint8_t *data(const Entry &entry) const;
+        size_t firstKey() const;
+
+        size_t capacity() const;
+        size_t bytes() const;
+        uint64_t span() const;
+        uint64_t overflows() const;
+
+    private:
+        void pop();
+
+        std::unique_ptr<uint8_t[]> buffer_;
+        size_t capacity_;
+        uint64_t duration_;
+
+        std::vector<Entry> entries_;
+        size_t head_;       /* Index of the oldest entry */
+        size_t count_;
+        size_t write_;      /* Offset following the newest entry */
+        size_t bytes_;
+
+        uint64_t overflows_;
+    };
+
+}
@@ -1,24 +1,34 @@
+#include <algorithm>
 #include <assert.h>
 #include <iomanip>
 #include <string>
+#include <string.h>
 #include <unistd.h>
 
 #include <libcamera/camera_manager.h>
 #include <libcamera/version.h>
 #include <libcamera/control_ids.h>
+#include <libcamera/property_ids.h>
 
 #include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
 
-#include <QMutexLocker>
 #include <QStandardPaths>
 #include <QStringList>
 #include <QTimer>
 #include <QtDebug>
 
 #include "common/image.h"
+#include "frame_pool.h"
 #include "qlibcamera.h"
+#include "qlibcamerarequestpool.h"
+#include "qlibcamerasync.h"
 #include "qlibcameraview.h"
 #include "qlibcameraworker.h"
+#include "stripe_pool.h"
 
 static const QMap<LibCamera::Format, libcamera::PixelFormat> formatMap
 {
@@ -31,6 +41,11 @@ static const QMap<LibCamera::Format, libcamera::PixelFormat> formatMap
     { LibCamera::Format_RGB888, libcamera::formats::RGB888 },
     { LibCamera::Format_RGB565, libcamera::formats::RGB565 },
     { LibCamera::Format_YUV420, libcamera::formats::YUV420 },
+    { LibCamera::Format_NV12, libcamera::formats::NV12 },
+    { LibCamera::Format_YUYV, libcamera::formats::YUYV },
+    { LibCamera::Format_MJPEG, libcamera::formats::MJPEG },
+    { LibCamera::Format_SRGGB10_CSI2P, libcamera::formats::SRGGB10_CSI2P },
+    { LibCamera::Format_SRGGB12_CSI2P, libcamera::formats::SRGGB12_CSI2P },
 };
 
 /**
@@ -54,8 +69,21 @@ public:
 libcamera::CameraManager *LibCamera::cm_ = nullptr;
 
 LibCamera::LibCamera(QObject *parent)
-    : QObject{parent}, view_(nullptr), index_(0), enabled_(false), format_(Format_RGB565), fps_(15), width_(640), height_(480), allocator_(nullptr),
-    isCapturing_(false), captureRaw_(false), isRecording_(false), framesRecorded_(0), recordBitRate_(300000)
+    : QObject{parent}, view_(nullptr), previewScaling_(ScaleOff), previewFormat_(PreviewRGB32), roiScalerCrop_(false), index_(0), enabled_(false), format_(Format_RGB565), fps_(15), width_(640), height_(480), allocator_(nullptr),
+    isCapturing_(false), rawCapturesPending_(0), captureStill_(false), isRecording_(false), framesRecorded_(0), recordBitRate_(300000),
+    recordingMode_(Encoded), rawRecording_(false),
+    preEventDuration_(0), preEventBytes_(0), preEventArmed_(false), preEvent_{},
+    videoEnabled_(false), videoWidth_(1920), videoHeight_(1080), videoFormat_(Format_YUV420),
+    stillEnabled_(false), stillWidth_(1920), stillHeight_(1080), stillFormat_(Format_RGB888),
+    rawEnabled_(false), videoStream_(nullptr), stillStream_(nullptr), rawStream_(nullptr),
+    processMailbox_(nullptr), recordingMailbox_(nullptr), captureMailbox_(nullptr), rawMailbox_(nullptr),
+    capturePending_(false), queuedRequests_(0), starvationCount_(0), starved_(false),
+    bufferCount_(0), videoBufferCount_(0), stillBufferCount_(0), rawBufferCount_(0), inFlightLow_(0),
+    requestsRanDry_(false), lossUpdate_{}, recordingLoss_{}, recordingLossEnd_{},
+    sync_(nullptr), syncIndex_(-1),
+    reopenPending_(false), fpsPending_(false), scalerCropPending_(false), firstFramePending_(false), restartTimestamp_(0),
+    timeToFirstFrame_(0), state_(Closed), reconnectDelay_(ReconnectDelayMin), disconnectTimestamp_(0),
+    reconnectLatency_(0)
 {
     init();
 }
@@ -66,71 +94,137 @@ void LibCamera::init()
     timerRestart_->setSingleShot(true);
     connect(timerRestart_, &QTimer::timeout, this, &LibCamera::restart);
 
+    timerReconnect_ = new QTimer(this);
+    timerReconnect_->setSingleShot(true);
+    connect(timerReconnect_, &QTimer::timeout, this, &LibCamera::restart);
+
+    /* Hotplug notifications are emitted in the camera manager's thread. */
+    cameraManager()->cameraAdded.connect(this, &LibCamera::cameraAdded);
+    cameraManager()->cameraRemoved.connect(this, &LibCamera::cameraRemoved);
+
+    latencyStats_ = std::make_shared<qlibcamera::LatencyStats>();
+    timerLatency_ = new QTimer(this);
+    timerLatency_->setInterval(1000);
+    connect(timerLatency_, &QTimer::timeout, this, &LibCamera::latencyChanged);
+    connect(timerLatency_, &QTimer::timeout, this, &LibCamera::framesDroppedChanged);
+    connect(timerLatency_, &QTimer::timeout, this, &LibCamera::updatePipeline);
+    connect(timerLatency_, &QTimer::timeout, this, &LibCamera::updateFramesLost);
+
+    /* Only the latest processed image is worth painting. */
+    viewMailbox_ = std::make_unique<LibCameraMailbox<ProcessedImage>>(this,
+        [this](ProcessedImage processed) {
+            Q_EMIT processCompleted(processed.image, processed.info);
+        }, qlibcamera::MailboxPolicy::LatestWins);
+
     initProcessWorker();
     initSnapshotWorker();
     initRecordingWorker();
+    initRawWorker();
+    initCaptureWorker();
 }
 
 void LibCamera::initProcessWorker()
 {
-    LibCameraThread *processThread = new LibCameraThread();
-    connect(this, &QObject::destroyed, processThread, [processThread]() {
-        processThread->quit();
-        processThread->wait();
-        delete processThread;
-    });
-    processThread->start();
+    LibCameraThread *processThread = LibCameraThread::acquire("process");
 
     LibCameraProcessWorker *processWorker = new LibCameraProcessWorker();
+    processWorker->setLatencyStats(latencyStats_);
     processWorker->moveToThread(processThread);
-    connect(processThread, &QThread::finished, processWorker, &QObject::deleteLater);
+    connect(this, &QObject::destroyed, processThread, [processThread, processWorker]() {
+        processWorker->deleteLater();
+        LibCameraThread::release(processThread);
+    });
     connect(this, &LibCamera::processFormatChanged, processWorker, &LibCameraProcessWorker::onFormatChanged);
-    connect(this, &LibCamera::processFrameReady, processWorker, &LibCameraProcessWorker::onFrameReady);
-    connect(processWorker, &LibCameraProcessWorker::completed, this, &LibCamera::processCompleted);
+    connect(this, &LibCamera::processOutputChanged, processWorker, &LibCameraProcessWorker::onOutputChanged);
+    connect(processWorker, &LibCameraProcessWorker::completed, this,
+            [this](QImage image, qlibcamera::FrameInfo info) {
+        viewMailbox_->post({ image, info });
+    }, Qt::DirectConnection);
+    processMailbox_ = processWorker->mailbox();
 }
 
 void LibCamera::initSnapshotWorker()
 {
-    LibCameraThread *snapshotThread = new LibCameraThread();
-    connect(this, &QObject::destroyed, snapshotThread, [snapshotThread]() {
-        snapshotThread->quit();
-        snapshotThread->wait();
-        delete snapshotThread;
-    });
-    snapshotThread->start();
+    LibCameraThread *snapshotThread = LibCameraThread::acquire("snapshot");
 
     LibCameraSnapshotWorker *snapshotWorker = new LibCameraSnapshotWorker();
     snapshotWorker->moveToThread(snapshotThread);
-    connect(snapshotThread, &QThread::finished, snapshotWorker, &QObject::deleteLater);
+    connect(this, &QObject::destroyed, snapshotThread, [snapshotThread, snapshotWorker]() {
+        snapshotWorker->deleteLater();
+        LibCameraThread::release(snapshotThread);
+    });
     connect(this, &LibCamera::snapshotFrameReady, snapshotWorker, &LibCameraSnapshotWorker::onFrameReady);
+    connect(this, &LibCamera::stillStreamFormatChanged, snapshotWorker, &LibCameraSnapshotWorker::onFormatChanged);
+    connect(this, &LibCamera::stillFrameReady, snapshotWorker, &LibCameraSnapshotWorker::onStillFrameReady);
     connect(snapshotWorker, &LibCameraSnapshotWorker::completed, this, &LibCamera::snapshotCompleted);
 }
 
 void LibCamera::initRecordingWorker()
 {
-    LibCameraThread *recordingThread = new LibCameraThread();
-    connect(this, &QObject::destroyed, recordingThread, [recordingThread]() {
-        recordingThread->quit();
-        recordingThread->wait();
-        delete recordingThread;
-    });
-    recordingThread->start();
+    LibCameraThread *recordingThread = LibCameraThread::acquire("recording");
 
     LibCameraRecordingWorker *recordingWorker = new LibCameraRecordingWorker();
+    recordingWorker->setLatencyStats(latencyStats_);
     recordingWorker->moveToThread(recordingThread);
-    connect(recordingThread, &QThread::finished, recordingWorker, &QObject::deleteLater);
+    connect(this, &QObject::destroyed, recordingThread, [recordingThread, recordingWorker]() {
+        recordingWorker->deleteLater();
+        LibCameraThread::release(recordingThread);
+    });
     connect(this, &LibCamera::recordingStart, recordingWorker, &LibCameraRecordingWorker::onStart);
     connect(this, &LibCamera::recordingEnd, recordingWorker, &LibCameraRecordingWorker::onEnd);
-    connect(this, &LibCamera::recordingFrameReady, recordingWorker, &LibCameraRecordingWorker::onFrameReady);
+    connect(this, &LibCamera::recordingPreEventStart, recordingWorker, &LibCameraRecordingWorker::onPreEventStart);
+    connect(this, &LibCamera::preEventTrigger, recordingWorker, &LibCameraRecordingWorker::onPreEventTrigger);
+    connect(this, &LibCamera::preEventEnd, recordingWorker, &LibCameraRecordingWorker::onPreEventEnd);
+    recordingMailbox_ = recordingWorker->mailbox();
     connect(recordingWorker, &LibCameraRecordingWorker::frameRecorded, this, &LibCamera::onFrameRecorded);
-    connect(recordingWorker, &LibCameraRecordingWorker::completed, this, &LibCamera::recordingCompleted);
+    connect(recordingWorker, &LibCameraRecordingWorker::framesLost, this, &LibCamera::onEncoderFramesLost);
+    connect(recordingWorker, &LibCameraRecordingWorker::completed, this, &LibCamera::onRecordingCompleted);
+    connect(recordingWorker, &LibCameraRecordingWorker::failed, this, &LibCamera::onRecordingFailed);
+}
+
+void LibCamera::initRawWorker()
+{
+    LibCameraThread *rawThread = LibCameraThread::acquire("raw");
+
+    LibCameraRawWorker *rawWorker = new LibCameraRawWorker();
+    rawWorker->moveToThread(rawThread);
+    connect(this, &QObject::destroyed, rawThread, [rawThread, rawWorker]() {
+        rawWorker->deleteLater();
+        LibCameraThread::release(rawThread);
+    });
+    connect(this, &LibCamera::rawStreamFormatChanged, rawWorker, &LibCameraRawWorker::onFormatChanged);
+    connect(rawWorker, &LibCameraRawWorker::completed, this, &LibCamera::rawCompleted);
+    rawMailbox_ = rawWorker->mailbox();
 }
 
 LibCamera::~LibCamera()
 {
+    cameraManager()->cameraAdded.disconnect(this);
+    cameraManager()->cameraRemoved.disconnect(this);
+
     cleanup();
 }
 
+void LibCamera::initCaptureWorker()
+{
+    LibCameraThread *captureThread = LibCameraThread::acquire("capture");
+
+    LibCameraCaptureWorker *captureWorker = new LibCameraCaptureWorker();
+    captureWorker->moveToThread(captureThread);
+    connect(this, &QObject::destroyed, captureThread, [captureThread, captureWorker]() {
+        captureWorker->deleteLater();
+        LibCameraThread::release(captureThread);
+    });
+    connect(this, &LibCamera::captureStart, captureWorker, &LibCameraCaptureWorker::onStart);
+    connect(this, &LibCamera::recordingEnd, captureWorker, &LibCameraCaptureWorker::onEnd);
+    connect(this, &LibCamera::capturePreEventStart, captureWorker, &LibCameraCaptureWorker::onPreEventStart);
+    connect(this, &LibCamera::preEventTrigger, captureWorker, &LibCameraCaptureWorker::onPreEventTrigger);
+    connect(this, &LibCamera::preEventEnd, captureWorker, &LibCameraCaptureWorker::onPreEventEnd);
+    captureMailbox_ = captureWorker->mailbox();
+    connect(captureWorker, &LibCameraCaptureWorker::frameRecorded, this, &LibCamera::onFrameRecorded);
+    connect(captureWorker, &LibCameraCaptureWorker::completed, this, &LibCamera::onRecordingCompleted);
+}
+
 bool LibCamera::event(QEvent *e)
 {
     if (e->type() == CaptureEvent::type()) {
@@ -138,32 +232,61 @@ bool LibCamera::event(QEvent *e)
         return true;
     }
 
+    if (e->type() == LibCameraRequestPool::ReleaseEvent::type()) {
+        processReleased();
+        return true;
+    }
+
     return QObject::event(e);
 }
 
 void LibCamera::cleanup()
 {
-    if (camera_) {
+    if (camera_ || isCapturing_) {
         if(this->isRecording()) {
             this->endRecording();
         }
 
         stopCapture();
+        freeBuffers();
+        if(view_)
+            view_->stop();
+    }
+
+    if (preEventArmed_) {
+        Q_EMIT preEventEnd();
+        preEventArmed_ = false;
+    }
+
+    if (camera_) {
         camera_->release();
         camera_.reset();
     }
+
+    setState(Closed);
 }
 
 int LibCamera::openCamera()
 {
-    std::string cameraName;
+    /* A source replaces the camera, there is nothing to acquire. */
+    if (source_)
+        return 0;
+
+    /*
+     * Once a camera has been opened, stick to it: after an unplug, the same
+     * index may designate another camera.
+     */
+    std::string cameraName = cameraId_;
 
-    std::vector<std::shared_ptr<libcamera::Camera>> cameras = cameraManager()->cameras();
-    if (cameras.size() > index_)
-        cameraName = cameras[index_]->id();
+    if (cameraName.empty()) {
+        std::vector<std::shared_ptr<libcamera::Camera>> cameras = cameraManager()->cameras();
+        if (cameras.size() > index_)
+            cameraName = cameras[index_]->id();
+    }
 
+    /* No camera at the index yet, it may still be plugged in. */
     if (cameraName == "")
-        return -EINVAL;
+        return -ENODEV;
 
     /* Get and acquire the camera. */
     camera_ = cameraManager()->get(cameraName);
@@ -178,36 +301,215 @@ int LibCamera::openCamera()
         return -EBUSY;
     }
 
+    cameraId_ = cameraName;
+
     return 0;
 }
 
+/*
+ * Apply pending property changes. Stream changes only need the camera to be
+ * stopped and reconfigured, the camera is released and reacquired only when
+ * a different one is selected.
+ */
 void LibCamera::restart()
 {
-    cleanup();
-    int ret = openCamera();
-    if (ret < 0) {
-        QCoreApplication::instance()->quit();
-        return;
+    restartTimestamp_ = qlibcamera::LatencyStats::now();
+
+    if (reopenPending_ || (!camera_ && !source_)) {
+        reopenPending_ = false;
+
+        cleanup();
+        int ret = openCamera();
+        if (ret == -ENODEV) {
+            scheduleReconnect();
+            return;
+        }
+
+        /* The camera is there but unusable, retrying won't help. */
+        if (ret < 0) {
+            qWarning() << "Failed to open camera:" << strerror(-ret);
+            return;
+        }
+    } else {
+        if(this->isRecording()) {
+            this->endRecording();
+        }
+
+        /* Keep showing the last frame until the new configuration delivers. */
+        stopCapture();
+        if(view_ && !enabled_)
+            view_->stop();
     }
 
+    bool capturing = false;
+
     if(enabled_) {
-        startCapture();
+        int ret = startCapture();
+        if (ret == -ENODEV) {
+            cleanup();
+            scheduleReconnect();
+            return;
+        }
+
+        /*
+         * Configuration errors are reported and the camera stays open, the
+         * next property change tries again.
+         */
+        if (ret < 0) {
+            qWarning() << "Failed to start capture:" << strerror(-ret);
+            if (view_)
+                view_->stop();
+        } else {
+            capturing = true;
+            firstFramePending_ = true;
+        }
+    }
+
+    setState(capturing ? Capturing : Open);
+
+    reconnectDelay_ = ReconnectDelayMin;
+    if (disconnectTimestamp_ && !capturing)
+        reconnected(qlibcamera::LatencyStats::now());
+}
+
+/*
+ * Retry with an exponential backoff. The camera being plugged back in
+ * triggers an immediate retry.
+ */
+void LibCamera::scheduleReconnect()
+{
+    if (!disconnectTimestamp_)
+        disconnectTimestamp_ = qlibcamera::LatencyStats::now();
+
+    setState(Disconnected);
+
+    qInfo() << "Camera unavailable, retrying in" << reconnectDelay_ << "ms";
+    timerReconnect_->start(reconnectDelay_);
+    reconnectDelay_ = qMin(reconnectDelay_ * 2, ReconnectDelayMax);
+}
+
+void LibCamera::reconnected(uint64_t timestamp)
+{
+    reconnectLatency_ = (timestamp - disconnectTimestamp_) / 1000000.0;
+    disconnectTimestamp_ = 0;
+
+    qInfo() << "Camera recovered after" << reconnectLatency_ << "ms";
+    Q_EMIT reconnectLatencyChanged();
+}
+
+void LibCamera::cameraAdded(std::shared_ptr<libcamera::Camera> camera)
+{
+    QMetaObject::invokeMethod(this, [this, id = camera->id()]() {
+        if (state_ != Disconnected)
+            return;
+
+        if (cameraId_.empty() || cameraId_ == id) {
+            reconnectDelay_ = ReconnectDelayMin;
+            timerReconnect_->start(0);
+        }
+    }, Qt::QueuedConnection);
+}
+
+void LibCamera::cameraRemoved(std::shared_ptr<libcamera::Camera> camera)
+{
+    QMetaObject::invokeMethod(this, [this, id = camera->id()]() {
+        if (!camera_ || camera_->id() != id)
+            return;
+
+        qWarning() << "Camera" << id.c_str() << "removed";
+
+        /* Keep the last frame on screen, capture resumes on reconnection. */
+        if (isRecording())
+            endRecording();
+
+        stopCapture();
+        freeBuffers();
+        camera_->release();
+        camera_.reset();
+
+        timerRestart_->stop();
+        scheduleReconnect();
+    }, Qt::QueuedConnection);
+}
+
+LibCamera::State LibCamera::state() const
+{
+    return state_;
+}
+
+void LibCamera::setState(State newState)
+{
+    if (state_ == newState)
+        return;
+    state_ = newState;
+    Q_EMIT stateChanged();
+}
+
+qreal LibCamera::reconnectLatency() const
+{
+    return reconnectLatency_;
+}
+
+/*
+ * Whether two validated configurations result in the same buffers, in which
+ * case an existing allocation can be reused.
+ */
+static bool sameConfiguration(const libcamera::CameraConfiguration &a,
+                              const libcamera::CameraConfiguration &b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (unsigned int i = 0; i < a.size(); i++) {
+        const libcamera::StreamConfiguration &x = a.at(i);
+        const libcamera::StreamConfiguration &y = b.at(i);
+
+        if (x.pixelFormat != y.pixelFormat || x.size != y.size ||
+            x.stride != y.stride || x.frameSize != y.frameSize ||
+            x.bufferCount != y.bufferCount)
+            return false;
     }
+
+    return true;
 }
 
 int LibCamera::startCapture()
 {
     std::vector<libcamera::StreamRole> roles = { libcamera::StreamRole::Viewfinder };
+    int videoIndex = -1;
+    int stillIndex = -1;
+    int rawIndex = -1;
+    unsigned int requestCount;
     int ret;
 
+    if (source_)
+        return startSource();
+
+    /*
+     * Every stream gets its own role, so that the ISP scales and converts
+     * each of them instead of the CPU.
+     */
+    if (videoEnabled_) {
+        videoIndex = roles.size();
+        roles.push_back(libcamera::StreamRole::VideoRecording);
+    }
+    if (stillEnabled_) {
+        stillIndex = roles.size();
+        roles.push_back(libcamera::StreamRole::StillCapture);
+    }
+    if (rawEnabled_) {
+        rawIndex = roles.size();
+        roles.push_back(libcamera::StreamRole::Raw);
+    }
+
     /* Configure the camera. */
-    config_ = camera_->generateConfiguration(roles);
-    if (!config_) {
+    std::unique_ptr<libcamera::CameraConfiguration> config = camera_->generateConfiguration(roles);
+    if (!config) {
         qWarning() << "Failed to generate configuration from roles";
         return -EINVAL;
     }
 
-    libcamera::StreamConfiguration &vfConfig = config_->at(0);
+    libcamera::StreamConfiguration &vfConfig = config->at(0);
 
     std::vector<libcamera::PixelFormat> formats = vfConfig.formats().pixelformats();
     qDebug() << "Supported formats:";
@@ -217,84 +519,172 @@ int LibCamera::startCapture()
 
     vfConfig.pixelFormat = formatMap[format_];
     vfConfig.size = libcamera::Size(width_, height_);
+    if (bufferCount_ > 0)
+        vfConfig.bufferCount = bufferCount_;
+
+    if (videoIndex >= 0) {
+        libcamera::StreamConfiguration &videoConfig = config->at(videoIndex);
+        videoConfig.pixelFormat = formatMap[videoFormat_];
+        videoConfig.size = libcamera::Size(videoWidth_, videoHeight_);
+        if (videoBufferCount_ > 0)
+            videoConfig.bufferCount = videoBufferCount_;
+    }
+
+    if (stillIndex >= 0) {
+        libcamera::StreamConfiguration &stillConfig = config->at(stillIndex);
+        stillConfig.pixelFormat = formatMap[stillFormat_];
+        stillConfig.size = libcamera::Size(stillWidth_, stillHeight_);
+        if (stillBufferCount_ > 0)
+            stillConfig.bufferCount = stillBufferCount_;
+    }
+
+    if (rawIndex >= 0 && rawBufferCount_ > 0)
+        config->at(rawIndex).bufferCount = rawBufferCount_;
 
-    libcamera::CameraConfiguration::Status validation = config_->validate();
+    libcamera::CameraConfiguration::Status validation = config->validate();
     if (validation == libcamera::CameraConfiguration::Invalid) {
         qWarning() << "Failed to create valid camera configuration";
         return -EINVAL;
     }
 
-    if (validation == libcamera::CameraConfiguration::Adjusted)
-        qInfo() << "Stream configuration adjusted to "
-                << vfConfig.toString().c_str();
+    if (validation == libcamera::CameraConfiguration::Adjusted) {
+        for (const libcamera::StreamConfiguration &streamConfig : *config)
+            qInfo() << "Stream configuration adjusted to "
+                    << streamConfig.toString().c_str();
+    }
 
-    ret = camera_->configure(config_.get());
-    if (ret < 0) {
-        qInfo() << "Failed to configure camera";
-        return ret;
+    /*
+     * Keep the buffers and their mappings if the validated configuration is
+     * the one they were allocated for, and no frame of a previous session
+     * still references them.
+     */
+    if (!allocator_ || roles != roles_ || !sameConfiguration(*config, *config_) ||
+        buffers_.use_count() > 1) {
+        freeBuffers();
+
+        ret = camera_->configure(config.get());
+        if (ret < 0) {
+            qInfo() << "Failed to configure camera";
+            return ret;
+        }
+
+        roles_ = roles;
+        config_ = std::move(config);
+
+        ret = allocateBuffers();
+        if (ret < 0)
+            return ret;
     }
 
     /* Store stream allocation. */
     vfStream_ = config_->at(0).stream();
-    if (config_->size() == 2)
-        rawStream_ = config_->at(1).stream();
-    else
-        rawStream_ = nullptr;
+    videoStream_ = videoIndex >= 0 ? config_->at(videoIndex).stream() : nullptr;
+    stillStream_ = stillIndex >= 0 ? config_->at(stillIndex).stream() : nullptr;
+    rawStream_ = rawIndex >= 0 ? config_->at(rawIndex).stream() : nullptr;
 
-    Q_EMIT processFormatChanged(vfConfig.pixelFormat,
-                                QSize(vfConfig.size.width, vfConfig.size.height),
-                                vfConfig.stride);
+    {
+        const libcamera::StreamConfiguration &vfConfig = config_->at(0);
+        Q_EMIT processFormatChanged(vfConfig.pixelFormat,
+                                    QSize(vfConfig.size.width, vfConfig.size.height),
+                                    vfConfig.stride, vfConfig.colorSpace);
+        updateProcessOutput();
+
+        const libcamera::StreamConfiguration &recordingConfig = config_->at(videoIndex >= 0 ? videoIndex : 0);
+        recordingFormat_ = { recordingConfig.pixelFormat,
+                             QSize(recordingConfig.size.width, recordingConfig.size.height),
+                             recordingConfig.stride, recordingConfig.frameSize };
+    }
 
-    /* Allocate and map buffers. */
-    allocator_ = new libcamera::FrameBufferAllocator(camera_);
-    for (libcamera::StreamConfiguration &config : *config_) {
-        libcamera::Stream *stream = config.stream();
+    if (stillStream_) {
+        const libcamera::StreamConfiguration &stillConfig = config_->at(stillIndex);
+        Q_EMIT stillStreamFormatChanged(stillConfig.pixelFormat,
+                                        QSize(stillConfig.size.width, stillConfig.size.height),
+                                        stillConfig.stride, stillConfig.colorSpace);
+    }
 
-        ret = allocator_->allocate(stream);
-        if (ret < 0) {
-            qWarning() << "Failed to allocate capture buffers";
-            goto error;
-        }
+    if (rawStream_) {
+        const libcamera::StreamConfiguration &rawConfig = config_->at(rawIndex);
+        Q_EMIT rawStreamFormatChanged(rawConfig.pixelFormat,
+                                      QSize(rawConfig.size.width, rawConfig.size.height),
+                                      rawConfig.stride,
+                                      QString::fromStdString(camera_->properties()
+                                          .get(libcamera::properties::Model).value_or(camera_->id())));
+    }
 
-        for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : allocator_->buffers(stream)) {
-            /* Map memory buffers and cache the mappings. */
-            std::unique_ptr<qlibcamera::Image> image =
-                qlibcamera::Image::fromFrameBuffer(buffer.get(), qlibcamera::Image::MapMode::ReadOnly);
-            assert(image != nullptr);
-            mappedBuffers_[buffer.get()] = std::move(image);
+    /* Store still and raw buffers on free rings, they are added on demand. */
+    for (libcamera::Stream *stream : { stillStream_, rawStream_ }) {
+        if (!stream)
+            continue;
 
-            /* Store buffers on the free list. */
-            freeBuffers_[stream].enqueue(buffer.get());
-        }
+        qlibcamera::SpscRing<libcamera::FrameBuffer *> &ring =
+            stream == stillStream_ ? freeStillBuffers_ : freeRawBuffers_;
+        ring.reset(allocator_->buffers(stream).size());
+        for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : allocator_->buffers(stream))
+            ring.push(buffer.get());
     }
 
-    /* Create requests and fill them with buffers from the viewfinder. */
-    while (!freeBuffers_[vfStream_].isEmpty()) {
-        libcamera::FrameBuffer *buffer = freeBuffers_[vfStream_].dequeue();
+    pool_ = std::make_shared<LibCameraRequestPool>(this, buffers_);
+
+    /*
+     * Each request carries one viewfinder buffer, and one video buffer if
+     * the video stream is enabled.
+     *
+     * Every request is either queued to the camera, waiting in the done ring
+     * or waiting in the free ring, so rings sized to the request count can
+     * never overflow.
+     */
+    requestCount = allocator_->buffers(vfStream_).size();
+    if (videoStream_)
+        requestCount = std::min<unsigned int>(requestCount, allocator_->buffers(videoStream_).size());
 
-        std::unique_ptr<libcamera::Request> request = camera_->createRequest();
+    doneQueue_.reset(requestCount);
+    freeQueue_.reset(requestCount);
+    requestCompleted_.assign(requestCount, 0);
+    requeueWait_.reset();
+    inFlightLow_ = requestCount;
+
+    /* Create requests and fill them with buffers from the viewfinder. */
+    for (unsigned int i = 0; i < requestCount; i++) {
+        /* The cookie indexes the per-request telemetry. */
+        std::unique_ptr<libcamera::Request> request = camera_->createRequest(i);
         if (!request) {
             qWarning() << "Can't create request";
             ret = -ENOMEM;
             goto error;
         }
 
-        // specifiy fps
-        std::int64_t value_pair[2] = {1000000 / fps_, 1000000 / fps_};
-        request->controls().set(libcamera::controls::FrameDurationLimits, libcamera::Span<const std::int64_t, 2>(value_pair));
-        ret = request->addBuffer(vfStream_, buffer);
+        setFrameDuration(request.get());
+        if (scalerCropActive())
+            setScalerCrop(request.get());
+        ret = request->addBuffer(vfStream_, allocator_->buffers(vfStream_)[i].get());
         if (ret < 0) {
             qWarning() << "Can't set buffer for request";
             goto error;
         }
 
-        requests_.push_back(std::move(request));
+        if (videoStream_) {
+            ret = request->addBuffer(videoStream_, allocator_->buffers(videoStream_)[i].get());
+            if (ret < 0) {
+                qWarning() << "Can't set video buffer for request";
+                goto error;
+            }
+        }
+
+        pool_->addRequest(std::move(request));
     }
 
     /* Start the title timer and the camera. */
+    capturePending_ = false;
     previousFrames_ = 0;
     framesCaptured_ = 0;
     lastBufferTime_ = 0;
+    queuedRequests_ = 0;
+    fpsPending_ = false;
+    scalerCropPending_ = false;
+    starved_ = false;
+    sequence_.reset();
+    requestsRanDry_ = false;
+    lossUpdate_ = frameLoss();
 
 //    struct timespec time;
 //    clock_gettime(CLOCK_REALTIME, &time);
@@ -311,7 +701,7 @@ int LibCamera::startCapture()
     camera_->requestCompleted.connect(this, &LibCamera::requestComplete);
 
     /* Queue all requests. */
-    for (std::unique_ptr<libcamera::Request> &request : requests_) {
+    for (const std::unique_ptr<libcamera::Request> &request : pool_->requests()) {
         ret = queueRequest(request.get());
         if (ret < 0) {
             qWarning() << "Can't queue request";
@@ -320,6 +710,8 @@ int LibCamera::startCapture()
     }
 
     isCapturing_ = true;
+    timerLatency_->start();
+    updatePreEvent();
 
     return 0;
 
@@ -328,16 +720,126 @@ error_disconnect:
     camera_->stop();
 
 error:
-    requests_.clear();
+    if (pool_) {
+        pool_->close();
+        pool_.reset();
+    }
+
+    freeStillBuffers_.clear();
+    freeRawBuffers_.clear();
+
+    return ret;
+}
+
+/*
+ * Allocate the buffers of every stream of config_ and map them. The mappings
+ * are kept with the allocation.
+ */
+int LibCamera::allocateBuffers()
+{
+    /* Cached frames of the previous configuration are likely useless now. */
+    qlibcamera::FramePool::global()->trim();
+
+    allocator_ = new libcamera::FrameBufferAllocator(camera_);
+    buffers_ = std::make_shared<LibCameraBufferMap>();
+
+    for (libcamera::StreamConfiguration &config : *config_) {
+        libcamera::Stream *stream = config.stream();
+
+        int ret = allocator_->allocate(stream);
+        if (ret < 0) {
+            qWarning() << "Failed to allocate capture buffers";
+            freeBuffers();
+            return ret;
+        }
+
+        for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : allocator_->buffers(stream)) {
+            /* Map memory buffers and cache the mappings. */
+            std::unique_ptr<qlibcamera::Image> image =
+                qlibcamera::Image::fromFrameBuffer(buffer.get(), qlibcamera::Image::MapMode::ReadOnly);
+            assert(image != nullptr);
+            buffers_->add(stream, buffer.get(), std::move(image));
+        }
+    }
 
-    mappedBuffers_.clear();
+    return 0;
+}
 
-    freeBuffers_.clear();
+/*
+ * Release the allocation. Frames still leased keep their mappings until they
+ * are released.
+ */
+void LibCamera::freeBuffers()
+{
+    buffers_.reset();
 
     delete allocator_;
     allocator_ = nullptr;
 
-    return ret;
+    config_.reset();
+    roles_.clear();
+}
+
+/*
+ * Capture from the source instead of a camera. The source only provides the
+ * viewfinder stream, its frames take the same path as those of a camera.
+ */
+int LibCamera::startSource()
+{
+    LibCameraSource::Configuration config = {
+        formatMap[format_], QSize(width_, height_), fps_,
+        static_cast<unsigned int>(std::max(bufferCount_, 0)), 0, 0
+    };
+
+    int ret = source_->configure(config);
+    if (ret < 0) {
+        qWarning() << "Failed to configure frame source";
+        return ret;
+    }
+
+    vfStream_ = nullptr;
+    videoStream_ = nullptr;
+    stillStream_ = nullptr;
+    rawStream_ = nullptr;
+
+    Q_EMIT processFormatChanged(config.format, config.size, config.stride, std::nullopt);
+    updateProcessOutput();
+    recordingFormat_ = { config.format, config.size, config.stride, config.frameSize };
+
+    /* Every queued frame holds a source buffer, the ring can't overflow. */
+    sourceQueue_.reset(config.bufferCount);
+    requestCompleted_.clear();
+    requeueWait_.reset();
+    inFlightLow_ = 0;
+
+    capturePending_ = false;
+    previousFrames_ = 0;
+    framesCaptured_ = 0;
+    lastBufferTime_ = 0;
+    queuedRequests_ = 0;
+    fpsPending_ = false;
+    starved_ = false;
+    sequence_.reset();
+    requestsRanDry_ = false;
+    lossUpdate_ = frameLoss();
+
+    captureSource_ = source_;
+    connect(captureSource_, &LibCameraSource::frameCompleted, this, &LibCamera::sourceComplete,
+            Qt::DirectConnection);
+
+    ret = captureSource_->start();
+    if (ret < 0) {
+        qInfo() << "Failed to start frame source";
+        disconnect(captureSource_, &LibCameraSource::frameCompleted, this, &LibCamera::sourceComplete);
+        captureSource_.clear();
+        return ret;
+    }
+
+    isCapturing_ = true;
+    timerLatency_->start();
+    updatePreEvent();
+
+    return 0;
 }
 
 void LibCamera::stopCapture()
@@ -345,9 +847,29 @@ void LibCamera::stopCapture()
     if (!isCapturing_)
         return;
 
-    if(view_)
-        view_->stop();
-    captureRaw_ = false;
+    if (!camera_) {
+        /* The source may be gone already, it stopped then. */
+        if (captureSource_) {
+            captureSource_->stop();
+            disconnect(captureSource_, &LibCameraSource::frameCompleted, this, &LibCamera::sourceComplete);
+        }
+        captureSource_.clear();
+
+        processMailbox_->clear();
+        viewMailbox_->clear();
+
+        /* Drop the frames not processed yet, they hold source buffers. */
+        LibCameraFrame frame;
+        while (sourceQueue_.pop(frame))
+            ;
+
+        isCapturing_ = false;
+        timerLatency_->stop();
+        return;
+    }
+
+    rawCapturesPending_ = 0;
+    captureStill_ = false;
 
     int ret = camera_->stop();
     if (ret)
@@ -355,29 +877,87 @@ void LibCamera::stopCapture()
 
     camera_->requestCompleted.disconnect(this);
 
-    mappedBuffers_.clear();
+    /*
+     * Frames may still be leased by the workers. The pool keeps the requests
+     * and mappings alive until they are released, but they won't be requeued.
+     */
+    pool_->close();
+    pool_.reset();
 
-    requests_.clear();
+    processMailbox_->clear();
+    rawMailbox_->clear();
+    viewMailbox_->clear();
     freeQueue_.clear();
 
-    delete allocator_;
-
     isCapturing_ = false;
-
-    config_.reset();
+    timerLatency_->stop();
 
     /*
      * A CaptureEvent may have been posted before we stopped the camera,
-     * but not processed yet. Clear the queue of done buffers to avoid
+     * but not processed yet. Clear the ring of done requests to avoid
      * racing with the event handler.
      */
-    freeBuffers_.clear();
+    freeStillBuffers_.clear();
+    freeRawBuffers_.clear();
     doneQueue_.clear();
 }
 
+void LibCamera::setFrameDuration(libcamera::Request *request)
+{
+    // specifiy fps
+    std::int64_t value_pair[2] = {1000000 / fps_, 1000000 / fps_};
+    request->controls().set(libcamera::controls::FrameDurationLimits, libcamera::Span<const std::int64_t, 2>(value_pair));
+}
+
+/* Whether the ISP crops to the region of interest rather than the converter */
+bool LibCamera::scalerCropActive() const
+{
+    return roiScalerCrop_ && camera_ && camera_->controls().count(&libcamera::controls::ScalerCrop);
+}
+
+/*
+ * Crop the sensor image to the region of interest in the ISP, the region
+ * mapped from viewfinder pixels to the largest crop the pipeline allows, or
+ * restore the full field of view. Cameras without ScalerCrop are left alone.
+ */
+void LibCamera::setScalerCrop(libcamera::Request *request)
+{
+    const libcamera::ControlInfoMap &controls = camera_->controls();
+    const auto info = controls.find(&libcamera::controls::ScalerCrop);
+    if (info == controls.end())
+        return;
+
+    const libcamera::Rectangle max = info->second.max().get<libcamera::Rectangle>();
+    const libcamera::Size &size = config_->at(0).size;
+    const QRect roi = roi_.intersected(QRect(0, 0, size.width, size.height));
+    libcamera::Rectangle crop = max;
+
+    if (roiScalerCrop_ && !roi.isEmpty()) {
+        crop.x = max.x + int64_t(roi.x()) * max.width / size.width;
+        crop.y = max.y + int64_t(roi.y()) * max.height / size.height;
+        crop.width = uint64_t(roi.width()) * max.width / size.width;
+        crop.height = uint64_t(roi.height()) * max.height / size.height;
+    }
+
+    request->controls().set(libcamera::controls::ScalerCrop, crop);
+}
+
 int LibCamera::queueRequest(libcamera::Request *request)
 {
-    return camera_->queueRequest(request);
+    int ret = camera_->queueRequest(request);
+    if (ret == 0) {
+        queuedRequests_++;
+        starved_ = false;
+
+        /* Time spent out of the camera, from completion to requeue, in us. */
+        uint64_t &completed = requestCompleted_[request->cookie()];
+        if (completed) {
+            requeueWait_.record((qlibcamera::LatencyStats::now() - completed) / 1000);
+            completed = 0;
+        }
+    }
+
+    return ret;
 }
 
 void LibCamera::requestComplete(libcamera::Request *request)
@@ -387,126 +967,272 @@ void LibCamera::requestComplete(libcamera::Request *request)
 
     /*
      * We're running in the libcamera thread context, expensive operations
-     * are not allowed. Add the buffer to the done queue and post a
-     * CaptureEvent for the application thread to handle.
+     * are not allowed. Add the request to the done ring and wake up the
+     * application thread, unless a wakeup is already pending: a single
+     * CaptureEvent drains every request completed in the meantime.
      */
-    {
-        QMutexLocker locker(&mutex_);
-        doneQueue_.enqueue(request);
-    }
+    doneQueue_.push({ request, qlibcamera::LatencyStats::now() });
+
+    if (!capturePending_.exchange(true))
+        QCoreApplication::postEvent(this, new CaptureEvent);
+}
+
+/*
+ * Called in the source's thread. Frames take the same way to the application
+ * thread as completed requests.
+ */
+void LibCamera::sourceComplete(LibCameraFrame frame)
+{
+    if (!sourceQueue_.push(frame))
+        return;
 
-    QCoreApplication::postEvent(this, new CaptureEvent);
+    if (!capturePending_.exchange(true))
+        QCoreApplication::postEvent(this, new CaptureEvent);
 }
 
 void LibCamera::processCapture()
 {
     /*
-     * Retrieve the next buffer from the done queue. The queue may be empty
-     * if stopCapture() has been called while a CaptureEvent was posted but
-     * not processed yet. Return immediately in that case.
+     * Clear the pending flag before draining, a request completed after
+     * this point either gets drained below or posts a new CaptureEvent.
+     * The ring may be empty if stopCapture() has been called while a
+     * CaptureEvent was posted but not processed yet.
      */
-    libcamera::Request *request;
-    {
-        QMutexLocker locker(&mutex_);
-        if (doneQueue_.isEmpty())
-            return;
+    capturePending_ = false;
 
-        request = doneQueue_.dequeue();
-    }
+    CompletedRequest completed;
+    while (doneQueue_.pop(completed))
+        processRequest(completed.request, completed.timestamp);
 
-    /* Process buffers. */
-    if (request->buffers().count(vfStream_)) {
-        libcamera::FrameBuffer *buffer = request->buffers().at(vfStream_);
+    LibCameraFrame frame;
+    while (sourceQueue_.pop(frame))
+        processSourceFrame(frame);
 
-        // Make a deep copy of the frame buffer
-        QList<QByteArray> list;
-        for(int i = 0;i < buffer->planes().size(); i ++) {
-            size_t size = buffer->metadata().planes()[i].bytesused;
-            list.append(QByteArray((const char *)mappedBuffers_[buffer]->data(i).data(), size));
-        }
+    Q_EMIT framesLeasedChanged();
+}
 
+void LibCamera::processRequest(libcamera::Request *request, uint64_t completedTimestamp)
+{
+    queuedRequests_--;
+    inFlightLow_ = qMin(inFlightLow_, queuedRequests_);
+    requestCompleted_[request->cookie()] = completedTimestamp;
+
+    libcamera::FrameBuffer *vfBuffer = request->findBuffer(vfStream_);
+    libcamera::FrameBuffer *videoBuffer = videoStream_ ? request->findBuffer(videoStream_) : nullptr;
+    libcamera::FrameBuffer *stillBuffer = stillStream_ ? request->findBuffer(stillStream_) : nullptr;
+    libcamera::FrameBuffer *rawBuffer = rawStream_ ? request->findBuffer(rawStream_) : nullptr;
+
+    /*
+     * Frames missing from the sequence were lost before reaching us. If the
+     * camera had no request queued since the previous completion, they are
+     * blamed on request starvation, on the sensor otherwise.
+     */
+    const uint32_t lost = vfBuffer ? sequence_.track(vfBuffer->metadata().sequence) : 0;
+    if (lost) {
+        const qlibcamera::LossStage stage = requestsRanDry_ ? qlibcamera::LossStage::Starvation
+                                                            : qlibcamera::LossStage::Sensor;
+        framesLost_[stage] += lost;
+        qDebug() << lost << "frames lost before" << vfBuffer->metadata().sequence << "-"
+                 << qlibcamera::FrameLoss::stageName(stage);
+    }
+    requestsRanDry_ = queuedRequests_ == 0;
+
+    qlibcamera::FrameTimestamps timestamps;
+    timestamps.sensor = request->metadata().get(libcamera::controls::SensorTimestamp).value_or(0);
+    timestamps.requestComplete = completedTimestamp;
+    timestamps.processCapture = qlibcamera::LatencyStats::now();
 
-        quint64 timestamp = request->metadata().get(libcamera::controls::SensorTimestamp).value_or(0) / 1000000;
-        // TODO: YOU CAN REPLACE SENSOR TIMESTAMP WITH SYSTEM TIMESTAMP
+    latencyStats_->record(qlibcamera::LatencyStage::RequestComplete, timestamps.sensor, timestamps.requestComplete);
+    latencyStats_->record(qlibcamera::LatencyStage::ProcessCapture, timestamps.sensor, timestamps.processCapture);
+
+    processFirstFrame(timestamps.requestComplete);
+
+    quint64 timestamp = timestamps.sensor / 1000000;
+    // TODO: YOU CAN REPLACE SENSOR TIMESTAMP WITH SYSTEM TIMESTAMP
 //        quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
 
-        Q_EMIT recordingFrameReady(list, timestamp);
-        Q_EMIT processFrameReady(list, timestamp);
-        qDebug() << buffer->metadata().sequence << "-" << timestamp;
+    /*
+     * Consumers share the mapped buffers. The request is requeued once the
+     * viewfinder and video frames have been released by all consumers, the
+     * still buffer is handed back on its own. Lease everything before any
+     * frame is posted, the local handles keep the request held meanwhile.
+     */
+    const libcamera::ControlList &metadata = request->metadata();
+    LibCameraFrame frame;
+    LibCameraFrame videoFrame;
+    if (vfBuffer)
+        frame = pool_->lease(request, vfBuffer, timestamp, timestamps, metadata);
+    if (videoBuffer)
+        videoFrame = pool_->lease(request, videoBuffer, timestamp, timestamps, metadata);
+
+    if (stillBuffer)
+        Q_EMIT stillFrameReady(pool_->lease(nullptr, stillBuffer, timestamp, timestamps, metadata));
+
+    /*
+     * The raw buffer is leased on its own and written out by the raw worker
+     * straight from the mapping, so bursts only hold back raw buffers.
+     */
+    if (rawBuffer)
+        rawMailbox_->post({ pool_->lease(nullptr, rawBuffer, timestamp, timestamps, metadata), metadata });
 
-        processViewfinder(buffer);
+    /* Record the video stream if there is one, the viewfinder otherwise. */
+    dispatchFrame(frame, videoStream_ ? videoFrame : frame);
+
+    if (!frame.isNull()) {
+        qDebug() << vfBuffer->metadata().sequence << "-" << timestamp;
+        processViewfinder(vfBuffer->metadata().timestamp);
     }
 
-    if (request->buffers().count(rawStream_)) {
-        processRaw(request->buffers().at(rawStream_), request->metadata());
+    if (frame.isNull() && videoFrame.isNull()) {
+        request->reuse();
+        freeQueue_.push(request);
+        return;
     }
 
-    request->reuse();
-    QMutexLocker locker(&mutex_);
-    freeQueue_.enqueue(request);
+    /*
+     * The camera runs dry when every request is held by a consumer. Report
+     * it once per starvation episode.
+     */
+    if (queuedRequests_ == 0 && !starved_) {
+        starved_ = true;
+        starvationCount_++;
+        qWarning() << "Camera starved of requests," << pool_->leased() << "frames leased";
+        Q_EMIT starvationCountChanged();
+        Q_EMIT requestStarved(pool_->leased());
+    }
 }
 
-void LibCamera::processRaw(libcamera::FrameBuffer *buffer, const libcamera::ControlList &metadata)
+void LibCamera::processSourceFrame(const LibCameraFrame &frame)
 {
-#ifdef HAVE_TIFF
-    QString defaultPath = QStandardPaths::writableLocation(QStandardPaths::PicturesLocation);
-    QString filename = QFileDialog::getSaveFileName(this, "Save DNG", defaultPath,
-                                                    "DNG Files (*.dng)");
+    const qlibcamera::FrameTimestamps &timestamps = frame.timestamps();
 
-    if (!filename.isEmpty()) {
-        uint8_t *memory = mappedBuffers_[buffer]->data(0).data();
-        DNGWriter::write(filename.toStdString().c_str(), camera_.get(),
-                         rawStream_->configuration(), metadata, buffer,
-                         memory);
+    latencyStats_->record(qlibcamera::LatencyStage::RequestComplete, timestamps.sensor, timestamps.requestComplete);
+    latencyStats_->record(qlibcamera::LatencyStage::ProcessCapture, timestamps.sensor,
+                          qlibcamera::LatencyStats::now());
+
+    processFirstFrame(timestamps.requestComplete);
+
+    /* Sources drop frames while all their buffers are held, as a sensor. */
+    const uint32_t lost = sequence_.track(frame.sequence());
+    if (lost) {
+        framesLost_[qlibcamera::LossStage::Sensor] += lost;
+        qDebug() << lost << "frames lost before" << frame.sequence() << "- sensor";
     }
-#endif
 
-    {
-        QMutexLocker locker(&mutex_);
-        freeBuffers_[rawStream_].enqueue(buffer);
+    dispatchFrame(frame, frame);
+    processViewfinder(timestamps.sensor);
+}
+
+void LibCamera::processFirstFrame(uint64_t completedTimestamp)
+{
+    if (!firstFramePending_)
+        return;
+
+    firstFramePending_ = false;
+    timeToFirstFrame_ = (completedTimestamp - restartTimestamp_) / 1000000.0;
+    qInfo() << "First frame" << timeToFirstFrame_ << "ms after restart";
+    Q_EMIT timeToFirstFrameChanged();
+
+    if (disconnectTimestamp_)
+        reconnected(completedTimestamp);
+}
+
+/* Hand a viewfinder frame and the frame to record to the consumers. */
+void LibCamera::dispatchFrame(const LibCameraFrame &frame, const LibCameraFrame &recordingFrame)
+{
+    /* The pre-event ring takes frames whenever no recording does. */
+    if (!recordingFrame.isNull() && (isRecording_ || preEventArmed_)) {
+        if (isRecording_ ? rawRecording_ : preEvent_.mode == RawCapture)
+            captureMailbox_->post(recordingFrame);
+        else
+            recordingMailbox_->post(recordingFrame);
     }
+
+    if (frame.isNull())
+        return;
+
+    if (sync_)
+        sync_->post(syncIndex_, frame);
+
+    processMailbox_->post(frame);
 }
 
-void LibCamera::processViewfinder(libcamera::FrameBuffer *buffer)
+void LibCamera::processViewfinder(uint64_t timestamp)
 {
     framesCaptured_++;
 
-    const libcamera::FrameMetadata &metadata = buffer->metadata();
-
-    curFps_ = metadata.timestamp - lastBufferTime_;
+    curFps_ = timestamp - lastBufferTime_;
     curFps_ = lastBufferTime_ && curFps_ ? 1000000000.0 / curFps_ : 0.0;
-    lastBufferTime_ = metadata.timestamp;
+    lastBufferTime_ = timestamp;
+}
+
+/*
+ * Requeue the requests whose frames have been released by every consumer,
+ * and put released on-demand buffers back on their free ring.
+ */
+void LibCamera::processReleased()
+{
+    if (!pool_)
+        return;
+
+    for (libcamera::Request *request : pool_->takeReleased()) {
+        libcamera::FrameBuffer *buffer = request->findBuffer(vfStream_);
+        libcamera::FrameBuffer *videoBuffer = videoStream_ ? request->findBuffer(videoStream_) : nullptr;
+
+        request->reuse();
+        freeQueue_.push(request);
+
+        renderComplete(buffer, videoBuffer);
+    }
 
-    renderComplete(buffer);
+    for (const LibCameraRequestPool::StreamBuffer &released : pool_->takeReleasedBuffers()) {
+        if (released.first == stillStream_)
+            freeStillBuffers_.push(released.second);
+        else if (released.first == rawStream_)
+            freeRawBuffers_.push(released.second);
+    }
+
+    Q_EMIT framesLeasedChanged();
 }
 
-void LibCamera::renderComplete(libcamera::FrameBuffer *buffer)
+void LibCamera::renderComplete(libcamera::FrameBuffer *buffer, libcamera::FrameBuffer *videoBuffer)
 {
     libcamera::Request *request;
-    {
-        QMutexLocker locker(&mutex_);
-        if (freeQueue_.isEmpty())
-            return;
+    if (!freeQueue_.pop(request))
+        return;
 
-        request = freeQueue_.dequeue();
+    /* Controls are cleared on reuse, set changes on the next request only. */
+    if (fpsPending_) {
+        fpsPending_ = false;
+        setFrameDuration(request);
+    }
+    if (scalerCropPending_) {
+        scalerCropPending_ = false;
+        setScalerCrop(request);
     }
 
     request->addBuffer(vfStream_, buffer);
+    if (videoBuffer)
+        request->addBuffer(videoStream_, videoBuffer);
 
-    if (captureRaw_) {
-        libcamera::FrameBuffer *rawBuffer = nullptr;
+    if (captureStill_) {
+        libcamera::FrameBuffer *stillBuffer;
 
-        {
-            QMutexLocker locker(&mutex_);
-            if (!freeBuffers_[rawStream_].isEmpty())
-                rawBuffer = freeBuffers_[rawStream_].dequeue();
+        if (freeStillBuffers_.pop(stillBuffer)) {
+            request->addBuffer(stillStream_, stillBuffer);
+            captureStill_ = false;
+        } else {
+            qWarning() << "No free buffer available for still capture";
         }
+    }
 
-        if (rawBuffer) {
+    /* Pending raw captures wait for the raw worker to free a buffer. */
+    if (rawCapturesPending_ > 0) {
+        libcamera::FrameBuffer *rawBuffer;
+
+        if (freeRawBuffers_.pop(rawBuffer)) {
             request->addBuffer(rawStream_, rawBuffer);
-            captureRaw_ = false;
-        } else {
-            qWarning() << "No free buffer available for RAW capture";
+            rawCapturesPending_--;
         }
     }
 
@@ -518,6 +1244,73 @@ void LibCamera::onFrameRecorded(qint32 frameCount)
     framesRecorded_ = frameCount;
 }
 
+/*
+ * A recording file has been closed. Files closed while recording goes on,
+ * when restarted or on a write error, end now and the next one starts.
+ */
+void LibCamera::onRecordingCompleted(QString filename, qint32 frameCount)
+{
+    const LossSnapshot end = isRecording_ ? frameLoss() : recordingLossEnd_;
+    writeSidecar(filename, frameCount, end);
+    if (isRecording_)
+        recordingLoss_ = end;
+
+    Q_EMIT recordingCompleted(filename, frameCount);
+}
+
+/*
+ * The encoder rejected the recording format or failed to open. Stop posting
+ * frames it can't encode, the recording or pre-event ring is off.
+ */
+void LibCamera::onRecordingFailed()
+{
+    qWarning() << "Failed to start the encoder";
+
+    if (preEventArmed_ && preEvent_.mode == Encoded)
+        preEventArmed_ = false;
+
+    if (isRecording_ && !rawRecording_)
+        setIsRecording(false);
+
+    Q_EMIT recordingFailed();
+}
+
+void LibCamera::onEncoderFramesLost(qint32 count)
+{
+    framesLost_[qlibcamera::LossStage::Encoder] += count;
+}
+
+/*
+ * Write the frames lost while recording \a filename next to it, as
+ * <name>.json.
+ */
+void LibCamera::writeSidecar(const QString &filename, qint32 frameCount, const LossSnapshot &end)
+{
+    const qlibcamera::FrameLoss loss = end.loss - recordingLoss_.loss;
+
+    QJsonObject lost;
+    for (int i = 0; i < static_cast<int>(qlibcamera::LossStage::Count); i++) {
+        qlibcamera::LossStage stage = static_cast<qlibcamera::LossStage>(i);
+        lost[qlibcamera::FrameLoss::stageName(stage)] = static_cast<qint64>(loss[stage]);
+    }
+    lost["total"] = static_cast<qint64>(loss.total());
+
+    QJsonObject sidecar;
+    sidecar["file"] = filename;
+    sidecar["frames"] = frameCount;
+    sidecar["duration"] = (end.timestamp - recordingLoss_.timestamp) / 1000000.0;
+    sidecar["framesLost"] = lost;
+
+    const QFileInfo info(filename);
+    QFile file(info.path() + "/" + info.completeBaseName() + ".json");
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Could not open" << file.fileName();
+        return;
+    }
+
+    file.write(QJsonDocument(sidecar).toJson());
+}
+
 qint32 LibCamera::recordBitRate() const
 {
     return recordBitRate_;
@@ -536,6 +1329,341 @@ qint32 LibCamera::framesRecorded() const
     return framesRecorded_;
 }
 
+qint32 LibCamera::framesLeased() const
+{
+    return pool_ ? pool_->leased() : 0;
+}
+
+qint32 LibCamera::starvationCount() const
+{
+    return starvationCount_;
+}
+
+LibCamera::MailboxPolicy LibCamera::processPolicy() const
+{
+    return static_cast<MailboxPolicy>(processMailbox_->policy());
+}
+
+void LibCamera::setProcessPolicy(MailboxPolicy newProcessPolicy)
+{
+    if (processPolicy() == newProcessPolicy)
+        return;
+    processMailbox_->setPolicy(static_cast<qlibcamera::MailboxPolicy>(newProcessPolicy));
+    Q_EMIT processPolicyChanged();
+}
+
+LibCamera::MailboxPolicy LibCamera::recordingPolicy() const
+{
+    return static_cast<MailboxPolicy>(recordingMailbox_->policy());
+}
+
+void LibCamera::setRecordingPolicy(MailboxPolicy newRecordingPolicy)
+{
+    if (recordingPolicy() == newRecordingPolicy)
+        return;
+    recordingMailbox_->setPolicy(static_cast<qlibcamera::MailboxPolicy>(newRecordingPolicy));
+    Q_EMIT recordingPolicyChanged();
+}
+
+LibCamera::MailboxPolicy LibCamera::viewPolicy() const
+{
+    return static_cast<MailboxPolicy>(viewMailbox_->policy());
+}
+
+void LibCamera::setViewPolicy(MailboxPolicy newViewPolicy)
+{
+    if (viewPolicy() == newViewPolicy)
+        return;
+    viewMailbox_->setPolicy(static_cast<qlibcamera::MailboxPolicy>(newViewPolicy));
+    Q_EMIT viewPolicyChanged();
+}
+
+qint32 LibCamera::mailboxCapacity() const
+{
+    return processMailbox_->capacity();
+}
+
+void LibCamera::setMailboxCapacity(qint32 newMailboxCapacity)
+{
+    if (mailboxCapacity() == newMailboxCapacity)
+        return;
+    processMailbox_->setCapacity(newMailboxCapacity);
+    recordingMailbox_->setCapacity(newMailboxCapacity);
+    viewMailbox_->setCapacity(newMailboxCapacity);
+    Q_EMIT mailboxCapacityChanged();
+}
+
+/* The conversion threads are shared by all cameras. */
+qint32 LibCamera::convertThreads() const
+{
+    return qlibcamera::StripePool::global()->threadCount();
+}
+
+void LibCamera::setConvertThreads(qint32 newConvertThreads)
+{
+    if (convertThreads() == newConvertThreads)
+        return;
+    qlibcamera::StripePool::global()->setThreadCount(std::max(newConvertThreads, 1));
+    Q_EMIT convertThreadsChanged();
+}
+
+LibCamera::PreviewScaling LibCamera::previewScaling() const
+{
+    return previewScaling_;
+}
+
+/*
+ * Convert frames at the size the view paints them at rather than at the
+ * stream size. Images handed to process() and snapshots of the view are
+ * preview-sized then.
+ */
+void LibCamera::setPreviewScaling(PreviewScaling newPreviewScaling)
+{
+    if (previewScaling_ == newPreviewScaling)
+        return;
+    previewScaling_ = newPreviewScaling;
+    updateProcessOutput();
+    Q_EMIT previewScalingChanged();
+}
+
+LibCamera::PreviewFormat LibCamera::previewFormat() const
+{
+    return previewFormat_;
+}
+
+/*
+ * Convert frames to a smaller image format, for the view and process().
+ * Formats displayed without conversion keep their own.
+ */
+void LibCamera::setPreviewFormat(PreviewFormat newPreviewFormat)
+{
+    if (previewFormat_ == newPreviewFormat)
+        return;
+    previewFormat_ = newPreviewFormat;
+    updateProcessOutput();
+    Q_EMIT previewFormatChanged();
+}
+
+QRect LibCamera::roi() const
+{
+    return roi_;
+}
+
+/*
+ * Convert and process only the \a newRoi rectangle of the viewfinder stream,
+ * in stream pixels, the whole frame if empty. Conversion cost follows its
+ * area, and process() and the view get images of it.
+ */
+void LibCamera::setRoi(const QRect &newRoi)
+{
+    if (roi_ == newRoi)
+        return;
+    roi_ = newRoi;
+    if (roiScalerCrop_ && isCapturing_ && camera_)
+        scalerCropPending_ = true;
+    updateProcessOutput();
+    Q_EMIT roiChanged();
+}
+
+bool LibCamera::roiScalerCrop() const
+{
+    return roiScalerCrop_;
+}
+
+/*
+ * Crop to the region of interest in the ISP through the ScalerCrop control
+ * rather than in the converter. The stream then shows the region scaled to
+ * the stream size, so software conversion is no longer cropped.
+ */
+void LibCamera::setRoiScalerCrop(bool newRoiScalerCrop)
+{
+    if (roiScalerCrop_ == newRoiScalerCrop)
+        return;
+    roiScalerCrop_ = newRoiScalerCrop;
+    if (isCapturing_ && camera_)
+        scalerCropPending_ = true;
+    updateProcessOutput();
+    Q_EMIT roiScalerCropChanged();
+}
+
+/*
+ * Tell the process worker the size to convert frames to, empty for the stream
+ * size, the region of interest to crop them to and their format.
+ */
+void LibCamera::updateProcessOutput()
+{
+    static const qlibcamera::ScaleFilter filters[] = {
+        qlibcamera::ScaleFilter::Nearest,
+        qlibcamera::ScaleFilter::Nearest,
+        qlibcamera::ScaleFilter::Bilinear,
+        qlibcamera::ScaleFilter::Box,
+    };
+    static const QImage::Format formats[] = {
+        QImage::Format_RGB32,
+        QImage::Format_RGB888,
+        QImage::Format_RGB16,
+        QImage::Format_Grayscale8,
+    };
+
+    QSize size;
+    if (previewScaling_ != ScaleOff && view_)
+        size = view_->paintSize();
+
+    const QRect crop = scalerCropActive() ? QRect() : roi_;
+
+    Q_EMIT processOutputChanged(size, crop, filters[previewScaling_], formats[previewFormat_]);
+}
+
+quint64 LibCamera::processFramesDropped() const
+{
+    return processMailbox_->dropped();
+}
+
+quint64 LibCamera::recordingFramesDropped() const
+{
+    return recordingMailbox_->dropped();
+}
+
+quint64 LibCamera::viewFramesDropped() const
+{
+    return viewMailbox_->dropped();
+}
+
+/*
+ * Latency of every stage from the start of exposure, in microseconds, as
+ * { stage: { count, p50, p95, p99, max } }.
+ */
+QVariantMap LibCamera::latency() const
+{
+    QVariantMap stages;
+
+    for (int i = 0; i < static_cast<int>(qlibcamera::LatencyStage::Count); i++) {
+        qlibcamera::LatencyStage stage = static_cast<qlibcamera::LatencyStage>(i);
+        const qlibcamera::LatencyHistogram &histogram = latencyStats_->histogram(stage);
+
+        QVariantMap values;
+        values["count"] = QVariant::fromValue<quint64>(histogram.count());
+        values["p50"] = QVariant::fromValue<quint64>(histogram.percentile(50));
+        values["p95"] = QVariant::fromValue<quint64>(histogram.percentile(95));
+        values["p99"] = QVariant::fromValue<quint64>(histogram.percentile(99));
+        values["max"] = QVariant::fromValue<quint64>(histogram.max());
+        stages[qlibcamera::LatencyStats::stageName(stage)] = values;
+    }
+
+    return stages;
+}
+
+QVariantMap LibCamera::pipeline() const
+{
+    return pipeline_;
+}
+
+/*
+ * Snapshot the request and buffer pressure. The lowest number of requests
+ * queued to the camera is tracked between two updates: if it reaches 0, the
+ * camera ran out of requests and sensor frames were lost.
+ */
+void LibCamera::updatePipeline()
+{
+    QVariantMap pipeline;
+
+    pipeline["requests"] = static_cast<qint32>(requestCompleted_.size());
+    pipeline["inFlight"] = queuedRequests_;
+    pipeline["inFlightLow"] = inFlightLow_;
+    pipeline["leased"] = pool_ ? pool_->leased() : 0;
+    pipeline["freeRequests"] = static_cast<qint32>(freeQueue_.size());
+    pipeline["freeStillBuffers"] = static_cast<qint32>(freeStillBuffers_.size());
+    pipeline["freeRawBuffers"] = static_cast<qint32>(freeRawBuffers_.size());
+
+    QVariantMap wait;
+    wait["count"] = QVariant::fromValue<quint64>(requeueWait_.count());
+    wait["p50"] = QVariant::fromValue<quint64>(requeueWait_.percentile(50));
+    wait["p95"] = QVariant::fromValue<quint64>(requeueWait_.percentile(95));
+    wait["p99"] = QVariant::fromValue<quint64>(requeueWait_.percentile(99));
+    wait["max"] = QVariant::fromValue<quint64>(requeueWait_.max());
+    pipeline["requeueWait"] = wait;
+
+    qlibcamera::FramePool *framePool = qlibcamera::FramePool::global();
+    QVariantMap pool;
+    pool["hits"] = QVariant::fromValue<quint64>(framePool->hits());
+    pool["misses"] = QVariant::fromValue<quint64>(framePool->misses());
+    pool["allocated"] = QVariant::fromValue<quint64>(framePool->allocated());
+    pool["highWater"] = QVariant::fromValue<quint64>(framePool->highWater());
+    pipeline["framePool"] = pool;
+
+    QVariantList buffers;
+    for (unsigned int i = 0; buffers_ && i < buffers_->size(); i++) {
+        const LibCameraBufferMap::Buffer &buffer = buffers_->at(i);
+        QVariantMap stats;
+        stats["stream"] = buffer.stream == vfStream_ ? "viewfinder"
+                        : buffer.stream == videoStream_ ? "video"
+                        : buffer.stream == stillStream_ ? "still" : "raw";
+        stats["completed"] = QVariant::fromValue<quint64>(buffer.completed);
+        stats["sequence"] = buffer.sequence;
+        buffers.append(stats);
+    }
+    pipeline["buffers"] = buffers;
+
+    pipeline_ = pipeline;
+    inFlightLow_ = queuedRequests_;
+
+    Q_EMIT pipelineChanged();
+}
+
+QVariantMap LibCamera::framesLost() const
+{
+    return framesLostMap_;
+}
+
+LibCamera::LossSnapshot LibCamera::frameLoss() const
+{
+    LossSnapshot snapshot = { framesLost_, qlibcamera::LatencyStats::now() };
+
+    snapshot.loss[qlibcamera::LossStage::Mailbox] += processMailbox_->dropped() + viewMailbox_->dropped();
+    snapshot.loss[qlibcamera::LossStage::Encoder] += recordingMailbox_->dropped() + captureMailbox_->dropped();
+
+    return snapshot;
+}
+
+/*
+ * Snapshot the frames lost per stage as { stage: count, total, rate }, rate
+ * holding the frames lost per second at every stage since the last update.
+ */
+void LibCamera::updateFramesLost()
+{
+    const LossSnapshot snapshot = frameLoss();
+    const qlibcamera::FrameLoss delta = snapshot.loss - lossUpdate_.loss;
+    const qreal elapsed = (snapshot.timestamp - lossUpdate_.timestamp) / 1000000000.0;
+
+    QVariantMap framesLost;
+    QVariantMap rate;
+    for (int i = 0; i < static_cast<int>(qlibcamera::LossStage::Count); i++) {
+        qlibcamera::LossStage stage = static_cast<qlibcamera::LossStage>(i);
+        const char *name = qlibcamera::FrameLoss::stageName(stage);
+        framesLost[name] = QVariant::fromValue<quint64>(snapshot.loss[stage]);
+        rate[name] = elapsed > 0 ? delta[stage] / elapsed : 0.0;
+    }
+    framesLost["total"] = QVariant::fromValue<quint64>(snapshot.loss.total());
+    rate["total"] = elapsed > 0 ? delta.total() / elapsed : 0.0;
+    framesLost["rate"] = rate;
+
+    framesLostMap_ = framesLost;
+    lossUpdate_ = snapshot;
+
+    Q_EMIT framesLostChanged();
+}
+
+QString LibCamera::dumpLatency() const
+{
+    return QString::fromStdString(latencyStats_->dump());
+}
+
+void LibCamera::resetLatency()
+{
+    latencyStats_->reset();
+    Q_EMIT latencyChanged();
+}
+
 uint32_t LibCamera::framesCaptured() const
 {
     return framesCaptured_;
@@ -566,7 +1694,16 @@ void LibCamera::setFps(qint32 newFps)
     fps_ = newFps;
     Q_EMIT fpsChanged();
 
-    timerRestart_->start(0);
+    /* The frame duration is a per-request control, no restart needed. */
+    if (isCapturing_ && captureSource_)
+        captureSource_->setFps(fps_);
+    else if (isCapturing_)
+        fpsPending_ = true;
+}
+
+qreal LibCamera::timeToFirstFrame() const
+{
+    return timeToFirstFrame_;
 }
 
 qreal LibCamera::curFps() const
@@ -589,13 +1726,227 @@ void LibCamera::setFormat(Format newFormat)
     timerRestart_->start(0);
 }
 
+bool LibCamera::videoEnabled() const
+{
+    return videoEnabled_;
+}
+
+void LibCamera::setVideoEnabled(bool newVideoEnabled)
+{
+    if (videoEnabled_ == newVideoEnabled)
+        return;
+    videoEnabled_ = newVideoEnabled;
+    Q_EMIT videoEnabledChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::videoWidth() const
+{
+    return videoWidth_;
+}
+
+void LibCamera::setVideoWidth(qint32 newVideoWidth)
+{
+    if (videoWidth_ == newVideoWidth)
+        return;
+    videoWidth_ = newVideoWidth;
+    Q_EMIT videoWidthChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::videoHeight() const
+{
+    return videoHeight_;
+}
+
+void LibCamera::setVideoHeight(qint32 newVideoHeight)
+{
+    if (videoHeight_ == newVideoHeight)
+        return;
+    videoHeight_ = newVideoHeight;
+    Q_EMIT videoHeightChanged();
+
+    timerRestart_->start(0);
+}
+
+LibCamera::Format LibCamera::videoFormat() const
+{
+    return videoFormat_;
+}
+
+void LibCamera::setVideoFormat(Format newVideoFormat)
+{
+    if (videoFormat_ == newVideoFormat)
+        return;
+    videoFormat_ = newVideoFormat;
+    Q_EMIT videoFormatChanged();
+
+    timerRestart_->start(0);
+}
+
+bool LibCamera::stillEnabled() const
+{
+    return stillEnabled_;
+}
+
+void LibCamera::setStillEnabled(bool newStillEnabled)
+{
+    if (stillEnabled_ == newStillEnabled)
+        return;
+    stillEnabled_ = newStillEnabled;
+    Q_EMIT stillEnabledChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::stillWidth() const
+{
+    return stillWidth_;
+}
+
+void LibCamera::setStillWidth(qint32 newStillWidth)
+{
+    if (stillWidth_ == newStillWidth)
+        return;
+    stillWidth_ = newStillWidth;
+    Q_EMIT stillWidthChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::stillHeight() const
+{
+    return stillHeight_;
+}
+
+void LibCamera::setStillHeight(qint32 newStillHeight)
+{
+    if (stillHeight_ == newStillHeight)
+        return;
+    stillHeight_ = newStillHeight;
+    Q_EMIT stillHeightChanged();
+
+    timerRestart_->start(0);
+}
+
+LibCamera::Format LibCamera::stillFormat() const
+{
+    return stillFormat_;
+}
+
+void LibCamera::setStillFormat(Format newStillFormat)
+{
+    if (stillFormat_ == newStillFormat)
+        return;
+    stillFormat_ = newStillFormat;
+    Q_EMIT stillFormatChanged();
+
+    timerRestart_->start(0);
+}
+
+bool LibCamera::rawEnabled() const
+{
+    return rawEnabled_;
+}
+
+void LibCamera::setRawEnabled(bool newRawEnabled)
+{
+    if (rawEnabled_ == newRawEnabled)
+        return;
+    rawEnabled_ = newRawEnabled;
+    Q_EMIT rawEnabledChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::bufferCount() const
+{
+    return bufferCount_;
+}
+
+void LibCamera::setBufferCount(qint32 newBufferCount)
+{
+    if (bufferCount_ == newBufferCount)
+        return;
+    bufferCount_ = newBufferCount;
+    Q_EMIT bufferCountChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::videoBufferCount() const
+{
+    return videoBufferCount_;
+}
+
+void LibCamera::setVideoBufferCount(qint32 newVideoBufferCount)
+{
+    if (videoBufferCount_ == newVideoBufferCount)
+        return;
+    videoBufferCount_ = newVideoBufferCount;
+    Q_EMIT videoBufferCountChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::stillBufferCount() const
+{
+    return stillBufferCount_;
+}
+
+void LibCamera::setStillBufferCount(qint32 newStillBufferCount)
+{
+    if (stillBufferCount_ == newStillBufferCount)
+        return;
+    stillBufferCount_ = newStillBufferCount;
+    Q_EMIT stillBufferCountChanged();
+
+    timerRestart_->start(0);
+}
+
+qint32 LibCamera::rawBufferCount() const
+{
+    return rawBufferCount_;
+}
+
+void LibCamera::setRawBufferCount(qint32 newRawBufferCount)
+{
+    if (rawBufferCount_ == newRawBufferCount)
+        return;
+    rawBufferCount_ = newRawBufferCount;
+    Q_EMIT rawBufferCountChanged();
+
+    timerRestart_->start(0);
+}
+
+void LibCamera::captureRaw(qint32 count)
+{
+    if (!isCapturing_)
+        return;
+
+    if (!rawStream_) {
+        qWarning() << "RAW capture requires rawEnabled";
+        return;
+    }
+
+    rawCapturesPending_ += qMax(count, 1);
+}
+
 void LibCamera::snapshot()
 {
     if(!isCapturing_) {
         return;
     }
 
-    Q_EMIT snapshotFrameReady(view_->getCurrentImage(), view_->imageTimestamp());
+    /* Take the next frame of the still stream if there is one. */
+    if (stillStream_) {
+        captureStill_ = true;
+        return;
+    }
+
+    Q_EMIT snapshotFrameReady(view_->getCurrentImage(), view_->frameInfo());
 }
 
 void LibCamera::startRecording()
@@ -604,14 +1955,129 @@ void LibCamera::startRecording()
         return;
     }
 
-    Q_EMIT recordingStart(width_, height_, fps_, formatMap[format_], recordBitRate_);
+    /* A recording restarted keeps counting until its file is completed. */
+    if (!isRecording_)
+        recordingLoss_ = frameLoss();
+
+    /* Raw captures store the frames as they come, whatever their format. */
+    rawRecording_ = recordingMode_ == RawCapture;
+    if (rawRecording_) {
+        Q_EMIT captureStart(recordingFormat_.format, recordingFormat_.size, recordingFormat_.stride);
+    } else if (videoStream_) {
+        const libcamera::StreamConfiguration &videoConfig = videoStream_->configuration();
+        Q_EMIT recordingStart(videoConfig.size.width, videoConfig.size.height, fps_,
+                              videoConfig.pixelFormat, videoConfig.stride, recordBitRate_);
+    } else {
+        Q_EMIT recordingStart(width_, height_, fps_, formatMap[format_], recordingFormat_.stride,
+                              recordBitRate_);
+    }
     setIsRecording(true);
 }
 
 void LibCamera::endRecording()
 {
+    if (isRecording_)
+        recordingLossEnd_ = frameLoss();
+
     Q_EMIT recordingEnd();
     setIsRecording(false);
+
+    /* Settings changed while recording apply now. */
+    updatePreEvent();
+}
+
+/*
+ * Write the pre-event ring out and keep recording seamlessly from there.
+ * Without a ring, start recording from the next frame.
+ */
+void LibCamera::triggerEvent()
+{
+    if (!preEventArmed_) {
+        startRecording();
+        return;
+    }
+
+    if (isRecording_)
+        return;
+
+    rawRecording_ = preEvent_.mode == RawCapture;
+    recordingLoss_ = frameLoss();
+    Q_EMIT preEventTrigger();
+    setIsRecording(true);
+}
+
+bool LibCamera::samePreEvent(const PreEvent &a, const PreEvent &b)
+{
+    return a.mode == b.mode && a.format.format == b.format.format &&
+           a.format.size == b.format.size && a.format.stride == b.format.stride &&
+           a.format.frameSize == b.format.frameSize && a.fps == b.fps &&
+           a.bitRate == b.bitRate && a.duration == b.duration && a.bytes == b.bytes &&
+           a.frames == b.frames;
+}
+
+/*
+ * Allocate, reallocate or free the pre-event ring to match the settings and
+ * the recorded stream. The ring is sized once here: frames of the recorded
+ * stream plus the record overhead for raw captures, twice the bit rate for
+ * encoded packets to absorb key frames. A recording in progress keeps the
+ * ring as it is until it ends.
+ */
+void LibCamera::updatePreEvent()
+{
+    /* Without a time limit, keep at most a minute of entries. */
+    static constexpr qint64 MaxUntimedSeconds = 60;
+
+    if (isRecording_)
+        return;
+
+    const bool enabled = (preEventDuration_ > 0 || preEventBytes_ > 0) &&
+                         recordingFormat_.size.isValid();
+
+    PreEvent preEvent = {};
+    if (enabled) {
+        const qint64 fps = std::max(fps_, 1);
+
+        preEvent.mode = recordingMode_;
+        preEvent.format = recordingFormat_;
+        preEvent.fps = fps_;
+        preEvent.bitRate = recordBitRate_;
+        preEvent.duration = preEventDuration_ * 1000000LL;
+        preEvent.frames = preEventDuration_ > 0 ? fps * preEventDuration_ / 1000 + fps
+                                                : fps * MaxUntimedSeconds;
+
+        if (preEventBytes_ > 0) {
+            preEvent.bytes = preEventBytes_;
+        } else if (recordingMode_ == RawCapture) {
+            const qint64 recordSize = recordingFormat_.frameSize +
+                (qlibcamera::RawCapture::MaxPlanes + 1) * qlibcamera::RawCapture::Alignment;
+            preEvent.bytes = recordSize * (fps * preEventDuration_ / 1000 + 1);
+        } else {
+            preEvent.bytes = 2 * qint64(recordBitRate_) / 8 * preEventDuration_ / 1000 + 1024 * 1024;
+        }
+    }
+
+    if (preEventArmed_ && enabled && samePreEvent(preEvent, preEvent_))
+        return;
+
+    if (preEventArmed_) {
+        Q_EMIT preEventEnd();
+        preEventArmed_ = false;
+    }
+
+    if (!enabled)
+        return;
+
+    if (preEvent.mode == RawCapture)
+        Q_EMIT capturePreEventStart(preEvent.format.format, preEvent.format.size, preEvent.format.stride,
+                                    preEvent.duration, preEvent.bytes, preEvent.frames);
+    else
+        Q_EMIT recordingPreEventStart(preEvent.format.size.width(), preEvent.format.size.height(),
+                                      preEvent.fps, preEvent.format.format, preEvent.format.stride,
+                                      preEvent.bitRate,
+                                      preEvent.duration, preEvent.bytes, preEvent.frames);
+
+    preEvent_ = preEvent;
+    preEventArmed_ = true;
 }
 
 bool LibCamera::enabled() const
@@ -641,6 +2107,8 @@ void LibCamera::setIndex(qint32 newIndex)
     index_ = newIndex;
     Q_EMIT indexChanged();
 
+    cameraId_.clear();
+    reopenPending_ = true;
     timerRestart_->start(0);
 }
 
@@ -674,11 +2142,104 @@ void LibCamera::setWidth(qint32 newWidth)
     timerRestart_->start(0);
 }
 
+LibCamera::RecordingMode LibCamera::recordingMode() const
+{
+    return recordingMode_;
+}
+
+/* Takes effect with the next recording. */
+void LibCamera::setRecordingMode(RecordingMode newRecordingMode)
+{
+    if (recordingMode_ == newRecordingMode)
+        return;
+    recordingMode_ = newRecordingMode;
+    Q_EMIT recordingModeChanged();
+
+    updatePreEvent();
+}
+
+qint32 LibCamera::preEventDuration() const
+{
+    return preEventDuration_;
+}
+
+/* Milliseconds kept before a triggered recording, 0 for no time limit */
+void LibCamera::setPreEventDuration(qint32 newPreEventDuration)
+{
+    if (preEventDuration_ == newPreEventDuration)
+        return;
+    preEventDuration_ = newPreEventDuration;
+    Q_EMIT preEventDurationChanged();
+
+    updatePreEvent();
+}
+
+qint64 LibCamera::preEventBytes() const
+{
+    return preEventBytes_;
+}
+
+/* Memory of the pre-event ring, 0 to size it from preEventDuration */
+void LibCamera::setPreEventBytes(qint64 newPreEventBytes)
+{
+    if (preEventBytes_ == newPreEventBytes)
+        return;
+    preEventBytes_ = newPreEventBytes;
+    Q_EMIT preEventBytesChanged();
+
+    updatePreEvent();
+}
+
+LibCameraSource *LibCamera::source() const
+{
+    return source_;
+}
+
+/*
+ * Capture from \a newSource instead of the camera, or from the camera again
+ * if null. The camera is released while a source is set.
+ */
+void LibCamera::setSource(LibCameraSource *newSource)
+{
+    if (source_ == newSource)
+        return;
+
+    if (source_)
+        disconnect(source_, &QObject::destroyed, this, nullptr);
+
+    source_ = newSource;
+    Q_EMIT sourceChanged();
+
+    if (source_) {
+        connect(source_, &QObject::destroyed, this, [this]() {
+            Q_EMIT sourceChanged();
+            reopenPending_ = true;
+            timerRestart_->start(0);
+        });
+    }
+
+    reopenPending_ = true;
+    timerRestart_->start(0);
+}
+
 LibCameraView *LibCamera::view() const
 {
     return view_;
 }
 
+/*
+ * Attach the camera to a frame synchroniser, as the camera at \a index of its
+ * frame sets. Capture restarts to report the stream format to it.
+ */
+void LibCamera::setSync(LibCameraSync *sync, qint32 index)
+{
+    sync_ = sync;
+    syncIndex_ = index;
+
+    if (sync_ && isCapturing_)
+        timerRestart_->start(0);
+}
+
 void LibCamera::setView(LibCameraView *newView)
 {
     if (view_ == newView)
@@ -686,13 +2247,17 @@ void LibCamera::setView(LibCameraView *newView)
 
     if(view_) {
         disconnect(this, &LibCamera::processCompleted, view_, &LibCameraView::onProcessCompleted);
+        disconnect(view_, &LibCameraView::paintSizeChanged, this, &LibCamera::updateProcessOutput);
+        view_->setLatencyStats(nullptr);
     }
 
     view_ = newView;
     Q_EMIT viewChanged();
 
     connect(this, &LibCamera::processCompleted, view_, &LibCameraView::onProcessCompleted);
-    timerRestart_->start(0);
+    connect(view_, &LibCameraView::paintSizeChanged, this, &LibCamera::updateProcessOutput);
+    view_->setLatencyStats(latencyStats_);
+    updateProcessOutput();
 }
 
 
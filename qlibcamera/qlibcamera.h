@@ -2,6 +2,7 @@
 
 #include <QObject>
 #include <QQmlEngine>
+#include <atomic>
 #include <memory>
 #include <vector>
 
@@ -13,13 +14,25 @@
 #include <libcamera/request.h>
 #include <libcamera/stream.h>
 
-#include <QMutex>
 #include <QObject>
-#include <QQueue>
+#include <QPointer>
+#include <QRect>
 #include <QTimer>
+#include <QVariantMap>
 #include <QQuickItem>
 
+#include "frame_loss.h"
+#include "qlibcameraframe.h"
+#include "qlibcameramailbox.h"
+#include "qlibcamerasource.h"
+#include "latency_histogram.h"
 #include "qlibcameraview.h"
+#include "spsc_ring.h"
+
+class LibCameraBufferMap;
+class LibCameraRequestPool;
+class LibCameraSync;
+struct LibCameraRawFrame;
 
 class LibCamera : public QObject
 {
@@ -31,11 +44,48 @@ class LibCamera : public QObject
     Q_PROPERTY(bool enabled READ enabled WRITE setEnabled NOTIFY enabledChanged FINAL)
     Q_PROPERTY(Format format READ format WRITE setFormat NOTIFY formatChanged FINAL)
     Q_PROPERTY(qreal curFps READ curFps CONSTANT FINAL)
+    Q_PROPERTY(qreal timeToFirstFrame READ timeToFirstFrame NOTIFY timeToFirstFrameChanged FINAL)
     Q_PROPERTY(qint32 fps READ fps WRITE setFps NOTIFY fpsChanged FINAL)
     Q_PROPERTY(bool isRecording READ isRecording WRITE setIsRecording NOTIFY isRecordingChanged FINAL)
     Q_PROPERTY(uint32_t framesCaptured READ framesCaptured CONSTANT FINAL)
     Q_PROPERTY(qint32 framesRecorded READ framesRecorded CONSTANT FINAL)
     Q_PROPERTY(int recordBitRate READ recordBitRate WRITE setRecordBitRate NOTIFY recordBitRateChanged FINAL)
+    Q_PROPERTY(qint32 framesLeased READ framesLeased NOTIFY framesLeasedChanged FINAL)
+    Q_PROPERTY(qint32 starvationCount READ starvationCount NOTIFY starvationCountChanged FINAL)
+    Q_PROPERTY(MailboxPolicy processPolicy READ processPolicy WRITE setProcessPolicy NOTIFY processPolicyChanged FINAL)
+    Q_PROPERTY(MailboxPolicy recordingPolicy READ recordingPolicy WRITE setRecordingPolicy NOTIFY recordingPolicyChanged FINAL)
+    Q_PROPERTY(MailboxPolicy viewPolicy READ viewPolicy WRITE setViewPolicy NOTIFY viewPolicyChanged FINAL)
+    Q_PROPERTY(qint32 mailboxCapacity READ mailboxCapacity WRITE setMailboxCapacity NOTIFY mailboxCapacityChanged FINAL)
+    Q_PROPERTY(qint32 convertThreads READ convertThreads WRITE setConvertThreads NOTIFY convertThreadsChanged FINAL)
+    Q_PROPERTY(PreviewScaling previewScaling READ previewScaling WRITE setPreviewScaling NOTIFY previewScalingChanged FINAL)
+    Q_PROPERTY(PreviewFormat previewFormat READ previewFormat WRITE setPreviewFormat NOTIFY previewFormatChanged FINAL)
+    Q_PROPERTY(QRect roi READ roi WRITE setRoi NOTIFY roiChanged FINAL)
+    Q_PROPERTY(bool roiScalerCrop READ roiScalerCrop WRITE setRoiScalerCrop NOTIFY roiScalerCropChanged FINAL)
+    Q_PROPERTY(quint64 processFramesDropped READ processFramesDropped NOTIFY framesDroppedChanged FINAL)
+    Q_PROPERTY(quint64 recordingFramesDropped READ recordingFramesDropped NOTIFY framesDroppedChanged FINAL)
+    Q_PROPERTY(quint64 viewFramesDropped READ viewFramesDropped NOTIFY framesDroppedChanged FINAL)
+    Q_PROPERTY(QVariantMap latency READ latency NOTIFY latencyChanged FINAL)
+    Q_PROPERTY(bool videoEnabled READ videoEnabled WRITE setVideoEnabled NOTIFY videoEnabledChanged FINAL)
+    Q_PROPERTY(qint32 videoWidth READ videoWidth WRITE setVideoWidth NOTIFY videoWidthChanged FINAL)
+    Q_PROPERTY(qint32 videoHeight READ videoHeight WRITE setVideoHeight NOTIFY videoHeightChanged FINAL)
+    Q_PROPERTY(Format videoFormat READ videoFormat WRITE setVideoFormat NOTIFY videoFormatChanged FINAL)
+    Q_PROPERTY(bool stillEnabled READ stillEnabled WRITE setStillEnabled NOTIFY stillEnabledChanged FINAL)
+    Q_PROPERTY(qint32 stillWidth READ stillWidth WRITE setStillWidth NOTIFY stillWidthChanged FINAL)
+    Q_PROPERTY(qint32 stillHeight READ stillHeight WRITE setStillHeight NOTIFY stillHeightChanged FINAL)
+    Q_PROPERTY(Format stillFormat READ stillFormat WRITE setStillFormat NOTIFY stillFormatChanged FINAL)
+    Q_PROPERTY(bool rawEnabled READ rawEnabled WRITE setRawEnabled NOTIFY rawEnabledChanged FINAL)
+    Q_PROPERTY(qint32 bufferCount READ bufferCount WRITE setBufferCount NOTIFY bufferCountChanged FINAL)
+    Q_PROPERTY(qint32 videoBufferCount READ videoBufferCount WRITE setVideoBufferCount NOTIFY videoBufferCountChanged FINAL)
+    Q_PROPERTY(qint32 stillBufferCount READ stillBufferCount WRITE setStillBufferCount NOTIFY stillBufferCountChanged FINAL)
+    Q_PROPERTY(qint32 rawBufferCount READ rawBufferCount WRITE setRawBufferCount NOTIFY rawBufferCountChanged FINAL)
+    Q_PROPERTY(QVariantMap pipeline READ pipeline NOTIFY pipelineChanged FINAL)
+    Q_PROPERTY(QVariantMap framesLost READ framesLost NOTIFY framesLostChanged FINAL)
+    Q_PROPERTY(State state READ state NOTIFY stateChanged FINAL)
+    Q_PROPERTY(qreal reconnectLatency READ reconnectLatency NOTIFY reconnectLatencyChanged FINAL)
+    Q_PROPERTY(LibCameraSource *source READ source WRITE setSource NOTIFY sourceChanged FINAL)
+    Q_PROPERTY(RecordingMode recordingMode READ recordingMode WRITE setRecordingMode NOTIFY recordingModeChanged FINAL)
+    Q_PROPERTY(qint32 preEventDuration READ preEventDuration WRITE setPreEventDuration NOTIFY preEventDurationChanged FINAL)
+    Q_PROPERTY(qint64 preEventBytes READ preEventBytes WRITE setPreEventBytes NOTIFY preEventBytesChanged FINAL)
     QML_ELEMENT
 
 public:
@@ -65,9 +115,53 @@ public:
         Format_RGB888,
         Format_RGB565,
         Format_YUV420,
+        Format_NV12,
+        Format_YUYV,
+        Format_MJPEG,
+        Format_SRGGB10_CSI2P,
+        Format_SRGGB12_CSI2P,
     };
     Q_ENUM(Format)
 
+    enum MailboxPolicy {
+        DropOldest,
+        LatestWins,
+        BlockCapture,
+    };
+    Q_ENUM(MailboxPolicy)
+
+    /* Scaling of converted frames to the size the view paints them at */
+    enum PreviewScaling {
+        ScaleOff,       /* Frames are converted at the stream size */
+        ScaleNearest,
+        ScaleBilinear,
+        ScaleBox,       /* Averages all pixels, for large reductions */
+    };
+    Q_ENUM(PreviewScaling)
+
+    /* Image format of converted frames, smaller formats write less memory */
+    enum PreviewFormat {
+        PreviewRGB32,
+        PreviewRGB888,
+        PreviewRGB16,
+        PreviewGrayscale8,
+    };
+    Q_ENUM(PreviewFormat)
+
+    enum State {
+        Closed,         /* No camera acquired */
+        Open,           /* Camera acquired, not capturing */
+        Capturing,
+        Disconnected,   /* Camera gone or failing, reconnection pending */
+    };
+    Q_ENUM(State)
+
+    enum RecordingMode {
+        Encoded,        /* H.264 elementary stream */
+        RawCapture,     /* Unmodified frames in a raw capture file */
+    };
+    Q_ENUM(RecordingMode)
+
     explicit LibCamera(QObject *parent = nullptr);
     virtual ~LibCamera();
 
@@ -75,12 +169,17 @@ public:
     virtual void initProcessWorker();
     virtual void initSnapshotWorker();
     virtual void initRecordingWorker();
+    virtual void initRawWorker();
+    virtual void initCaptureWorker();
 
     bool event(QEvent *e) override;
 
     LibCameraView *view() const;
     void setView(LibCameraView *newView);
 
+    LibCameraSource *source() const;
+    void setSource(LibCameraSource *newSource);
+
     qint32 width() const;
     void setWidth(qint32 newWidth);
 
@@ -98,6 +197,8 @@ public:
 
     qreal curFps() const;
 
+    qreal timeToFirstFrame() const;
+
     qint32 fps() const;
     void setFps(qint32 newFps);
 
@@ -111,9 +212,104 @@ public:
     qint32 recordBitRate() const;
     void setRecordBitRate(qint32 newRecordBitRate);
 
+    qint32 framesLeased() const;
+    qint32 starvationCount() const;
+
+    MailboxPolicy processPolicy() const;
+    void setProcessPolicy(MailboxPolicy newProcessPolicy);
+
+    MailboxPolicy recordingPolicy() const;
+    void setRecordingPolicy(MailboxPolicy newRecordingPolicy);
+
+    MailboxPolicy viewPolicy() const;
+    void setViewPolicy(MailboxPolicy newViewPolicy);
+
+    qint32 mailboxCapacity() const;
+    void setMailboxCapacity(qint32 newMailboxCapacity);
+
+    qint32 convertThreads() const;
+    void setConvertThreads(qint32 newConvertThreads);
+
+    PreviewScaling previewScaling() const;
+    void setPreviewScaling(PreviewScaling newPreviewScaling);
+
+    PreviewFormat previewFormat() const;
+    void setPreviewFormat(PreviewFormat newPreviewFormat);
+
+    QRect roi() const;
+    void setRoi(const QRect &newRoi);
+
+    bool roiScalerCrop() const;
+    void setRoiScalerCrop(bool newRoiScalerCrop);
+
+    quint64 processFramesDropped() const;
+    quint64 recordingFramesDropped() const;
+    quint64 viewFramesDropped() const;
+
+    bool videoEnabled() const;
+    void setVideoEnabled(bool newVideoEnabled);
+
+    qint32 videoWidth() const;
+    void setVideoWidth(qint32 newVideoWidth);
+
+    qint32 videoHeight() const;
+    void setVideoHeight(qint32 newVideoHeight);
+
+    Format videoFormat() const;
+    void setVideoFormat(Format newVideoFormat);
+
+    bool stillEnabled() const;
+    void setStillEnabled(bool newStillEnabled);
+
+    qint32 stillWidth() const;
+    void setStillWidth(qint32 newStillWidth);
+
+    qint32 stillHeight() const;
+    void setStillHeight(qint32 newStillHeight);
+
+    Format stillFormat() const;
+    void setStillFormat(Format newStillFormat);
+
+    bool rawEnabled() const;
+    void setRawEnabled(bool newRawEnabled);
+
+    qint32 bufferCount() const;
+    void setBufferCount(qint32 newBufferCount);
+
+    qint32 videoBufferCount() const;
+    void setVideoBufferCount(qint32 newVideoBufferCount);
+
+    qint32 stillBufferCount() const;
+    void setStillBufferCount(qint32 newStillBufferCount);
+
+    qint32 rawBufferCount() const;
+    void setRawBufferCount(qint32 newRawBufferCount);
+
+    QVariantMap pipeline() const;
+    QVariantMap framesLost() const;
+
+    void setSync(LibCameraSync *sync, qint32 index);
+
+    State state() const;
+    qreal reconnectLatency() const;
+
+    RecordingMode recordingMode() const;
+    void setRecordingMode(RecordingMode newRecordingMode);
+
+    qint32 preEventDuration() const;
+    void setPreEventDuration(qint32 newPreEventDuration);
+    qint64 preEventBytes() const;
+    void setPreEventBytes(qint64 newPreEventBytes);
+
+    QVariantMap latency() const;
+    Q_INVOKABLE QString dumpLatency() const;
+    Q_INVOKABLE void resetLatency();
+
     Q_INVOKABLE void snapshot();
+    Q_INVOKABLE void captureRaw(qint32 count = 1);
     Q_INVOKABLE void startRecording();
     Q_INVOKABLE void endRecording();
+    Q_INVOKABLE void triggerEvent();
 
 Q_SIGNALS:
     void viewChanged();
@@ -130,44 +326,176 @@ Q_SIGNALS:
 
     void fpsChanged();
 
-    void snapshotFrameReady(QImage image, quint64 timestamp);
+    void timeToFirstFrameChanged();
+
+    void snapshotFrameReady(QImage image, qlibcamera::FrameInfo info);
     void snapshotCompleted(QString filename);
 
-    void recordingStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat, qint32 bitRate);
-    void recordingFrameReady(QList<QByteArray> dataList, quint64 timestamp);
+    void recordingStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat,
+                        unsigned int stride, qint32 bitRate);
     void recordingEnd();
+    void captureStart(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride);
+    void recordingPreEventStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat,
+                                unsigned int stride, qint32 bitRate, qint64 duration, qint64 bytes, qint32 frames);
+    void capturePreEventStart(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                              qint64 duration, qint64 bytes, qint32 frames);
+    void preEventTrigger();
+    void preEventEnd();
     void recordingCompleted(QString filename, qint32 frameCount);
+    void recordingFailed();
 
     void isRecordingChanged();
 
     void recordBitRateChanged();
 
-    void processFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride);
-    void processFrameReady(QList<QByteArray> dataList, quint64 timestamp);
-    void processCompleted(QImage image, quint64 timestamp);
+    void processFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                              const std::optional<libcamera::ColorSpace> &colorSpace);
+    void processOutputChanged(const QSize &size, const QRect &crop, qlibcamera::ScaleFilter filter,
+                              QImage::Format format);
+    void processCompleted(QImage image, qlibcamera::FrameInfo info);
+
+    void framesLeasedChanged();
+    void starvationCountChanged();
+    void requestStarved(qint32 framesLeased);
+
+    void processPolicyChanged();
+    void recordingPolicyChanged();
+    void viewPolicyChanged();
+    void mailboxCapacityChanged();
+    void convertThreadsChanged();
+    void previewScalingChanged();
+    void previewFormatChanged();
+    void roiChanged();
+    void roiScalerCropChanged();
+    void framesDroppedChanged();
+
+    void latencyChanged();
+
+    void videoEnabledChanged();
+    void videoWidthChanged();
+    void videoHeightChanged();
+    void videoFormatChanged();
+
+    void stillEnabledChanged();
+    void stillWidthChanged();
+    void stillHeightChanged();
+    void stillFormatChanged();
+
+    void rawEnabledChanged();
+
+    void bufferCountChanged();
+    void videoBufferCountChanged();
+    void stillBufferCountChanged();
+    void rawBufferCountChanged();
+
+    void pipelineChanged();
+    void framesLostChanged();
+
+    void stateChanged();
+    void reconnectLatencyChanged();
+    void sourceChanged();
+    void recordingModeChanged();
+    void preEventDurationChanged();
+    void preEventBytesChanged();
+
+    void stillStreamFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                                  const std::optional<libcamera::ColorSpace> &colorSpace);
+    void stillFrameReady(LibCameraFrame frame);
+
+    void rawStreamFormatChanged(const libcamera::PixelFormat &format, const QSize &size,
+                                unsigned int stride, const QString &model);
+    void rawCompleted(QString filename);
 
 private:
+    struct CompletedRequest {
+        libcamera::Request *request;
+        uint64_t timestamp;
+    };
+
+    struct StreamFormat {
+        libcamera::PixelFormat format;
+        QSize size;
+        unsigned int stride;
+        size_t frameSize;
+    };
+
+    /* Settings the pre-event ring was allocated for */
+    struct PreEvent {
+        RecordingMode mode;
+        StreamFormat format;
+        qint32 fps;
+        qint32 bitRate;
+        qint64 duration;    /* ns, 0 for no time limit */
+        qint64 bytes;
+        qint32 frames;
+    };
+
+    static bool samePreEvent(const PreEvent &a, const PreEvent &b);
+
+    /* Frames lost at every stage at some point in time */
+    struct LossSnapshot {
+        qlibcamera::FrameLoss loss;
+        uint64_t timestamp;     /* CLOCK_BOOTTIME ns */
+    };
+
+    struct ProcessedImage {
+        QImage image;
+        qlibcamera::FrameInfo info;
+    };
+
+    static constexpr int ReconnectDelayMin = 100;
+    static constexpr int ReconnectDelayMax = 5000;
+
     void cleanup();
     int openCamera();
     void restart();
 
+    void setState(State newState);
+    void scheduleReconnect();
+    void reconnected(uint64_t timestamp);
+    void cameraAdded(std::shared_ptr<libcamera::Camera> camera);
+    void cameraRemoved(std::shared_ptr<libcamera::Camera> camera);
+
     int startCapture();
     void stopCapture();
-
+    int allocateBuffers();
+    void freeBuffers();
+    int startSource();
+    void sourceComplete(LibCameraFrame frame);
+
+    void setFrameDuration(libcamera::Request *request);
+    bool scalerCropActive() const;
+    void setScalerCrop(libcamera::Request *request);
     int queueRequest(libcamera::Request *request);
     void requestComplete(libcamera::Request *request);
 
     void processCapture();
-    void processRaw(libcamera::FrameBuffer *buffer,
-                    const libcamera::ControlList &metadata);
-    void processViewfinder(libcamera::FrameBuffer *buffer);
-    void renderComplete(libcamera::FrameBuffer *buffer);
+    void processRequest(libcamera::Request *request, uint64_t completedTimestamp);
+    void processSourceFrame(const LibCameraFrame &frame);
+    void processFirstFrame(uint64_t completedTimestamp);
+    void dispatchFrame(const LibCameraFrame &frame, const LibCameraFrame &recordingFrame);
+    void processViewfinder(uint64_t timestamp);
+    void processReleased();
+    void updatePreEvent();
+    LossSnapshot frameLoss() const;
+    void writeSidecar(const QString &filename, qint32 frameCount, const LossSnapshot &end);
+    void renderComplete(libcamera::FrameBuffer *buffer, libcamera::FrameBuffer *videoBuffer);
 
 private Q_SLOTS:
     void onFrameRecorded(int frameCount);
+    void onRecordingCompleted(QString filename, qint32 frameCount);
+    void onRecordingFailed();
+    void onEncoderFramesLost(qint32 count);
+    void updatePipeline();
+    void updateFramesLost();
+    void updateProcessOutput();
 
 private:
     LibCameraView *view_;
+    PreviewScaling previewScaling_;
+    PreviewFormat previewFormat_;
+    QRect roi_;
+    bool roiScalerCrop_;
     qint32 width_;
     qint32 height_;
     qint32 index_;
@@ -176,31 +504,134 @@ private:
     qint32 fps_;
     bool isRecording_;
     qint32 recordBitRate_;
+    RecordingMode recordingMode_;
+    bool rawRecording_;     /* Recording started in RawCapture mode */
+
+    /* Ring of the frames preceding a recording, in the recording mode */
+    qint32 preEventDuration_;   /* ms */
+    qint64 preEventBytes_;
+    bool preEventArmed_;
+    PreEvent preEvent_;
+
+    /* Additional streams, each routed to the consumer that wants it */
+    bool videoEnabled_;
+    qint32 videoWidth_;
+    qint32 videoHeight_;
+    Format videoFormat_;
+    bool stillEnabled_;
+    qint32 stillWidth_;
+    qint32 stillHeight_;
+    Format stillFormat_;
+    bool rawEnabled_;
+
+    /* Buffers per stream, 0 leaves the choice to the pipeline handler */
+    qint32 bufferCount_;
+    qint32 videoBufferCount_;
+    qint32 stillBufferCount_;
+    qint32 rawBufferCount_;
 
     QTimer *timerRestart_;
     qint32 framesRecorded_;
+    StreamFormat recordingFormat_;  /* Video stream if enabled, viewfinder otherwise */
+
+    /*
+     * Bounded hand-off to the workers and the view. The worker mailboxes are
+     * owned by the workers, which outlive this object.
+     */
+    LibCameraMailbox<LibCameraFrame> *processMailbox_;
+    LibCameraMailbox<LibCameraFrame> *recordingMailbox_;
+    LibCameraMailbox<LibCameraFrame> *captureMailbox_;
+    LibCameraMailbox<LibCameraRawFrame> *rawMailbox_;
+    std::unique_ptr<LibCameraMailbox<ProcessedImage>> viewMailbox_;
+
+    /* Per-stage latency, shared with the workers and the view */
+    std::shared_ptr<qlibcamera::LatencyStats> latencyStats_;
+    QTimer *timerLatency_;
 
     /* Camera manager, camera, configuration and buffers */
     std::shared_ptr<libcamera::Camera> camera_;
+
+    /*
+     * Frame source replacing the camera, and the one capture was started
+     * from. Completed frames are handed over in sourceQueue_.
+     */
+    QPointer<LibCameraSource> source_;
+    QPointer<LibCameraSource> captureSource_;
+    qlibcamera::SpscRing<LibCameraFrame> sourceQueue_;
     libcamera::FrameBufferAllocator *allocator_;
 
+    /*
+     * The configuration and its buffers are kept across stop and start, and
+     * only reallocated when the configuration changes.
+     */
+    std::vector<libcamera::StreamRole> roles_;
     std::unique_ptr<libcamera::CameraConfiguration> config_;
-    std::map<libcamera::FrameBuffer *, std::unique_ptr<qlibcamera::Image>> mappedBuffers_;
+    std::shared_ptr<LibCameraBufferMap> buffers_;
+    std::shared_ptr<LibCameraRequestPool> pool_;
 
     /* Capture state, buffers queue and statistics */
     bool isCapturing_;
-    bool captureRaw_;
+    qint32 rawCapturesPending_;
+    bool captureStill_;
     libcamera::Stream *vfStream_;
+    libcamera::Stream *videoStream_;
+    libcamera::Stream *stillStream_;
     libcamera::Stream *rawStream_;
-    std::map<const libcamera::Stream *, QQueue<libcamera::FrameBuffer *>> freeBuffers_;
-    QQueue<libcamera::Request *> doneQueue_;
-    QQueue<libcamera::Request *> freeQueue_;
-    QMutex mutex_; /* Protects freeBuffers_, doneQueue_, and freeQueue_ */
+    /*
+     * doneQueue_ is filled from the libcamera thread, everything else is
+     * only touched from the application thread.
+     */
+    qlibcamera::SpscRing<libcamera::FrameBuffer *> freeStillBuffers_;
+    qlibcamera::SpscRing<libcamera::FrameBuffer *> freeRawBuffers_;
+    qlibcamera::SpscRing<CompletedRequest> doneQueue_;
+    qlibcamera::SpscRing<libcamera::Request *> freeQueue_;
+    std::atomic<bool> capturePending_; /* A CaptureEvent is posted, not yet handled */
 
     uint64_t lastBufferTime_;
     uint32_t previousFrames_;
     uint32_t framesCaptured_;
     qreal curFps_;
 
-    std::vector<std::unique_ptr<libcamera::Request>> requests_;
+    /* Requests queued to the camera, and starvation caused by leased frames */
+    qint32 queuedRequests_;
+    qint32 starvationCount_;
+    bool starved_;
+
+    /* Pipeline pressure, indexed by request cookie */
+    std::vector<uint64_t> requestCompleted_;
+    qlibcamera::LatencyHistogram requeueWait_;
+    qint32 inFlightLow_;
+    QVariantMap pipeline_;
+
+    /*
+     * Frames lost by the sensor, by request starvation and by the encoder.
+     * Mailbox drops are counted by the mailboxes, see frameLoss().
+     */
+    qlibcamera::FrameLoss framesLost_;
+    qlibcamera::SequenceTracker sequence_;
+    bool requestsRanDry_;           /* No request queued since the last completion */
+    LossSnapshot lossUpdate_;       /* At the last update of framesLostMap_ */
+    LossSnapshot recordingLoss_;    /* At the start of the recording */
+    LossSnapshot recordingLossEnd_; /* At the end of the recording */
+    QVariantMap framesLostMap_;
+
+    /* Frame synchroniser this camera belongs to, if any */
+    LibCameraSync *sync_;
+    qint32 syncIndex_;
+
+    /* Restart state, see restart() */
+    bool reopenPending_;
+    bool fpsPending_;
+    bool scalerCropPending_;
+    bool firstFramePending_;
+    uint64_t restartTimestamp_;
+    qreal timeToFirstFrame_;
+
+    /* Hotplug recovery */
+    std::string cameraId_;
+    State state_;
+    QTimer *timerReconnect_;
+    int reconnectDelay_;            /* ms, doubled after each failed attempt */
+    uint64_t disconnectTimestamp_;  /* CLOCK_BOOTTIME ns, 0 when connected */
+    qreal reconnectLatency_;
 };
@@ -0,0 +1,176 @@
+#include "qlibcameraframe.h"
+
+#include <string.h>
+#include <utility>
+
+#include "frame_pool.h"
+
+namespace {
+
+/* Private copy of the planes, stored in buffers of the frame pool */
+class DetachedFrameData : public LibCameraFrameData
+{
+public:
+    ~DetachedFrameData()
+    {
+        for (int i = 0; i < planeCount; i++)
+            qlibcamera::FramePool::release(const_cast<uchar *>(planes[i].data));
+    }
+};
+
+} /* namespace */
+
+LibCameraFrameData::LibCameraFrameData()
+    : ref(0), lease(false), planeCount(0), sequence(0), timestamp(0), timestamps{},
+    controls(nullptr), metadata{}
+{
+}
+
+LibCameraFrameData::~LibCameraFrameData()
+{
+}
+
+void LibCameraFrameData::recycle()
+{
+    delete this;
+}
+
+LibCameraFrame::LibCameraFrame()
+    : d_(nullptr)
+{
+}
+
+LibCameraFrame::LibCameraFrame(LibCameraFrameData *data)
+    : d_(data)
+{
+    if (d_)
+        d_->ref.ref();
+}
+
+LibCameraFrame::LibCameraFrame(const LibCameraFrame &other)
+    : d_(other.d_)
+{
+    if (d_)
+        d_->ref.ref();
+}
+
+LibCameraFrame::LibCameraFrame(LibCameraFrame &&other) noexcept
+    : d_(std::exchange(other.d_, nullptr))
+{
+}
+
+LibCameraFrame::~LibCameraFrame()
+{
+    release();
+}
+
+LibCameraFrame &LibCameraFrame::operator=(const LibCameraFrame &other)
+{
+    if (d_ != other.d_) {
+        LibCameraFrame copy(other);
+        std::swap(d_, copy.d_);
+    }
+    return *this;
+}
+
+LibCameraFrame &LibCameraFrame::operator=(LibCameraFrame &&other) noexcept
+{
+    if (this != &other) {
+        release();
+        d_ = std::exchange(other.d_, nullptr);
+    }
+    return *this;
+}
+
+bool LibCameraFrame::isNull() const
+{
+    return d_ == nullptr;
+}
+
+bool LibCameraFrame::isLease() const
+{
+    return d_ && d_->lease;
+}
+
+int LibCameraFrame::planeCount() const
+{
+    return d_ ? d_->planeCount : 0;
+}
+
+const uchar *LibCameraFrame::constData(int plane) const
+{
+    return d_->planes[plane].data;
+}
+
+qsizetype LibCameraFrame::size(int plane) const
+{
+    return d_->planes[plane].size;
+}
+
+quint32 LibCameraFrame::sequence() const
+{
+    return d_ ? d_->sequence : 0;
+}
+
+quint64 LibCameraFrame::timestamp() const
+{
+    return d_ ? d_->timestamp : 0;
+}
+
+const qlibcamera::FrameTimestamps &LibCameraFrame::timestamps() const
+{
+    static const qlibcamera::FrameTimestamps none{};
+    return d_ ? d_->timestamps : none;
+}
+
+/*
+ * Decode the metadata of the frame. The ControlList of the request isn't
+ * copied, it is only looked up here, by the stages that need it.
+ */
+qlibcamera::FrameMetadata LibCameraFrame::metadata() const
+{
+    if (!d_)
+        return {};
+
+    return d_->controls ? qlibcamera::FrameMetadata::decode(*d_->controls) : d_->metadata;
+}
+
+qlibcamera::FrameInfo LibCameraFrame::info() const
+{
+    return { sequence(), timestamps(), metadata() };
+}
+
+/*
+ * Make a deep copy of the planes that does not hold on to the camera buffer.
+ */
+LibCameraFrame LibCameraFrame::detach() const
+{
+    if (!d_)
+        return LibCameraFrame();
+
+    DetachedFrameData *copy = new DetachedFrameData;
+    copy->planeCount = d_->planeCount;
+    copy->sequence = d_->sequence;
+    copy->timestamp = d_->timestamp;
+    copy->timestamps = d_->timestamps;
+    copy->metadata = metadata();
+    for (int i = 0; i < d_->planeCount; i++) {
+        uchar *data = static_cast<uchar *>(qlibcamera::FramePool::global()->allocate(d_->planes[i].size));
+        memcpy(data, d_->planes[i].data, d_->planes[i].size);
+        copy->planes[i].data = data;
+        copy->planes[i].size = d_->planes[i].size;
+    }
+
+    return LibCameraFrame(copy);
+}
+
+/*
+ * Drop this handle's reference. The last reference to a lease hands the
+ * buffer back to the camera.
+ */
+void LibCameraFrame::release()
+{
+    LibCameraFrameData *d = std::exchange(d_, nullptr);
+    if (d && !d->ref.deref())
+        d->recycle();
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QAtomicInt>
+#include <QMetaType>
+
+#include "frame_info.h"
+#include "latency_histogram.h"
+
+/**
+ * \brief Reference-counted backing store of a LibCameraFrame
+ *
+ * The base class owns nothing, subclasses either reference the mapped planes
+ * of a libcamera::FrameBuffer (a lease) or own a detached copy. recycle() is
+ * called from whichever thread drops the last reference.
+ *
+ * Frames holding their request reference its metadata in \a controls, which
+ * stays valid until the request is reused, i.e. until the frame is released.
+ * Other frames carry their metadata decoded in \a metadata.
+ */
+class LibCameraFrameData
+{
+public:
+    static constexpr int MaxPlanes = 3;
+
+    struct Plane {
+        const uchar *data = nullptr;
+        qsizetype size = 0;
+    };
+
+    LibCameraFrameData();
+    virtual ~LibCameraFrameData();
+
+    virtual void recycle();
+
+    QAtomicInt ref;
+    bool lease;
+    int planeCount;
+    Plane planes[MaxPlanes];
+    quint32 sequence;
+    quint64 timestamp;
+    qlibcamera::FrameTimestamps timestamps;
+    const libcamera::ControlList *controls;
+    qlibcamera::FrameMetadata metadata;
+};
+
+/**
+ * \brief Handle to the planes of a captured frame
+ *
+ * Copying a LibCameraFrame is cheap and never touches pixel data. As long as
+ * a handle to a leased frame exists, the camera buffer is not requeued, so
+ * consumers holding frames for a long time should call detach() to get a
+ * private copy and drop the lease.
+ */
+class LibCameraFrame
+{
+public:
+    LibCameraFrame();
+    explicit LibCameraFrame(LibCameraFrameData *data);
+    LibCameraFrame(const LibCameraFrame &other);
+    LibCameraFrame(LibCameraFrame &&other) noexcept;
+    ~LibCameraFrame();
+
+    LibCameraFrame &operator=(const LibCameraFrame &other);
+    LibCameraFrame &operator=(LibCameraFrame &&other) noexcept;
+
+    bool isNull() const;
+    bool isLease() const;
+
+    int planeCount() const;
+    const uchar *constData(int plane) const;
+    qsizetype size(int plane) const;
+    quint32 sequence() const;
+    quint64 timestamp() const;
+    const qlibcamera::FrameTimestamps &timestamps() const;
+    qlibcamera::FrameMetadata metadata() const;
+    qlibcamera::FrameInfo info() const;
+
+    LibCameraFrame detach() const;
+    void release();
+
+private:
+    LibCameraFrameData *d_;
+};
+
+Q_DECLARE_METATYPE(LibCameraFrame)
+Q_DECLARE_METATYPE(qlibcamera::FrameTimestamps)
+Q_DECLARE_METATYPE(qlibcamera::FrameInfo)
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <functional>
+
+#include <QAtomicInteger>
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QObject>
+#include <QQueue>
+
+namespace qlibcamera {
+
+    enum class MailboxPolicy {
+        DropOldest,     /* Keep the newest capacity items */
+        LatestWins,     /* Keep only the newest item */
+        BlockCapture,   /* Never drop, leased frames hold the camera back */
+    };
+
+}
+
+/**
+ * \brief Bounded hand-off of items from a producer to a consumer thread
+ *
+ * Unlike a queued signal connection, the mailbox never grows past its
+ * capacity: depending on the policy, the oldest items are dropped when the
+ * consumer falls behind. The consumer is woken up once per batch, and drains
+ * every pending item in the context of the consumer QObject's thread.
+ *
+ * With MailboxPolicy::BlockCapture nothing is dropped. Posted frames keep
+ * their request leased, so a slow consumer ends up holding back the camera
+ * instead of losing frames.
+ */
+template<typename T>
+class LibCameraMailbox
+{
+public:
+    LibCameraMailbox(QObject *consumer, std::function<void(T)> handler,
+                     qlibcamera::MailboxPolicy policy = qlibcamera::MailboxPolicy::DropOldest,
+                     qsizetype capacity = 2)
+        : consumer_(consumer), handler_(std::move(handler)), policy_(policy),
+        capacity_(capacity), wakeupPending_(false), dropped_(0)
+    {
+        queue_.reserve(capacity_ + 1);
+    }
+
+    qlibcamera::MailboxPolicy policy() const
+    {
+        QMutexLocker locker(&mutex_);
+        return policy_;
+    }
+
+    void setPolicy(qlibcamera::MailboxPolicy policy)
+    {
+        QMutexLocker locker(&mutex_);
+        policy_ = policy;
+    }
+
+    qsizetype capacity() const
+    {
+        QMutexLocker locker(&mutex_);
+        return capacity_;
+    }
+
+    void setCapacity(qsizetype capacity)
+    {
+        QMutexLocker locker(&mutex_);
+        capacity_ = qMax<qsizetype>(capacity, 1);
+        queue_.reserve(capacity_ + 1);
+    }
+
+    quint64 dropped() const
+    {
+        return dropped_.loadRelaxed();
+    }
+
+    /*
+     * Post an item from the producer thread. Returns false if an older item
+     * had to be dropped to make room.
+     */
+    bool post(T item)
+    {
+        bool kept = true;
+        QMutexLocker locker(&mutex_);
+
+        qsizetype limit = policy_ == qlibcamera::MailboxPolicy::LatestWins ? 1 : capacity_;
+        if (policy_ != qlibcamera::MailboxPolicy::BlockCapture) {
+            while (queue_.size() >= limit) {
+                queue_.dequeue();
+                dropped_.fetchAndAddRelaxed(1);
+                kept = false;
+            }
+        }
+
+        queue_.enqueue(std::move(item));
+
+        if (!wakeupPending_) {
+            wakeupPending_ = true;
+            QMetaObject::invokeMethod(consumer_, [this]() { drain(); }, Qt::QueuedConnection);
+        }
+
+        return kept;
+    }
+
+    /* Drop pending items, e.g. when capture stops. */
+    void clear()
+    {
+        QMutexLocker locker(&mutex_);
+        queue_.clear();
+    }
+
+private:
+    void drain()
+    {
+        for (;;) {
+            T item;
+            {
+                QMutexLocker locker(&mutex_);
+                if (queue_.isEmpty()) {
+                    wakeupPending_ = false;
+                    return;
+                }
+
+                item = queue_.dequeue();
+            }
+
+            handler_(std::move(item));
+        }
+    }
+
+    QObject *consumer_;
+    std::function<void(T)> handler_;
+
+    mutable QMutex mutex_; /* Protects everything below but dropped_ */
+    QQueue<T> queue_;
+    qlibcamera::MailboxPolicy policy_;
+    qsizetype capacity_;
+    bool wakeupPending_;
+
+    QAtomicInteger<quint64> dropped_;
+};
@@ -0,0 +1,135 @@
+#include "qlibcamerareplay.h"
+
+#include <string.h>
+
+#include <QtDebug>
+
+#include "qlibcameraworker.h"
+
+LibCameraReplay::LibCameraReplay(QObject *parent)
+    : LibCameraSource{parent}, speed_(Original), loop_(false), bufferCount_(0)
+{
+    LibCameraThread *sourceThread = LibCameraThread::acquire("source");
+
+    worker_ = new LibCameraReplayWorker();
+    worker_->moveToThread(sourceThread);
+    connect(this, &QObject::destroyed, sourceThread, [sourceThread, worker = worker_]() {
+        worker->deleteLater();
+        LibCameraThread::release(sourceThread);
+    });
+
+    /* Frames are handed over from the worker thread. */
+    connect(worker_, &LibCameraReplayWorker::frameCompleted,
+            this, &LibCameraSource::frameCompleted, Qt::DirectConnection);
+    connect(worker_, &LibCameraReplayWorker::finished, this, &LibCameraReplay::finished);
+}
+
+LibCameraReplay::~LibCameraReplay()
+{
+    stop();
+}
+
+/*
+ * The file dictates format, size and stride, the requested ones are
+ * overridden. The file is (re)opened on every configuration.
+ */
+int LibCameraReplay::configure(Configuration &config)
+{
+    int ret;
+
+    QMetaObject::invokeMethod(worker_, [&]() {
+        ret = worker_->open(file_);
+        if (ret < 0)
+            return;
+
+        config.format = worker_->format();
+        config.size = worker_->size();
+        config.stride = worker_->stride();
+        config.frameSize = worker_->frameSize();
+    }, Qt::BlockingQueuedConnection);
+
+    if (ret < 0) {
+        qWarning() << "Failed to open raw capture" << file_ << ":" << strerror(-ret);
+        return ret;
+    }
+
+    if (!config.bufferCount)
+        config.bufferCount = LibCameraReplayWorker::DefaultBufferCount;
+
+    bufferCount_ = config.bufferCount;
+
+    return 0;
+}
+
+int LibCameraReplay::start()
+{
+    QMetaObject::invokeMethod(worker_, [worker = worker_, maximumSpeed = speed_ == Maximum,
+                                        loop = loop_, bufferCount = bufferCount_]() {
+        worker->start(maximumSpeed, loop, bufferCount);
+    }, Qt::BlockingQueuedConnection);
+
+    return 0;
+}
+
+void LibCameraReplay::stop()
+{
+    QMetaObject::invokeMethod(worker_, [worker = worker_]() {
+        worker->stop();
+    }, Qt::BlockingQueuedConnection);
+}
+
+/* Frame timing comes from the file. */
+void LibCameraReplay::setFps(qint32 fps)
+{
+    Q_UNUSED(fps);
+}
+
+QString LibCameraReplay::file() const
+{
+    return file_;
+}
+
+/* Takes effect with the next configuration, i.e. when the camera restarts. */
+void LibCameraReplay::setFile(const QString &newFile)
+{
+    if (file_ == newFile)
+        return;
+    file_ = newFile;
+    Q_EMIT fileChanged();
+}
+
+LibCameraReplay::Speed LibCameraReplay::speed() const
+{
+    return speed_;
+}
+
+void LibCameraReplay::setSpeed(Speed newSpeed)
+{
+    if (speed_ == newSpeed)
+        return;
+    speed_ = newSpeed;
+    Q_EMIT speedChanged();
+}
+
+bool LibCameraReplay::loop() const
+{
+    return loop_;
+}
+
+void LibCameraReplay::setLoop(bool newLoop)
+{
+    if (loop_ == newLoop)
+        return;
+    loop_ = newLoop;
+    Q_EMIT loopChanged();
+}
+
+quint64 LibCameraReplay::framesReplayed() const
+{
+    return worker_->framesReplayed();
+}
+
+quint64 LibCameraReplay::framesDropped() const
+{
+    return worker_->framesDropped();
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <QObject>
+#include <QQmlEngine>
+#include <QString>
+
+#include "qlibcamerasource.h"
+
+class LibCameraReplayWorker;
+
+/**
+ * \brief Replays a raw capture file as a camera
+ *
+ * Frames recorded with LibCamera.RawCapture are served straight from the
+ * mapped file, in their recorded format and size, either at their recorded
+ * pace or as fast as the pipeline releases them. This makes captures
+ * reproducible inputs for the processing, view and recording path:
+ * \code
+ *     LibCamera {
+ *         source: LibCameraReplay { file: "1700000000000.qlcraw"; loop: true }
+ *         enabled: true
+ *     }
+ * \endcode
+ */
+class LibCameraReplay : public LibCameraSource
+{
+    Q_OBJECT
+    Q_PROPERTY(QString file READ file WRITE setFile NOTIFY fileChanged FINAL)
+    Q_PROPERTY(Speed speed READ speed WRITE setSpeed NOTIFY speedChanged FINAL)
+    Q_PROPERTY(bool loop READ loop WRITE setLoop NOTIFY loopChanged FINAL)
+    Q_PROPERTY(quint64 framesReplayed READ framesReplayed CONSTANT FINAL)
+    Q_PROPERTY(quint64 framesDropped READ framesDropped CONSTANT FINAL)
+    QML_ELEMENT
+public:
+    enum Speed {
+        Original,   /* Recorded frame intervals, frames are dropped if buffers run out */
+        Maximum,    /* Next frame as soon as a buffer is released */
+    };
+    Q_ENUM(Speed)
+
+    explicit LibCameraReplay(QObject *parent = nullptr);
+    ~LibCameraReplay();
+
+    int configure(Configuration &config) override;
+    int start() override;
+    void stop() override;
+    void setFps(qint32 fps) override;
+
+    QString file() const;
+    void setFile(const QString &newFile);
+
+    Speed speed() const;
+    void setSpeed(Speed newSpeed);
+
+    bool loop() const;
+    void setLoop(bool newLoop);
+
+    quint64 framesReplayed() const;
+    quint64 framesDropped() const;
+
+Q_SIGNALS:
+    void fileChanged();
+    void speedChanged();
+    void loopChanged();
+    void finished();
+
+private:
+    LibCameraReplayWorker *worker_;
+    QString file_;
+    Speed speed_;
+    bool loop_;
+    unsigned int bufferCount_;
+};
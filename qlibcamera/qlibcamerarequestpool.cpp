@@ -0,0 +1,205 @@
+#include "qlibcamerarequestpool.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <utility>
+
+#include <QCoreApplication>
+#include <QMutexLocker>
+
+unsigned int LibCameraBufferMap::add(const libcamera::Stream *stream, libcamera::FrameBuffer *buffer,
+                                     std::unique_ptr<qlibcamera::Image> image)
+{
+    unsigned int index = buffers_.size();
+
+    buffer->setCookie(index);
+    buffers_.push_back({ stream, buffer, std::move(image), 0, 0 });
+
+    return index;
+}
+
+LibCameraBufferMap::Buffer &LibCameraBufferMap::at(const libcamera::FrameBuffer *buffer)
+{
+    return at(buffer->cookie());
+}
+
+LibCameraBufferMap::Buffer &LibCameraBufferMap::at(unsigned int index)
+{
+    assert(index < buffers_.size());
+    return buffers_[index];
+}
+
+unsigned int LibCameraBufferMap::size() const
+{
+    return buffers_.size();
+}
+
+/*
+ * One lease per buffer. The lease keeps the pool alive only while it is
+ * referenced, so an idle pool can be destroyed with its requests.
+ */
+class LibCameraRequestPool::Lease : public LibCameraFrameData
+{
+public:
+    Lease(const libcamera::Stream *stream, libcamera::FrameBuffer *buffer)
+        : stream_(stream), buffer_(buffer), request_(nullptr)
+    {
+        lease = true;
+    }
+
+    void recycle() override
+    {
+        std::shared_ptr<LibCameraRequestPool> pool = std::move(pool_);
+        pool->release(this);
+    }
+
+    const libcamera::Stream *stream_;
+    libcamera::FrameBuffer *buffer_;
+    libcamera::Request *request_; /* Held back by this lease, if any */
+    std::shared_ptr<LibCameraRequestPool> pool_;
+};
+
+LibCameraRequestPool::LibCameraRequestPool(QObject *receiver, std::shared_ptr<LibCameraBufferMap> buffers)
+    : receiver_(receiver), leased_(0), buffers_(std::move(buffers))
+{
+    for (unsigned int i = 0; i < buffers_->size(); i++) {
+        const LibCameraBufferMap::Buffer &buffer = buffers_->at(i);
+        leases_.push_back(std::make_unique<Lease>(buffer.stream, buffer.buffer));
+    }
+}
+
+LibCameraRequestPool::~LibCameraRequestPool()
+{
+    /* Requests reference the buffers, release them first. */
+    requests_.clear();
+    pending_.clear();
+    leases_.clear();
+}
+
+LibCameraBufferMap *LibCameraRequestPool::buffers() const
+{
+    return buffers_.get();
+}
+
+/*
+ * Requests must be created with consecutive cookies starting at 0, their
+ * cookie indexes the per-request state.
+ */
+libcamera::Request *LibCameraRequestPool::addRequest(std::unique_ptr<libcamera::Request> request)
+{
+    libcamera::Request *req = request.get();
+
+    assert(req->cookie() == requests_.size());
+    pending_.push_back(std::make_unique<std::atomic<int>>(0));
+    requests_.push_back(std::move(request));
+
+    return req;
+}
+
+const std::vector<std::unique_ptr<libcamera::Request>> &LibCameraRequestPool::requests() const
+{
+    return requests_;
+}
+
+/*
+ * Hand out the planes of a completed buffer. Must be called from the
+ * receiver's thread, once per completed buffer.
+ *
+ * If \a request is given, it is held back until every buffer leased with it
+ * has been released. Callers must keep the first frame of a request alive
+ * until all of its buffers have been leased. Without a request, the buffer is
+ * handed back on its own through takeReleasedBuffers().
+ *
+ * \a metadata is that of the completed request. Frames holding the request
+ * reference it, others get it decoded as the request may be reused first.
+ */
+LibCameraFrame LibCameraRequestPool::lease(libcamera::Request *request,
+                                           libcamera::FrameBuffer *buffer,
+                                           quint64 timestamp,
+                                           const qlibcamera::FrameTimestamps &timestamps,
+                                           const libcamera::ControlList &metadata)
+{
+    LibCameraBufferMap::Buffer &mapped = buffers_->at(buffer);
+    Lease *lease = leases_[buffer->cookie()].get();
+    const libcamera::FrameMetadata &bufferMetadata = buffer->metadata();
+
+    assert(lease->ref.loadRelaxed() == 0);
+
+    lease->planeCount = std::min<int>(bufferMetadata.planes().size(), LibCameraFrameData::MaxPlanes);
+    for (int i = 0; i < lease->planeCount; i++) {
+        lease->planes[i].data = mapped.image->data(i).data();
+        lease->planes[i].size = bufferMetadata.planes()[i].bytesused;
+    }
+    lease->sequence = bufferMetadata.sequence;
+    lease->timestamp = timestamp;
+    lease->timestamps = timestamps;
+    lease->controls = request ? &metadata : nullptr;
+    lease->metadata = request ? qlibcamera::FrameMetadata{} : qlibcamera::FrameMetadata::decode(metadata);
+    lease->request_ = request;
+    lease->pool_ = shared_from_this();
+
+    mapped.completed++;
+    mapped.sequence = bufferMetadata.sequence;
+
+    if (request && (*pending_[request->cookie()])++ == 0)
+        leased_++;
+
+    return LibCameraFrame(lease);
+}
+
+QList<libcamera::Request *> LibCameraRequestPool::takeReleased()
+{
+    QMutexLocker locker(&mutex_);
+    return std::exchange(released_, {});
+}
+
+QList<LibCameraRequestPool::StreamBuffer> LibCameraRequestPool::takeReleasedBuffers()
+{
+    QMutexLocker locker(&mutex_);
+    return std::exchange(releasedBuffers_, {});
+}
+
+/*
+ * Number of requests currently held by consumers.
+ */
+int LibCameraRequestPool::leased() const
+{
+    return leased_;
+}
+
+/*
+ * Detach the pool from its receiver. Requests and buffers released
+ * afterwards are not handed back.
+ */
+void LibCameraRequestPool::close()
+{
+    QMutexLocker locker(&mutex_);
+    receiver_ = nullptr;
+    released_.clear();
+    releasedBuffers_.clear();
+}
+
+void LibCameraRequestPool::release(Lease *lease)
+{
+    libcamera::Request *request = std::exchange(lease->request_, nullptr);
+
+    if (request) {
+        if (--(*pending_[request->cookie()]) != 0)
+            return;
+
+        leased_--;
+    }
+
+    QMutexLocker locker(&mutex_);
+    if (!receiver_)
+        return;
+
+    if (request)
+        released_.append(request);
+    else
+        releasedBuffers_.append({ lease->stream_, lease->buffer_ });
+
+    /* Coalesce wakeups, the receiver drains everything released at once. */
+    if (released_.size() + releasedBuffers_.size() == 1)
+        QCoreApplication::postEvent(receiver_, new ReleaseEvent);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <libcamera/framebuffer.h>
+#include <libcamera/request.h>
+#include <libcamera/stream.h>
+
+#include <QEvent>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+
+#include "common/image.h"
+#include "qlibcameraframe.h"
+
+/**
+ * \brief Mapped buffers of an allocation, indexed by buffer cookie
+ *
+ * Buffers get dense indices when they are added, stored in their cookie, so
+ * that mappings and per-buffer statistics are looked up in O(1) from a
+ * completed FrameBuffer. The map lives as long as the allocation, which may
+ * span several capture sessions.
+ */
+class LibCameraBufferMap
+{
+public:
+    struct Buffer {
+        const libcamera::Stream *stream;
+        libcamera::FrameBuffer *buffer;
+        std::unique_ptr<qlibcamera::Image> image;
+
+        /* Statistics, only touched from the capture thread */
+        uint64_t completed;
+        unsigned int sequence;
+    };
+
+    unsigned int add(const libcamera::Stream *stream, libcamera::FrameBuffer *buffer,
+                     std::unique_ptr<qlibcamera::Image> image);
+
+    Buffer &at(const libcamera::FrameBuffer *buffer);
+    Buffer &at(unsigned int index);
+    unsigned int size() const;
+
+private:
+    std::vector<Buffer> buffers_;
+};
+
+/**
+ * \brief Requests and frame leases of one capture session
+ *
+ * Frames handed to consumers reference the mapped buffers directly. The pool
+ * keeps track of which requests are still leased and posts a ReleaseEvent to
+ * the receiver once a request has been released by every consumer of every
+ * stream, so that it can be requeued on the receiver's thread.
+ *
+ * Buffers of on-demand streams (stills, raw) can be leased on their own. They
+ * don't hold back their request, and are handed back separately once
+ * released, so a slow still or raw consumer never stalls the viewfinder.
+ *
+ * The pool and its buffer map outlive the capture session for as long as
+ * frames are leased, so consumers never see unmapped memory even if the
+ * camera is stopped under them.
+ */
+class LibCameraRequestPool : public std::enable_shared_from_this<LibCameraRequestPool>
+{
+public:
+    class ReleaseEvent : public QEvent
+    {
+    public:
+        ReleaseEvent()
+            : QEvent(type())
+        {
+        }
+
+        static Type type()
+        {
+            static int type = QEvent::registerEventType();
+            return static_cast<Type>(type);
+        }
+    };
+
+    using StreamBuffer = std::pair<const libcamera::Stream *, libcamera::FrameBuffer *>;
+
+    LibCameraRequestPool(QObject *receiver, std::shared_ptr<LibCameraBufferMap> buffers);
+    ~LibCameraRequestPool();
+
+    LibCameraBufferMap *buffers() const;
+
+    libcamera::Request *addRequest(std::unique_ptr<libcamera::Request> request);
+    const std::vector<std::unique_ptr<libcamera::Request>> &requests() const;
+
+    LibCameraFrame lease(libcamera::Request *request, libcamera::FrameBuffer *buffer,
+                         quint64 timestamp, const qlibcamera::FrameTimestamps &timestamps,
+                         const libcamera::ControlList &metadata);
+    QList<libcamera::Request *> takeReleased();
+    QList<StreamBuffer> takeReleasedBuffers();
+
+    int leased() const;
+    void close();
+
+private:
+    class Lease;
+
+    void release(Lease *lease);
+
+    QObject *receiver_;
+    QMutex mutex_; /* Protects receiver_, released_ and releasedBuffers_ */
+    QList<libcamera::Request *> released_;
+    QList<StreamBuffer> releasedBuffers_;
+    std::atomic<int> leased_;
+
+    std::shared_ptr<LibCameraBufferMap> buffers_;
+
+    /* Indexed by buffer and request cookie respectively */
+    std::vector<std::unique_ptr<Lease>> leases_;
+    std::vector<std::unique_ptr<std::atomic<int>>> pending_;
+    std::vector<std::unique_ptr<libcamera::Request>> requests_;
+};
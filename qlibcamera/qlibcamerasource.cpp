@@ -0,0 +1,10 @@
+#include "qlibcamerasource.h"
+
+LibCameraSource::LibCameraSource(QObject *parent)
+    : QObject{parent}
+{
+}
+
+LibCameraSource::~LibCameraSource()
+{
+}
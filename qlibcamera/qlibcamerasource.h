@@ -0,0 +1,48 @@
+#pragma once
+
+#include <QObject>
+#include <QQmlEngine>
+#include <QSize>
+
+#include <libcamera/pixel_format.h>
+
+#include "qlibcameraframe.h"
+
+/**
+ * \brief Producer of viewfinder frames in place of a camera
+ *
+ * A LibCamera with a source set captures from it instead of a libcamera
+ * camera. Frames go through the same processing, view, recording and sync
+ * path as camera frames, which makes that path usable without a sensor.
+ *
+ * The calls mirror the camera's: configure() adjusts and completes the
+ * configuration, start() and stop() are synchronous, and no frame is
+ * completed outside of them. frameCompleted() is emitted from the thread
+ * producing the frames and must be connected directly.
+ */
+class LibCameraSource : public QObject
+{
+    Q_OBJECT
+    QML_ELEMENT
+    QML_UNCREATABLE("LibCameraSource is an interface")
+public:
+    struct Configuration {
+        libcamera::PixelFormat format;
+        QSize size;
+        qint32 fps;
+        unsigned int bufferCount;
+        unsigned int stride; /* Set by configure() */
+        size_t frameSize;    /* Set by configure(), largest frame in bytes */
+    };
+
+    explicit LibCameraSource(QObject *parent = nullptr);
+    virtual ~LibCameraSource();
+
+    virtual int configure(Configuration &config) = 0;
+    virtual int start() = 0;
+    virtual void stop() = 0;
+    virtual void setFps(qint32 fps) = 0;
+
+Q_SIGNALS:
+    void frameCompleted(LibCameraFrame frame);
+};
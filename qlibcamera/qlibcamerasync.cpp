@@ -0,0 +1,194 @@
+#include "qlibcamerasync.h"
+
+#include <QtDebug>
+
+#include "qlibcamera.h"
+#include "qlibcameraworker.h"
+
+LibCameraSync::LibCameraSync(QObject *parent)
+    : QObject{parent}, tolerance_(1000), setsCompleted_(0), framesDropped_(0), lastSkew_(0),
+    mailbox_(nullptr)
+{
+    initSyncWorker();
+}
+
+LibCameraSync::~LibCameraSync()
+{
+    detach();
+}
+
+void LibCameraSync::initSyncWorker()
+{
+    LibCameraThread *syncThread = LibCameraThread::acquire("sync");
+
+    LibCameraSyncWorker *syncWorker = new LibCameraSyncWorker();
+    syncWorker->moveToThread(syncThread);
+    connect(this, &QObject::destroyed, syncThread, [syncThread, syncWorker]() {
+        syncWorker->deleteLater();
+        LibCameraThread::release(syncThread);
+    });
+    connect(this, &LibCameraSync::formatChanged, syncWorker, &LibCameraSyncWorker::onFormatChanged);
+    connect(syncWorker, &LibCameraSyncWorker::completed, this, &LibCameraSync::frameSetCompleted);
+    mailbox_ = syncWorker->mailbox();
+}
+
+QList<LibCamera *> LibCameraSync::cameras() const
+{
+    return cameras_;
+}
+
+void LibCameraSync::setCameras(const QList<LibCamera *> &newCameras)
+{
+    if (cameras_ == newCameras)
+        return;
+
+    detach();
+    attach(newCameras);
+
+    Q_EMIT camerasChanged();
+}
+
+qint32 LibCameraSync::tolerance() const
+{
+    return tolerance_;
+}
+
+void LibCameraSync::setTolerance(qint32 newTolerance)
+{
+    if (tolerance_ == newTolerance)
+        return;
+    tolerance_ = newTolerance;
+    Q_EMIT toleranceChanged();
+}
+
+quint64 LibCameraSync::setsCompleted() const
+{
+    return setsCompleted_;
+}
+
+quint64 LibCameraSync::framesDropped() const
+{
+    return framesDropped_;
+}
+
+qint32 LibCameraSync::lastSkew() const
+{
+    return lastSkew_;
+}
+
+/*
+ * Called by the cameras for each viewfinder frame. All cameras live in the
+ * GUI thread, so matching doesn't need any locking.
+ */
+void LibCameraSync::post(qint32 index, const LibCameraFrame &frame)
+{
+    if (index < 0 || static_cast<size_t>(index) >= pending_.size())
+        return;
+
+    std::deque<LibCameraFrame> &pending = pending_[index];
+    pending.push_back(frame);
+    if (static_cast<qsizetype>(pending.size()) > MaxPending) {
+        pending.pop_front();
+        framesDropped_++;
+    }
+
+    match();
+}
+
+quint64 LibCameraSync::timestamp(const LibCameraFrame &frame)
+{
+    const qlibcamera::FrameTimestamps &timestamps = frame.timestamps();
+    return timestamps.sensor ? timestamps.sensor : timestamps.requestComplete;
+}
+
+/*
+ * Attach the cameras in order, their position is their index in the frame
+ * sets. Cameras already capturing are restarted to report their format.
+ */
+void LibCameraSync::attach(const QList<LibCamera *> &cameras)
+{
+    cameras_ = cameras;
+    pending_.assign(cameras_.size(), {});
+
+    for (qsizetype i = 0; i < cameras_.size(); i++) {
+        LibCamera *camera = cameras_[i];
+
+        connections_.append(connect(camera, &LibCamera::processFormatChanged, this,
+            [this, i](const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                      const std::optional<libcamera::ColorSpace> &colorSpace) {
+                Q_EMIT formatChanged(i, format, size, stride, colorSpace);
+            }));
+        connections_.append(connect(camera, &QObject::destroyed, this, [this, camera]() {
+            cameras_.removeAll(camera);
+            QList<LibCamera *> cameras = cameras_;
+
+            detach();
+            attach(cameras);
+
+            Q_EMIT camerasChanged();
+        }));
+
+        camera->setSync(this, i);
+    }
+}
+
+void LibCameraSync::detach()
+{
+    for (const QMetaObject::Connection &connection : connections_)
+        disconnect(connection);
+    connections_.clear();
+
+    for (LibCamera *camera : cameras_)
+        camera->setSync(nullptr, -1);
+
+    pending_.clear();
+    mailbox_->clear();
+}
+
+/*
+ * Emit frame sets while every camera has a frame pending. The oldest frames
+ * are dropped until all heads lie within the tolerance of the newest one.
+ */
+void LibCameraSync::match()
+{
+    const quint64 tolerance = static_cast<quint64>(tolerance_) * 1000;
+
+    if (pending_.empty())
+        return;
+
+    for (;;) {
+        quint64 newest = 0;
+        for (const std::deque<LibCameraFrame> &pending : pending_) {
+            if (pending.empty())
+                return;
+            newest = qMax(newest, timestamp(pending.front()));
+        }
+
+        bool dropped = false;
+        for (std::deque<LibCameraFrame> &pending : pending_) {
+            while (!pending.empty() && timestamp(pending.front()) + tolerance < newest) {
+                pending.pop_front();
+                framesDropped_++;
+                dropped = true;
+            }
+        }
+
+        if (dropped)
+            continue;
+
+        LibCameraFrameSet frameSet;
+        frameSet.timestamp = newest;
+        for (std::deque<LibCameraFrame> &pending : pending_) {
+            frameSet.timestamp = qMin(frameSet.timestamp, timestamp(pending.front()));
+            frameSet.frames.append(std::move(pending.front()));
+            pending.pop_front();
+        }
+        frameSet.skew = newest - frameSet.timestamp;
+
+        setsCompleted_++;
+        lastSkew_ = frameSet.skew / 1000;
+
+        Q_EMIT frameSetReady(frameSet.timestamp, frameSet.skew);
+        mailbox_->post(std::move(frameSet));
+    }
+}
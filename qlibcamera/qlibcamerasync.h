@@ -0,0 +1,86 @@
+#pragma once
+
+#include <QImage>
+#include <QList>
+#include <QObject>
+#include <QQmlEngine>
+
+#include <deque>
+#include <optional>
+#include <vector>
+
+#include <libcamera/color_space.h>
+
+#include "qlibcameraframe.h"
+#include "qlibcameramailbox.h"
+
+class LibCamera;
+struct LibCameraFrameSet;
+
+/**
+ * \brief Groups the frames of several cameras by sensor timestamp
+ *
+ * Every camera of the set posts its viewfinder frames here. Frames whose
+ * sensor timestamps lie within the tolerance of each other form a frame set,
+ * which is handed to a LibCameraSyncWorker for multi-view processing. Frames
+ * that can't be matched any more are dropped, so a stalled camera never holds
+ * back the requests of the others for long.
+ */
+class LibCameraSync : public QObject
+{
+    Q_OBJECT
+    Q_MOC_INCLUDE("qlibcamera.h")
+    Q_PROPERTY(QList<LibCamera *> cameras READ cameras WRITE setCameras NOTIFY camerasChanged FINAL)
+    Q_PROPERTY(qint32 tolerance READ tolerance WRITE setTolerance NOTIFY toleranceChanged FINAL)
+    Q_PROPERTY(quint64 setsCompleted READ setsCompleted CONSTANT FINAL)
+    Q_PROPERTY(quint64 framesDropped READ framesDropped CONSTANT FINAL)
+    Q_PROPERTY(qint32 lastSkew READ lastSkew CONSTANT FINAL)
+    QML_ELEMENT
+public:
+    /* Frames kept per camera while waiting for the others */
+    static constexpr qsizetype MaxPending = 4;
+
+    explicit LibCameraSync(QObject *parent = nullptr);
+    virtual ~LibCameraSync();
+
+    virtual void initSyncWorker();
+
+    QList<LibCamera *> cameras() const;
+    void setCameras(const QList<LibCamera *> &newCameras);
+
+    qint32 tolerance() const;
+    void setTolerance(qint32 newTolerance);
+
+    quint64 setsCompleted() const;
+    quint64 framesDropped() const;
+    qint32 lastSkew() const;
+
+    void post(qint32 index, const LibCameraFrame &frame);
+
+Q_SIGNALS:
+    void camerasChanged();
+    void toleranceChanged();
+
+    void formatChanged(qint32 index, const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                       const std::optional<libcamera::ColorSpace> &colorSpace);
+    void frameSetReady(quint64 timestamp, quint64 skew);
+    void frameSetCompleted(QList<QImage> images, quint64 timestamp);
+
+private:
+    static quint64 timestamp(const LibCameraFrame &frame);
+
+    void attach(const QList<LibCamera *> &cameras);
+    void detach();
+    void match();
+
+    QList<LibCamera *> cameras_;
+    QList<QMetaObject::Connection> connections_;
+    std::vector<std::deque<LibCameraFrame>> pending_;
+
+    qint32 tolerance_;
+    quint64 setsCompleted_;
+    quint64 framesDropped_;
+    qint32 lastSkew_;
+
+    LibCameraMailbox<LibCameraFrameSet> *mailbox_;
+};
@@ -0,0 +1,108 @@
+#include "qlibcameratestpattern.h"
+
+#include <QtDebug>
+
+#include "qlibcameraworker.h"
+
+LibCameraTestPattern::LibCameraTestPattern(QObject *parent)
+    : LibCameraSource{parent}, pattern_(ColorBars), fps_(15), bufferCount_(0)
+{
+    LibCameraThread *sourceThread = LibCameraThread::acquire("source");
+
+    worker_ = new LibCameraTestPatternWorker();
+    worker_->moveToThread(sourceThread);
+    connect(this, &QObject::destroyed, sourceThread, [sourceThread, worker = worker_]() {
+        worker->deleteLater();
+        LibCameraThread::release(sourceThread);
+    });
+
+    /* Frames are handed over from the worker thread. */
+    connect(worker_, &LibCameraTestPatternWorker::frameCompleted,
+            this, &LibCameraSource::frameCompleted, Qt::DirectConnection);
+}
+
+LibCameraTestPattern::~LibCameraTestPattern()
+{
+    stop();
+}
+
+/*
+ * The worker only runs on its thread, calls block until it is done so that
+ * the source behaves synchronously, as a camera does.
+ */
+int LibCameraTestPattern::configure(Configuration &config)
+{
+    int ret;
+
+    QMetaObject::invokeMethod(worker_, [&]() {
+        ret = worker_->configure(config.format, config.size,
+                                 static_cast<qlibcamera::TestPattern::Pattern>(pattern_));
+        config.stride = worker_->stride();
+        config.frameSize = worker_->frameSize();
+    }, Qt::BlockingQueuedConnection);
+
+    if (ret < 0) {
+        qWarning() << "Test pattern does not support" << config.format.toString().c_str()
+                   << "at" << config.size;
+        return ret;
+    }
+
+    if (!config.bufferCount)
+        config.bufferCount = LibCameraTestPatternWorker::DefaultBufferCount;
+
+    fps_ = config.fps;
+    bufferCount_ = config.bufferCount;
+
+    return 0;
+}
+
+int LibCameraTestPattern::start()
+{
+    QMetaObject::invokeMethod(worker_, [worker = worker_, fps = fps_, bufferCount = bufferCount_]() {
+        worker->start(fps, bufferCount);
+    }, Qt::BlockingQueuedConnection);
+
+    return 0;
+}
+
+void LibCameraTestPattern::stop()
+{
+    QMetaObject::invokeMethod(worker_, [worker = worker_]() {
+        worker->stop();
+    }, Qt::BlockingQueuedConnection);
+}
+
+void LibCameraTestPattern::setFps(qint32 fps)
+{
+    fps_ = fps;
+    QMetaObject::invokeMethod(worker_, [worker = worker_, fps]() {
+        worker->setFps(fps);
+    }, Qt::QueuedConnection);
+}
+
+LibCameraTestPattern::Pattern LibCameraTestPattern::pattern() const
+{
+    return pattern_;
+}
+
+void LibCameraTestPattern::setPattern(Pattern newPattern)
+{
+    if (pattern_ == newPattern)
+        return;
+    pattern_ = newPattern;
+    Q_EMIT patternChanged();
+
+    QMetaObject::invokeMethod(worker_, [worker = worker_, newPattern]() {
+        worker->setPattern(static_cast<qlibcamera::TestPattern::Pattern>(newPattern));
+    }, Qt::QueuedConnection);
+}
+
+quint64 LibCameraTestPattern::framesGenerated() const
+{
+    return worker_->framesGenerated();
+}
+
+quint64 LibCameraTestPattern::framesDropped() const
+{
+    return worker_->framesDropped();
+}
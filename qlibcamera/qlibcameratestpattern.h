@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QObject>
+#include <QQmlEngine>
+
+#include "qlibcamerasource.h"
+
+class LibCameraTestPatternWorker;
+
+/**
+ * \brief Synthetic camera rendering moving test patterns
+ *
+ * Produces frames in any of the formats of LibCamera, at the configured size
+ * and rate, with sensor timestamps spaced as a free-running sensor would.
+ * Frames are rendered on a shared worker thread, so the capture pipeline can
+ * be measured and exercised without camera hardware:
+ * \code
+ *     LibCamera {
+ *         source: LibCameraTestPattern { pattern: LibCameraTestPattern.ColorBars }
+ *         format: LibCamera.Format_NV12
+ *         enabled: true
+ *     }
+ * \endcode
+ */
+class LibCameraTestPattern : public LibCameraSource
+{
+    Q_OBJECT
+    Q_PROPERTY(Pattern pattern READ pattern WRITE setPattern NOTIFY patternChanged FINAL)
+    Q_PROPERTY(quint64 framesGenerated READ framesGenerated CONSTANT FINAL)
+    Q_PROPERTY(quint64 framesDropped READ framesDropped CONSTANT FINAL)
+    QML_ELEMENT
+public:
+    enum Pattern {
+        ColorBars,
+        Gradient,
+        Checkerboard,
+    };
+    Q_ENUM(Pattern)
+
+    explicit LibCameraTestPattern(QObject *parent = nullptr);
+    ~LibCameraTestPattern();
+
+    int configure(Configuration &config) override;
+    int start() override;
+    void stop() override;
+    void setFps(qint32 fps) override;
+
+    Pattern pattern() const;
+    void setPattern(Pattern newPattern);
+
+    quint64 framesGenerated() const;
+    quint64 framesDropped() const;
+
+Q_SIGNALS:
+    void patternChanged();
+
+private:
+    LibCameraTestPatternWorker *worker_;
+    Pattern pattern_;
+    qint32 fps_;
+    unsigned int bufferCount_;
+};
@@ -1,20 +1,24 @@
 #include "qlibcameraview.h"
 #include <QPainter>
+#include <QQuickWindow>
 
 LibCameraView::LibCameraView(QQuickItem *parent)
-    : QQuickPaintedItem(parent), place_(boundingRect()), refreshRateLimit_(15), nextRenderTime_(0)
+    : QQuickPaintedItem(parent), place_(boundingRect()), refreshRateLimit_(15), nextRenderTime_(0), info_{},
+    sensorTimestamp_(0)
 {
     setFillColor(QColor());
 }
 
-void LibCameraView::onProcessCompleted(QImage image, quint64 timestamp)
+void LibCameraView::onProcessCompleted(QImage image, qlibcamera::FrameInfo info)
 {
     if(QDateTime::currentMSecsSinceEpoch() >= nextRenderTime_) {
         update();
         nextRenderTime_ = QDateTime::currentMSecsSinceEpoch() + 1000 / refreshRateLimit() - 1;
     }
     image_ = image;
-    imageTimestamp_ = timestamp;
+    info_ = info;
+    sensorTimestamp_ = info.timestamps.sensor;
+    Q_EMIT frameInfoChanged();
 }
 
 void LibCameraView::stop()
@@ -46,6 +50,12 @@ void LibCameraView::paint(QPainter *painter)
 //        }
 
         painter->drawImage(place_, image_, image_.rect());
+
+        /* Repaints of the same image don't count. */
+        if (latencyStats_ && sensorTimestamp_) {
+            latencyStats_->record(qlibcamera::LatencyStage::Painted, sensorTimestamp_);
+            sensorTimestamp_ = 0;
+        }
         return;
     }
 }
@@ -53,11 +63,58 @@ void LibCameraView::paint(QPainter *painter)
 void LibCameraView::geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry) {
     place_.setRect(0, 0, newGeometry.width(), newGeometry.height());
     QQuickPaintedItem::geometryChange(newGeometry, oldGeometry);
+    if (newGeometry.size() != oldGeometry.size())
+        Q_EMIT paintSizeChanged();
+}
+
+/* Device pixels the image is painted on, the size worth converting frames to */
+QSize LibCameraView::paintSize() const
+{
+    const qreal ratio = window() ? window()->effectiveDevicePixelRatio() : 1.0;
+    return (place_.size() * ratio).toSize();
 }
 
+void LibCameraView::setLatencyStats(std::shared_ptr<qlibcamera::LatencyStats> latencyStats)
+{
+    latencyStats_ = std::move(latencyStats);
+}
+
+/* Sensor timestamp of the current image, in ms */
 quint64 LibCameraView::imageTimestamp() const
 {
-    return imageTimestamp_;
+    return info_.timestamps.sensor / 1000000;
+}
+
+const qlibcamera::FrameInfo &LibCameraView::frameInfo() const
+{
+    return info_;
+}
+
+/* The current image's descriptor for QML, with the metadata reported for it */
+QVariantMap LibCameraView::frameInfoMap() const
+{
+    const qlibcamera::FrameMetadata &metadata = info_.metadata;
+    QVariantMap map;
+
+    map["sequence"] = info_.sequence;
+    map["sensorTimestamp"] = QVariant::fromValue<quint64>(info_.timestamps.sensor);
+
+    if (metadata.has(qlibcamera::FrameMetadata::ExposureTime))
+        map["exposureTime"] = metadata.exposureTime;
+    if (metadata.has(qlibcamera::FrameMetadata::AnalogueGain))
+        map["analogueGain"] = metadata.analogueGain;
+    if (metadata.has(qlibcamera::FrameMetadata::DigitalGain))
+        map["digitalGain"] = metadata.digitalGain;
+    if (metadata.has(qlibcamera::FrameMetadata::ColourGains))
+        map["colourGains"] = QVariantList{ metadata.colourGains[0], metadata.colourGains[1] };
+    if (metadata.has(qlibcamera::FrameMetadata::Lux))
+        map["lux"] = metadata.lux;
+    if (metadata.has(qlibcamera::FrameMetadata::ColourTemperature))
+        map["colourTemperature"] = metadata.colourTemperature;
+    if (metadata.has(qlibcamera::FrameMetadata::FrameDuration))
+        map["frameDuration"] = QVariant::fromValue<qint64>(metadata.frameDuration);
+
+    return map;
 }
 
 int LibCameraView::refreshRateLimit() const
@@ -6,18 +6,24 @@
 #include <QList>
 #include <QMutex>
 #include <QSize>
+#include <QVariantMap>
 
 #include <libcamera/formats.h>
 #include <libcamera/framebuffer.h>
 #include <libcamera/pixel_format.h>
 #include <libcamera/color_space.h>
 
+#include <memory>
+
 #include "format_converter.h"
+#include "frame_info.h"
+#include "latency_histogram.h"
 
 class LibCameraView : public QQuickPaintedItem
 {
     Q_OBJECT
     Q_PROPERTY(int refreshRateLimit READ refreshRateLimit WRITE setRefreshRateLimit NOTIFY refreshRateLimitChanged FINAL)
+    Q_PROPERTY(QVariantMap frameInfo READ frameInfoMap NOTIFY frameInfoChanged FINAL)
     QML_ELEMENT
 
 public:
@@ -31,9 +37,15 @@ public:
     void setRefreshRateLimit(int newRefreshRateLimit);
 
     quint64 imageTimestamp() const;
+    const qlibcamera::FrameInfo &frameInfo() const;
+    QVariantMap frameInfoMap() const;
+
+    void setLatencyStats(std::shared_ptr<qlibcamera::LatencyStats> latencyStats);
+
+    QSize paintSize() const;
 
 public Q_SLOTS:
-    void onProcessCompleted(QImage image, quint64 timestamp);
+    void onProcessCompleted(QImage image, qlibcamera::FrameInfo info);
 
 protected:
     void paint(QPainter *painter) override;
@@ -41,12 +53,17 @@ protected:
 
 Q_SIGNALS:
     void refreshRateLimitChanged();
+    void frameInfoChanged();
+    void paintSizeChanged();
 
 private:
     int refreshRateLimit_;
     qint64 nextRenderTime_;
     QImage image_;
-    quint64 imageTimestamp_;
+    qlibcamera::FrameInfo info_;    /* Of image_ */
     QRectF place_;
+
+    std::shared_ptr<qlibcamera::LatencyStats> latencyStats_;
+    quint64 sensorTimestamp_; /* Of image_, until it gets painted */
 };
 
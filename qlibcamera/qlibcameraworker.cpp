@@ -1,9 +1,17 @@
 #include "qlibcameraworker.h"
+#include <algorithm>
+#include <string.h>
+#include <utility>
+
+#include <QDateTime>
 #include <QDebug>
 #include <QImage>
 #include <QImageWriter>
+#include <QMutex>
 
+#include "common/dng_writer.h"
 #include "format_converter_yuv.h"
+#include "frame_pool.h"
 
 static const QMap<libcamera::PixelFormat, QImage::Format> nativeFormats
 {
@@ -19,7 +27,7 @@ static const QMap<libcamera::PixelFormat, QImage::Format> nativeFormats
 
 
 LibCameraThread::LibCameraThread(QObject *parent)
-    : QThread{parent}
+    : QThread{parent}, users_(0)
 {
 //    qDebug() << "Thread Id:" << QThread::currentThreadId() << "Func:" << __FUNCTION__;
 }
@@ -29,6 +37,43 @@ LibCameraThread::~LibCameraThread()
 //    qDebug() << "Thread Id:" << QThread::currentThreadId() << "Func:" << __FUNCTION__;
 }
 
+static QMap<QString, LibCameraThread *> sharedThreads;
+
+/*
+ * Worker threads are shared by name between all LibCamera instances, so that
+ * running several cameras doesn't multiply the number of threads. Must be
+ * called from the GUI thread.
+ */
+LibCameraThread *LibCameraThread::acquire(const QString &name)
+{
+    LibCameraThread *thread = ::sharedThreads.value(name);
+    if (!thread) {
+        thread = new LibCameraThread();
+        thread->name_ = name;
+        thread->setObjectName(name);
+        thread->start();
+        ::sharedThreads.insert(name, thread);
+    }
+
+    thread->users_++;
+    return thread;
+}
+
+/*
+ * Drop a reference to a shared thread. The last user stops it, workers
+ * deleted with deleteLater() beforehand are destroyed when it finishes.
+ */
+void LibCameraThread::release(LibCameraThread *thread)
+{
+    if (--thread->users_ > 0)
+        return;
+
+    ::sharedThreads.remove(thread->name_);
+    thread->quit();
+    thread->wait();
+    delete thread;
+}
+
 void LibCameraThread::run()
 {
     exec();
@@ -36,26 +81,36 @@ void LibCameraThread::run()
 
 
 LibCameraProcessWorker::LibCameraProcessWorker(QObject *parent)
-    : QObject{parent}
+    : QObject{parent},
+    mailbox_(this, [this](LibCameraFrame frame) { onFrameReady(frame); }, qlibcamera::MailboxPolicy::LatestWins)
+{
+
+}
+
+LibCameraMailbox<LibCameraFrame> *LibCameraProcessWorker::mailbox()
 {
+    return &mailbox_;
+}
 
+void LibCameraProcessWorker::setLatencyStats(std::shared_ptr<qlibcamera::LatencyStats> latencyStats)
+{
+    latencyStats_ = std::move(latencyStats);
 }
 
-void LibCameraProcessWorker::onFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride)
+void LibCameraProcessWorker::onFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                                            const std::optional<libcamera::ColorSpace> &colorSpace)
 {
     image_ = QImage();
 
     /*
-     * If format conversion is needed, configure the converter and allocate
-     * the destination image.
+     * If format conversion is needed, configure the converter. Destination
+     * images are drawn from the frame pool for every frame.
      */
     if (!::nativeFormats.contains(format)) {
-        int ret = converter_.configure(format, size, stride);
+        int ret = converter_.configure(format, size, stride, colorSpace);
         if (ret < 0)
             return;
 
-        image_ = QImage(size, QImage::Format_RGB32);
-
         qDebug() << "Using software format conversion from"
                 << format.toString().c_str();
     } else {
@@ -66,32 +121,72 @@ void LibCameraProcessWorker::onFormatChanged(const libcamera::PixelFormat &forma
     size_ = size;
 }
 
-void LibCameraProcessWorker::onFrameReady(QList<QByteArray> dataList, quint64 timestamp)
+/*
+ * Convert the \a crop rectangle of frames, the whole frame if empty, to
+ * \a size, or to the size of the rectangle if it is empty, and to \a format.
+ * Frames displayed without conversion are left as they are.
+ */
+void LibCameraProcessWorker::onOutputChanged(const QSize &size, const QRect &crop,
+                                            qlibcamera::ScaleFilter filter, QImage::Format format)
 {
-    if (::nativeFormats.contains(format_)) {
+    crop_ = crop;
+    converter_.setOutput(size, crop, filter);
+    converter_.setOutputFormat(format);
+}
+
+void LibCameraProcessWorker::onFrameReady(LibCameraFrame frame)
+{
+    bool native = ::nativeFormats.contains(format_);
+    if (native) {
         /*
          * If the frame format is identical to the display
-         * format, create a QImage that references the frame
-         * and store a reference to the frame buffer. The
-         * previously stored frame buffer, if any, will be
-         * released.
+         * format, create a QImage that references the frame,
+         * from the first pixel of the crop rectangle on.
+         * The frame stays leased until the image is dropped
+         * below.
          *
          * \todo Get the stride from the buffer instead of
          * computing it naively
          */
-        assert(dataList.size() == 1);
-        image_ = QImage((const uchar *)dataList[0].constData(), size_.width(),
-                        size_.height(), dataList[0].size() / size_.height(),
-                        ::nativeFormats[format_]);
-        imageBuffer_ = dataList[0];
+        assert(frame.planeCount() == 1);
+        const QRect rect = crop_.intersected(QRect(QPoint(), size_.toSize()));
+        const QRect area = rect.isEmpty() ? QRect(QPoint(), size_.toSize()) : rect;
+        const QImage::Format format = ::nativeFormats[format_];
+        const qsizetype stride = frame.size(0) / qsizetype(size_.height());
+        const int bytesPerPixel = QImage::toPixelFormat(format).bitsPerPixel() / 8;
+
+        image_ = QImage(frame.constData(0) + area.y() * stride + area.x() * bytesPerPixel,
+                        area.width(), area.height(), stride, format);
     } else {
         // Make a deep copy
-        converter_.convert(dataList, &image_);
+        image_ = qlibcamera::FramePool::global()->image(converter_.outputSize(), converter_.outputFormat());
+
+        /* MJPEG frames that don't decode are dropped. */
+        if (converter_.convert(frame, &image_) < 0) {
+            image_ = QImage();
+            return;
+        }
     }
 
+    if (latencyStats_)
+        latencyStats_->record(qlibcamera::LatencyStage::Converted, frame.timestamps().sensor);
+
     process();
 
-    Q_EMIT completed(image_.copy(), timestamp);
+    if (latencyStats_)
+        latencyStats_->record(qlibcamera::LatencyStage::Processed, frame.timestamps().sensor);
+
+    /*
+     * Converted images are handed over as is, the pooled buffer is recycled
+     * once the view drops it. Native images reference the camera buffer and
+     * are copied to a pooled buffer to end the lease.
+     */
+    if (native)
+        Q_EMIT completed(qlibcamera::FramePool::global()->copy(image_), frame.info());
+    else
+        Q_EMIT completed(image_, frame.info());
+
+    image_ = QImage();
 }
 
 void LibCameraProcessWorker::process()
@@ -105,105 +200,446 @@ LibCameraSnapshotWorker::LibCameraSnapshotWorker(QObject *parent)
 
 }
 
-void LibCameraSnapshotWorker::onFrameReady(QImage image, quint64 timestamp)
+void LibCameraSnapshotWorker::onFrameReady(QImage image, qlibcamera::FrameInfo info)
+{
+    save(image, info);
+}
+
+void LibCameraSnapshotWorker::onFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                                             const std::optional<libcamera::ColorSpace> &colorSpace)
+{
+    format_ = format;
+    size_ = size;
+
+    if (!::nativeFormats.contains(format_))
+        converter_.configure(format, size, stride, colorSpace);
+}
+
+/*
+ * Save a frame of the still stream at full resolution. The frame is leased
+ * on its own, holding it here never stalls the viewfinder.
+ */
+void LibCameraSnapshotWorker::onStillFrameReady(LibCameraFrame frame)
+{
+    QImage image;
+
+    if (::nativeFormats.contains(format_)) {
+        assert(frame.planeCount() == 1);
+        image = QImage(frame.constData(0), size_.width(), size_.height(),
+                       frame.size(0) / size_.height(), ::nativeFormats[format_]);
+    } else {
+        image = qlibcamera::FramePool::global()->image(size_, converter_.outputFormat());
+        if (converter_.convert(frame, &image) < 0)
+            return;
+    }
+
+    save(image, frame.info());
+}
+
+/*
+ * The frame metadata is stored as text, in a JPEG comment. It is set on the
+ * writer, setting it on the image would detach it.
+ */
+void LibCameraSnapshotWorker::save(const QImage &image, const qlibcamera::FrameInfo &info)
 {
-    QString filename = QString("%1.jpg").arg(timestamp);
+    const qlibcamera::FrameMetadata &metadata = info.metadata;
+
+    QString filename = QString("%1.jpg").arg(info.timestamps.sensor / 1000000);
     QImageWriter writer(filename);
     writer.setQuality(95);
+
+    writer.setText("Sequence", QString::number(info.sequence));
+    writer.setText("SensorTimestamp", QString::number(info.timestamps.sensor));
+    if (metadata.has(qlibcamera::FrameMetadata::ExposureTime))
+        writer.setText("ExposureTime", QString::number(metadata.exposureTime));
+    if (metadata.has(qlibcamera::FrameMetadata::AnalogueGain))
+        writer.setText("AnalogueGain", QString::number(metadata.analogueGain));
+    if (metadata.has(qlibcamera::FrameMetadata::DigitalGain))
+        writer.setText("DigitalGain", QString::number(metadata.digitalGain));
+    if (metadata.has(qlibcamera::FrameMetadata::ColourGains))
+        writer.setText("ColourGains", QString("%1 %2").arg(metadata.colourGains[0]).arg(metadata.colourGains[1]));
+    if (metadata.has(qlibcamera::FrameMetadata::Lux))
+        writer.setText("Lux", QString::number(metadata.lux));
+    if (metadata.has(qlibcamera::FrameMetadata::ColourTemperature))
+        writer.setText("ColourTemperature", QString::number(metadata.colourTemperature));
+
     writer.write(image);
 
     Q_EMIT completed(filename);
 }
 
-LibCameraRecordingWorker::LibCameraRecordingWorker(QObject *parent)
-    : QObject{parent}, codec_(nullptr), codecContext_(nullptr), file_(nullptr), frame_(nullptr), packet_(nullptr),
-    running_(false), frameCount_(0)
+/*
+ * Raw frames only hold back their own buffer, never the request, so the
+ * mailbox doesn't need to drop anything: a burst is bounded by the number of
+ * raw buffers.
+ */
+LibCameraRawWorker::LibCameraRawWorker(QObject *parent)
+    : QObject{parent},
+    mailbox_(this, [this](LibCameraRawFrame frame) { onFrameReady(frame); }, qlibcamera::MailboxPolicy::BlockCapture)
 {
 
 }
 
-void LibCameraRecordingWorker::onStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat, qint32 bitRate)
+LibCameraMailbox<LibCameraRawFrame> *LibCameraRawWorker::mailbox()
 {
-//    qDebug() << "Thread Id:" << QThread::currentThreadId() << "Func:" << __FUNCTION__;
+    return &mailbox_;
+}
 
-    int ret;
-    filename_ = QString("%1.mp4").arg(QDateTime::currentMSecsSinceEpoch());
-    const char* codexName = "h264_v4l2m2m";
-    // TODO: YOU CAN USE libx264 FOR BETTER QUALITY
-//    const char* codexName = "libx264";
+void LibCameraRawWorker::onFormatChanged(const libcamera::PixelFormat &format, const QSize &size,
+                                         unsigned int stride, const QString &model)
+{
+    config_.pixelFormat = format;
+    config_.size = libcamera::Size(size.width(), size.height());
+    config_.stride = stride;
+    model_ = model.toStdString();
+}
 
-    /* find the mpeg1video encoder */
-    codec_ = avcodec_find_encoder_by_name(codexName);
-    if (!codec_) {
-        qDebug() << QString("Codec '%1' not found").arg(codexName);
+void LibCameraRawWorker::onFrameReady(LibCameraRawFrame frame)
+{
+    QString filename = QString("%1.dng").arg(frame.frame.timestamp());
+
+    /* Write straight from the mapped buffer, the lease is dropped afterwards. */
+    int ret = DNGWriter::write(filename.toStdString().c_str(), model_, config_, frame.metadata,
+                               libcamera::Span<const uint8_t>(frame.frame.constData(0), frame.frame.size(0)));
+    frame.frame.release();
+
+    if (ret < 0) {
+        qWarning() << "Failed to write" << filename;
         return;
     }
 
-    codecContext_ = avcodec_alloc_context3(codec_);
-    if (!codecContext_) {
-        qDebug() << "Could not allocate video codec context";
-        return;
+    Q_EMIT completed(filename);
+}
+
+LibCameraSyncWorker::LibCameraSyncWorker(QObject *parent)
+    : QObject{parent},
+    mailbox_(this, [this](LibCameraFrameSet frameSet) { onFrameSetReady(frameSet); }, qlibcamera::MailboxPolicy::LatestWins)
+{
+
+}
+
+LibCameraMailbox<LibCameraFrameSet> *LibCameraSyncWorker::mailbox()
+{
+    return &mailbox_;
+}
+
+void LibCameraSyncWorker::onFormatChanged(qint32 index, const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                                         const std::optional<libcamera::ColorSpace> &colorSpace)
+{
+    while (streams_.size() <= static_cast<size_t>(index))
+        streams_.push_back(std::make_unique<Stream>());
+
+    Stream *stream = streams_[index].get();
+    stream->format = format;
+    stream->size = size;
+
+    if (!::nativeFormats.contains(format))
+        stream->converter.configure(format, size, stride, colorSpace);
+}
+
+void LibCameraSyncWorker::onFrameSetReady(LibCameraFrameSet frameSet)
+{
+    QList<QImage> images;
+    QList<bool> native;
+
+    for (qsizetype i = 0; i < frameSet.frames.size(); i++) {
+        const LibCameraFrame &frame = frameSet.frames[i];
+        Stream *stream = static_cast<size_t>(i) < streams_.size() ? streams_[i].get() : nullptr;
+
+        native.append(stream && ::nativeFormats.contains(stream->format));
+
+        if (!stream || !stream->format.isValid()) {
+            images.append(QImage());
+            continue;
+        }
+
+        /* Native frames are referenced, they stay leased until copied below. */
+        if (native[i]) {
+            images.append(QImage(frame.constData(0), stream->size.width(), stream->size.height(),
+                                 frame.size(0) / stream->size.height(),
+                                 ::nativeFormats[stream->format]));
+        } else {
+            QImage image = qlibcamera::FramePool::global()->image(stream->size,
+                                                                  stream->converter.outputFormat());
+            if (stream->converter.convert(frame, &image) < 0)
+                image = QImage();
+            images.append(image);
+        }
     }
 
-    packet_ = av_packet_alloc();
-    if (!packet_)
-        return;
+    process(images, frameSet.timestamp);
 
-    /* put sample parameters */
-    codecContext_->bit_rate = bitRate;
-    /* resolution must be a multiple of two */
-    codecContext_->width = width;
-    codecContext_->height = height;
-    /* frames per second */
-    codecContext_->time_base = (AVRational){1, fps};
-    codecContext_->framerate = (AVRational){fps, 1};
+    for (qsizetype i = 0; i < images.size(); i++) {
+        if (native[i])
+            images[i] = qlibcamera::FramePool::global()->copy(images[i]);
+    }
 
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
-    codecContext_->gop_size = 10;
-    codecContext_->max_b_frames = 1;
-    codecContext_->pix_fmt = AV_PIX_FMT_YUV420P;
+    Q_EMIT completed(images, frameSet.timestamp);
+}
 
-    if (codec_->id == AV_CODEC_ID_H264)
-        av_opt_set(codecContext_->priv_data, "preset", "slow", 0);
+void LibCameraSyncWorker::process(QList<QImage> &images, quint64 timestamp)
+{
+    Q_UNUSED(images);
+    Q_UNUSED(timestamp);
 
-    /* open it */
-    ret = avcodec_open2(codecContext_, codec_, NULL);
-    if (ret < 0) {
-        qDebug() << QString("Could not open codec: %1").arg(ret);
-        return;
+    // TODO: DO YOUR STEREO / MULTI-VIEW PROCESSINGS HERE
+}
+
+/*
+ * Copy the \a rows rows of \a width bytes of a plane of \a srcStride bytes to
+ * one of \a dstStride bytes. Returns false if the plane is too short.
+ */
+static bool copyPlane(const uchar *src, size_t srcSize, unsigned int srcStride,
+                      uint8_t *dst, int dstStride, int width, int rows)
+{
+    if (srcStride < static_cast<unsigned int>(width) ||
+        srcSize < size_t(srcStride) * (rows - 1) + width)
+        return false;
+
+    for (int y = 0; y < rows; y++)
+        memcpy(dst + y * dstStride, src + y * srcStride, width);
+
+    return true;
+}
+
+/*
+ * Copy a YUV420 \a frame of luma stride \a stride to \a dst row by row, the
+ * strides the ISP and FFmpeg pad their rows to differ.
+ */
+static bool copyYuv420(const LibCameraFrame &frame, unsigned int stride, AVFrame *dst)
+{
+    const int chromaWidth = (dst->width + 1) / 2;
+    const int chromaHeight = (dst->height + 1) / 2;
+
+    return copyPlane(frame.constData(0), frame.size(0), stride,
+                     dst->data[0], dst->linesize[0], dst->width, dst->height) &&
+           copyPlane(frame.constData(1), frame.size(1), stride / 2,
+                     dst->data[1], dst->linesize[1], chromaWidth, chromaHeight) &&
+           copyPlane(frame.constData(2), frame.size(2), stride / 2,
+                     dst->data[2], dst->linesize[2], chromaWidth, chromaHeight);
+}
+
+/*
+ * Convert an NV12 \a frame of stride \a stride to \a dst, splitting the
+ * interleaved chroma plane.
+ */
+static bool copyNv12(const LibCameraFrame &frame, unsigned int stride, AVFrame *dst)
+{
+    const int chromaWidth = (dst->width + 1) / 2;
+    const int chromaHeight = (dst->height + 1) / 2;
+
+    if (!copyPlane(frame.constData(0), frame.size(0), stride,
+                   dst->data[0], dst->linesize[0], dst->width, dst->height))
+        return false;
+
+    if (frame.size(1) < size_t(stride) * (chromaHeight - 1) + 2 * chromaWidth)
+        return false;
+
+    for (int y = 0; y < chromaHeight; y++) {
+        const uchar *src = frame.constData(1) + y * stride;
+        uint8_t *u = dst->data[1] + y * dst->linesize[1];
+        uint8_t *v = dst->data[2] + y * dst->linesize[2];
+
+        for (int x = 0; x < chromaWidth; x++) {
+            u[x] = src[2 * x];
+            v[x] = src[2 * x + 1];
+        }
     }
 
-    file_ = fopen(filename_.toStdString().c_str(), "wb");
-    if (!file_) {
-        qDebug() << QString("Could not open %1").arg(filename_);
+    return true;
+}
+
+/*
+ * Convert a YUYV \a frame of stride \a stride to \a dst, averaging the chroma
+ * of row pairs down to 4:2:0.
+ */
+static bool copyYuyv(const LibCameraFrame &frame, unsigned int stride, AVFrame *dst)
+{
+    const int width = dst->width;
+    const int height = dst->height;
+
+    if (frame.size(0) < size_t(stride) * (height - 1) + 2 * width)
+        return false;
+
+    for (int y = 0; y < height; y++) {
+        const uchar *src = frame.constData(0) + y * stride;
+        uint8_t *luma = dst->data[0] + y * dst->linesize[0];
+
+        for (int x = 0; x < width; x++)
+            luma[x] = src[2 * x];
+    }
+
+    for (int y = 0; y < (height + 1) / 2; y++) {
+        const uchar *top = frame.constData(0) + 2 * y * stride;
+        const uchar *bottom = 2 * y + 1 < height ? top + stride : top;
+        uint8_t *u = dst->data[1] + y * dst->linesize[1];
+        uint8_t *v = dst->data[2] + y * dst->linesize[2];
+
+        for (int x = 0; x < width / 2; x++) {
+            u[x] = (top[4 * x + 1] + bottom[4 * x + 1] + 1) >> 1;
+            v[x] = (top[4 * x + 3] + bottom[4 * x + 3] + 1) >> 1;
+        }
+    }
+
+    return true;
+}
+
+/* Formats the recorder converts to YUV420P */
+static bool encoderFormat(const libcamera::PixelFormat &format)
+{
+    return format == libcamera::formats::RGB565 || format == libcamera::formats::BGR888 ||
+           format == libcamera::formats::RGB888 || format == libcamera::formats::YUV420 ||
+           format == libcamera::formats::NV12 || format == libcamera::formats::YUYV ||
+           format == libcamera::formats::MJPEG;
+}
+
+/*
+ * Copy a decoded MJPEG \a frame to the 4:2:0 planes of \a dst, averaging
+ * 4:2:2 and 4:4:4 chroma down. Frames decoded to RGB are not supported.
+ */
+static bool copyToYuv420(const LibCameraFrame &frame, const libcamera::PixelFormat &format,
+                         unsigned int stride, AVFrame *dst)
+{
+    if (format != libcamera::formats::YUV420 && format != libcamera::formats::YUV422 &&
+        format != libcamera::formats::YUV444)
+        return false;
+
+    const int width = dst->width;
+    const int height = dst->height;
+    const unsigned int horzSubSample = format == libcamera::formats::YUV444 ? 1 : 2;
+    const unsigned int rows = format == libcamera::formats::YUV420 ? 1 : 2;
+    const unsigned int columns = 2 / horzSubSample;
+    const unsigned int chromaStride = stride / horzSubSample;
+
+    for (int y = 0; y < height; y++)
+        memcpy(dst->data[0] + y * dst->linesize[0], frame.constData(0) + y * stride, width);
+
+    /* Decoded planes are padded to whole blocks, reading past odd sizes is safe. */
+    for (int plane = 1; plane < 3; plane++) {
+        for (int y = 0; y < (height + 1) / 2; y++) {
+            const uchar *src = frame.constData(plane) + y * rows * chromaStride;
+            uint8_t *out = dst->data[plane] + y * dst->linesize[plane];
+
+            for (int x = 0; x < (width + 1) / 2; x++) {
+                unsigned int sum = 0;
+
+                for (unsigned int row = 0; row < rows; row++) {
+                    for (unsigned int column = 0; column < columns; column++)
+                        sum += src[row * chromaStride + x * columns + column];
+                }
+
+                out[x] = (sum + rows * columns / 2) / (rows * columns);
+            }
+        }
+    }
+
+    return true;
+}
+
+LibCameraRecordingWorker::LibCameraRecordingWorker(QObject *parent)
+    : QObject{parent},
+    mailbox_(this, [this](LibCameraFrame frame) { onFrameReady(frame); }, qlibcamera::MailboxPolicy::BlockCapture),
+    codec_(nullptr), codecContext_(nullptr), file_(nullptr), frame_(nullptr), packet_(nullptr),
+    stride_(0), running_(false), frameCount_(0), pts_(0), forceKeyFrame_(false), waitKeyFrame_(false)
+{
+
+}
+
+LibCameraMailbox<LibCameraFrame> *LibCameraRecordingWorker::mailbox()
+{
+    return &mailbox_;
+}
+
+void LibCameraRecordingWorker::setLatencyStats(std::shared_ptr<qlibcamera::LatencyStats> latencyStats)
+{
+    latencyStats_ = std::move(latencyStats);
+}
+
+void LibCameraRecordingWorker::onStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat,
+                                       unsigned int stride, qint32 bitRate)
+{
+//    qDebug() << "Thread Id:" << QThread::currentThreadId() << "Func:" << __FUNCTION__;
+
+    /*
+     * With a pre-event ring the encoder runs already. The recording starts
+     * without the ring, from a key frame requested right away.
+     */
+    if (ring_.isAllocated()) {
+        closeFile();
+        ring_.clear();
+
+        if (openFile())
+            forceKeyFrame_ = true;
         return;
     }
 
-    frame_ = av_frame_alloc();
-    if (!frame_) {
-        qDebug() << "Could not allocate video frame";
+    onEnd();
+
+    if (!openEncoder(width, height, fps, pixelFormat, stride, bitRate)) {
+        closeEncoder();
+        Q_EMIT failed();
         return;
     }
-    frame_->format = codecContext_->pix_fmt;
-    frame_->width  = codecContext_->width;
-    frame_->height = codecContext_->height;
 
-    ret = av_frame_get_buffer(frame_, 0);
+    openFile();
+}
+
+/*
+ * Encode into a ring of the last \a duration ns or \a bytes of packets,
+ * until a recording is started or triggered.
+ */
+void LibCameraRecordingWorker::onPreEventStart(qint32 width, qint32 height, qint32 fps,
+                                               libcamera::PixelFormat pixelFormat, unsigned int stride,
+                                               qint32 bitRate,
+                                               qint64 duration, qint64 bytes, qint32 frames)
+{
+    onPreEventEnd();
+
+    int ret = ring_.allocate(bytes, frames, duration);
     if (ret < 0) {
-        qDebug() << "Could not allocate the video frame data";
+        qWarning() << "Failed to allocate the pre-event ring:" << strerror(-ret);
         return;
     }
 
-    running_ = true;
-    pixelFormat_ = pixelFormat;
+    if (!openEncoder(width, height, fps, pixelFormat, stride, bitRate)) {
+        closeEncoder();
+        ring_.free();
+        Q_EMIT failed();
+    }
+}
+
+/*
+ * Write the ring out from its oldest key frame and keep recording, the
+ * encoder isn't interrupted so the file continues seamlessly.
+ */
+void LibCameraRecordingWorker::onPreEventTrigger()
+{
+    if (!ring_.isAllocated() || file_ || !openFile())
+        return;
+
+    const size_t first = ring_.firstKey();
+    for (size_t i = first; i < ring_.count(); i++) {
+        const qlibcamera::PreEventRing::Entry &entry = ring_.at(i);
+        fwrite(ring_.data(entry), 1, entry.size, file_);
+        frameCount_++;
+    }
+
+    waitKeyFrame_ = first == ring_.count();
+    ring_.clear();
+
+    Q_EMIT frameRecorded(frameCount_);
+}
+
+void LibCameraRecordingWorker::onPreEventEnd()
+{
+    if (!ring_.isAllocated())
+        return;
+
+    ring_.free();
+    onEnd();
 }
 
-void LibCameraRecordingWorker::onFrameReady(QList<QByteArray> dataList, quint64 timestamp)
+void LibCameraRecordingWorker::onFrameReady(LibCameraFrame frame)
 {
     if(!running_) {
         return;
@@ -220,42 +656,79 @@ void LibCameraRecordingWorker::onFrameReady(QList<QByteArray> dataList, quint64
        for the frame only if necessary.
     */
     int ret = av_frame_make_writable(frame_);
-    if (ret < 0)
+    if (ret < 0) {
+        Q_EMIT framesLost(1);
         return;
+    }
 
     if(pixelFormat_ == libcamera::formats::RGB565) {
-        rgb565_to_yuv420((quint16 *)dataList.at(0).data(), frame_->data[0], frame_->data[1], frame_->data[2], codecContext_->width, codecContext_->height);
+        rgb565_to_yuv420((quint16 *)frame.constData(0), frame_->data[0], frame_->data[1], frame_->data[2], codecContext_->width, codecContext_->height);
     }
     else if(pixelFormat_ == libcamera::formats::BGR888) {
-        rgb24_to_yuv420((quint8 *)dataList.at(0).data(), frame_->data[0], frame_->data[1], frame_->data[2], codecContext_->width, codecContext_->height);
+        rgb24_to_yuv420((quint8 *)frame.constData(0), frame_->data[0], frame_->data[1], frame_->data[2], codecContext_->width, codecContext_->height);
     }
     else if(pixelFormat_ == libcamera::formats::RGB888) {
-        bgr24_to_yuv420((quint8 *)dataList.at(0).data(), frame_->data[0], frame_->data[1], frame_->data[2], codecContext_->width, codecContext_->height);
+        bgr24_to_yuv420((quint8 *)frame.constData(0), frame_->data[0], frame_->data[1], frame_->data[2], codecContext_->width, codecContext_->height);
     }
     else if(pixelFormat_ == libcamera::formats::YUV420) {
-        memcpy(frame_->data[0], dataList.at(0).data(), frame_->linesize[0] * codecContext_->height);
-        memcpy(frame_->data[1], dataList.at(1).data(), frame_->linesize[1] * codecContext_->height / 2);
-        memcpy(frame_->data[2], dataList.at(2).data(), frame_->linesize[2] * codecContext_->height / 2);
+        if (!copyYuv420(frame, stride_, frame_)) {
+            Q_EMIT framesLost(1);
+            return;
+        }
+    }
+    else if(pixelFormat_ == libcamera::formats::NV12) {
+        if (!copyNv12(frame, stride_, frame_)) {
+            Q_EMIT framesLost(1);
+            return;
+        }
+    }
+    else if(pixelFormat_ == libcamera::formats::YUYV) {
+        if (!copyYuyv(frame, stride_, frame_)) {
+            Q_EMIT framesLost(1);
+            return;
+        }
+    }
+    else if(pixelFormat_ == libcamera::formats::MJPEG) {
+        const LibCameraFrame decoded = decoder_.decode(frame);
+        if (decoded.isNull() || decoder_.size() != QSize(codecContext_->width, codecContext_->height) ||
+            !copyToYuv420(decoded, decoder_.format(), decoder_.stride(), frame_)) {
+            Q_EMIT framesLost(1);
+            return;
+        }
     }
 
-    frame_->pts = frameCount_;
-    frameCount_ ++;
+    frame_->pts = pts_++;
+    frame_->pict_type = forceKeyFrame_ ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    forceKeyFrame_ = false;
 
     /* encode the image */
-    encode(frame_);
+    if (!encode(frame_, frame.timestamps().sensor)) {
+        Q_EMIT framesLost(1);
+        return;
+    }
 
-    Q_EMIT frameRecorded(frameCount_);
+    if (latencyStats_)
+        latencyStats_->record(qlibcamera::LatencyStage::Encoded, frame.timestamps().sensor);
+
+    if (file_)
+        Q_EMIT frameRecorded(frameCount_);
 }
 
 void LibCameraRecordingWorker::onEnd()
 {
+    /* Keep encoding into the pre-event ring. */
+    if (ring_.isAllocated()) {
+        closeFile();
+        return;
+    }
+
     if(running_) {
         uint8_t endcode[] = { 0, 0, 1, 0xb7 };
 
     //  qDebug() << "Thread Id:" << QThread::currentThreadId() << "Func:" << __FUNCTION__;
 
         /* flush the encoder */
-        encode(NULL);
+        encode(NULL, 0);
 
         /* Add sequence end code to have a real MPEG file.
            It makes only sense because this tiny examples writes packets
@@ -263,18 +736,106 @@ void LibCameraRecordingWorker::onEnd()
            codecs. To create a valid file, you usually need to write packets
            into a proper file format or protocol; see mux.c.
          */
-        if (codec_->id == AV_CODEC_ID_MPEG1VIDEO || codec_->id == AV_CODEC_ID_MPEG2VIDEO)
+        if (file_ && (codec_->id == AV_CODEC_ID_MPEG1VIDEO || codec_->id == AV_CODEC_ID_MPEG2VIDEO))
             fwrite(endcode, 1, sizeof(endcode), file_);
-
-        Q_EMIT completed(filename_, frameCount_);
     }
-    running_ = false;
 
-    if(file_) {
-        fclose(file_);
-        file_ = nullptr;
+    closeFile();
+    closeEncoder();
+}
+
+bool LibCameraRecordingWorker::openEncoder(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat,
+                                           unsigned int stride, qint32 bitRate)
+{
+    int ret;
+    const char* codexName = "h264_v4l2m2m";
+    // TODO: YOU CAN USE libx264 FOR BETTER QUALITY
+//    const char* codexName = "libx264";
+
+    /* Frames of other formats would be encoded as garbage. */
+    if (!encoderFormat(pixelFormat)) {
+        qWarning() << "Can't record" << pixelFormat.toString().c_str() << "frames";
+        return false;
     }
 
+    /* find the mpeg1video encoder */
+    codec_ = avcodec_find_encoder_by_name(codexName);
+    if (!codec_) {
+        qDebug() << QString("Codec '%1' not found").arg(codexName);
+        return false;
+    }
+
+    codecContext_ = avcodec_alloc_context3(codec_);
+    if (!codecContext_) {
+        qDebug() << "Could not allocate video codec context";
+        return false;
+    }
+
+    packet_ = av_packet_alloc();
+    if (!packet_)
+        return false;
+
+    /* put sample parameters */
+    codecContext_->bit_rate = bitRate;
+    /* resolution must be a multiple of two */
+    codecContext_->width = width;
+    codecContext_->height = height;
+    /* frames per second */
+    codecContext_->time_base = (AVRational){1, fps};
+    codecContext_->framerate = (AVRational){fps, 1};
+
+    /* emit one intra frame every ten frames
+     * check frame pict_type before passing frame
+     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
+     * then gop_size is ignored and the output of encoder
+     * will always be I frame irrespective to gop_size
+     */
+    codecContext_->gop_size = 10;
+    codecContext_->max_b_frames = 1;
+    codecContext_->pix_fmt = AV_PIX_FMT_YUV420P;
+
+    /* MJPEG frames are decoded to full range YUV, as JFIF specifies. */
+    if (pixelFormat == libcamera::formats::MJPEG)
+        codecContext_->color_range = AVCOL_RANGE_JPEG;
+
+    if (codec_->id == AV_CODEC_ID_H264)
+        av_opt_set(codecContext_->priv_data, "preset", "slow", 0);
+
+    /* open it */
+    ret = avcodec_open2(codecContext_, codec_, NULL);
+    if (ret < 0) {
+        qDebug() << QString("Could not open codec: %1").arg(ret);
+        return false;
+    }
+
+    frame_ = av_frame_alloc();
+    if (!frame_) {
+        qDebug() << "Could not allocate video frame";
+        return false;
+    }
+    frame_->format = codecContext_->pix_fmt;
+    frame_->width  = codecContext_->width;
+    frame_->height = codecContext_->height;
+
+    ret = av_frame_get_buffer(frame_, 0);
+    if (ret < 0) {
+        qDebug() << "Could not allocate the video frame data";
+        return false;
+    }
+
+    running_ = true;
+    pixelFormat_ = pixelFormat;
+    stride_ = stride;
+    pts_ = 0;
+    forceKeyFrame_ = false;
+
+    return true;
+}
+
+void LibCameraRecordingWorker::closeEncoder()
+{
+    running_ = false;
+
     if(codecContext_) {
         avcodec_free_context(&codecContext_);
         codecContext_ = nullptr;
@@ -293,7 +854,43 @@ void LibCameraRecordingWorker::onEnd()
     codec_ = nullptr;
 }
 
-void LibCameraRecordingWorker::encode(AVFrame *frame)
+/* Start writing packets to a new file, from the next key frame. */
+bool LibCameraRecordingWorker::openFile()
+{
+    if (!running_)
+        return false;
+
+    filename_ = QString("%1.mp4").arg(QDateTime::currentMSecsSinceEpoch());
+    file_ = fopen(filename_.toStdString().c_str(), "wb");
+    if (!file_) {
+        qDebug() << QString("Could not open %1").arg(filename_);
+        return false;
+    }
+
+    frameCount_ = 0;
+    waitKeyFrame_ = true;
+
+    return true;
+}
+
+void LibCameraRecordingWorker::closeFile()
+{
+    if (!file_)
+        return;
+
+    fclose(file_);
+    file_ = nullptr;
+
+    Q_EMIT completed(filename_, frameCount_);
+}
+
+/*
+ * Packets go to the file while recording, to the pre-event ring otherwise.
+ * \a timestamp is the sensor timestamp of \a frame, the packets are stamped
+ * with it as the encoder delays them by a frame or two at most. Returns false
+ * if the encoder rejected \a frame.
+ */
+bool LibCameraRecordingWorker::encode(AVFrame *frame, uint64_t timestamp)
 {
     int ret;
 
@@ -304,20 +901,603 @@ void LibCameraRecordingWorker::encode(AVFrame *frame)
     ret = avcodec_send_frame(codecContext_, frame);
     if (ret < 0) {
         qDebug() << "Error sending a frame for encoding";
-        return;
+        return false;
     }
 
     while (ret >= 0) {
         ret = avcodec_receive_packet(codecContext_, packet_);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            return;
+            return true;
         else if (ret < 0) {
             qDebug() << "Error during encoding";
             exit(1);
         }
 
-        qDebug() << QString("Write packet %1 (size=%2)").arg(packet_->pts).arg(packet_->size);
-        fwrite(packet_->data, 1, packet_->size, file_);
+        const bool key = packet_->flags & AV_PKT_FLAG_KEY;
+
+        if (file_) {
+            waitKeyFrame_ = waitKeyFrame_ && !key;
+            if (!waitKeyFrame_) {
+                qDebug() << QString("Write packet %1 (size=%2)").arg(packet_->pts).arg(packet_->size);
+                fwrite(packet_->data, 1, packet_->size, file_);
+                frameCount_++;
+            }
+        } else if (ring_.isAllocated()) {
+            uint8_t *data = ring_.push(packet_->size, timestamp, key);
+            if (data)
+                memcpy(data, packet_->data, packet_->size);
+        }
+
         av_packet_unref(packet_);
     }
+
+    return true;
+}
+
+namespace {
+
+/* A rendered frame, its buffer goes back to the frame pool once released */
+class TestPatternFrameData : public LibCameraFrameData
+{
+public:
+    TestPatternFrameData(std::shared_ptr<std::atomic<unsigned int>> outstanding, void *buffer)
+        : outstanding_(std::move(outstanding)), buffer_(buffer)
+    {
+        (*outstanding_)++;
+    }
+
+    ~TestPatternFrameData()
+    {
+        qlibcamera::FramePool::release(buffer_);
+        (*outstanding_)--;
+    }
+
+private:
+    std::shared_ptr<std::atomic<unsigned int>> outstanding_;
+    void *buffer_;
+};
+
+} /* namespace */
+
+LibCameraTestPatternWorker::LibCameraTestPatternWorker(QObject *parent)
+    : QObject{parent}, timer_(new QTimer(this)), base_(0), baseSequence_(0), period_(0),
+    sequence_(0), bufferCount_(DefaultBufferCount),
+    outstanding_(std::make_shared<std::atomic<unsigned int>>(0)),
+    framesGenerated_(0), framesDropped_(0)
+{
+    timer_->setSingleShot(true);
+    timer_->setTimerType(Qt::PreciseTimer);
+    connect(timer_, &QTimer::timeout, this, &LibCameraTestPatternWorker::generate);
+}
+
+int LibCameraTestPatternWorker::configure(const libcamera::PixelFormat &format, const QSize &size,
+                                          qlibcamera::TestPattern::Pattern pattern)
+{
+    int ret = pattern_.configure(format, size, pattern);
+    if (ret < 0)
+        return ret;
+
+    format_ = format;
+    size_ = size;
+
+    return 0;
+}
+
+unsigned int LibCameraTestPatternWorker::stride() const
+{
+    return pattern_.stride();
+}
+
+size_t LibCameraTestPatternWorker::frameSize() const
+{
+    return pattern_.frameSize();
+}
+
+void LibCameraTestPatternWorker::start(qint32 fps, unsigned int bufferCount)
+{
+    bufferCount_ = bufferCount ? bufferCount : DefaultBufferCount;
+    period_ = 1000000000ULL / std::max(fps, 1);
+    base_ = qlibcamera::LatencyStats::now();
+    baseSequence_ = 0;
+    sequence_ = 0;
+
+    schedule();
+}
+
+void LibCameraTestPatternWorker::stop()
+{
+    timer_->stop();
+}
+
+/* Change the frame rate from the next frame on, keeping the sequence. */
+void LibCameraTestPatternWorker::setFps(qint32 fps)
+{
+    if (fps <= 0)
+        return;
+
+    base_ = sensorTimestamp(sequence_);
+    baseSequence_ = sequence_;
+    period_ = 1000000000ULL / fps;
+
+    if (timer_->isActive())
+        schedule();
+}
+
+void LibCameraTestPatternWorker::setPattern(qlibcamera::TestPattern::Pattern pattern)
+{
+    if (format_.isValid())
+        pattern_.configure(format_, size_, pattern);
+}
+
+quint64 LibCameraTestPatternWorker::framesGenerated() const
+{
+    return framesGenerated_;
+}
+
+quint64 LibCameraTestPatternWorker::framesDropped() const
+{
+    return framesDropped_;
+}
+
+uint64_t LibCameraTestPatternWorker::sensorTimestamp(unsigned int sequence) const
+{
+    return base_ + (sequence - baseSequence_) * period_;
+}
+
+/* Wake up when the readout of the current frame ends. */
+void LibCameraTestPatternWorker::schedule()
+{
+    const uint64_t deadline = sensorTimestamp(sequence_ + 1);
+    const uint64_t now = qlibcamera::LatencyStats::now();
+
+    timer_->start(deadline > now ? (deadline - now + 999999) / 1000000 : 0);
+}
+
+void LibCameraTestPatternWorker::generate()
+{
+    const uint64_t now = qlibcamera::LatencyStats::now();
+
+    /* Timers may fire early, by less than a millisecond. */
+    if (now < sensorTimestamp(sequence_ + 1)) {
+        schedule();
+        return;
+    }
+
+    /* Skip the frames whose readout ended while we were busy. */
+    const unsigned int latest = baseSequence_ + (now - base_) / period_ - 1;
+    if (latest > sequence_) {
+        framesDropped_ += latest - sequence_;
+        sequence_ = latest;
+    }
+
+    if (*outstanding_ >= bufferCount_) {
+        framesDropped_++;
+    } else {
+        void *buffer = qlibcamera::FramePool::global()->allocate(pattern_.frameSize());
+        uint8_t *data = static_cast<uint8_t *>(buffer);
+        const size_t used = data ? pattern_.render(sequence_, data) : 0;
+
+        if (!used) {
+            qlibcamera::FramePool::release(buffer);
+            framesDropped_++;
+        } else {
+            TestPatternFrameData *frame = new TestPatternFrameData(outstanding_, buffer);
+
+            frame->planeCount = pattern_.planeCount();
+            for (int i = 0; i < frame->planeCount; i++) {
+                frame->planes[i].data = data + pattern_.planeOffset(i);
+                frame->planes[i].size = frame->planeCount == 1 ? used : pattern_.planeSize(i);
+            }
+            frame->sequence = sequence_;
+            frame->timestamps.sensor = sensorTimestamp(sequence_);
+            frame->timestamps.requestComplete = qlibcamera::LatencyStats::now();
+            frame->timestamp = frame->timestamps.sensor / 1000000;
+
+            framesGenerated_++;
+            Q_EMIT frameCompleted(LibCameraFrame(frame));
+        }
+    }
+
+    sequence_++;
+    schedule();
+}
+
+/*
+ * Replayed frames in flight. Releasing a frame wakes the worker up if it
+ * waits for a buffer.
+ */
+struct LibCameraReplayWorker::Buffers {
+    QMutex mutex; /* Protects receiver and waiting */
+    LibCameraReplayWorker *receiver = nullptr;
+    bool waiting = false;
+    std::atomic<unsigned int> outstanding = 0;
+
+    void release()
+    {
+        outstanding--;
+
+        QMutexLocker locker(&mutex);
+        if (!waiting || !receiver)
+            return;
+
+        waiting = false;
+        QMetaObject::invokeMethod(receiver, [worker = receiver]() {
+            worker->replay();
+        }, Qt::QueuedConnection);
+    }
+};
+
+/* A replayed frame, its planes point into the mapping of the file. */
+class LibCameraReplayWorker::Frame : public LibCameraFrameData
+{
+public:
+    Frame(std::shared_ptr<qlibcamera::RawCaptureReader> reader, std::shared_ptr<Buffers> buffers)
+        : reader_(std::move(reader)), buffers_(std::move(buffers))
+    {
+        lease = true;
+        buffers_->outstanding++;
+    }
+
+    ~Frame()
+    {
+        buffers_->release();
+    }
+
+private:
+    std::shared_ptr<qlibcamera::RawCaptureReader> reader_;
+    std::shared_ptr<Buffers> buffers_;
+};
+
+LibCameraReplayWorker::LibCameraReplayWorker(QObject *parent)
+    : QObject{parent}, buffers_(std::make_shared<Buffers>()), timer_(new QTimer(this)),
+    running_(false), maximumSpeed_(false), loop_(false), bufferCount_(DefaultBufferCount),
+    index_(0), loops_(0), sequenceSpan_(0), frameSize_(0), offset_(0), framesReplayed_(0), framesDropped_(0)
+{
+    buffers_->receiver = this;
+
+    timer_->setSingleShot(true);
+    timer_->setTimerType(Qt::PreciseTimer);
+    connect(timer_, &QTimer::timeout, this, &LibCameraReplayWorker::replay);
+}
+
+LibCameraReplayWorker::~LibCameraReplayWorker()
+{
+    QMutexLocker locker(&buffers_->mutex);
+    buffers_->receiver = nullptr;
+}
+
+/*
+ * Map \a filename. Frames of a previous file stay valid until released, they
+ * keep their mapping.
+ */
+int LibCameraReplayWorker::open(const QString &filename)
+{
+    std::shared_ptr<qlibcamera::RawCaptureReader> reader = std::make_shared<qlibcamera::RawCaptureReader>();
+
+    int ret = reader->open(filename.toStdString());
+    if (ret < 0)
+        return ret;
+
+    /*
+     * The converter trusts the header, make sure every plane holds the rows
+     * it reads before any is replayed.
+     */
+    size_t planeSizes[qlibcamera::RawCapture::MaxPlanes];
+    const int planeCount = qlibcamera::RawCapture::planeSizes(reader->format(), reader->size(),
+                                                              reader->stride(), planeSizes);
+    if (planeCount < 0) {
+        qWarning() << "Can't replay" << reader->format().toString().c_str() << "frames of"
+                   << reader->size() << "and stride" << reader->stride();
+        return planeCount;
+    }
+
+    size_t frameSize = 0;
+    for (size_t i = 0; i < reader->frameCount(); i++) {
+        const qlibcamera::RawCaptureReader::Frame frame = reader->frame(i);
+        size_t size = 0;
+
+        if (frame.planeCount < planeCount) {
+            qWarning() << "Frame" << i << "of" << filename << "lacks planes";
+            return -EINVAL;
+        }
+
+        for (int j = 0; j < frame.planeCount; j++) {
+            if (j < planeCount && frame.planeSizes[j] < planeSizes[j]) {
+                qWarning() << "Plane" << j << "of frame" << i << "of" << filename << "is too short";
+                return -EINVAL;
+            }
+
+            size += frame.planeSizes[j];
+        }
+        frameSize = std::max(frameSize, size);
+    }
+
+    reader_ = std::move(reader);
+    sequenceSpan_ = reader_->frame(reader_->frameCount() - 1).sequence - reader_->frame(0).sequence + 1;
+    frameSize_ = frameSize;
+
+    return 0;
+}
+
+libcamera::PixelFormat LibCameraReplayWorker::format() const
+{
+    return reader_ ? reader_->format() : libcamera::PixelFormat();
+}
+
+QSize LibCameraReplayWorker::size() const
+{
+    return reader_ ? reader_->size() : QSize();
+}
+
+unsigned int LibCameraReplayWorker::stride() const
+{
+    return reader_ ? reader_->stride() : 0;
+}
+
+size_t LibCameraReplayWorker::frameSize() const
+{
+    return frameSize_;
+}
+
+void LibCameraReplayWorker::start(bool maximumSpeed, bool loop, unsigned int bufferCount)
+{
+    if (!reader_)
+        return;
+
+    maximumSpeed_ = maximumSpeed;
+    loop_ = loop;
+    bufferCount_ = bufferCount ? bufferCount : DefaultBufferCount;
+
+    index_ = 0;
+    loops_ = 0;
+    offset_ = qlibcamera::LatencyStats::now() - recordedTimestamp(0);
+    running_ = true;
+
+    timer_->start(0);
+}
+
+void LibCameraReplayWorker::stop()
+{
+    running_ = false;
+    timer_->stop();
+
+    QMutexLocker locker(&buffers_->mutex);
+    buffers_->waiting = false;
+}
+
+quint64 LibCameraReplayWorker::framesReplayed() const
+{
+    return framesReplayed_;
+}
+
+quint64 LibCameraReplayWorker::framesDropped() const
+{
+    return framesDropped_;
+}
+
+uint64_t LibCameraReplayWorker::recordedTimestamp(size_t index) const
+{
+    return reader_->frame(index).timestamp;
+}
+
+/* Wake up when the current frame is due. */
+void LibCameraReplayWorker::schedule()
+{
+    const uint64_t due = recordedTimestamp(index_) + offset_;
+    const uint64_t now = qlibcamera::LatencyStats::now();
+
+    timer_->start(due > now ? (due - now + 999999) / 1000000 : 0);
+}
+
+void LibCameraReplayWorker::replay()
+{
+    if (!running_)
+        return;
+
+    if (!maximumSpeed_) {
+        const uint64_t due = recordedTimestamp(index_) + offset_;
+
+        if (qlibcamera::LatencyStats::now() < due) {
+            schedule();
+            return;
+        }
+
+        if (buffers_->outstanding < bufferCount_)
+            complete(due);
+        else
+            framesDropped_++;
+
+        if (advance())
+            schedule();
+        return;
+    }
+
+    /*
+     * Complete a frame per free buffer, then yield to the event loop so that
+     * stop() gets through even if consumers keep up.
+     */
+    for (unsigned int i = 0; i < bufferCount_; i++) {
+        {
+            QMutexLocker locker(&buffers_->mutex);
+            if (buffers_->outstanding >= bufferCount_) {
+                buffers_->waiting = true;
+                return;
+            }
+        }
+
+        complete(qlibcamera::LatencyStats::now());
+        if (!advance())
+            return;
+    }
+
+    timer_->start(0);
+}
+
+/* Complete the current frame, with \a timestamp as its sensor timestamp. */
+bool LibCameraReplayWorker::complete(uint64_t timestamp)
+{
+    const qlibcamera::RawCaptureReader::Frame recorded = reader_->frame(index_);
+    Frame *frame = new Frame(reader_, buffers_);
+
+    frame->planeCount = recorded.planeCount;
+    for (int i = 0; i < recorded.planeCount; i++) {
+        frame->planes[i].data = recorded.planes[i];
+        frame->planes[i].size = recorded.planeSizes[i];
+    }
+    frame->sequence = recorded.sequence + loops_ * sequenceSpan_;
+    frame->timestamps.sensor = timestamp;
+    frame->timestamps.requestComplete = qlibcamera::LatencyStats::now();
+    frame->timestamp = timestamp / 1000000;
+
+    framesReplayed_++;
+    Q_EMIT frameCompleted(LibCameraFrame(frame));
+
+    return true;
+}
+
+/*
+ * Move to the next frame. Loops continue one frame interval after the last
+ * frame, replay ends otherwise.
+ */
+bool LibCameraReplayWorker::advance()
+{
+    const size_t count = reader_->frameCount();
+
+    if (++index_ < count)
+        return true;
+
+    if (!loop_) {
+        running_ = false;
+        Q_EMIT finished();
+        return false;
+    }
+
+    const uint64_t duration = recordedTimestamp(count - 1) - recordedTimestamp(0);
+    const uint64_t interval = count > 1 ? duration / (count - 1) : 1000000000ULL / 30;
+
+    offset_ += duration + interval;
+    index_ = 0;
+    loops_++;
+
+    return true;
+}
+
+LibCameraCaptureWorker::LibCameraCaptureWorker(QObject *parent)
+    : QObject{parent},
+    mailbox_(this, [this](LibCameraFrame frame) { onFrameReady(frame); }, qlibcamera::MailboxPolicy::BlockCapture),
+    stride_(0)
+{
+
+}
+
+LibCameraMailbox<LibCameraFrame> *LibCameraCaptureWorker::mailbox()
+{
+    return &mailbox_;
+}
+
+void LibCameraCaptureWorker::onStart(const libcamera::PixelFormat &format, const QSize &size,
+                                     unsigned int stride)
+{
+    onEnd();
+
+    /* A recording started, rather than triggered, leaves out the ring. */
+    ring_.clear();
+
+    filename_ = QString("%1.qlcraw").arg(QDateTime::currentMSecsSinceEpoch());
+
+    int ret = writer_.open(filename_.toStdString(), format, size, stride);
+    if (ret < 0)
+        qWarning() << "Failed to create" << filename_ << ":" << strerror(-ret);
+}
+
+/* Copy frames into a ring of the last \a duration ns or \a bytes of frames. */
+void LibCameraCaptureWorker::onPreEventStart(const libcamera::PixelFormat &format, const QSize &size,
+                                             unsigned int stride, qint64 duration, qint64 bytes,
+                                             qint32 frames)
+{
+    onPreEventEnd();
+
+    int ret = ring_.allocate(bytes, frames, duration);
+    if (ret < 0) {
+        qWarning() << "Failed to allocate the pre-event ring:" << strerror(-ret);
+        return;
+    }
+
+    format_ = format;
+    size_ = size;
+    stride_ = stride;
+}
+
+/* Write the ring out and keep recording. */
+void LibCameraCaptureWorker::onPreEventTrigger()
+{
+    if (!ring_.isAllocated() || writer_.isOpen())
+        return;
+
+    filename_ = QString("%1.qlcraw").arg(QDateTime::currentMSecsSinceEpoch());
+
+    int ret = writer_.open(filename_.toStdString(), format_, size_, stride_);
+    if (ret < 0) {
+        qWarning() << "Failed to create" << filename_ << ":" << strerror(-ret);
+        return;
+    }
+
+    for (size_t i = 0; i < ring_.count(); i++) {
+        const uint8_t *data = ring_.data(ring_.at(i));
+
+        ret = writer_.append(reinterpret_cast<const qlibcamera::RawCapture::FrameRecord *>(data));
+        if (ret < 0) {
+            qWarning() << "Failed to write" << filename_ << ":" << strerror(-ret);
+            onEnd();
+            break;
+        }
+    }
+
+    ring_.clear();
+
+    if (writer_.isOpen())
+        Q_EMIT frameRecorded(writer_.frameCount());
+}
+
+void LibCameraCaptureWorker::onPreEventEnd()
+{
+    if (!ring_.isAllocated())
+        return;
+
+    onEnd();
+    ring_.free();
+}
+
+void LibCameraCaptureWorker::onFrameReady(LibCameraFrame frame)
+{
+    if (!writer_.isOpen()) {
+        if (!ring_.isAllocated())
+            return;
+
+        uint8_t *data = ring_.push(qlibcamera::RawCapture::recordSize(frame),
+                                   frame.timestamps().sensor, true);
+        if (data)
+            qlibcamera::RawCapture::serialize(frame, format_, size_, stride_, data);
+        return;
+    }
+
+    int ret = writer_.append(frame);
+    if (ret < 0) {
+        qWarning() << "Failed to write" << filename_ << ":" << strerror(-ret);
+        onEnd();
+        return;
+    }
+
+    Q_EMIT frameRecorded(writer_.frameCount());
+}
+
+void LibCameraCaptureWorker::onEnd()
+{
+    if (!writer_.isOpen())
+        return;
+
+    const qint32 frameCount = writer_.frameCount();
+    writer_.close();
+
+    Q_EMIT completed(filename_, frameCount);
 }
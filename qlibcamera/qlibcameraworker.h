@@ -3,8 +3,11 @@
 #include <QObject>
 #include <QThread>
 #include <QImage>
+#include <QTimer>
 
+#include <libcamera/controls.h>
 #include <libcamera/formats.h>
+#include <libcamera/stream.h>
 
 extern "C" {
     #include <libavcodec/avcodec.h>
@@ -13,7 +16,19 @@ extern "C" {
     #include <libavutil/imgutils.h>
 }
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "format_converter.h"
+#include "latency_histogram.h"
+#include "mjpeg_decoder.h"
+#include "qlibcameraframe.h"
+#include "qlibcameramailbox.h"
+#include "pre_event_ring.h"
+#include "raw_capture.h"
+#include "test_pattern.h"
 
 class LibCameraThread: public QThread
 {
@@ -22,7 +37,14 @@ public:
     explicit LibCameraThread(QObject *parent = nullptr);
     ~LibCameraThread();
 
+    static LibCameraThread *acquire(const QString &name);
+    static void release(LibCameraThread *thread);
+
     void run() override;
+
+private:
+    QString name_;
+    int users_;
 };
 
 class LibCameraProcessWorker: public QObject
@@ -33,20 +55,29 @@ public:
 
     virtual void process();
 
+    LibCameraMailbox<LibCameraFrame> *mailbox();
+    void setLatencyStats(std::shared_ptr<qlibcamera::LatencyStats> latencyStats);
+
 Q_SIGNALS:
-    void completed(QImage image, quint64 timestamp);
+    void completed(QImage image, qlibcamera::FrameInfo info);
 
 public Q_SLOTS:
-    void onFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride);
-    void onFrameReady(QList<QByteArray> dataList, quint64 timestamp);
+    void onFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                         const std::optional<libcamera::ColorSpace> &colorSpace);
+    void onOutputChanged(const QSize &size, const QRect &crop, qlibcamera::ScaleFilter filter,
+                         QImage::Format format);
+    void onFrameReady(LibCameraFrame frame);
 
 private:
+    LibCameraMailbox<LibCameraFrame> mailbox_;
+    std::shared_ptr<qlibcamera::LatencyStats> latencyStats_;
+
     qlibcamera::FormatConverter converter_;
     libcamera::PixelFormat format_;
     QSizeF size_;
+    QRect crop_;
 
     QImage image_;
-    QByteArray imageBuffer_;
 };
 
 class LibCameraSnapshotWorker : public QObject
@@ -59,7 +90,245 @@ Q_SIGNALS:
     void completed(QString filename);
 
 public Q_SLOTS:
-    void onFrameReady(QImage image, quint64 timestamp);
+    void onFrameReady(QImage image, qlibcamera::FrameInfo info);
+    void onFormatChanged(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                         const std::optional<libcamera::ColorSpace> &colorSpace);
+    void onStillFrameReady(LibCameraFrame frame);
+
+private:
+    void save(const QImage &image, const qlibcamera::FrameInfo &info);
+
+private:
+    qlibcamera::FormatConverter converter_;
+    libcamera::PixelFormat format_;
+    QSize size_;
+};
+
+/**
+ * \brief A raw frame and the metadata of the request that captured it
+ */
+struct LibCameraRawFrame
+{
+    LibCameraFrame frame;
+    libcamera::ControlList metadata;
+};
+
+class LibCameraRawWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit LibCameraRawWorker(QObject *parent = nullptr);
+
+    LibCameraMailbox<LibCameraRawFrame> *mailbox();
+
+Q_SIGNALS:
+    void completed(QString filename);
+
+public Q_SLOTS:
+    void onFormatChanged(const libcamera::PixelFormat &format, const QSize &size,
+                         unsigned int stride, const QString &model);
+    void onFrameReady(LibCameraRawFrame frame);
+
+private:
+    LibCameraMailbox<LibCameraRawFrame> mailbox_;
+
+    libcamera::StreamConfiguration config_;
+    std::string model_;
+};
+
+/**
+ * \brief Frames of several cameras captured at the same time
+ */
+struct LibCameraFrameSet
+{
+    quint64 timestamp = 0;          /* Earliest sensor timestamp of the set, in ns */
+    quint64 skew = 0;               /* Spread of the sensor timestamps, in ns */
+    QList<LibCameraFrame> frames;   /* One frame per camera, in camera order */
+};
+
+class LibCameraSyncWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit LibCameraSyncWorker(QObject *parent = nullptr);
+
+    virtual void process(QList<QImage> &images, quint64 timestamp);
+
+    LibCameraMailbox<LibCameraFrameSet> *mailbox();
+
+Q_SIGNALS:
+    void completed(QList<QImage> images, quint64 timestamp);
+
+public Q_SLOTS:
+    void onFormatChanged(qint32 index, const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                         const std::optional<libcamera::ColorSpace> &colorSpace);
+    void onFrameSetReady(LibCameraFrameSet frameSet);
+
+private:
+    struct Stream {
+        qlibcamera::FormatConverter converter;
+        libcamera::PixelFormat format;
+        QSize size;
+    };
+
+    LibCameraMailbox<LibCameraFrameSet> mailbox_;
+    std::vector<std::unique_ptr<Stream>> streams_;
+};
+
+/**
+ * \brief Renders test pattern frames, paced like a sensor
+ *
+ * Frame n is exposed from the start time plus n frame periods and completes
+ * one period later, so sensor timestamps are evenly spaced on the boot time
+ * clock whatever the scheduling jitter. Frames whose readout ends while the
+ * worker is busy are lost, as on a sensor, and so are frames completing
+ * while every buffer is held by consumers.
+ */
+class LibCameraTestPatternWorker : public QObject
+{
+    Q_OBJECT
+public:
+    static constexpr unsigned int DefaultBufferCount = 4;
+
+    explicit LibCameraTestPatternWorker(QObject *parent = nullptr);
+
+    int configure(const libcamera::PixelFormat &format, const QSize &size,
+                  qlibcamera::TestPattern::Pattern pattern);
+    unsigned int stride() const;
+    size_t frameSize() const;
+
+    void start(qint32 fps, unsigned int bufferCount);
+    void stop();
+    void setFps(qint32 fps);
+    void setPattern(qlibcamera::TestPattern::Pattern pattern);
+
+    quint64 framesGenerated() const;
+    quint64 framesDropped() const;
+
+Q_SIGNALS:
+    void frameCompleted(LibCameraFrame frame);
+
+private:
+    uint64_t sensorTimestamp(unsigned int sequence) const;
+    void schedule();
+    void generate();
+
+    qlibcamera::TestPattern pattern_;
+    libcamera::PixelFormat format_;
+    QSize size_;
+    QTimer *timer_;
+
+    /* Sensor timing: frame baseSequence_ was exposed at base_ */
+    uint64_t base_;
+    unsigned int baseSequence_;
+    uint64_t period_;
+    unsigned int sequence_;
+
+    unsigned int bufferCount_;
+    std::shared_ptr<std::atomic<unsigned int>> outstanding_;
+
+    std::atomic<quint64> framesGenerated_;
+    std::atomic<quint64> framesDropped_;
+};
+
+/**
+ * \brief Replays a raw capture file from its mapping
+ *
+ * Frames reference the mapped planes, nothing is copied. At the original
+ * speed frames are completed at their recorded intervals and lost if every
+ * buffer is held by consumers, as on a sensor. At maximum speed a frame is
+ * completed whenever a buffer is free, which makes the consumers the
+ * bottleneck.
+ */
+class LibCameraReplayWorker : public QObject
+{
+    Q_OBJECT
+public:
+    static constexpr unsigned int DefaultBufferCount = 4;
+
+    explicit LibCameraReplayWorker(QObject *parent = nullptr);
+    ~LibCameraReplayWorker();
+
+    int open(const QString &filename);
+    libcamera::PixelFormat format() const;
+    QSize size() const;
+    unsigned int stride() const;
+    size_t frameSize() const;
+
+    void start(bool maximumSpeed, bool loop, unsigned int bufferCount);
+    void stop();
+
+    quint64 framesReplayed() const;
+    quint64 framesDropped() const;
+
+Q_SIGNALS:
+    void frameCompleted(LibCameraFrame frame);
+    void finished();
+
+private:
+    struct Buffers;
+    class Frame;
+
+    uint64_t recordedTimestamp(size_t index) const;
+    void schedule();
+    void replay();
+    bool complete(uint64_t timestamp);
+    bool advance();
+
+    std::shared_ptr<qlibcamera::RawCaptureReader> reader_;
+    std::shared_ptr<Buffers> buffers_;
+    QTimer *timer_;
+
+    bool running_;
+    bool maximumSpeed_;
+    bool loop_;
+    unsigned int bufferCount_;
+
+    /* Replay position and the offset from recorded to replayed time */
+    size_t index_;
+    quint32 loops_;
+    quint32 sequenceSpan_;
+    size_t frameSize_;      /* Largest frame of the file */
+    uint64_t offset_;
+
+    std::atomic<quint64> framesReplayed_;
+    std::atomic<quint64> framesDropped_;
+};
+
+/**
+ * \brief Writes recorded frames unmodified to a raw capture file
+ */
+class LibCameraCaptureWorker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit LibCameraCaptureWorker(QObject *parent = nullptr);
+
+    LibCameraMailbox<LibCameraFrame> *mailbox();
+
+Q_SIGNALS:
+    void frameRecorded(qint32 frameCount);
+    void completed(QString filename, qint32 frameCount);
+
+public Q_SLOTS:
+    void onStart(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride);
+    void onPreEventStart(const libcamera::PixelFormat &format, const QSize &size, unsigned int stride,
+                         qint64 duration, qint64 bytes, qint32 frames);
+    void onPreEventTrigger();
+    void onPreEventEnd();
+    void onFrameReady(LibCameraFrame frame);
+    void onEnd();
+
+private:
+    LibCameraMailbox<LibCameraFrame> mailbox_;
+    qlibcamera::RawCaptureWriter writer_;
+    QString filename_;
+
+    /* Frames preceding a recording, serialized as stored in the file */
+    qlibcamera::PreEventRing ring_;
+    libcamera::PixelFormat format_;
+    QSize size_;
+    unsigned int stride_;
 };
 
 class LibCameraRecordingWorker : public QObject
@@ -68,19 +337,37 @@ class LibCameraRecordingWorker : public QObject
 public:
     explicit LibCameraRecordingWorker(QObject *parent = nullptr);
 
+    LibCameraMailbox<LibCameraFrame> *mailbox();
+    void setLatencyStats(std::shared_ptr<qlibcamera::LatencyStats> latencyStats);
+
 Q_SIGNALS:
     void frameRecorded(qint32 frameCount);
+    void framesLost(qint32 count);
     void completed(QString filename, qint32 frameCount);
+    void failed();      /* The encoder could not be opened */
 
 public Q_SLOTS:
-    void onStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat, qint32 bitRate);
-    void onFrameReady(QList<QByteArray> dataList, quint64 timestamp);
+    void onStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat,
+                 unsigned int stride, qint32 bitRate);
+    void onPreEventStart(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat,
+                         unsigned int stride, qint32 bitRate, qint64 duration, qint64 bytes, qint32 frames);
+    void onPreEventTrigger();
+    void onPreEventEnd();
+    void onFrameReady(LibCameraFrame frame);
     void onEnd();
 
 private:
-    void encode(AVFrame *frame);
+    bool openEncoder(qint32 width, qint32 height, qint32 fps, libcamera::PixelFormat pixelFormat,
+                     unsigned int stride, qint32 bitRate);
+    void closeEncoder();
+    bool openFile();
+    void closeFile();
+    bool encode(AVFrame *frame, uint64_t timestamp);
 
 private:
+    LibCameraMailbox<LibCameraFrame> mailbox_;
+    std::shared_ptr<qlibcamera::LatencyStats> latencyStats_;
+
     QString filename_;
     const AVCodec *codec_;
     AVCodecContext *codecContext_;
@@ -88,7 +375,15 @@ private:
     AVFrame *frame_;
     AVPacket *packet_;
     libcamera::PixelFormat pixelFormat_;
+    unsigned int stride_;                  /* Of the stream, chosen by the ISP */
+    qlibcamera::MjpegDecoder decoder_;     /* Of MJPEG streams, to YUV */
 
     bool running_;
-    qint32 frameCount_;
+    qint32 frameCount_;     /* Packets written to the file */
+    int64_t pts_;
+    bool forceKeyFrame_;
+    bool waitKeyFrame_;     /* Drop packets until a key frame */
+
+    /* Encoded packets preceding a recording */
+    qlibcamera::PreEventRing ring_;
 };
@@ -0,0 +1,463 @@
+#include "raw_capture.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iterator>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <libcamera/formats.h>
+
+using namespace qlibcamera;
+
+namespace {
+
+constexpr uint64_t align(uint64_t value)
+{
+    return (value + RawCapture::Alignment - 1) & ~(RawCapture::Alignment - 1);
+}
+
+/* Write all of \a iov, resuming after short writes. */
+int writeAll(int fd, struct iovec *iov, int count)
+{
+    while (count) {
+        ssize_t ret = ::writev(fd, iov, count);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        while (count && static_cast<size_t>(ret) >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count) {
+            iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return 0;
+}
+
+const uint8_t padding[RawCapture::Alignment] = {};
+
+/* The record of \a frame, with plane offsets and the padded record size */
+RawCapture::FrameRecord frameRecord(const LibCameraFrame &frame)
+{
+    RawCapture::FrameRecord record = {};
+    uint64_t size = align(sizeof(record));
+
+    record.magic = RawCapture::FrameMagic;
+    record.planeCount = frame.planeCount();
+    record.sequence = frame.sequence();
+    record.timestamp = frame.timestamps().sensor;
+
+    for (int i = 0; i < frame.planeCount(); i++) {
+        record.planeOffset[i] = size;
+        record.planeSize[i] = frame.size(i);
+        size += align(frame.size(i));
+    }
+
+    record.size = size;
+
+    return record;
+}
+
+} /* namespace */
+
+/* Bytes taken by \a frame in a raw capture file */
+uint64_t RawCapture::recordSize(const LibCameraFrame &frame)
+{
+    return frameRecord(frame).size;
+}
+
+/*
+ * Lay out \a frame in \a data as it is stored in a file, for a later
+ * RawCaptureWriter::append(). \a data must hold recordSize() bytes.
+ */
+void RawCapture::serialize(const LibCameraFrame &frame, const libcamera::PixelFormat &format,
+                           const QSize &size, unsigned int stride, uint8_t *data)
+{
+    FrameRecord record = frameRecord(frame);
+    record.fourcc = format.fourcc();
+    record.stride = stride;
+    record.width = size.width();
+    record.height = size.height();
+
+    memcpy(data, &record, sizeof(record));
+    for (unsigned int i = 0; i < record.planeCount; i++)
+        memcpy(data + record.planeOffset[i], frame.constData(i), record.planeSize[i]);
+}
+
+namespace {
+
+/* Layout of the frames of a format */
+struct PlaneLayout {
+    libcamera::PixelFormat format;
+    unsigned int bits;          /* Per pixel of the first plane */
+    unsigned int planes;
+    unsigned int chromaStride;  /* Of the other planes, in halves of the stride */
+    unsigned int chromaRows;    /* Luma rows per chroma row */
+};
+
+#define PACKED(format, bits) { libcamera::formats::format, bits, 1, 0, 1 }
+
+#define BAYER(bits, suffix, packedBits)                 \
+    PACKED(SRGGB##bits##suffix, packedBits),            \
+    PACKED(SGRBG##bits##suffix, packedBits),            \
+    PACKED(SGBRG##bits##suffix, packedBits),            \
+    PACKED(SBGGR##bits##suffix, packedBits)
+
+/*
+ * Looked up with PixelFormat::operator==(), as the CSI-2 packed formats share
+ * their fourcc with the unpacked ones and differ only by the modifier.
+ */
+const PlaneLayout planeLayouts[] = {
+    PACKED(R8, 8),
+    BAYER(8, , 8),
+    BAYER(10, , 16),
+    BAYER(12, , 16),
+    BAYER(16, , 16),
+    BAYER(10, _CSI2P, 10),
+    BAYER(12, _CSI2P, 12),
+    PACKED(RGB565, 16),
+    PACKED(YUYV, 16), PACKED(YVYU, 16), PACKED(UYVY, 16), PACKED(VYUY, 16),
+    PACKED(RGB888, 24), PACKED(BGR888, 24),
+    PACKED(ARGB8888, 32), PACKED(XRGB8888, 32), PACKED(RGBA8888, 32), PACKED(RGBX8888, 32),
+    PACKED(ABGR8888, 32), PACKED(XBGR8888, 32), PACKED(BGRA8888, 32), PACKED(BGRX8888, 32),
+    { libcamera::formats::YUV420, 8, 3, 1, 2 },
+    { libcamera::formats::YVU420, 8, 3, 1, 2 },
+    { libcamera::formats::YUV422, 8, 3, 1, 1 },
+    { libcamera::formats::YUV444, 8, 3, 2, 1 },
+    { libcamera::formats::NV12, 8, 2, 2, 2 },
+    { libcamera::formats::NV21, 8, 2, 2, 2 },
+    { libcamera::formats::NV16, 8, 2, 2, 1 },
+    { libcamera::formats::NV61, 8, 2, 2, 1 },
+    { libcamera::formats::NV24, 8, 2, 4, 1 },
+    { libcamera::formats::NV42, 8, 2, 4, 1 },
+};
+
+#undef BAYER
+#undef PACKED
+
+} /* namespace */
+
+/*
+ * Bytes each plane of frames of \a format, \a size and \a stride takes at
+ * least, in \a sizes. Returns the number of planes, 0 for formats of variable
+ * frame size such as MJPEG, or -EINVAL if the format is unknown or its rows
+ * don't fit in \a stride.
+ */
+int RawCapture::planeSizes(const libcamera::PixelFormat &format, const QSize &size,
+                           unsigned int stride, size_t sizes[MaxPlanes])
+{
+    if (format == libcamera::formats::MJPEG)
+        return 0;
+
+    const PlaneLayout *layout = std::find_if(std::begin(planeLayouts), std::end(planeLayouts),
+                                             [&](const PlaneLayout &l) { return l.format == format; });
+    if (layout == std::end(planeLayouts))
+        return -EINVAL;
+
+    if (size.isEmpty() || stride < (uint64_t(size.width()) * layout->bits + 7) / 8)
+        return -EINVAL;
+
+    const size_t height = size.height();
+    const size_t chromaStride = size_t(stride) * layout->chromaStride / 2;
+
+    sizes[0] = size_t(stride) * height;
+    for (unsigned int i = 1; i < layout->planes; i++)
+        sizes[i] = chromaStride * ((height + layout->chromaRows - 1) / layout->chromaRows);
+
+    return layout->planes;
+}
+
+RawCaptureWriter::RawCaptureWriter()
+    : fd_(-1), offset_(0), header_{}
+{
+}
+
+RawCaptureWriter::~RawCaptureWriter()
+{
+    close();
+}
+
+int RawCaptureWriter::open(const std::string &filename, const libcamera::PixelFormat &format,
+                           const QSize &size, unsigned int stride)
+{
+    close();
+
+    fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+        return -errno;
+
+    header_ = {};
+    memcpy(header_.magic, RawCapture::FileMagic, sizeof(header_.magic));
+    header_.version = RawCapture::Version;
+    header_.headerSize = sizeof(header_);
+    header_.fourcc = format.fourcc();
+    header_.modifier = format.modifier();
+    header_.width = size.width();
+    header_.height = size.height();
+    header_.stride = stride;
+
+    struct iovec iov = { &header_, sizeof(header_) };
+    int ret = writeAll(fd_, &iov, 1);
+    if (ret < 0) {
+        ::close(fd_);
+        fd_ = -1;
+        return ret;
+    }
+
+    offset_ = sizeof(header_);
+    index_.clear();
+
+    return 0;
+}
+
+int RawCaptureWriter::append(const LibCameraFrame &frame)
+{
+    if (fd_ < 0)
+        return -EBADF;
+
+    RawCapture::FrameRecord record = frameRecord(frame);
+    record.fourcc = header_.fourcc;
+    record.stride = header_.stride;
+    record.width = header_.width;
+    record.height = header_.height;
+
+    /* Record, then each plane, each padded to the alignment. */
+    struct iovec iov[2 + 2 * RawCapture::MaxPlanes];
+    int count = 0;
+
+    iov[count++] = { &record, sizeof(record) };
+    iov[count++] = { const_cast<uint8_t *>(padding), align(sizeof(record)) - sizeof(record) };
+
+    for (int i = 0; i < frame.planeCount(); i++) {
+        const uint64_t length = frame.size(i);
+
+        iov[count++] = { const_cast<uchar *>(frame.constData(i)), length };
+        if (align(length) != length)
+            iov[count++] = { const_cast<uint8_t *>(padding), align(length) - length };
+    }
+
+    int ret = writeAll(fd_, iov, count);
+    if (ret < 0)
+        return ret;
+
+    index_.push_back({ offset_, record.timestamp });
+    offset_ += record.size;
+
+    return 0;
+}
+
+/* Append a record laid out by RawCapture::serialize(). */
+int RawCaptureWriter::append(const RawCapture::FrameRecord *record)
+{
+    if (fd_ < 0)
+        return -EBADF;
+
+    struct iovec iov = { const_cast<RawCapture::FrameRecord *>(record), record->size };
+    int ret = writeAll(fd_, &iov, 1);
+    if (ret < 0)
+        return ret;
+
+    index_.push_back({ offset_, record->timestamp });
+    offset_ += record->size;
+
+    return 0;
+}
+
+/* Write the index and the trailer, and close the file. */
+int RawCaptureWriter::close()
+{
+    if (fd_ < 0)
+        return 0;
+
+    RawCapture::Trailer trailer = {};
+    trailer.magic = RawCapture::IndexMagic;
+    trailer.version = RawCapture::Version;
+    trailer.count = index_.size();
+    trailer.indexOffset = offset_;
+
+    struct iovec iov[2] = {
+        { index_.data(), index_.size() * sizeof(RawCapture::IndexEntry) },
+        { &trailer, sizeof(trailer) },
+    };
+    int ret = writeAll(fd_, iov, 2);
+
+    ::close(fd_);
+    fd_ = -1;
+    index_.clear();
+
+    return ret;
+}
+
+bool RawCaptureWriter::isOpen() const
+{
+    return fd_ >= 0;
+}
+
+uint64_t RawCaptureWriter::frameCount() const
+{
+    return index_.size();
+}
+
+RawCaptureReader::RawCaptureReader()
+    : data_(nullptr), size_(0)
+{
+}
+
+RawCaptureReader::~RawCaptureReader()
+{
+    if (data_)
+        munmap(const_cast<uint8_t *>(data_), size_);
+}
+
+int RawCaptureReader::open(const std::string &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int ret = -errno;
+        ::close(fd);
+        return ret;
+    }
+
+    if (static_cast<size_t>(st.st_size) < sizeof(RawCapture::FileHeader)) {
+        ::close(fd);
+        return -EINVAL;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return -errno;
+
+    data_ = static_cast<const uint8_t *>(data);
+    size_ = st.st_size;
+
+    const RawCapture::FileHeader *header = reinterpret_cast<const RawCapture::FileHeader *>(data_);
+    if (memcmp(header->magic, RawCapture::FileMagic, sizeof(header->magic)) ||
+        header->version != RawCapture::Version)
+        return -EINVAL;
+
+    if (!readIndex())
+        scanRecords();
+
+    madvise(data, size_, MADV_SEQUENTIAL);
+
+    return offsets_.empty() ? -ENODATA : 0;
+}
+
+libcamera::PixelFormat RawCaptureReader::format() const
+{
+    const RawCapture::FileHeader *header = reinterpret_cast<const RawCapture::FileHeader *>(data_);
+    return libcamera::PixelFormat(header->fourcc, header->modifier);
+}
+
+QSize RawCaptureReader::size() const
+{
+    const RawCapture::FileHeader *header = reinterpret_cast<const RawCapture::FileHeader *>(data_);
+    return QSize(header->width, header->height);
+}
+
+unsigned int RawCaptureReader::stride() const
+{
+    const RawCapture::FileHeader *header = reinterpret_cast<const RawCapture::FileHeader *>(data_);
+    return header->stride;
+}
+
+size_t RawCaptureReader::frameCount() const
+{
+    return offsets_.size();
+}
+
+RawCaptureReader::Frame RawCaptureReader::frame(size_t index) const
+{
+    const RawCapture::FrameRecord *rec = record(offsets_[index]);
+    Frame frame = {};
+
+    frame.sequence = rec->sequence;
+    frame.timestamp = rec->timestamp;
+    frame.planeCount = rec->planeCount;
+    for (int i = 0; i < frame.planeCount; i++) {
+        frame.planes[i] = reinterpret_cast<const uint8_t *>(rec) + rec->planeOffset[i];
+        frame.planeSizes[i] = rec->planeSize[i];
+    }
+
+    return frame;
+}
+
+/* Use the index written on close, if the trailer is intact. */
+bool RawCaptureReader::readIndex()
+{
+    if (size_ < sizeof(RawCapture::FileHeader) + sizeof(RawCapture::Trailer))
+        return false;
+
+    const RawCapture::Trailer *trailer =
+        reinterpret_cast<const RawCapture::Trailer *>(data_ + size_ - sizeof(RawCapture::Trailer));
+    if (trailer->magic != RawCapture::IndexMagic || trailer->version != RawCapture::Version)
+        return false;
+
+    const uint64_t indexSize = trailer->count * sizeof(RawCapture::IndexEntry);
+    if (trailer->indexOffset + indexSize + sizeof(RawCapture::Trailer) != size_)
+        return false;
+
+    const RawCapture::IndexEntry *entries =
+        reinterpret_cast<const RawCapture::IndexEntry *>(data_ + trailer->indexOffset);
+
+    offsets_.clear();
+    offsets_.reserve(trailer->count);
+    for (uint64_t i = 0; i < trailer->count; i++) {
+        if (!record(entries[i].offset)) {
+            offsets_.clear();
+            return false;
+        }
+        offsets_.push_back(entries[i].offset);
+    }
+
+    return true;
+}
+
+/* Walk the records, stopping at the first incomplete one. */
+void RawCaptureReader::scanRecords()
+{
+    offsets_.clear();
+
+    uint64_t offset = sizeof(RawCapture::FileHeader);
+    while (const RawCapture::FrameRecord *rec = record(offset)) {
+        offsets_.push_back(offset);
+        offset += rec->size;
+    }
+}
+
+/* The record at \a offset, or nullptr if it is not a complete record. */
+const RawCapture::FrameRecord *RawCaptureReader::record(uint64_t offset) const
+{
+    if (offset % RawCapture::Alignment || offset + sizeof(RawCapture::FrameRecord) > size_)
+        return nullptr;
+
+    const RawCapture::FrameRecord *rec = reinterpret_cast<const RawCapture::FrameRecord *>(data_ + offset);
+    if (rec->magic != RawCapture::FrameMagic || rec->planeCount > RawCapture::MaxPlanes ||
+        rec->size < sizeof(*rec) || rec->size > size_ - offset)
+        return nullptr;
+
+    for (unsigned int i = 0; i < rec->planeCount; i++) {
+        if (rec->planeOffset[i] > rec->size || rec->planeSize[i] > rec->size - rec->planeOffset[i])
+            return nullptr;
+    }
+
+    return rec;
+}
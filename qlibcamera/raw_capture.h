@@ -0,0 +1,157 @@
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <QSize>
+
+#include <libcamera/pixel_format.h>
+
+#include "qlibcameraframe.h"
+
+namespace qlibcamera {
+
+    /**
+     * \brief Layout of raw capture files
+     *
+     * A raw capture file stores frames exactly as the camera produced them.
+     * It starts with a FileHeader and continues with one FrameRecord per
+     * frame, each followed by its planes. Records and planes start on
+     * Alignment boundaries, so planes can be used in place once the file
+     * is mapped. Closing the file appends an index of the records and a
+     * Trailer pointing to it. Files without a trailer, e.g. after a crash,
+     * are indexed by walking the records.
+     *
+     * All fields are little-endian.
+     */
+    namespace RawCapture {
+
+        static constexpr size_t Alignment = 64;
+        static constexpr int MaxPlanes = LibCameraFrameData::MaxPlanes;
+
+        static constexpr char FileMagic[8] = { 'Q', 'L', 'C', 'R', 'A', 'W', '0', '1' };
+        static constexpr uint32_t FrameMagic = 0x46434c51; /* "QLCF" */
+        static constexpr uint32_t IndexMagic = 0x49434c51; /* "QLCI" */
+        static constexpr uint32_t Version = 1;
+
+        struct FileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t fourcc;
+            uint32_t width;
+            uint32_t height;
+            uint32_t stride;
+            uint64_t modifier;
+            uint8_t reserved[24];
+        };
+
+        struct FrameRecord {
+            uint32_t magic;
+            uint32_t planeCount;
+            uint64_t size;              /* Record and planes, padded */
+            uint64_t sequence;
+            uint64_t timestamp;         /* SensorTimestamp, in ns */
+            uint32_t fourcc;
+            uint32_t stride;
+            uint32_t width;
+            uint32_t height;
+            uint64_t planeOffset[MaxPlanes];  /* From the start of the record */
+            uint64_t planeSize[MaxPlanes];
+        };
+
+        struct IndexEntry {
+            uint64_t offset;
+            uint64_t timestamp;
+        };
+
+        struct Trailer {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t count;
+            uint64_t indexOffset;
+            uint64_t reserved;
+        };
+
+        static_assert(sizeof(FileHeader) == Alignment);
+        static_assert(sizeof(Trailer) == 32);
+
+        uint64_t recordSize(const LibCameraFrame &frame);
+        void serialize(const LibCameraFrame &frame, const libcamera::PixelFormat &format,
+                       const QSize &size, unsigned int stride, uint8_t *data);
+        int planeSizes(const libcamera::PixelFormat &format, const QSize &size,
+                       unsigned int stride, size_t sizes[MaxPlanes]);
+
+    }
+
+    /**
+     * \brief Appends frames to a raw capture file
+     *
+     * Planes are written straight from the frame with a single writev() per
+     * frame. The index is kept in memory and written by close().
+     */
+    class RawCaptureWriter
+    {
+    public:
+        RawCaptureWriter();
+        ~RawCaptureWriter();
+
+        int open(const std::string &filename, const libcamera::PixelFormat &format,
+                 const QSize &size, unsigned int stride);
+        int append(const LibCameraFrame &frame);
+        int append(const RawCapture::FrameRecord *record);
+        int close();
+
+        bool isOpen() const;
+        uint64_t frameCount() const;
+
+    private:
+        int fd_;
+        uint64_t offset_;
+        RawCapture::FileHeader header_;
+        std::vector<RawCapture::IndexEntry> index_;
+    };
+
+    /**
+     * \brief Read-only mapping of a raw capture file
+     *
+     * The whole file is mapped once, frames are served from the mapping
+     * without copies. Keep the reader alive as long as any plane is used.
+     */
+    class RawCaptureReader
+    {
+    public:
+        struct Frame {
+            uint64_t sequence;
+            uint64_t timestamp;
+            int planeCount;
+            const uint8_t *planes[RawCapture::MaxPlanes];
+            size_t planeSizes[RawCapture::MaxPlanes];
+        };
+
+        RawCaptureReader();
+        ~RawCaptureReader();
+
+        int open(const std::string &filename);
+
+        libcamera::PixelFormat format() const;
+        QSize size() const;
+        unsigned int stride() const;
+
+        size_t frameCount() const;
+        Frame frame(size_t index) const;
+
+    private:
+        bool readIndex();
+        void scanRecords();
+        const RawCapture::FrameRecord *record(uint64_t offset) const;
+
+        const uint8_t *data_;
+        size_t size_;
+        std::vector<uint64_t> offsets_;
+    };
+
+}
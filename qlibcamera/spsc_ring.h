@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <utility>
+
+namespace qlibcamera {
+
+    /**
+     * \brief Fixed-capacity lock-free single-producer/single-consumer ring
+     *
+     * push() may only be called from one thread and pop() from one (possibly
+     * different) thread. reset() reallocates the storage and must not race
+     * with either side, it is meant to be called when capture is stopped.
+     */
+    template<typename T>
+    class SpscRing
+    {
+    public:
+        SpscRing()
+            : mask_(0), head_(0), tail_(0)
+        {
+        }
+
+        void reset(size_t capacity)
+        {
+            size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+
+            buffer_ = std::make_unique<T[]>(size);
+            mask_ = size - 1;
+            head_.store(0, std::memory_order_relaxed);
+            tail_.store(0, std::memory_order_relaxed);
+        }
+
+        size_t capacity() const
+        {
+            return buffer_ ? mask_ + 1 : 0;
+        }
+
+        bool push(const T &value)
+        {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            if (!buffer_ || head - tail_.load(std::memory_order_acquire) > mask_)
+                return false;
+
+            buffer_[head & mask_] = value;
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &value)
+        {
+            const size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail == head_.load(std::memory_order_acquire))
+                return false;
+
+            value = std::move(buffer_[tail & mask_]);
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const
+        {
+            return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+        }
+
+        size_t size() const
+        {
+            return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+        }
+
+        /* Consumer side: drop everything queued so far. */
+        void clear()
+        {
+            tail_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+        }
+
+    private:
+        std::unique_ptr<T[]> buffer_;
+        size_t mask_;
+
+        alignas(64) std::atomic<size_t> head_;
+        alignas(64) std::atomic<size_t> tail_;
+    };
+}
@@ -0,0 +1,166 @@
+#include "stripe_pool.h"
+
+#include <algorithm>
+
+#include <QMutexLocker>
+#include <QThread>
+
+using namespace qlibcamera;
+
+namespace {
+
+/* The Pi has four cores, more threads rarely pay off for a memory-bound job. */
+constexpr int DefaultThreadCount = 4;
+
+} /* namespace */
+
+/*
+ * The global pool is shared by every converter, so cameras and stages don't
+ * multiply threads. It is never destroyed.
+ */
+StripePool *StripePool::global()
+{
+    static StripePool *pool = new StripePool();
+    return pool;
+}
+
+StripePool::StripePool()
+    : stopping_(false)
+{
+    startThreads(std::clamp(QThread::idealThreadCount(), 1, DefaultThreadCount) - 1);
+}
+
+StripePool::~StripePool()
+{
+    stopThreads();
+}
+
+/* Threads stripes run on, including the caller of run() */
+unsigned int StripePool::threadCount() const
+{
+    QMutexLocker locker(&mutex_);
+    return threads_.size() + 1;
+}
+
+/*
+ * Resize the pool, 1 runs stripes sequentially on the caller. Jobs in
+ * progress are finished by their callers meanwhile. Not reentrant.
+ */
+void StripePool::setThreadCount(unsigned int count)
+{
+    count = std::max(count, 1u);
+    if (count == threadCount())
+        return;
+
+    stopThreads();
+    startThreads(count - 1);
+}
+
+void StripePool::startThreads(unsigned int count)
+{
+    QMutexLocker locker(&mutex_);
+    stopping_ = false;
+
+    for (unsigned int i = 0; i < count; i++) {
+        QThread *thread = QThread::create([this]() { work(); });
+        thread->setObjectName("stripe");
+        thread->start();
+        threads_.push_back(thread);
+    }
+}
+
+void StripePool::stopThreads()
+{
+    std::vector<QThread *> threads;
+
+    {
+        QMutexLocker locker(&mutex_);
+        stopping_ = true;
+        threads.swap(threads_);
+        wake_.wakeAll();
+    }
+
+    for (QThread *thread : threads) {
+        thread->wait();
+        delete thread;
+    }
+}
+
+void StripePool::work()
+{
+    QMutexLocker locker(&mutex_);
+
+    while (true) {
+        while (!stopping_ && jobs_.empty())
+            wake_.wait(&mutex_);
+
+        if (stopping_)
+            return;
+
+        Job *job = jobs_.front();
+        unsigned int index;
+        take(job, &index);
+
+        locker.unlock();
+        (*job->stripe)(index);
+        locker.relock();
+
+        finish(job);
+    }
+}
+
+/* Start the next stripe of \a job. The job leaves the queue with its last stripe. */
+bool StripePool::take(Job *job, unsigned int *index)
+{
+    if (job->next == job->count)
+        return false;
+
+    *index = job->next++;
+    if (job->next == job->count)
+        jobs_.erase(std::find(jobs_.begin(), jobs_.end(), job));
+
+    return true;
+}
+
+void StripePool::finish(Job *job)
+{
+    if (--job->pending == 0)
+        job->done.wakeAll();
+}
+
+/*
+ * Run stripe(0) to stripe(count - 1), the caller taking its share, and
+ * return when all of them are done.
+ */
+void StripePool::run(unsigned int count, const Stripe &stripe)
+{
+    QMutexLocker locker(&mutex_);
+
+    if (count <= 1 || threads_.empty()) {
+        locker.unlock();
+        for (unsigned int i = 0; i < count; i++)
+            stripe(i);
+        return;
+    }
+
+    Job job;
+    job.stripe = &stripe;
+    job.count = count;
+    job.next = 0;
+    job.pending = count;
+
+    jobs_.push_back(&job);
+    for (unsigned int i = 1; i < count; i++)
+        wake_.wakeOne();
+
+    unsigned int index;
+    while (take(&job, &index)) {
+        locker.unlock();
+        stripe(index);
+        locker.relock();
+        finish(&job);
+    }
+
+    while (job.pending)
+        job.done.wait(&mutex_);
+}
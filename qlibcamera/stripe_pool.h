@@ -0,0 +1,59 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include <QMutex>
+#include <QWaitCondition>
+
+class QThread;
+
+namespace qlibcamera {
+
+    /**
+     * \brief Threads sharing the stripes of a frame
+     *
+     * run() splits a job in stripes, executed by the pool threads and by the
+     * calling thread, and returns once all of them are done. Jobs submitted
+     * concurrently from several threads are served in order, the callers
+     * keep working on their own jobs meanwhile so they never wait for a
+     * busy pool to pick them up.
+     */
+    class StripePool
+    {
+    public:
+        using Stripe = std::function<void(unsigned int index)>;
+
+        static StripePool *global();
+
+        StripePool();
+        ~StripePool();
+
+        unsigned int threadCount() const;
+        void setThreadCount(unsigned int count);
+
+        void run(unsigned int count, const Stripe &stripe);
+
+    private:
+        struct Job {
+            const Stripe *stripe;
+            unsigned int count;
+            unsigned int next;      /* First stripe not started */
+            unsigned int pending;   /* Stripes not done */
+            QWaitCondition done;
+        };
+
+        void startThreads(unsigned int count);
+        void stopThreads();
+        void work();
+        bool take(Job *job, unsigned int *index);
+        void finish(Job *job);
+
+        mutable QMutex mutex_;      /* Protects all members */
+        QWaitCondition wake_;
+        std::vector<Job *> jobs_;
+        std::vector<QThread *> threads_;
+        bool stopping_;
+    };
+
+}
@@ -0,0 +1,289 @@
+#include "test_pattern.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#include <QBuffer>
+#include <QImageWriter>
+
+#include <libcamera/formats.h>
+
+using namespace qlibcamera;
+
+namespace {
+
+/* BT.601 limited range, as produced by most ISPs */
+inline uint8_t toY(int r, int g, int b)
+{
+    return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+inline uint8_t toU(int r, int g, int b)
+{
+    return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+}
+
+inline uint8_t toV(int r, int g, int b)
+{
+    return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+/* Position of an object bouncing between 0 and range after travelling \a travel */
+int bounce(unsigned int travel, int range)
+{
+    if (range <= 0)
+        return 0;
+
+    const unsigned int position = travel % (2 * range);
+    return position <= static_cast<unsigned int>(range) ? position : 2 * range - position;
+}
+
+} /* namespace */
+
+/*
+ * Lay out frames of \a format and \a size and render the background. Sizes
+ * must be even, chroma is subsampled in 2x2 blocks.
+ */
+int TestPattern::configure(const libcamera::PixelFormat &format, const QSize &size, Pattern pattern)
+{
+    if (size.isEmpty() || size.width() % 2 || size.height() % 2)
+        return -EINVAL;
+
+    switch (format) {
+    case libcamera::formats::RGB565:
+    case libcamera::formats::YUYV:
+        layout_ = Packed;
+        bpp_ = 2;
+        break;
+    case libcamera::formats::RGB888:
+    case libcamera::formats::BGR888:
+        layout_ = Packed;
+        bpp_ = 3;
+        break;
+    case libcamera::formats::YUV420:
+        layout_ = Planar;
+        bpp_ = 1;
+        break;
+    case libcamera::formats::NV12:
+        layout_ = SemiPlanar;
+        bpp_ = 1;
+        break;
+    case libcamera::formats::MJPEG:
+        layout_ = Jpeg;
+        bpp_ = 0;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    format_ = format;
+    pattern_ = pattern;
+    width_ = size.width();
+    height_ = size.height();
+
+    /* Lines are aligned to 64 bytes, as most ISPs do. */
+    stride_ = (width_ * bpp_ + 63) & ~63;
+
+    const size_t luma = static_cast<size_t>(stride_) * height_;
+    switch (layout_) {
+    case Packed:
+        planeCount_ = 1;
+        planeSize_[0] = luma;
+        break;
+    case Planar:
+        planeCount_ = 3;
+        planeSize_[0] = luma;
+        planeSize_[1] = luma / 4;
+        planeSize_[2] = luma / 4;
+        break;
+    case SemiPlanar:
+        planeCount_ = 2;
+        planeSize_[0] = luma;
+        planeSize_[1] = luma / 2;
+        break;
+    case Jpeg:
+        /* Worst case payload, as UVC cameras size their buffers */
+        planeCount_ = 1;
+        planeSize_[0] = static_cast<size_t>(width_) * height_ * 2;
+        break;
+    }
+
+    frameSize_ = 0;
+    for (int i = 0; i < planeCount_; i++) {
+        planeOffset_[i] = frameSize_;
+        frameSize_ += planeSize_[i];
+    }
+
+    const QRect rect(0, 0, width_, height_);
+    auto background = [this](int x, int y) { return colour(x, y); };
+
+    if (layout_ == Jpeg) {
+        background_.clear();
+        image_ = QImage(size, QImage::Format_RGB888);
+        frame_ = QImage(size, QImage::Format_RGB888);
+        paint(image_.bits(), rect, background);
+        jpeg_.reserve(frameSize_);
+    } else {
+        image_ = QImage();
+        frame_ = QImage();
+        background_.assign(frameSize_, 0);
+        paint(background_.data(), rect, background);
+    }
+
+    return 0;
+}
+
+/* Bytes per line of the first plane, 0 for MJPEG */
+unsigned int TestPattern::stride() const
+{
+    return stride_;
+}
+
+/* Size of a buffer holding any frame */
+size_t TestPattern::frameSize() const
+{
+    return frameSize_;
+}
+
+int TestPattern::planeCount() const
+{
+    return planeCount_;
+}
+
+size_t TestPattern::planeOffset(int plane) const
+{
+    return planeOffset_[plane];
+}
+
+size_t TestPattern::planeSize(int plane) const
+{
+    return planeSize_[plane];
+}
+
+/*
+ * Render frame \a sequence into \a data, which must hold frameSize() bytes.
+ * Returns the number of bytes used, which only varies for MJPEG, or 0 if the
+ * frame could not be rendered.
+ */
+size_t TestPattern::render(unsigned int sequence, uint8_t *data)
+{
+    const QRect rect = box(sequence);
+    auto foreground = [](int, int) { return qRgb(255, 128, 0); };
+
+    if (layout_ != Jpeg) {
+        memcpy(data, background_.data(), frameSize_);
+        paint(data, rect, foreground);
+        return frameSize_;
+    }
+
+    memcpy(frame_.bits(), image_.constBits(), image_.sizeInBytes());
+    paint(frame_.bits(), rect, foreground);
+
+    /* Opening the buffer truncates it, the capacity is kept. */
+    QBuffer buffer(&jpeg_);
+    buffer.open(QIODevice::WriteOnly);
+
+    QImageWriter writer(&buffer, "JPEG");
+    writer.setQuality(85);
+    if (!writer.write(frame_) || static_cast<size_t>(jpeg_.size()) > frameSize_)
+        return 0;
+
+    memcpy(data, jpeg_.constData(), jpeg_.size());
+    return jpeg_.size();
+}
+
+QRgb TestPattern::colour(int x, int y) const
+{
+    static constexpr QRgb bars[] = {
+        0xffffff, 0xffff00, 0x00ffff, 0x00ff00,
+        0xff00ff, 0xff0000, 0x0000ff, 0x000000,
+    };
+
+    switch (pattern_) {
+    case ColorBars:
+        return bars[x * 8 / width_];
+    case Gradient:
+        return qRgb(x * 255 / (width_ - 1), y * 255 / (height_ - 1),
+                    255 - x * 255 / (width_ - 1));
+    case Checkerboard:
+        return ((x / 32) ^ (y / 32)) & 1 ? qRgb(224, 224, 224) : qRgb(32, 32, 32);
+    }
+
+    return 0;
+}
+
+/*
+ * The box moves diagonally and bounces off the edges. Its position and size
+ * are even, so that it covers whole chroma blocks.
+ */
+QRect TestPattern::box(unsigned int sequence) const
+{
+    const int side = std::max(2, std::min(width_, height_) / 8) & ~1;
+    const int step = std::max(2, width_ / 64);
+
+    const int x = bounce(sequence * step, width_ - side) & ~1;
+    const int y = bounce(sequence * step * 3 / 4, height_ - side) & ~1;
+
+    return QRect(x, y, side, side);
+}
+
+template<typename Colour>
+void TestPattern::paint(uint8_t *data, const QRect &rect, Colour colour) const
+{
+    const unsigned int stride = layout_ == Jpeg ? image_.bytesPerLine() : stride_;
+    uint8_t *planeU = data + (layout_ == Jpeg ? 0 : planeOffset_[std::min(planeCount_ - 1, 1)]);
+    uint8_t *planeV = data + (layout_ == Jpeg ? 0 : planeOffset_[planeCount_ - 1]);
+
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        uint8_t *line = data + y * stride;
+
+        for (int x = rect.left(); x <= rect.right(); x++) {
+            const QRgb rgb = colour(x, y);
+            const int r = qRed(rgb);
+            const int g = qGreen(rgb);
+            const int b = qBlue(rgb);
+            const bool chroma = !(x & 1) && !(y & 1);
+
+            switch (format_) {
+            case libcamera::formats::RGB565: {
+                const uint16_t value = ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+                line[2 * x] = value & 0xff;
+                line[2 * x + 1] = value >> 8;
+                break;
+            }
+            case libcamera::formats::RGB888:
+                line[3 * x] = b;
+                line[3 * x + 1] = g;
+                line[3 * x + 2] = r;
+                break;
+            case libcamera::formats::BGR888:
+            case libcamera::formats::MJPEG:
+                line[3 * x] = r;
+                line[3 * x + 1] = g;
+                line[3 * x + 2] = b;
+                break;
+            case libcamera::formats::YUYV:
+                line[2 * x] = toY(r, g, b);
+                line[2 * x + 1] = x & 1 ? toV(r, g, b) : toU(r, g, b);
+                break;
+            case libcamera::formats::YUV420:
+                line[x] = toY(r, g, b);
+                if (chroma) {
+                    const size_t offset = (y / 2) * (stride / 2) + x / 2;
+                    planeU[offset] = toU(r, g, b);
+                    planeV[offset] = toV(r, g, b);
+                }
+                break;
+            case libcamera::formats::NV12:
+                line[x] = toY(r, g, b);
+                if (chroma) {
+                    const size_t offset = (y / 2) * stride + x;
+                    planeU[offset] = toU(r, g, b);
+                    planeU[offset + 1] = toV(r, g, b);
+                }
+                break;
+            }
+        }
+    }
+}
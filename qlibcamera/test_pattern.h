@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include <QByteArray>
+#include <QImage>
+#include <QRect>
+#include <QSize>
+
+#include <libcamera/pixel_format.h>
+
+namespace qlibcamera {
+
+    /**
+     * \brief Synthetic frames in camera pixel formats
+     *
+     * Renders a static background with a box bouncing across it, straight
+     * into the memory layout a camera produces for the format: packed RGB
+     * and YUV, planar and semi-planar YUV with the chroma planes following
+     * the luma plane, and MJPEG. The background is rendered once by
+     * configure(), so a frame costs a copy and a small fill, except for
+     * MJPEG which is encoded for every frame.
+     */
+    class TestPattern
+    {
+    public:
+        enum Pattern {
+            ColorBars,
+            Gradient,
+            Checkerboard,
+        };
+
+        static constexpr int MaxPlanes = 3;
+
+        int configure(const libcamera::PixelFormat &format, const QSize &size, Pattern pattern);
+
+        unsigned int stride() const;
+        size_t frameSize() const;
+        int planeCount() const;
+        size_t planeOffset(int plane) const;
+        size_t planeSize(int plane) const;
+
+        size_t render(unsigned int sequence, uint8_t *data);
+
+    private:
+        enum Layout {
+            Packed,
+            Planar,
+            SemiPlanar,
+            Jpeg,
+        };
+
+        QRgb colour(int x, int y) const;
+        QRect box(unsigned int sequence) const;
+
+        template<typename Colour>
+        void paint(uint8_t *data, const QRect &rect, Colour colour) const;
+
+        libcamera::PixelFormat format_;
+        Layout layout_;
+        Pattern pattern_;
+        int width_;
+        int height_;
+        unsigned int bpp_;
+        unsigned int stride_;
+
+        int planeCount_;
+        size_t planeOffset_[MaxPlanes];
+        size_t planeSize_[MaxPlanes];
+        size_t frameSize_;
+
+        std::vector<uint8_t> background_;
+
+        /* MJPEG is rendered in RGB888 and encoded */
+        QImage image_;
+        QImage frame_;
+        QByteArray jpeg_;
+    };
+
+}
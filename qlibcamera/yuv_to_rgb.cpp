@@ -0,0 +1,94 @@
+#include "yuv_to_rgb.h"
+
+#include <initializer_list>
+
+using namespace qlibcamera;
+
+namespace {
+
+constexpr int16_t fixedPoint(double value)
+{
+    return static_cast<int16_t>(value * 256 + (value < 0 ? -0.5 : 0.5));
+}
+
+/*
+ * Coefficients of an encoding from its luma weights \a kr and \a kb. Limited
+ * range scales luma from [16, 235] and chroma from [16, 240] to [0, 255].
+ */
+constexpr YuvCoefficients coefficients(double kr, double kb, bool fullRange)
+{
+    const double kg = 1 - kr - kb;
+    const double yScale = fullRange ? 1.0 : 255.0 / 219;
+    const double cScale = fullRange ? 1.0 : 255.0 / 224;
+
+    return {
+        static_cast<int16_t>(fullRange ? 0 : 16),
+        fixedPoint(yScale),
+        fixedPoint(cScale * 2 * (1 - kr)),
+        fixedPoint(-cScale * 2 * (1 - kb) * kb / kg),
+        fixedPoint(-cScale * 2 * (1 - kr) * kr / kg),
+        fixedPoint(cScale * 2 * (1 - kb)),
+    };
+}
+
+/* Indexed by encoding, then limited and full range */
+constexpr YuvCoefficients coefficientTable[][2] = {
+    { coefficients(0.299, 0.114, false), coefficients(0.299, 0.114, true) },
+    { coefficients(0.2126, 0.0722, false), coefficients(0.2126, 0.0722, true) },
+    { coefficients(0.2627, 0.0593, false), coefficients(0.2627, 0.0593, true) },
+};
+
+/* The historical BT.601 limited range coefficients */
+static_assert(coefficientTable[0][0].y == 298 && coefficientTable[0][0].rv == 409 &&
+              coefficientTable[0][0].gu == -100 && coefficientTable[0][0].gv == -208 &&
+              coefficientTable[0][0].bu == 516);
+
+template<RgbFormat F>
+constexpr YuvRowTable scalarRows = {
+    yuvRow<YuvLayout::Planar, F>,
+    yuvRow<YuvLayout::Planar444, F>,
+    yuvRow<YuvLayout::SemiPlanarUV, F>,
+    yuvRow<YuvLayout::SemiPlanarVU, F>,
+    yuvRow<YuvLayout::SemiPlanar444UV, F>,
+    yuvRow<YuvLayout::SemiPlanar444VU, F>,
+    yuvRow<YuvLayout::YUYV, F>,
+    yuvRow<YuvLayout::YVYU, F>,
+    yuvRow<YuvLayout::UYVY, F>,
+    yuvRow<YuvLayout::VYUY, F>,
+};
+
+const YuvToRgbKernels scalarKernels = {
+    "scalar",
+    {
+        scalarRows<RgbFormat::RGB32>,
+        scalarRows<RgbFormat::RGB888>,
+        scalarRows<RgbFormat::RGB16>,
+        scalarRows<RgbFormat::Grayscale8>,
+    },
+};
+
+} /* namespace */
+
+const YuvCoefficients &YuvCoefficients::get(Encoding encoding, bool fullRange)
+{
+    return coefficientTable[encoding][fullRange ? 1 : 0];
+}
+
+const YuvToRgbKernels &YuvToRgbKernels::scalar()
+{
+    return scalarKernels;
+}
+
+/* The widest kernels the CPU runs, selected on first use */
+const YuvToRgbKernels &YuvToRgbKernels::best()
+{
+    static const YuvToRgbKernels *kernels = []() {
+        for (const YuvToRgbKernels *candidate : { yuvToRgbAvx2(), yuvToRgbSse2(), yuvToRgbNeon() }) {
+            if (candidate)
+                return candidate;
+        }
+        return &scalarKernels;
+    }();
+
+    return *kernels;
+}
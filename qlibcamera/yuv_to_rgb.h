@@ -0,0 +1,226 @@
+#pragma once
+
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace qlibcamera {
+
+    /* Layouts of YUV rows, in memory order */
+    enum class YuvLayout {
+        Planar,             /* Y, U and V planes, chroma shared by pixel pairs */
+        Planar444,          /* Y, U and V planes, chroma for every pixel */
+        SemiPlanarUV,       /* Y plane and interleaved U/V plane (NV12, NV16) */
+        SemiPlanarVU,       /* Y plane and interleaved V/U plane (NV21, NV61) */
+        SemiPlanar444UV,    /* NV24, chroma for every pixel */
+        SemiPlanar444VU,    /* NV42 */
+        YUYV,
+        YVYU,
+        UYVY,
+        VYUY,
+        Count,
+    };
+
+    /* Pixel formats of converted rows, stored as the QImage format of the same name */
+    enum class RgbFormat {
+        RGB32,              /* B, G, R, 0xff bytes */
+        RGB888,             /* R, G, B bytes */
+        RGB16,              /* 5:6:5, in native-endian words */
+        Grayscale8,         /* Luma */
+        Count,
+    };
+
+    constexpr unsigned int bytesPerPixel(RgbFormat format)
+    {
+        switch (format) {
+        case RgbFormat::RGB32:
+            return 4;
+        case RgbFormat::RGB888:
+            return 3;
+        case RgbFormat::RGB16:
+            return 2;
+        default:
+            return 1;
+        }
+    }
+
+    /**
+     * \brief Fixed-point YUV to RGB coefficients, scaled by 256
+     *
+     * R = (y * (Y - yOffset) + rv * (V - 128) + 128) >> 8
+     * G = (y * (Y - yOffset) + gu * (U - 128) + gv * (V - 128) + 128) >> 8
+     * B = (y * (Y - yOffset) + bu * (U - 128) + 128) >> 8
+     */
+    struct YuvCoefficients {
+        enum Encoding {
+            Rec601,
+            Rec709,
+            Rec2020,
+        };
+
+        static const YuvCoefficients &get(Encoding encoding, bool fullRange);
+
+        int16_t yOffset;
+        int16_t y;
+        int16_t rv;
+        int16_t gu;
+        int16_t gv;
+        int16_t bu;
+    };
+
+    /*
+     * Converts \a width pixels of a row to an RGB format. \a src holds the
+     * row of each plane the layout uses, in plane order, and \a width is even
+     * unless chroma is not subsampled.
+     */
+    using YuvRowFunction = void (*)(const uint8_t *const src[3], uint8_t *dst, unsigned int width,
+                                    const YuvCoefficients &k);
+    using YuvRowTable = std::array<YuvRowFunction, static_cast<size_t>(YuvLayout::Count)>;
+
+    /**
+     * \brief YUV to RGB row kernels of an instruction set
+     *
+     * All kernels produce the output of the scalar reference bit for bit: the
+     * fixed-point products are summed in 32 bits, so no intermediate result
+     * is rounded differently. The coefficients are loaded once per row. 4:4:4
+     * semi-planar layouts only have reference kernels.
+     *
+     * There are kernels for every output format, packing the pixels as they
+     * are converted. Grayscale8 kernels only read and scale luma.
+     */
+    struct YuvToRgbKernels {
+        const char *name;
+        YuvRowTable rows[static_cast<int>(RgbFormat::Count)];
+
+        YuvRowFunction row(YuvLayout layout, RgbFormat format) const
+        {
+            return rows[static_cast<int>(format)][static_cast<int>(layout)];
+        }
+
+        static const YuvToRgbKernels &scalar();
+        static const YuvToRgbKernels &best();
+    };
+
+    /* Kernels of an instruction set, null if the build or the CPU lacks it */
+    const YuvToRgbKernels *yuvToRgbSse2();
+    const YuvToRgbKernels *yuvToRgbAvx2();
+    const YuvToRgbKernels *yuvToRgbNeon();
+
+    /* Byte offsets of the components of a YUV 4:2:2 packed macropixel */
+    template<YuvLayout L> struct YuvPacking;
+    template<> struct YuvPacking<YuvLayout::YUYV> { static constexpr unsigned int y = 0, u = 1, v = 3; };
+    template<> struct YuvPacking<YuvLayout::YVYU> { static constexpr unsigned int y = 0, u = 3, v = 1; };
+    template<> struct YuvPacking<YuvLayout::UYVY> { static constexpr unsigned int y = 1, u = 0, v = 2; };
+    template<> struct YuvPacking<YuvLayout::VYUY> { static constexpr unsigned int y = 1, u = 2, v = 0; };
+
+    constexpr bool isYuvPacked(YuvLayout layout)
+    {
+        return layout == YuvLayout::YUYV || layout == YuvLayout::YVYU ||
+               layout == YuvLayout::UYVY || layout == YuvLayout::VYUY;
+    }
+
+    inline uint8_t clamp8(int value)
+    {
+        return value < 0 ? 0 : value > 255 ? 255 : value;
+    }
+
+    /*
+     * Stores pixel \a x of a row. The 5:6:5 components are truncated, as
+     * QImage converts them, and grey is the BT.601 luma.
+     */
+    template<RgbFormat F>
+    inline void storeRgb(uint8_t *dst, unsigned int x, uint8_t r, uint8_t g, uint8_t b)
+    {
+        if constexpr (F == RgbFormat::RGB32) {
+            dst[4 * x + 0] = b;
+            dst[4 * x + 1] = g;
+            dst[4 * x + 2] = r;
+            dst[4 * x + 3] = 0xff;
+        } else if constexpr (F == RgbFormat::RGB888) {
+            dst[3 * x + 0] = r;
+            dst[3 * x + 1] = g;
+            dst[3 * x + 2] = b;
+        } else if constexpr (F == RgbFormat::RGB16) {
+            reinterpret_cast<uint16_t *>(dst)[x] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        } else {
+            dst[x] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+        }
+    }
+
+    /* The reference conversion of one pixel, stored as pixel \a x of \a dst */
+    template<RgbFormat F>
+    inline void yuvToRgb(int y, int u, int v, const YuvCoefficients &k, uint8_t *dst, unsigned int x)
+    {
+        const int c = k.y * (y - k.yOffset) + 128;
+        const int d = u - 128;
+        const int e = v - 128;
+        const int r = (c + k.rv * e) >> 8;
+        const int g = (c + k.gu * d + k.gv * e) >> 8;
+        const int b = (c + k.bu * d) >> 8;
+
+        storeRgb<F>(dst, x, clamp8(r), clamp8(g), clamp8(b));
+    }
+
+    /* Luma scaled to full range, the grey of a pixel */
+    inline uint8_t yuvToGray(int y, const YuvCoefficients &k)
+    {
+        return clamp8((k.y * (y - k.yOffset) + 128) >> 8);
+    }
+
+    /*
+     * The reference row kernel, converting the pixels from \a x on. The
+     * vectorised kernels finish their rows with it.
+     */
+    template<YuvLayout L, RgbFormat F>
+    inline void yuvRowScalar(const uint8_t *const src[3], uint8_t *dst, unsigned int x,
+                             unsigned int width, const YuvCoefficients &k)
+    {
+        if constexpr (F == RgbFormat::Grayscale8 && isYuvPacked(L)) {
+            for (; x < width; x++)
+                dst[x] = yuvToGray(src[0][2 * x + YuvPacking<L>::y], k);
+        } else if constexpr (F == RgbFormat::Grayscale8) {
+            for (; x < width; x++)
+                dst[x] = yuvToGray(src[0][x], k);
+        } else if constexpr (L == YuvLayout::Planar444) {
+            for (; x < width; x++)
+                yuvToRgb<F>(src[0][x], src[1][x], src[2][x], k, dst, x);
+        } else if constexpr (L == YuvLayout::SemiPlanar444UV || L == YuvLayout::SemiPlanar444VU) {
+            constexpr unsigned int uPos = L == YuvLayout::SemiPlanar444UV ? 0 : 1;
+            for (; x < width; x++)
+                yuvToRgb<F>(src[0][x], src[1][2 * x + uPos], src[1][2 * x + 1 - uPos], k, dst, x);
+        } else {
+            for (; x < width; x += 2) {
+                int y0, y1, u, v;
+
+                if constexpr (L == YuvLayout::Planar) {
+                    y0 = src[0][x];
+                    y1 = src[0][x + 1];
+                    u = src[1][x / 2];
+                    v = src[2][x / 2];
+                } else if constexpr (L == YuvLayout::SemiPlanarUV || L == YuvLayout::SemiPlanarVU) {
+                    constexpr unsigned int uPos = L == YuvLayout::SemiPlanarUV ? 0 : 1;
+                    y0 = src[0][x];
+                    y1 = src[0][x + 1];
+                    u = src[1][x + uPos];
+                    v = src[1][x + 1 - uPos];
+                } else {
+                    using P = YuvPacking<L>;
+                    const uint8_t *pixel = src[0] + 2 * x;
+                    y0 = pixel[P::y];
+                    y1 = pixel[P::y + 2];
+                    u = pixel[P::u];
+                    v = pixel[P::v];
+                }
+
+                yuvToRgb<F>(y0, u, v, k, dst, x);
+                yuvToRgb<F>(y1, u, v, k, dst, x + 1);
+            }
+        }
+    }
+
+    template<YuvLayout L, RgbFormat F>
+    void yuvRow(const uint8_t *const src[3], uint8_t *dst, unsigned int width, const YuvCoefficients &k)
+    {
+        yuvRowScalar<L, F>(src, dst, 0, width, k);
+    }
+}
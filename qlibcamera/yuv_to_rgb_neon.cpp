@@ -0,0 +1,235 @@
+#include "yuv_to_rgb.h"
+
+/*
+ * NEON is part of the aarch64 baseline. On 32-bit ARM the kernels are only
+ * built when the compiler targets NEON (-mfpu=neon), every Raspberry Pi from
+ * the Pi 2 on has it.
+ */
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+using namespace qlibcamera;
+
+namespace {
+
+/* 16 pixels, with the chroma of each */
+struct Block {
+    uint8x16_t y;
+    uint8x16_t u;
+    uint8x16_t v;
+};
+
+/* Chroma of 8 pixel pairs, spread over their pixels */
+inline uint8x16_t spread(uint8x8_t c)
+{
+    const uint8x8x2_t pairs = vzip_u8(c, c);
+    return vcombine_u8(pairs.val[0], pairs.val[1]);
+}
+
+template<YuvLayout L>
+inline Block load(const uint8_t *const src[3], unsigned int x)
+{
+    Block block;
+
+    if constexpr (isYuvPacked(L)) {
+        using P = YuvPacking<L>;
+
+        /* One lane per macropixel and component. */
+        const uint8x8x4_t p = vld4_u8(src[0] + 2 * x);
+        const uint8x8x2_t y = vzip_u8(p.val[P::y], p.val[P::y + 2]);
+        block.y = vcombine_u8(y.val[0], y.val[1]);
+        block.u = spread(p.val[P::u]);
+        block.v = spread(p.val[P::v]);
+    } else if constexpr (L == YuvLayout::Planar444) {
+        block.y = vld1q_u8(src[0] + x);
+        block.u = vld1q_u8(src[1] + x);
+        block.v = vld1q_u8(src[2] + x);
+    } else if constexpr (L == YuvLayout::Planar) {
+        block.y = vld1q_u8(src[0] + x);
+        block.u = spread(vld1_u8(src[1] + x / 2));
+        block.v = spread(vld1_u8(src[2] + x / 2));
+    } else {
+        const uint8x8x2_t c = vld2_u8(src[1] + x);
+        block.y = vld1q_u8(src[0] + x);
+        block.u = spread(c.val[L == YuvLayout::SemiPlanarUV ? 0 : 1]);
+        block.v = spread(c.val[L == YuvLayout::SemiPlanarUV ? 1 : 0]);
+    }
+
+    return block;
+}
+
+/* The luma of 16 pixels */
+template<YuvLayout L>
+inline uint8x16_t loadLuma(const uint8_t *const src[3], unsigned int x)
+{
+    if constexpr (isYuvPacked(L))
+        return vld2q_u8(src[0] + 2 * x).val[YuvPacking<L>::y];
+    else
+        return vld1q_u8(src[0] + x);
+}
+
+/* Interleave 16 pixels of 8-bit channels in format \a F. */
+template<RgbFormat F>
+inline void store(uint8_t *dst, uint8x16_t b, uint8x16_t g, uint8x16_t r)
+{
+    if constexpr (F == RgbFormat::RGB32) {
+        uint8x16x4_t bgra;
+        bgra.val[0] = b;
+        bgra.val[1] = g;
+        bgra.val[2] = r;
+        bgra.val[3] = vdupq_n_u8(0xff);
+        vst4q_u8(dst, bgra);
+    } else if constexpr (F == RgbFormat::RGB888) {
+        uint8x16x3_t rgb;
+        rgb.val[0] = r;
+        rgb.val[1] = g;
+        rgb.val[2] = b;
+        vst3q_u8(dst, rgb);
+    } else {
+        static_assert(F == RgbFormat::RGB16);
+
+        /* Shift each component in under the top bits of the previous one. */
+        uint16_t *out = reinterpret_cast<uint16_t *>(dst);
+        uint16x8_t lo = vshll_n_u8(vget_low_u8(r), 8);
+        uint16x8_t hi = vshll_n_u8(vget_high_u8(r), 8);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(g), 8), 5);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(g), 8), 5);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(b), 8), 11);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(b), 8), 11);
+        vst1q_u16(out, lo);
+        vst1q_u16(out + 8, hi);
+    }
+}
+
+/*
+ * (a * ka + b * kb + 128) >> 8 for 8 pixels, the products summed in 32 bits
+ * and narrowed with rounding.
+ */
+inline int16x8_t dot(int16x8_t a, int16_t ka)
+{
+    const int32x4_t lo = vmull_n_s16(vget_low_s16(a), ka);
+    const int32x4_t hi = vmull_n_s16(vget_high_s16(a), ka);
+    return vcombine_s16(vrshrn_n_s32(lo, 8), vrshrn_n_s32(hi, 8));
+}
+
+inline int16x8_t dot(int16x8_t a, int16_t ka, int16x8_t b, int16_t kb)
+{
+    int32x4_t lo = vmull_n_s16(vget_low_s16(a), ka);
+    int32x4_t hi = vmull_n_s16(vget_high_s16(a), ka);
+    lo = vmlal_n_s16(lo, vget_low_s16(b), kb);
+    hi = vmlal_n_s16(hi, vget_high_s16(b), kb);
+    return vcombine_s16(vrshrn_n_s32(lo, 8), vrshrn_n_s32(hi, 8));
+}
+
+inline int16x8_t dot(int16x8_t a, int16_t ka, int16x8_t b, int16_t kb, int16x8_t c, int16_t kc)
+{
+    int32x4_t lo = vmull_n_s16(vget_low_s16(a), ka);
+    int32x4_t hi = vmull_n_s16(vget_high_s16(a), ka);
+    lo = vmlal_n_s16(lo, vget_low_s16(b), kb);
+    hi = vmlal_n_s16(hi, vget_high_s16(b), kb);
+    lo = vmlal_n_s16(lo, vget_low_s16(c), kc);
+    hi = vmlal_n_s16(hi, vget_high_s16(c), kc);
+    return vcombine_s16(vrshrn_n_s32(lo, 8), vrshrn_n_s32(hi, 8));
+}
+
+/* Widen to 16 bits and subtract the offset, wrapping to signed values. */
+inline int16x8_t offset(uint8x8_t x, uint8_t bias)
+{
+    return vreinterpretq_s16_u16(vsubl_u8(x, vdup_n_u8(bias)));
+}
+
+/* Grey rows only scale luma, chroma is never read. */
+template<YuvLayout L>
+void grayRowNeon(const uint8_t *const src[3], uint8_t *dst, unsigned int width, const YuvCoefficients &k)
+{
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        const uint8x16_t y = loadLuma<L>(src, x);
+        const uint8x8_t lo = vqmovun_s16(dot(offset(vget_low_u8(y), k.yOffset), k.y));
+        const uint8x8_t hi = vqmovun_s16(dot(offset(vget_high_u8(y), k.yOffset), k.y));
+        vst1q_u8(dst + x, vcombine_u8(lo, hi));
+    }
+
+    yuvRowScalar<L, RgbFormat::Grayscale8>(src, dst, x, width, k);
+}
+
+template<YuvLayout L, RgbFormat F>
+void rowNeon(const uint8_t *const src[3], uint8_t *dst, unsigned int width, const YuvCoefficients &k)
+{
+    if constexpr (F == RgbFormat::Grayscale8) {
+        grayRowNeon<L>(src, dst, width, k);
+    } else {
+        unsigned int x = 0;
+
+        for (; x + 16 <= width; x += 16) {
+            const Block block = load<L>(src, x);
+
+            const int16x8_t c[2] = {
+                offset(vget_low_u8(block.y), k.yOffset),
+                offset(vget_high_u8(block.y), k.yOffset),
+            };
+            const int16x8_t d[2] = {
+                offset(vget_low_u8(block.u), 128),
+                offset(vget_high_u8(block.u), 128),
+            };
+            const int16x8_t e[2] = {
+                offset(vget_low_u8(block.v), 128),
+                offset(vget_high_u8(block.v), 128),
+            };
+
+            uint8x8_t b[2], g[2], r[2];
+            for (int i = 0; i < 2; i++) {
+                r[i] = vqmovun_s16(dot(c[i], k.y, e[i], k.rv));
+                g[i] = vqmovun_s16(dot(c[i], k.y, d[i], k.gu, e[i], k.gv));
+                b[i] = vqmovun_s16(dot(c[i], k.y, d[i], k.bu));
+            }
+
+            store<F>(dst + bytesPerPixel(F) * x, vcombine_u8(b[0], b[1]), vcombine_u8(g[0], g[1]),
+                     vcombine_u8(r[0], r[1]));
+        }
+
+        yuvRowScalar<L, F>(src, dst, x, width, k);
+    }
+}
+
+template<RgbFormat F>
+constexpr YuvRowTable neonRows = {
+    rowNeon<YuvLayout::Planar, F>,
+    rowNeon<YuvLayout::Planar444, F>,
+    rowNeon<YuvLayout::SemiPlanarUV, F>,
+    rowNeon<YuvLayout::SemiPlanarVU, F>,
+    yuvRow<YuvLayout::SemiPlanar444UV, F>,
+    yuvRow<YuvLayout::SemiPlanar444VU, F>,
+    rowNeon<YuvLayout::YUYV, F>,
+    rowNeon<YuvLayout::YVYU, F>,
+    rowNeon<YuvLayout::UYVY, F>,
+    rowNeon<YuvLayout::VYUY, F>,
+};
+
+const YuvToRgbKernels neonKernels = {
+    "neon",
+    {
+        neonRows<RgbFormat::RGB32>,
+        neonRows<RgbFormat::RGB888>,
+        neonRows<RgbFormat::RGB16>,
+        neonRows<RgbFormat::Grayscale8>,
+    },
+};
+
+} /* namespace */
+
+const YuvToRgbKernels *qlibcamera::yuvToRgbNeon()
+{
+    return &neonKernels;
+}
+
+#else /* __ARM_NEON */
+
+const qlibcamera::YuvToRgbKernels *qlibcamera::yuvToRgbNeon()
+{
+    return nullptr;
+}
+
+#endif /* __ARM_NEON */
@@ -0,0 +1,438 @@
+#include "yuv_to_rgb.h"
+
+#if defined(__SSE2__)
+
+#include <immintrin.h>
+
+using namespace qlibcamera;
+
+namespace {
+
+/* 16 pixels, each component widened to 16 bits, 8 per vector */
+struct Block {
+    __m128i y[2];
+    __m128i u[2];
+    __m128i v[2];
+};
+
+/* Chroma of 8 pixel pairs, spread over their pixels */
+inline void spread(__m128i c, __m128i out[2])
+{
+    out[0] = _mm_unpacklo_epi16(c, c);
+    out[1] = _mm_unpackhi_epi16(c, c);
+}
+
+template<YuvLayout L>
+inline Block load(const uint8_t *const src[3], unsigned int x)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    Block block;
+
+    if constexpr (isYuvPacked(L)) {
+        using P = YuvPacking<L>;
+
+        /* Words hold a luma and a chroma sample, chroma alternating. */
+        const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + 2 * x));
+        const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + 2 * x + 16));
+
+        __m128i c0, c1;
+        if constexpr (P::y == 0) {
+            block.y[0] = _mm_and_si128(p0, low);
+            block.y[1] = _mm_and_si128(p1, low);
+            c0 = _mm_srli_epi16(p0, 8);
+            c1 = _mm_srli_epi16(p1, 8);
+        } else {
+            block.y[0] = _mm_srli_epi16(p0, 8);
+            block.y[1] = _mm_srli_epi16(p1, 8);
+            c0 = _mm_and_si128(p0, low);
+            c1 = _mm_and_si128(p1, low);
+        }
+
+        const __m128i first = _mm_packs_epi32(_mm_and_si128(c0, _mm_set1_epi32(0xffff)),
+                                              _mm_and_si128(c1, _mm_set1_epi32(0xffff)));
+        const __m128i second = _mm_packs_epi32(_mm_srli_epi32(c0, 16), _mm_srli_epi32(c1, 16));
+        spread(P::u < P::v ? first : second, block.u);
+        spread(P::u < P::v ? second : first, block.v);
+    } else {
+        const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + x));
+        block.y[0] = _mm_unpacklo_epi8(y, zero);
+        block.y[1] = _mm_unpackhi_epi8(y, zero);
+
+        if constexpr (L == YuvLayout::Planar444) {
+            const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[1] + x));
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[2] + x));
+            block.u[0] = _mm_unpacklo_epi8(u, zero);
+            block.u[1] = _mm_unpackhi_epi8(u, zero);
+            block.v[0] = _mm_unpacklo_epi8(v, zero);
+            block.v[1] = _mm_unpackhi_epi8(v, zero);
+        } else if constexpr (L == YuvLayout::Planar) {
+            spread(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src[1] + x / 2)), zero), block.u);
+            spread(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src[2] + x / 2)), zero), block.v);
+        } else {
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[1] + x));
+            const __m128i even = _mm_and_si128(c, low);
+            const __m128i odd = _mm_srli_epi16(c, 8);
+            spread(L == YuvLayout::SemiPlanarUV ? even : odd, block.u);
+            spread(L == YuvLayout::SemiPlanarUV ? odd : even, block.v);
+        }
+    }
+
+    return block;
+}
+
+/* The luma of 16 pixels, widened to 16 bits */
+template<YuvLayout L>
+inline void loadLuma(const uint8_t *const src[3], unsigned int x, __m128i y[2])
+{
+    if constexpr (isYuvPacked(L)) {
+        const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + 2 * x));
+        const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + 2 * x + 16));
+
+        if constexpr (YuvPacking<L>::y == 0) {
+            y[0] = _mm_and_si128(p0, _mm_set1_epi16(0x00ff));
+            y[1] = _mm_and_si128(p1, _mm_set1_epi16(0x00ff));
+        } else {
+            y[0] = _mm_srli_epi16(p0, 8);
+            y[1] = _mm_srli_epi16(p1, 8);
+        }
+    } else {
+        const __m128i luma = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src[0] + x));
+        y[0] = _mm_unpacklo_epi8(luma, _mm_setzero_si128());
+        y[1] = _mm_unpackhi_epi8(luma, _mm_setzero_si128());
+    }
+}
+
+/* Pack the 3 low bytes of the 4 words of \a w, the last 4 bytes cleared. */
+inline __m128i pack24(__m128i w)
+{
+    const __m128i lowWords = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i lowHalf = _mm_set_epi32(0, 0, -1, -1);
+    const __m128i q = _mm_or_si128(_mm_and_si128(w, lowWords),
+                                   _mm_slli_epi64(_mm_srli_epi64(w, 32), 24));
+    return _mm_or_si128(_mm_and_si128(q, lowHalf), _mm_srli_si128(_mm_andnot_si128(lowHalf, q), 2));
+}
+
+/* Interleave 16 pixels of 8-bit channels in format \a F. */
+template<RgbFormat F>
+inline void store(uint8_t *dst, __m128i b, __m128i g, __m128i r)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i *out = reinterpret_cast<__m128i *>(dst);
+
+    if constexpr (F == RgbFormat::RGB32) {
+        const __m128i a = _mm_set1_epi8(static_cast<char>(0xff));
+        const __m128i bgLo = _mm_unpacklo_epi8(b, g);
+        const __m128i bgHi = _mm_unpackhi_epi8(b, g);
+        const __m128i raLo = _mm_unpacklo_epi8(r, a);
+        const __m128i raHi = _mm_unpackhi_epi8(r, a);
+
+        _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(bgLo, raLo));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bgLo, raLo));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bgHi, raHi));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bgHi, raHi));
+    } else if constexpr (F == RgbFormat::RGB888) {
+        /* SSE2 has no byte shuffle: pack RGB0 words, then the 12-byte groups. */
+        const __m128i rgLo = _mm_unpacklo_epi8(r, g);
+        const __m128i rgHi = _mm_unpackhi_epi8(r, g);
+        const __m128i bLo = _mm_unpacklo_epi8(b, zero);
+        const __m128i bHi = _mm_unpackhi_epi8(b, zero);
+
+        const __m128i p0 = pack24(_mm_unpacklo_epi16(rgLo, bLo));
+        const __m128i p1 = pack24(_mm_unpackhi_epi16(rgLo, bLo));
+        const __m128i p2 = pack24(_mm_unpacklo_epi16(rgHi, bHi));
+        const __m128i p3 = pack24(_mm_unpackhi_epi16(rgHi, bHi));
+
+        _mm_storeu_si128(out + 0, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128(out + 2, _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    } else {
+        static_assert(F == RgbFormat::RGB16);
+
+        /* The high and low bytes of the words, masking what 16-bit shifts carry over. */
+        const __m128i rMask = _mm_set1_epi8(static_cast<char>(0xf8));
+        const __m128i gHighMask = _mm_set1_epi8(0x07);
+        const __m128i gLowMask = _mm_set1_epi8(static_cast<char>(0xe0));
+        const __m128i bMask = _mm_set1_epi8(0x1f);
+        const __m128i high = _mm_or_si128(_mm_and_si128(r, rMask),
+                                          _mm_and_si128(_mm_srli_epi16(g, 5), gHighMask));
+        const __m128i low = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(g, 3), gLowMask),
+                                         _mm_and_si128(_mm_srli_epi16(b, 3), bMask));
+
+        _mm_storeu_si128(out + 0, _mm_unpacklo_epi8(low, high));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(low, high));
+    }
+}
+
+inline __m128i pair(int16_t a, int16_t b)
+{
+    return _mm_setr_epi16(a, b, a, b, a, b, a, b);
+}
+
+/* The coefficients of a row, paired for madd and loaded once per row */
+struct Coefficients {
+    Coefficients(const YuvCoefficients &k)
+        : yOffset(_mm_set1_epi16(k.yOffset)), yrv(pair(k.y, k.rv)), ybu(pair(k.y, k.bu)),
+          ygu(pair(k.y, k.gu)), gvRound(pair(k.gv, 128))
+    {
+    }
+
+    __m128i yOffset;
+    __m128i yrv;
+    __m128i ybu;
+    __m128i ygu;
+    __m128i gvRound;        /* The rounding rides on a constant 1 lane */
+};
+
+/*
+ * Sum of the products of the interleaved (a, b) pairs with \a k, rounded and
+ * scaled back, for 8 pixels. The products are summed in 32 bits.
+ */
+inline __m128i dot(__m128i a, __m128i b, __m128i k, __m128i bias)
+{
+    const __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k), bias);
+    const __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k), bias);
+    return _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+/* Convert 8 pixels to 16-bit B, G and R. */
+inline void convert(__m128i y, __m128i u, __m128i v, const Coefficients &k,
+                    __m128i &b, __m128i &g, __m128i &r)
+{
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i c = _mm_sub_epi16(y, k.yOffset);
+    const __m128i d = _mm_sub_epi16(u, _mm_set1_epi16(128));
+    const __m128i e = _mm_sub_epi16(v, _mm_set1_epi16(128));
+
+    r = dot(c, e, k.yrv, round);
+    b = dot(c, d, k.ybu, round);
+
+    /* Three terms, the last pair carries the rounding. */
+    const __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c, d), k.ygu),
+                                     _mm_madd_epi16(_mm_unpacklo_epi16(e, one), k.gvRound));
+    const __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c, d), k.ygu),
+                                     _mm_madd_epi16(_mm_unpackhi_epi16(e, one), k.gvRound));
+    g = _mm_packs_epi32(_mm_srai_epi32(lo, 8), _mm_srai_epi32(hi, 8));
+}
+
+/* Grey rows only scale luma, chroma is never read. */
+template<YuvLayout L>
+void grayRowSse2(const uint8_t *const src[3], uint8_t *dst, unsigned int width, const YuvCoefficients &k)
+{
+    const __m128i yOffset = _mm_set1_epi16(k.yOffset);
+    const __m128i yRound = pair(k.y, 128);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i y[2];
+        loadLuma<L>(src, x, y);
+
+        const __m128i lo = dot(_mm_sub_epi16(y[0], yOffset), one, yRound, zero);
+        const __m128i hi = dot(_mm_sub_epi16(y[1], yOffset), one, yRound, zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(lo, hi));
+    }
+
+    yuvRowScalar<L, RgbFormat::Grayscale8>(src, dst, x, width, k);
+}
+
+template<YuvLayout L, RgbFormat F>
+void rowSse2(const uint8_t *const src[3], uint8_t *dst, unsigned int width, const YuvCoefficients &coefficients)
+{
+    if constexpr (F == RgbFormat::Grayscale8) {
+        grayRowSse2<L>(src, dst, width, coefficients);
+    } else {
+        const Coefficients k(coefficients);
+        unsigned int x = 0;
+
+        for (; x + 16 <= width; x += 16) {
+            const Block block = load<L>(src, x);
+            __m128i b[2], g[2], r[2];
+
+            convert(block.y[0], block.u[0], block.v[0], k, b[0], g[0], r[0]);
+            convert(block.y[1], block.u[1], block.v[1], k, b[1], g[1], r[1]);
+
+            store<F>(dst + bytesPerPixel(F) * x, _mm_packus_epi16(b[0], b[1]),
+                     _mm_packus_epi16(g[0], g[1]), _mm_packus_epi16(r[0], r[1]));
+        }
+
+        yuvRowScalar<L, F>(src, dst, x, width, coefficients);
+    }
+}
+
+template<RgbFormat F>
+constexpr YuvRowTable sse2Rows = {
+    rowSse2<YuvLayout::Planar, F>,
+    rowSse2<YuvLayout::Planar444, F>,
+    rowSse2<YuvLayout::SemiPlanarUV, F>,
+    rowSse2<YuvLayout::SemiPlanarVU, F>,
+    yuvRow<YuvLayout::SemiPlanar444UV, F>,
+    yuvRow<YuvLayout::SemiPlanar444VU, F>,
+    rowSse2<YuvLayout::YUYV, F>,
+    rowSse2<YuvLayout::YVYU, F>,
+    rowSse2<YuvLayout::UYVY, F>,
+    rowSse2<YuvLayout::VYUY, F>,
+};
+
+const YuvToRgbKernels sse2Kernels = {
+    "sse2",
+    {
+        sse2Rows<RgbFormat::RGB32>,
+        sse2Rows<RgbFormat::RGB888>,
+        sse2Rows<RgbFormat::RGB16>,
+        sse2Rows<RgbFormat::Grayscale8>,
+    },
+};
+
+#if defined(__GNUC__)
+
+/*
+ * The AVX2 kernels convert the same 16 pixels in one pass of 256-bit
+ * vectors. They are compiled for AVX2 whatever the build flags and only
+ * selected on CPUs that have it.
+ */
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256i combine(__m128i lo, __m128i hi)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+AVX2 inline __m256i pair256(int16_t a, int16_t b)
+{
+    return _mm256_setr_epi16(a, b, a, b, a, b, a, b, a, b, a, b, a, b, a, b);
+}
+
+/* Unpacking and packing within 128-bit lanes keep the pixel order. */
+AVX2 inline __m256i dot256(__m256i a, __m256i b, __m256i k, __m256i bias)
+{
+    const __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), k), bias);
+    const __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), k), bias);
+    return _mm256_packs_epi32(_mm256_srai_epi32(lo, 8), _mm256_srai_epi32(hi, 8));
+}
+
+AVX2 inline __m128i narrow(__m256i x)
+{
+    return _mm_packus_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+}
+
+/* As store(), packing RGB888 with byte shuffles. */
+template<RgbFormat F>
+AVX2 inline void storeAvx2(uint8_t *dst, __m128i b, __m128i g, __m128i r)
+{
+    if constexpr (F == RgbFormat::RGB888) {
+        const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        const __m128i rgLo = _mm_unpacklo_epi8(r, g);
+        const __m128i rgHi = _mm_unpackhi_epi8(r, g);
+        const __m128i bLo = _mm_unpacklo_epi8(b, b);
+        const __m128i bHi = _mm_unpackhi_epi8(b, b);
+
+        const __m128i p0 = _mm_shuffle_epi8(_mm_unpacklo_epi16(rgLo, bLo), pack);
+        const __m128i p1 = _mm_shuffle_epi8(_mm_unpackhi_epi16(rgLo, bLo), pack);
+        const __m128i p2 = _mm_shuffle_epi8(_mm_unpacklo_epi16(rgHi, bHi), pack);
+        const __m128i p3 = _mm_shuffle_epi8(_mm_unpackhi_epi16(rgHi, bHi), pack);
+
+        __m128i *out = reinterpret_cast<__m128i *>(dst);
+        _mm_storeu_si128(out + 0, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128(out + 2, _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    } else {
+        store<F>(dst, b, g, r);
+    }
+}
+
+template<YuvLayout L, RgbFormat F>
+AVX2 void rowAvx2(const uint8_t *const src[3], uint8_t *dst, unsigned int width, const YuvCoefficients &k)
+{
+    const __m256i round = _mm256_set1_epi32(128);
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i yOffset = _mm256_set1_epi16(k.yOffset);
+    const __m256i yrv = pair256(k.y, k.rv);
+    const __m256i ybu = pair256(k.y, k.bu);
+    const __m256i ygu = pair256(k.y, k.gu);
+    const __m256i gvRound = pair256(k.gv, 128);
+    unsigned int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        const Block block = load<L>(src, x);
+
+        const __m256i y = combine(block.y[0], block.y[1]);
+        const __m256i u = combine(block.u[0], block.u[1]);
+        const __m256i v = combine(block.v[0], block.v[1]);
+
+        const __m256i c = _mm256_sub_epi16(y, yOffset);
+        const __m256i d = _mm256_sub_epi16(u, _mm256_set1_epi16(128));
+        const __m256i e = _mm256_sub_epi16(v, _mm256_set1_epi16(128));
+
+        const __m256i r = dot256(c, e, yrv, round);
+        const __m256i b = dot256(c, d, ybu, round);
+
+        const __m256i gLo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(c, d), ygu),
+                                             _mm256_madd_epi16(_mm256_unpacklo_epi16(e, one), gvRound));
+        const __m256i gHi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(c, d), ygu),
+                                             _mm256_madd_epi16(_mm256_unpackhi_epi16(e, one), gvRound));
+        const __m256i g = _mm256_packs_epi32(_mm256_srai_epi32(gLo, 8), _mm256_srai_epi32(gHi, 8));
+
+        storeAvx2<F>(dst + bytesPerPixel(F) * x, narrow(b), narrow(g), narrow(r));
+    }
+
+    yuvRowScalar<L, F>(src, dst, x, width, k);
+}
+
+template<RgbFormat F>
+constexpr YuvRowTable avx2Rows = {
+    rowAvx2<YuvLayout::Planar, F>,
+    rowAvx2<YuvLayout::Planar444, F>,
+    rowAvx2<YuvLayout::SemiPlanarUV, F>,
+    rowAvx2<YuvLayout::SemiPlanarVU, F>,
+    yuvRow<YuvLayout::SemiPlanar444UV, F>,
+    yuvRow<YuvLayout::SemiPlanar444VU, F>,
+    rowAvx2<YuvLayout::YUYV, F>,
+    rowAvx2<YuvLayout::YVYU, F>,
+    rowAvx2<YuvLayout::UYVY, F>,
+    rowAvx2<YuvLayout::VYUY, F>,
+};
+
+const YuvToRgbKernels avx2Kernels = {
+    "avx2",
+    {
+        avx2Rows<RgbFormat::RGB32>,
+        avx2Rows<RgbFormat::RGB888>,
+        avx2Rows<RgbFormat::RGB16>,
+        sse2Rows<RgbFormat::Grayscale8>,    /* Bound by memory, luma only */
+    },
+};
+
+#endif /* __GNUC__ */
+
+} /* namespace */
+
+const YuvToRgbKernels *qlibcamera::yuvToRgbSse2()
+{
+    return &sse2Kernels;
+}
+
+const YuvToRgbKernels *qlibcamera::yuvToRgbAvx2()
+{
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2Kernels;
+#endif
+    return nullptr;
+}
+
+#else /* __SSE2__ */
+
+const qlibcamera::YuvToRgbKernels *qlibcamera::yuvToRgbSse2()
+{
+    return nullptr;
+}
+
+const qlibcamera::YuvToRgbKernels *qlibcamera::yuvToRgbAvx2()
+{
+    return nullptr;
+}
+
+#endif /* __SSE2__ */
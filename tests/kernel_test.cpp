@@ -0,0 +1,192 @@
+/*
+ * Checks the vectorised row kernels against the scalar references, bit for
+ * bit: every YUV to RGB kernel for each layout, output format and coefficient
+ * table, and every Bayer demosaicing and binning kernel, over random rows of
+ * every width up to MaxWidth. Kernels the build or the CPU lacks are skipped.
+ *
+ * Usage: kernel_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "bayer_to_rgb.h"
+#include "yuv_to_rgb.h"
+
+using namespace qlibcamera;
+
+namespace {
+
+constexpr unsigned int MaxWidth = 80;
+constexpr unsigned int RowsPerWidth = 8;
+
+/* Bytes past the end of the outputs, which the kernels must leave alone */
+constexpr unsigned int Guard = 64;
+
+const char *const layoutNames[] = {
+    "Planar", "Planar444", "SemiPlanarUV", "SemiPlanarVU", "SemiPlanar444UV",
+    "SemiPlanar444VU", "YUYV", "YVYU", "UYVY", "VYUY",
+};
+
+const char *const formatNames[] = { "RGB32", "RGB888", "RGB16", "Grayscale8" };
+
+std::vector<uint8_t> randomRow(size_t size)
+{
+    std::vector<uint8_t> row(size);
+    for (uint8_t &byte : row)
+        byte = rand();
+
+    return row;
+}
+
+bool subsampled(YuvLayout layout)
+{
+    return layout != YuvLayout::Planar444 && layout != YuvLayout::SemiPlanar444UV &&
+           layout != YuvLayout::SemiPlanar444VU;
+}
+
+/* Compares \a kernels to the scalar ones, returns the number of mismatches */
+unsigned int testYuv(const YuvToRgbKernels &kernels)
+{
+    const YuvToRgbKernels &reference = YuvToRgbKernels::scalar();
+    unsigned int failures = 0;
+    unsigned int rows = 0;
+
+    for (int l = 0; l < static_cast<int>(YuvLayout::Count); l++) {
+        const YuvLayout layout = static_cast<YuvLayout>(l);
+
+        for (int f = 0; f < static_cast<int>(RgbFormat::Count); f++) {
+            const RgbFormat format = static_cast<RgbFormat>(f);
+            const YuvRowFunction row = kernels.row(layout, format);
+            const YuvRowFunction expected = reference.row(layout, format);
+
+            for (int e = YuvCoefficients::Rec601; e <= YuvCoefficients::Rec2020; e++) {
+                for (bool fullRange : { false, true }) {
+                    const YuvCoefficients &k =
+                        YuvCoefficients::get(static_cast<YuvCoefficients::Encoding>(e), fullRange);
+
+                    for (unsigned int width = 1; width <= MaxWidth; width++) {
+                        if (subsampled(layout) && width % 2)
+                            continue;
+
+                        for (unsigned int i = 0; i < RowsPerWidth; i++) {
+                            /* Planes sized to what the widest layout reads */
+                            const std::vector<uint8_t> planes[3] = {
+                                randomRow(2 * width), randomRow(2 * width), randomRow(width),
+                            };
+                            const uint8_t *src[3] = {
+                                planes[0].data(), planes[1].data(), planes[2].data(),
+                            };
+
+                            const size_t size = bytesPerPixel(format) * width + Guard;
+                            std::vector<uint8_t> out(size, 0x5a);
+                            std::vector<uint8_t> ref(size, 0x5a);
+
+                            row(src, out.data(), width, k);
+                            expected(src, ref.data(), width, k);
+                            rows++;
+
+                            if (memcmp(out.data(), ref.data(), size)) {
+                                if (!failures)
+                                    printf("%s: %s to %s, encoding %d%s, width %u differs\n",
+                                           kernels.name, layoutNames[l], formatNames[f], e,
+                                           fullRange ? " full range" : "", width);
+                                failures++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%-8s YUV   %6u rows, %u mismatches\n", kernels.name, rows, failures);
+    return failures;
+}
+
+unsigned int testBayer(const BayerKernels &kernels)
+{
+    const BayerKernels &reference = BayerKernels::scalar();
+    unsigned int failures = 0;
+    unsigned int rows = 0;
+
+    for (unsigned int width = 1; width <= MaxWidth; width++) {
+        for (unsigned int i = 0; i < RowsPerWidth; i++) {
+            /* Bilinear kernels read a pixel past both ends of the rows. */
+            const std::vector<uint8_t> levelled[3] = {
+                randomRow(2 * width + 2), randomRow(2 * width + 2), randomRow(2 * width + 2),
+            };
+            const uint8_t *src[3] = {
+                levelled[0].data() + 1, levelled[1].data() + 1, levelled[2].data() + 1,
+            };
+
+            const size_t size = 4 * width + Guard;
+
+            for (int kernel = 0; kernel < 8; kernel++) {
+                const bool binned = kernel >= 4;
+                const BayerRowFunction row = binned ? kernels.binned[kernel - 4]
+                                                    : kernels.bilinear[kernel / 2][kernel % 2];
+                const BayerRowFunction expected = binned ? reference.binned[kernel - 4]
+                                                         : reference.bilinear[kernel / 2][kernel % 2];
+
+                std::vector<uint8_t> out(size, 0x5a);
+                std::vector<uint8_t> ref(size, 0x5a);
+
+                row(src, out.data(), width);
+                expected(src, ref.data(), width);
+                rows++;
+
+                if (memcmp(out.data(), ref.data(), size)) {
+                    if (!failures) {
+                        if (binned)
+                            printf("%s: binned, red at %d, width %u differs\n",
+                                   kernels.name, kernel - 4, width);
+                        else
+                            printf("%s: bilinear, %s row, %s first, width %u differs\n",
+                                   kernels.name, kernel / 2 ? "red" : "blue",
+                                   kernel % 2 ? "green" : "colour", width);
+                    }
+                    failures++;
+                }
+            }
+        }
+    }
+
+    printf("%-8s Bayer %6u rows, %u mismatches\n", kernels.name, rows, failures);
+    return failures;
+}
+
+} /* namespace */
+
+int main()
+{
+    unsigned int failures = 0;
+
+    srand(1);
+
+    const YuvToRgbKernels *yuvKernels[] = {
+        &YuvToRgbKernels::best(), yuvToRgbSse2(), yuvToRgbAvx2(), yuvToRgbNeon(),
+    };
+    const char *const yuvNames[] = { "best", "sse2", "avx2", "neon" };
+
+    for (unsigned int i = 0; i < 4; i++) {
+        if (yuvKernels[i])
+            failures += testYuv(*yuvKernels[i]);
+        else
+            printf("%-8s YUV   skipped\n", yuvNames[i]);
+    }
+
+    const BayerKernels *bayerKernels[] = { &BayerKernels::best(), bayerNeon() };
+    const char *const bayerNames[] = { "best", "neon" };
+
+    for (unsigned int i = 0; i < 2; i++) {
+        if (bayerKernels[i])
+            failures += testBayer(*bayerKernels[i]);
+        else
+            printf("%-8s Bayer skipped\n", bayerNames[i]);
+    }
+
+    return failures ? 1 : 0;
+}
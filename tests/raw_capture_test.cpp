@@ -0,0 +1,167 @@
+/*
+ * Round trips raw captures through RawCaptureWriter, RawCaptureReader and
+ * the replay source: SRGGB10, SRGGB10_CSI2P and YUV420 frames must come back
+ * with their format, modifier included, and their planes intact, and be
+ * accepted by LibCameraReplayWorker::open(). Files whose planes are shorter
+ * than the header requires, such as CSI-2 packed frames under an unpacked
+ * header, must be refused.
+ *
+ * Usage: raw_capture_test
+ */
+
+#include <errno.h>
+#include <iterator>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <QCoreApplication>
+#include <QSize>
+#include <QTemporaryDir>
+
+#include <libcamera/formats.h>
+
+#include "qlibcameraframe.h"
+#include "qlibcameraworker.h"
+#include "raw_capture.h"
+
+using namespace qlibcamera;
+
+namespace {
+
+constexpr unsigned int FrameCount = 5;
+const QSize FrameSize(64, 48);
+
+/* A frame of random pixels, owning its planes */
+class TestFrameData : public LibCameraFrameData
+{
+public:
+    TestFrameData(const std::vector<qsizetype> &sizes, quint32 frameSequence)
+    {
+        for (qsizetype size : sizes) {
+            buffers_.emplace_back(size);
+            for (uchar &byte : buffers_.back())
+                byte = rand();
+
+            planes[planeCount].data = buffers_.back().data();
+            planes[planeCount].size = size;
+            planeCount++;
+        }
+
+        sequence = frameSequence;
+        timestamps.sensor = 1000000000ull + frameSequence * 33333333ull;
+    }
+
+private:
+    std::vector<std::vector<uchar>> buffers_;
+};
+
+struct Capture {
+    const char *name;
+    libcamera::PixelFormat format;      /* Written to the header */
+    unsigned int stride;
+    std::vector<qsizetype> planeSizes;  /* Of the frames written */
+    int expected;                       /* From LibCameraReplayWorker::open() */
+};
+
+/* Writes, reads back and replays \a capture, returns the number of failures */
+unsigned int testCapture(const Capture &capture, const QString &filename)
+{
+    std::vector<LibCameraFrame> frames;
+    for (unsigned int i = 0; i < FrameCount; i++)
+        frames.emplace_back(new TestFrameData(capture.planeSizes, 100 + 2 * i));
+
+    RawCaptureWriter writer;
+    int ret = writer.open(filename.toStdString(), capture.format, FrameSize, capture.stride);
+    for (const LibCameraFrame &frame : frames) {
+        if (ret == 0)
+            ret = writer.append(frame);
+    }
+    if (ret == 0)
+        ret = writer.close();
+
+    if (ret < 0) {
+        printf("%s: writing failed: %s\n", capture.name, strerror(-ret));
+        return 1;
+    }
+
+    RawCaptureReader reader;
+    ret = reader.open(filename.toStdString());
+    if (ret < 0) {
+        printf("%s: reading failed: %s\n", capture.name, strerror(-ret));
+        return 1;
+    }
+
+    unsigned int failures = 0;
+
+    if (reader.format() != capture.format || reader.format().modifier() != capture.format.modifier() ||
+        reader.size() != FrameSize || reader.stride() != capture.stride ||
+        reader.frameCount() != FrameCount) {
+        printf("%s: header differs\n", capture.name);
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < FrameCount; i++) {
+        const RawCaptureReader::Frame frame = reader.frame(i);
+        const LibCameraFrame &written = frames[i];
+        bool same = frame.sequence == written.sequence() &&
+                    frame.timestamp == written.timestamps().sensor &&
+                    frame.planeCount == written.planeCount();
+
+        for (int j = 0; same && j < frame.planeCount; j++)
+            same = frame.planeSizes[j] == size_t(written.size(j)) &&
+                   !memcmp(frame.planes[j], written.constData(j), frame.planeSizes[j]);
+
+        if (!same) {
+            printf("%s: frame %u differs\n", capture.name, i);
+            failures++;
+        }
+    }
+
+    LibCameraReplayWorker replay;
+    ret = replay.open(filename);
+    if (ret != capture.expected) {
+        printf("%s: replay open returned %d, expected %d\n", capture.name, ret, capture.expected);
+        failures++;
+    } else if (ret == 0 && replay.format() != capture.format) {
+        printf("%s: replay format differs\n", capture.name);
+        failures++;
+    }
+
+    printf("%-28s %s\n", capture.name, failures ? "failed" : "passed");
+    return failures;
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QTemporaryDir dir;
+    unsigned int failures = 0;
+
+    srand(1);
+
+    const qsizetype width = FrameSize.width();
+    const qsizetype height = FrameSize.height();
+
+    const Capture captures[] = {
+        { "SRGGB10", libcamera::formats::SRGGB10, unsigned(2 * width),
+          { 2 * width * height }, 0 },
+        { "SRGGB10_CSI2P", libcamera::formats::SRGGB10_CSI2P, unsigned(width * 5 / 4),
+          { width * 5 / 4 * height }, 0 },
+        { "YUV420", libcamera::formats::YUV420, unsigned(width),
+          { width * height, width * height / 4, width * height / 4 }, 0 },
+        /* The header must not be mistaken for the packed format sharing its fourcc. */
+        { "SRGGB10 with packed planes", libcamera::formats::SRGGB10, unsigned(2 * width),
+          { width * 5 / 4 * height }, -EINVAL },
+        { "YUV420 lacking a plane", libcamera::formats::YUV420, unsigned(width),
+          { width * height, width * height / 4 }, -EINVAL },
+    };
+
+    for (unsigned int i = 0; i < std::size(captures); i++)
+        failures += testCapture(captures[i], dir.filePath(QString("capture%1.qlcraw").arg(i)));
+
+    return failures ? 1 : 0;
+}